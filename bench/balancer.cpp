@@ -0,0 +1,123 @@
+#include <libserver/Balancer.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * archer-proxy-bench-balancer, p50 and p99 latency of every balancer policy
+ * against a skewed synthetic backend mix.
+ *
+ *   archer-proxy-bench-balancer [seconds per policy] [clients]
+ *
+ * Four equally weighted backends, three answer in about 2ms and one in about
+ * 20ms, every backend sends one request in a hundred to a 10x tail and slows
+ * down linearly once more than 8 requests are in flight on it. Clients run a
+ * closed loop on the real clock, so the peer EWMA decays as it does in the proxy.
+*/
+
+using namespace archer::server;
+
+typedef std::chrono::steady_clock Clock;
+
+static const int    BACKEND_CAPACITY = 8;
+static const double TAIL_RATE = 0.01;
+static const double TAIL_FACTOR = 10.0;
+static const int    SLOW_BACKEND = 3;
+
+typedef struct {
+    const char *name;
+    BalancerType type;
+} Policy;
+
+// service time of one request on a backend whose base time is baseMicros
+static int64_t serviceMicros(DstPeer *peer, double baseMicros, std::mt19937& rng) {
+    std::lognormal_distribution<double> jitter(0.0, 0.25);
+    std::uniform_real_distribution<double> tail(0.0, 1.0);
+    double micros = baseMicros * jitter(rng);
+    if(tail(rng) < TAIL_RATE) {
+        micros *= TAIL_FACTOR;
+    }
+    int32_t inflight = peer->outstanding();
+    if(inflight > BACKEND_CAPACITY) {
+        micros *= (double) inflight / BACKEND_CAPACITY;
+    }
+    return (int64_t) micros;
+}
+
+static void client(Balancer *balancer, std::vector<double> const& bases, Clock::time_point until, unsigned seed, std::vector<int64_t>& latencies, int64_t& slowPicks) {
+    std::mt19937 rng(seed);
+    uint32_t tick = seed;
+    while(Clock::now() < until) {
+        DstPeer *peer = balancer->pick(NULL, tick);
+        slowPicks += peer->port() == SLOW_BACKEND ? 1 : 0;
+        peer->onSend();
+        Clock::time_point start = Clock::now();
+        std::this_thread::sleep_for(std::chrono::microseconds(serviceMicros(peer, bases[peer->port()], rng)));
+        int64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        peer->onComplete(nanos);
+        latencies.push_back(nanos);
+    }
+}
+
+static double percentileMillis(std::vector<int64_t>& latencies, double p) {
+    size_t at = std::min(latencies.size() - 1, (size_t) (latencies.size() * p));
+    std::nth_element(latencies.begin(), latencies.begin() + at, latencies.end());
+    return latencies[at] / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int seconds = argc > 1 ? atoi(argv[1]) : 3;
+    int clients = argc > 2 ? atoi(argv[2]) : 32;
+    if(seconds <= 0 || clients <= 0) {
+        fprintf(stderr, "usage: archer-proxy-bench-balancer [seconds per policy] [clients]\n");
+        return 1;
+    }
+    // the port doubles as the index of the backend base time
+    std::vector<double> bases = {2000, 2000, 2000, 20000};
+    Policy policies[] = {
+        {"round_robin", BALANCER_ROUND_ROBIN},
+        {"weighted", BALANCER_WEIGHTED},
+        {"least_request", BALANCER_LEAST_REQUEST},
+        {"peak_ewma", BALANCER_PEAK_EWMA},
+    };
+    HashKey key = {HASH_KEY_PATH, ""};
+    printf("%-14s %10s %10s %10s %12s\n", "balancer", "requests", "p50 ms", "p99 ms", "slow share");
+    for(size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        PeerList peers;
+        for(size_t i = 0; i < bases.size(); i++) {
+            peers.push_back(std::make_shared<DstPeer>("127.0.0.1", (int) i, 1));
+        }
+        std::unique_ptr<Balancer> balancer(Balancer::create(policies[p].type, peers, key));
+        std::vector<std::vector<int64_t>> latencies(clients);
+        std::vector<int64_t> slowPicks(clients, 0);
+        std::vector<std::thread> threads;
+        Clock::time_point until = Clock::now() + std::chrono::seconds(seconds);
+        for(int c = 0; c < clients; c++) {
+            threads.push_back(std::thread(client, balancer.get(), std::cref(bases), until, (unsigned) (c + 1), std::ref(latencies[c]), std::ref(slowPicks[c])));
+        }
+        for(size_t c = 0; c < threads.size(); c++) {
+            threads[c].join();
+        }
+        std::vector<int64_t> all;
+        int64_t slow = 0;
+        for(size_t c = 0; c < latencies.size(); c++) {
+            all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+            slow += slowPicks[c];
+        }
+        if(all.empty()) {
+            continue;
+        }
+        size_t requests = all.size();
+        double p50 = percentileMillis(all, 0.50);
+        double p99 = percentileMillis(all, 0.99);
+        printf("%-14s %10zu %10.2f %10.2f %11.1f%%\n", policies[p].name, requests, p50, p99, 100.0 * slow / requests);
+    }
+    return 0;
+}
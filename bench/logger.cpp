@@ -0,0 +1,71 @@
+#include <libcommon/Logger.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * archer-proxy-bench-logger, lines per second through a Logger into its file.
+ *
+ *   archer-proxy-bench-logger [lines per thread] [threads] [block|drop|drop_count] [directory]
+ *
+ * Every thread logs an access style info line in a tight loop. The producer
+ * rate stops with the last call, the end to end rate once the writer put the
+ * last line into the file, which is when the Logger is destroyed. Files are
+ * appended to in directory, /tmp/archer-proxy-bench-logger by default.
+*/
+
+using namespace archer::common;
+
+typedef std::chrono::steady_clock Clock;
+
+static void logMany(Logger *logger, int lines, int thread) {
+    for(int i = 0; i < lines; i++) {
+        LOGGER_info(*logger, "Proxy Server access /api/v1/items/%d from thread %d", i, thread);
+    }
+}
+
+int main(int argc, char **argv) {
+    int lines = argc > 1 ? atoi(argv[1]) : 20000;
+    int threads = argc > 2 ? atoi(argv[2]) : 16;
+    const char *policy = argc > 3 ? argv[3] : "block";
+    std::string directory = argc > 4 ? argv[4] : "/tmp/archer-proxy-bench-logger";
+    int overflow = -1;
+    if(strcmp(policy, "block") == 0) {
+        overflow = LOG_OVERFLOW_BLOCK;
+    } else if(strcmp(policy, "drop") == 0) {
+        overflow = LOG_OVERFLOW_DROP;
+    } else if(strcmp(policy, "drop_count") == 0) {
+        overflow = LOG_OVERFLOW_DROP_COUNT;
+    }
+    if(lines <= 0 || threads <= 0 || overflow < 0) {
+        fprintf(stderr, "usage: archer-proxy-bench-logger [lines per thread] [threads] [block|drop|drop_count] [directory]\n");
+        return 1;
+    }
+    double total = (double) lines * threads;
+    double produced = 0;
+    uint64_t dropped = 0;
+    Clock::time_point start = Clock::now();
+    {
+        Logger logger(directory, "bench", LOG_LEVEL_INFO);
+        logger.setOverflow(overflow);
+        std::vector<std::thread> workers;
+        for(int t = 0; t < threads; t++) {
+            workers.push_back(std::thread(logMany, &logger, lines, t));
+        }
+        for(size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        produced = std::chrono::duration<double>(Clock::now() - start).count();
+        dropped = logger.dropped();
+    }
+    double written = std::chrono::duration<double>(Clock::now() - start).count();
+    printf("%-10s %8s %14s %14s %10s\n", "policy", "threads", "produced/s", "written/s", "dropped");
+    printf("%-10s %8d %14.0f %14.0f %10llu\n", policy, threads, total / produced, (total - dropped) / written, (unsigned long long) dropped);
+    return 0;
+}
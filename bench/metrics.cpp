@@ -0,0 +1,68 @@
+#include <libserver/Metrics.h>
+
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * archer-proxy-bench-metrics, nanoseconds per Metrics::record() call.
+ *
+ *   archer-proxy-bench-metrics [records per thread]
+ *
+ * One thread, then four threads, record into the same 16 series with
+ * latencies spread over the histogram, the way request threads of one
+ * proxy do, and a scrape of the result is timed at the end.
+*/
+
+using namespace archer::server;
+
+typedef std::chrono::steady_clock Clock;
+
+static const int SERIES = 16;
+
+// keeps the compiler from dropping the scrape whose result is otherwise unused
+static volatile size_t sink;
+
+static void recordMany(std::vector<MetricSeriesPtr> const* series, uint64_t records) {
+    Metrics& metrics = Metrics::instance();
+    for(uint64_t i = 0; i < records; i++) {
+        int status = (i & 63) == 0 ? 503 : 200;
+        int64_t latency = (int64_t) ((i * 7919) % 2000000) * 1000;
+        metrics.record((*series)[i % SERIES].get(), status, latency, latency / 2, 512, 4096);
+    }
+}
+
+static double run(std::vector<MetricSeriesPtr> const& series, int threads, uint64_t records) {
+    std::vector<std::thread> workers;
+    Clock::time_point start = Clock::now();
+    for(int t = 0; t < threads; t++) {
+        workers.push_back(std::thread(recordMany, &series, records));
+    }
+    for(size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    // wall time over the calls of all threads, the cost of a call while the others run
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / (records * threads);
+}
+
+int main(int argc, char **argv) {
+    uint64_t records = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    if(records == 0) {
+        fprintf(stderr, "usage: archer-proxy-bench-metrics [records per thread]\n");
+        return 1;
+    }
+    std::vector<MetricSeriesPtr> series;
+    for(int i = 0; i < SERIES; i++) {
+        series.push_back(Metrics::instance().series(SERIES_BACKEND, "bench", "127.0.0.1:" + std::to_string(8000 + i)));
+    }
+    printf("%-12s %10s\n", "threads", "ns/record");
+    printf("%-12d %10.1f\n", 1, run(series, 1, records));
+    printf("%-12d %10.1f\n", 4, run(series, 4, records));
+    Clock::time_point start = Clock::now();
+    sink = Metrics::instance().scrape().length();
+    printf("scrape of %d series took %.2f ms\n", SERIES, std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+    return 0;
+}
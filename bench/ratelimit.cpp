@@ -0,0 +1,98 @@
+#include <libserver/RateLimiter.h>
+
+#include <vector>
+#include <thread>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * archer-proxy-bench-ratelimit, nanoseconds per RateLimiter::take() decision.
+ *
+ *   archer-proxy-bench-ratelimit [decisions]
+ *
+ * One thread over 1M distinct keys in a table of 1M buckets, then four
+ * threads over the same 1000 keys. The clock advances by 1ms every 100000
+ * decisions, so buckets refill, run dry and get limited along the way. Last
+ * sixteen threads with keys of their own race for the slots of an empty
+ * table of 1024 buckets, every probe window fills up and gets recycled
+ * while other threads claim its slots.
+*/
+
+using namespace archer::server;
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint64_t GOLDEN = 0x9e3779b97f4a7c15ULL;
+
+// keeps the compiler from dropping decisions whose result is otherwise unused
+static volatile uint64_t sink;
+
+static RateLimitConfig makeConfig(size_t maxKeys) {
+    RateLimitConfig config;
+    config.perRoute = false;
+    config.key.type = HASH_KEY_IP;
+    config.rate = 10;
+    config.burst = 5;
+    config.maxKeys = maxKeys;
+    return config;
+}
+
+static void takeMany(RateLimiter *limiter, uint64_t decisions, uint64_t keys, uint64_t offset) {
+    int retryAfter = 0;
+    uint64_t allowed = 0;
+    for(uint64_t i = 0; i < decisions; i++) {
+        uint64_t hash = ((i % keys) + offset + 1) * GOLDEN;
+        allowed += limiter->take(hash, (uint32_t) (i / 100000), retryAfter) ? 1 : 0;
+    }
+    sink = allowed;
+}
+
+int main(int argc, char **argv) {
+    uint64_t decisions = argc > 1 ? strtoull(argv[1], NULL, 10) : 20000000;
+    if(decisions == 0) {
+        fprintf(stderr, "usage: archer-proxy-bench-ratelimit [decisions]\n");
+        return 1;
+    }
+    printf("%-28s %10s\n", "case", "ns/take");
+    {
+        RateLimiter limiter(makeConfig(1 << 20));
+        Clock::time_point start = Clock::now();
+        takeMany(&limiter, decisions, 1000000, 0);
+        double nanos = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / decisions;
+        printf("%-28s %10.1f\n", "1 thread, 1M keys", nanos);
+    }
+    {
+        RateLimiter limiter(makeConfig(1 << 20));
+        int threads = 4;
+        uint64_t each = decisions / threads;
+        std::vector<std::thread> workers;
+        Clock::time_point start = Clock::now();
+        for(int t = 0; t < threads; t++) {
+            workers.push_back(std::thread(takeMany, &limiter, each, (uint64_t) 1000, (uint64_t) 0));
+        }
+        for(size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        // wall time per decision of one thread, what a request sees under contention
+        double nanos = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / each;
+        printf("%-28s %10.1f\n", "4 threads, 1000 shared keys", nanos);
+    }
+    {
+        RateLimiter limiter(makeConfig(1024));
+        int threads = 16;
+        uint64_t each = decisions / threads;
+        std::vector<std::thread> workers;
+        Clock::time_point start = Clock::now();
+        for(int t = 0; t < threads; t++) {
+            workers.push_back(std::thread(takeMany, &limiter, each, each, (uint64_t) t * each));
+        }
+        for(size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        double nanos = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / each;
+        printf("%-28s %10.1f\n", "16 threads, distinct keys", nanos);
+    }
+    return 0;
+}
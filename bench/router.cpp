@@ -0,0 +1,114 @@
+#include <libserver/LocationRouter.h>
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * archer-proxy-bench-router, LocationRouter::match against the linear prefix
+ * scan it replaced, over 10, 100 and 10000 locations.
+ *
+ *   archer-proxy-bench-router [lookups]
+ *
+ * Locations look like "/svc<i>/v<j>/", uris are drawn from them with a tail
+ * appended, one in eight misses every location.
+*/
+
+using namespace archer::server;
+
+typedef std::chrono::steady_clock Clock;
+
+// keeps the compiler from dropping lookups whose result is otherwise unused
+static volatile uintptr_t sink;
+
+// the loop ProxyServer ran before the router, first src that prefixes the uri in order
+static const Location* linearMatch(std::vector<Location> const& locations, const char *uri, size_t uriLen) {
+    for(size_t i = 0; i < locations.size(); i++) {
+        std::string const& src = locations[i].src;
+        if(src.length() <= uriLen && memcmp(src.data(), uri, src.length()) == 0) {
+            return &locations[i];
+        }
+    }
+    return NULL;
+}
+
+static std::vector<Location> makeLocations(int count) {
+    std::vector<Location> locations;
+    for(int i = 0; i < count; i++) {
+        Location loc = Location();
+        loc.order = rand() % 4;
+        loc.src = "/svc" + std::to_string(i / 4) + "/v" + std::to_string(i % 4) + "/";
+        loc.dst = "/";
+        locations.push_back(loc);
+    }
+    Location root = Location();
+    root.order = 4;
+    root.src = "/static/";
+    root.dst = "/";
+    locations.push_back(root);
+    std::stable_sort(locations.begin(), locations.end(), [](Location const& a, Location const& b) {
+        return a.order < b.order;
+    });
+    return locations;
+}
+
+static std::vector<std::string> makeUris(std::vector<Location> const& locations, size_t count) {
+    std::vector<std::string> uris;
+    for(size_t i = 0; i < count; i++) {
+        if(i % 8 == 7) {
+            uris.push_back("/missing/" + std::to_string(i) + "/index.html");
+        } else {
+            uris.push_back(locations[rand() % locations.size()].src + "items/" + std::to_string(i) + "?page=2");
+        }
+    }
+    return uris;
+}
+
+template<typename Match>
+static double nanosPerLookup(std::vector<std::string> const& uris, size_t lookups, Match match) {
+    uintptr_t acc = 0;
+    Clock::time_point start = Clock::now();
+    for(size_t i = 0; i < lookups; i++) {
+        std::string const& uri = uris[i % uris.size()];
+        acc += (uintptr_t) match(uri.data(), uri.length());
+    }
+    double nanos = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / lookups;
+    sink = acc;
+    return nanos;
+}
+
+int main(int argc, char **argv) {
+    size_t lookups = argc > 1 ? strtoull(argv[1], NULL, 10) : 5000000;
+    int sizes[] = {10, 100, 10000};
+    srand(1);
+    printf("%-10s %14s %14s %8s\n", "locations", "linear ns", "router ns", "speedup");
+    for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        std::vector<Location> locations = makeLocations(sizes[s]);
+        LocationRouter router(locations);
+        std::vector<std::string> uris = makeUris(locations, 4096);
+        // both must agree on every uri before their times mean anything
+        for(size_t i = 0; i < uris.size(); i++) {
+            const Location *expected = linearMatch(locations, uris[i].data(), uris[i].length());
+            const Location *got = router.match(uris[i].data(), uris[i].length());
+            if((expected == NULL) != (got == NULL) || (expected != NULL && expected->src != got->src)) {
+                fprintf(stderr, "archer-proxy-bench-router: mismatch on %s\n", uris[i].c_str());
+                return 1;
+            }
+        }
+        // the linear scan at 10000 locations is slow, fewer rounds give the same per lookup time
+        size_t linearLookups = sizes[s] >= 10000 ? lookups / 100 : lookups;
+        double linear = nanosPerLookup(uris, linearLookups, [&locations](const char *uri, size_t len) {
+            return linearMatch(locations, uri, len);
+        });
+        double radix = nanosPerLookup(uris, lookups, [&router](const char *uri, size_t len) {
+            return router.match(uri, len);
+        });
+        printf("%-10d %14.1f %14.1f %7.1fx\n", sizes[s], linear, radix, linear / radix);
+    }
+    return 0;
+}
@@ -32,6 +32,12 @@ public:
 
     void listAllProxy(HttpResponse *res, Json::Value &val);
 
+    void metrics(HttpResponse *res, Json::Value &val);
+
+    void logLevel(HttpResponse *res, Json::Value &val);
+
+    void setLogLevel(HttpResponse *res, Json::Value &val);
+
     void addProxy(HttpResponse *res, Json::Value &val);
 
     void delProxy(HttpResponse *res, Json::Value &val);
@@ -50,6 +56,26 @@ public:
 
     bool locationCheck(HttpResponse *res, Json::Value &val);
 
+    bool healthCheck(HttpResponse *res, Json::Value &val);
+
+    bool serverNamesCheck(HttpResponse *res, Json::Value &val);
+
+    bool compressCheck(HttpResponse *res, Json::Value &val);
+
+    bool poolCheck(HttpResponse *res, Json::Value &val);
+
+    bool hedgeCheck(HttpResponse *res, Json::Value &val);
+
+    bool rateLimitCheck(HttpResponse *res, Json::Value &val);
+
+    bool concurrencyCheck(HttpResponse *res, Json::Value &val, const char *name);
+
+    bool tlsCheck(HttpResponse *res, Json::Value &val);
+
+    bool staticCheck(HttpResponse *res, Json::Value &val);
+
+    bool positiveIntsCheck(HttpResponse *res, Json::Value &val, const char *name, const char **fields, int count);
+
 private:
     
     ProxyApi() {}
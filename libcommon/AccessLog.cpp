@@ -0,0 +1,229 @@
+#include "AccessLog.h"
+#include "Logger.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace archer::common;
+
+static const uint64_t MIN_RECORDS = 1024;
+
+inline static int kindIndex(char kind) {
+    return kind == 'p' ? 0 : (kind == 'l' ? 1 : 2);
+}
+
+inline static uint64_t wallMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+inline static uint32_t toMicros32(int64_t nanos) {
+    uint64_t us = nanos > 0 ? (uint64_t) nanos / 1000 : 0;
+    return us >= ACCESS_NO_UPSTREAM ? ACCESS_NO_UPSTREAM - 1 : (uint32_t) us;
+}
+
+AccessLog::Segment::~Segment() {
+    if(map != NULL) {
+        munmap(map, mapBytes);
+    }
+    if(fd >= 0) {
+        close(fd);
+    }
+}
+
+bool AccessLog::open(std::string const& dir, uint64_t segmentBytes, int maxSegments) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_enabled) {
+        return true;
+    }
+    m_dir = dir;
+    while(m_dir.length() > 1 && m_dir[m_dir.length() - 1] == '/') {
+        m_dir.pop_back();
+    }
+    std::string made;
+    for(size_t i = 0; i <= m_dir.length(); i++) {
+        if((i == m_dir.length() || m_dir[i] == '/') && !made.empty()) {
+            mkdir(made.c_str(), S_IRWXU);
+        }
+        if(i < m_dir.length()) {
+            made.push_back(m_dir[i]);
+        }
+    }
+    m_capacity = std::max(MIN_RECORDS, (segmentBytes - std::min(segmentBytes, (uint64_t) sizeof(AccessSegmentHeader))) / sizeof(AccessRecord));
+    m_maxSegments = maxSegments > 1 ? maxSegments : 2;
+
+    // segments left by earlier runs count against maxSegments too, names sort by creation
+    std::vector<std::string> found;
+    DIR *d = opendir(m_dir.c_str());
+    if(d != NULL) {
+        struct dirent *entry;
+        while((entry = readdir(d)) != NULL) {
+            std::string name(entry->d_name);
+            size_t suffix = strlen(ACCESS_SEGMENT_SUFFIX);
+            if(name.compare(0, 7, "access-") == 0 && name.length() > suffix && name.compare(name.length() - suffix, suffix, ACCESS_SEGMENT_SUFFIX) == 0) {
+                found.push_back(m_dir + '/' + name);
+            }
+        }
+        closedir(d);
+    }
+    std::sort(found.begin(), found.end());
+    m_files.assign(found.begin(), found.end());
+
+    loadNames();
+    SegmentPtr segment = create();
+    if(!segment) {
+        return false;
+    }
+    m_segment.store(segment);
+    m_enabled = true;
+    LOG_info("Access log %s, %llu records per segment, keep %d segments", m_dir.c_str(), (unsigned long long) m_capacity, m_maxSegments);
+    return true;
+}
+
+AccessLog::SegmentPtr AccessLog::create() {
+    char stamp[32];
+    time_t now = time(0);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+    size_t bytes = sizeof(AccessSegmentHeader) + m_capacity * sizeof(AccessRecord);
+    int fd = -1;
+    std::string path;
+    // another process may have started in the same second
+    for(int attempt = 0; attempt < 16 && fd < 0; attempt++) {
+        char name[64];
+        snprintf(name, sizeof(name), "/access-%s-%06u%s", stamp, m_sequence++, ACCESS_SEGMENT_SUFFIX);
+        path = m_dir + name;
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if(fd < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    if(fd < 0) {
+        LOG_error("Access log can not create a segment in %s, %s", m_dir.c_str(), strerror(errno));
+        return nullptr;
+    }
+    int err = posix_fallocate(fd, 0, bytes);
+    void *map = err == 0 ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if(map == MAP_FAILED) {
+        LOG_error("Access log can not preallocate %s, %s", path.c_str(), strerror(err != 0 ? err : errno));
+        close(fd);
+        unlink(path.c_str());
+        return nullptr;
+    }
+
+    AccessSegmentHeader *header = static_cast<AccessSegmentHeader *>(map);
+    memcpy(header->magic, ACCESS_SEGMENT_MAGIC, sizeof(header->magic));
+    header->version = ACCESS_SEGMENT_VERSION;
+    header->recordSize = sizeof(AccessRecord);
+    header->created = wallMicros();
+    header->capacity = m_capacity;
+
+    std::shared_ptr<Segment> segment = std::make_shared<Segment>();
+    segment->fd = fd;
+    segment->map = map;
+    segment->mapBytes = bytes;
+    segment->records = reinterpret_cast<AccessRecord *>(static_cast<char *>(map) + sizeof(AccessSegmentHeader));
+    segment->capacity = m_capacity;
+
+    m_files.push_back(path);
+    while((int) m_files.size() > m_maxSegments) {
+        unlink(m_files.front().c_str());
+        m_files.pop_front();
+    }
+    return segment;
+}
+
+void AccessLog::rotate(Segment const *full) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_segment.load().get() != full) {
+        return ;
+    }
+    SegmentPtr segment = create();
+    if(!segment) {
+        LOG_error("Access log disabled");
+        m_enabled = false;
+        return ;
+    }
+    m_segment.store(segment);
+}
+
+void AccessLog::append(uint32_t proxy, uint32_t location, uint32_t peer, int status, int64_t latencyNanos, int64_t ttfbNanos, uint64_t bytesIn, uint64_t bytesOut) {
+    AccessRecord record;
+    record.totalUs = toMicros32(latencyNanos);
+    record.time = wallMicros() - record.totalUs;
+    record.proxy = proxy;
+    record.location = location;
+    record.peer = peer;
+    record.status = (uint16_t) status;
+    record.reserved = 0;
+    record.bytesIn = bytesIn;
+    record.bytesOut = bytesOut;
+    record.upstreamUs = ttfbNanos < 0 ? ACCESS_NO_UPSTREAM : toMicros32(ttfbNanos);
+    while(enabled()) {
+        SegmentPtr const& segment = m_segment.local().ptr;
+        uint64_t slot = segment->next.fetch_add(1, std::memory_order_relaxed);
+        if(slot < segment->capacity) {
+            memcpy(&segment->records[slot], &record, sizeof(record));
+            return ;
+        }
+        rotate(segment.get());
+    }
+}
+
+void AccessLog::loadNames() {
+    std::string path = m_dir + "/" + ACCESS_NAMES_FILE;
+    std::lock_guard<std::mutex> lock(m_nameMutex);
+    FILE *file = fopen(path.c_str(), "r");
+    if(file != NULL) {
+        char line[1024];
+        while(fgets(line, sizeof(line), file) != NULL) {
+            char kind;
+            unsigned id;
+            int offset = 0;
+            if(sscanf(line, "%c %u %n", &kind, &id, &offset) < 2 || offset == 0) {
+                continue;
+            }
+            std::string name(line + offset);
+            if(!name.empty() && name[name.length() - 1] == '\n') {
+                name.pop_back();
+            }
+            m_names[kind + name] = id;
+            uint32_t& next = m_nextId[kindIndex(kind)];
+            next = std::max(next, (uint32_t) id + 1);
+        }
+        fclose(file);
+    }
+    m_namesFile = fopen(path.c_str(), "a");
+    if(m_namesFile == NULL) {
+        LOG_error("Access log can not open %s, %s", path.c_str(), strerror(errno));
+    }
+}
+
+uint32_t AccessLog::nameId(char kind, std::string const& name) {
+    std::string key = kind + name;
+    std::replace(key.begin(), key.end(), '\n', ' ');
+    std::lock_guard<std::mutex> lock(m_nameMutex);
+    auto it = m_names.find(key);
+    if(it != m_names.end()) {
+        return it->second;
+    }
+    uint32_t id = m_nextId[kindIndex(kind)]++;
+    m_names[key] = id;
+    if(m_namesFile != NULL) {
+        fprintf(m_namesFile, "%c %u %s\n", kind, id, key.c_str() + 1);
+        fflush(m_namesFile);
+    }
+    return id;
+}
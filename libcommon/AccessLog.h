@@ -0,0 +1,105 @@
+#pragma once
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+#include <stdio.h>
+
+#include "AccessRecord.h"
+#include "Snapshot.h"
+
+namespace archer
+{
+namespace common
+{
+
+/**
+ * Binary per request access log.
+ *
+ * Records are copied into the current segment, a preallocated file mapped
+ * shared, at a slot claimed with one atomic add, there is no formatting, no
+ * lock and no system call per request. A full segment is replaced under a lock
+ * by a new one, the oldest segments beyond maxSegments are deleted. Writers
+ * hold the segment they write to through a Snapshot, so it is unmapped only
+ * once no thread uses it any more. archer-proxy-logcat decodes the segments.
+*/
+class AccessLog
+{
+typedef struct Segment {
+    int                           fd;
+    void                         *map;
+    size_t                        mapBytes;
+    AccessRecord                 *records;
+    uint64_t                      capacity;
+    mutable std::atomic<uint64_t> next{0};
+
+    ~Segment();
+} Segment;
+
+typedef std::shared_ptr<const Segment> SegmentPtr;
+
+public:
+
+    // never destroyed, requests may finish during static destruction
+    static AccessLog& instance() {
+        static AccessLog *instance = new AccessLog();
+        return *instance;
+    }
+
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+
+    // starts writing segments of about segmentBytes under dir, false when the first one can not be created
+    bool open(std::string const& dir, uint64_t segmentBytes, int maxSegments);
+
+    bool enabled() const {
+        return m_enabled.load(std::memory_order_relaxed);
+    }
+
+    // stable id of a proxy 'p', location 'l' or backend 'b' name, ids start at 1,
+    // only ids given out after open() are kept in the names file
+    uint32_t nameId(char kind, std::string const& name);
+
+    // one finished request, ttfbNanos is negative when no upstream byte came back
+    void write(uint32_t proxy, uint32_t location, uint32_t peer, int status, int64_t latencyNanos, int64_t ttfbNanos, uint64_t bytesIn, uint64_t bytesOut) {
+        if(enabled()) {
+            append(proxy, location, peer, status, latencyNanos, ttfbNanos, bytesIn, bytesOut);
+        }
+    }
+
+private:
+
+    AccessLog() {}
+    ~AccessLog() {}
+
+    void append(uint32_t proxy, uint32_t location, uint32_t peer, int status, int64_t latencyNanos, int64_t ttfbNanos, uint64_t bytesIn, uint64_t bytesOut);
+
+    // with m_mutex held
+    SegmentPtr create();
+
+    // replaces full unless another thread already did
+    void rotate(Segment const *full);
+
+    void loadNames();
+
+    std::mutex                   m_mutex;
+    std::atomic<bool>            m_enabled{false};
+    std::string                  m_dir;
+    uint64_t                     m_capacity = 0;
+    int                          m_maxSegments = 0;
+    uint32_t                     m_sequence = 0;
+    // our segments on disk, oldest first
+    std::deque<std::string>      m_files;
+    Snapshot<Segment>            m_segment;
+
+    std::mutex                   m_nameMutex;
+    std::unordered_map<std::string, uint32_t> m_names;
+    uint32_t                     m_nextId[3] = {1, 1, 1};
+    FILE                        *m_namesFile = NULL;
+};
+}
+}
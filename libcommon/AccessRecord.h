@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * On disk layout of the binary access log, shared by the proxy and archer-proxy-logcat.
+ *
+ * A segment file is one AccessSegmentHeader followed by fixed size AccessRecords
+ * in host byte order. Segments are preallocated and filled in place, a record whose
+ * time is zero was never written and is skipped. Proxies, locations and backends are
+ * stored as ids, the "names" file next to the segments maps them back, one
+ * "<kind> <id> <name>" line per id with kind 'p', 'l' or 'b'.
+*/
+
+#define ACCESS_SEGMENT_MAGIC   "APXALOG1"
+#define ACCESS_SEGMENT_VERSION 1
+#define ACCESS_SEGMENT_SUFFIX  ".alog"
+#define ACCESS_NAMES_FILE      "names"
+
+// no upstream byte came back
+#define ACCESS_NO_UPSTREAM     0xFFFFFFFFU
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    // microseconds since the epoch
+    uint64_t created;
+    uint64_t capacity;
+    char     reserved[32];
+} AccessSegmentHeader;
+
+typedef struct {
+    // request start, microseconds since the epoch
+    uint64_t time;
+    uint32_t proxy;
+    // 0 when no location matched
+    uint32_t location;
+    // 0 when the proxy answered without a backend
+    uint32_t peer;
+    uint16_t status;
+    uint16_t reserved;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    // to the first upstream response byte
+    uint32_t upstreamUs;
+    uint32_t totalUs;
+} AccessRecord;
+
+static_assert(sizeof(AccessSegmentHeader) == 64, "access segment header layout");
+static_assert(sizeof(AccessRecord) == 48, "access record layout");
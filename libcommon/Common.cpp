@@ -5,10 +5,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fstream>
+#include <chrono>
+#include <random>
+#include <mutex>
 
 static const int HEX_MAP[] = {127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 127, 127, 127, 127, 127, 127, 127, 10, 11, 12, 13, 14, 15, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 10, 11, 12, 13, 14, 15, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127, 127};
 static const char BYTE_MAP[] = {'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
-static unsigned char SEED = 1;
 
 static int checkHex(std::string const& hex) {
     if(hex.length() != 128 && hex.length() != 130) {
@@ -110,13 +112,14 @@ std::string archer::common::getHexFromUint8s(const uint8_t* bytes, size_t bytes_
 }
 
 std::string archer::common::randomString() {
+    // proxy ids key their database records, they must not repeat
+    static std::mutex mutex;
+    static std::mt19937_64 engine(((uint64_t) std::random_device()() << 32) ^ std::random_device()() ^ (uint64_t) steadyNanos());
     unsigned char random[16];
-    SEED++;
-    if(SEED == 0) {
-        SEED++;
-    }
-    for(int i = 0; i < 16; i++) {
-        random[i] = SEED ^ random[i];
+    std::lock_guard<std::mutex> lock(mutex);
+    for(int i = 0; i < 16; i += 8) {
+        uint64_t bits = engine();
+        memcpy(random + i, &bits, 8);
     }
     return getHexFromUint8s(random, 16);
 }
@@ -129,3 +132,7 @@ bool archer::common::isIpAddress(std::string& ipstr) {
     }
     return false;
 }
+
+int64_t archer::common::steadyNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
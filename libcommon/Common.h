@@ -27,6 +27,7 @@ int getUint8sFromHex(std::string const& hex, uint8_t* bytes);
 std::string getHexFromUint8s(const uint8_t* bytes, size_t bytes_len);
 std::string randomString();
 bool isIpAddress(std::string& ipstr);
+int64_t steadyNanos();
 }
 }
 
@@ -28,7 +28,7 @@ void GlobalConfig::parseConfig(std::string const & configPath) {
         console_out("Log path = %s", m_logPath.c_str());
         console_out("Log level = INFO");
         console_out("Database path = %s", m_dbPath.c_str());
-        console_out("Database memory size = %u", m_dbMemory);
+        console_out("Database initial map size = %u", m_dbMemory);
         console_out("HTTP Server host = %s", m_httpServerAddress.c_str());
         console_out("HTTP Server port = %d", m_httpServerPort);
 
@@ -82,6 +82,21 @@ void GlobalConfig::parseConfig(std::string const & configPath) {
         } else {
             m_logLevel = LOG_LEVEL_INFO;
         }
+
+        // a producer whose ring is full waits for the writer, or drops the line
+        std::string overflow = m_root["log"].get("overflow", "block").asString();
+        if(overflow == "drop") {
+            Logger::getDefault().setOverflow(LOG_OVERFLOW_DROP);
+        } else if(overflow == "drop_count") {
+            Logger::getDefault().setOverflow(LOG_OVERFLOW_DROP_COUNT);
+        } else {
+            overflow = "block";
+            Logger::getDefault().setOverflow(LOG_OVERFLOW_BLOCK);
+        }
+        console_out("Log overflow = %s", overflow.c_str());
+        if(m_root["log"].isMember("ring_size") && m_root["log"]["ring_size"].isUInt()) {
+            Logger::getDefault().setRingSize(m_root["log"]["ring_size"].asUInt());
+        }
     } else {
         m_logPath = "logs";
         m_logLevel = LOG_LEVEL_INFO;
@@ -93,6 +108,24 @@ void GlobalConfig::parseConfig(std::string const & configPath) {
     Logger::getDefault().setPath(m_logPath);
     Logger::getDefault().setLevel(m_logLevel);
 
+    console_out("Parse access log configs");
+    if(m_root.isMember("access_log") && m_root["access_log"].get("enable", true).asBool()) {
+        Json::Value const& access = m_root["access_log"];
+        std::string accessPath = access.get("path", m_logPath + "/access").asString();
+        if(!archer::common::isAbsolutePath(accessPath)) {
+            accessPath = m_curPath + "/" + accessPath;
+        }
+        uint64_t segmentBytes = access.get("segment_size", 64 * 1024 * 1024).asUInt64();
+        int maxSegments = access.get("max_segments", 16).asInt();
+        if(AccessLog::instance().open(accessPath, segmentBytes, maxSegments)) {
+            console_out("Access log path = %s", accessPath.c_str());
+        } else {
+            console_error("Can not open access log %s", accessPath.c_str());
+        }
+    } else {
+        console_out("Access log disabled");
+    }
+
     console_out("Parse database configs");
     if(m_root.isMember("database") && m_root["database"].isMember("path")) {
         m_dbPath = std::string(m_root["database"]["path"].asCString());
@@ -110,11 +143,15 @@ void GlobalConfig::parseConfig(std::string const & configPath) {
         m_dbPath = m_curPath + "/database/";
     }
     m_dbReaders = 4;
+    // only the size the map starts at, it doubles whenever a write fills it
     m_dbMemory = 1024 * 1024 * 8;
+    if(m_root.isMember("database") && m_root["database"].isMember("map_size") && m_root["database"]["map_size"].asUInt() > 0) {
+        m_dbMemory = m_root["database"]["map_size"].asUInt();
+    }
 
     console_out("Database path = %s", m_dbPath.c_str());
     console_out("Database readers = %d", m_dbReaders);
-    console_out("Database memory size = %u", m_dbMemory);
+    console_out("Database initial map size = %u", m_dbMemory);
 
     console_out("Parse http server configs");
     if(m_root.isMember("http") && m_root["http"].isMember("host")) {
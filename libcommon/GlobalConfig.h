@@ -6,6 +6,7 @@
 #include "Common.h"
 // #include "Log.h"
 #include "Logger.h"
+#include "AccessLog.h"
 
 namespace archer 
 {
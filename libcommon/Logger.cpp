@@ -1,24 +1,38 @@
 #include "Logger.h"
 
+#include <algorithm>
+#include <functional>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+
 using namespace archer::common;
 
 static const char *levelFormat[] = {
   "[NONE]", "[TRACE]", "[DEBUG]", "[INFO]", "[WARN]", "[ERROR]", "[FATAL]"
 };
 
-static bool logThreadRuning = false;
+static const size_t levelLength[] = {6, 7, 7, 6, 6, 7, 7};
+
+static const char NEWLINE[] = "\n";
 
-inline static std::string simplifyFilename(const char *filename) {
-    size_t len = strlen(filename);
-    long off = len - 1;
-    while(off >= 0 && filename[off] != 47 && filename[off] != 92) {
-        --off;
+// rings of the calling thread, given up for adoption when it exits
+typedef struct {
+    const void          *logger;
+    void                *ring;
+    std::atomic<bool>   *abandoned;
+} ThreadRing;
+
+typedef struct ThreadRings {
+    std::vector<ThreadRing> rings;
+    ~ThreadRings() {
+        for(size_t i = 0; i < rings.size(); i++) {
+            rings[i].abandoned->store(true, std::memory_order_release);
+        }
     }
-    char *new_name =  (char *)malloc(len - off);
-    memcpy(new_name, filename + off + 1, len - off - 1);
-    new_name[len - off - 1] = '\0';
-    return new_name;
-}
+} ThreadRings;
+
+static thread_local ThreadRings threadRings;
 
 inline static std::string formatNowTime() {
     char buffer[20];
@@ -28,12 +42,30 @@ inline static std::string formatNowTime() {
     return std::string(buffer);
 }
 
-inline static std::string formatNowDate() {
-    char buffer[20];
-    time_t t = time(0);
-    struct tm* timeinfo = localtime(&t);
-    strftime(buffer, sizeof(buffer), "%Y-%m-%d", timeinfo);
-    return std::string(buffer);
+// xorshift, sampling needs no more than a cheap uniform draw per request
+inline static uint32_t sampleDraw() {
+    static thread_local uint32_t state = 0;
+    if(state == 0) {
+        state = (uint32_t) (std::hash<std::thread::id>()(std::this_thread::get_id()) ^ time(0)) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// writes the decimal digits of value to out, returns their count
+inline static size_t formatUnsigned(char *out, uint64_t value) {
+    char digits[20];
+    size_t n = 0;
+    do {
+        digits[n++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while(value > 0);
+    for(size_t i = 0; i < n; i++) {
+        out[i] = digits[n - 1 - i];
+    }
+    return n;
 }
 
 inline static void doMkdir(const char *path) {
@@ -73,7 +105,6 @@ Logger::Logger(std::string const& logPath, std::string const& logFileName, const
     m_logPath = logPath;
     m_logLevel = logLevel;
     m_logFileName = logFileName;
-    m_logFile = NULL;
     
     size_t pathLen = m_logPath.length();
     if(!isAbsolutePath(m_logPath.c_str())) {
@@ -87,44 +118,129 @@ Logger::Logger(std::string const& logPath, std::string const& logFileName, const
     }
     doMkdirs(m_logPath);
 
-    if(!logThreadRuning) {
+    m_writer = std::thread(&Logger::logAppendThread, this);
+}
+
+Logger::~Logger() {
+    {
         std::lock_guard<std::mutex> lock(m_logMutex);
-        if(!logThreadRuning) {
-            logThreadRuning = true;
-            std::thread run(&Logger::logAppendThread, this);
-            run.detach();
+        m_running = false;
+        m_cv.notify_one();
+    }
+    if(m_writer.joinable()) {
+        m_writer.join();
+    }
+    if(m_logFd >= 0) {
+        close(m_logFd);
+    }
+    for(size_t i = 0; i < m_rings.size(); i++) {
+        delete m_rings[i];
+    }
+}
+
+int Logger::requestLevel(LogControl const *proxy, LogControl const *location) {
+    int level = LOG_LEVEL_UNSET;
+    uint32_t every = 0;
+    int sampled = LOG_LEVEL_UNSET;
+    LogControl const *controls[2] = {location, proxy};
+    for(int i = 0; i < 2; i++) {
+        if(controls[i] == NULL) {
+            continue;
+        }
+        if(level == LOG_LEVEL_UNSET) {
+            level = controls[i]->level.load(std::memory_order_relaxed);
+        }
+        if(every == 0) {
+            every = controls[i]->sampleEvery.load(std::memory_order_relaxed);
+            sampled = controls[i]->sampleLevel.load(std::memory_order_relaxed);
         }
     }
+    if(every > 0 && sampleDraw() % every == 0) {
+        int base = level != LOG_LEVEL_UNSET ? level : getDefault().level();
+        level = std::min(base, sampled);
+    }
+    return level;
 }
 
-Logger::~Logger() {
+void Logger::setRingSize(size_t slots) {
+    size_t size = 16;
+    while(size < slots && size < (1U << 20)) {
+        size <<= 1;
+    }
     std::lock_guard<std::mutex> lock(m_logMutex);
-    m_cv.notify_one();
+    m_ringSize = size;
+}
+
+Logger::LogRing* Logger::ring() {
+    std::vector<ThreadRing>& mine = threadRings.rings;
+    for(size_t i = 0; i < mine.size(); i++) {
+        if(mine[i].logger == this) {
+            return static_cast<LogRing *>(mine[i].ring);
+        }
+    }
+    LogRing *ring = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_logMutex);
+        for(size_t i = 0; i < m_rings.size() && ring == NULL; i++) {
+            LogRing *r = m_rings[i];
+            if(r->abandoned.load(std::memory_order_acquire) && r->head.load(std::memory_order_relaxed) == r->tail.load(std::memory_order_acquire)) {
+                r->abandoned.store(false, std::memory_order_relaxed);
+                ring = r;
+            }
+        }
+        if(ring == NULL) {
+            ring = new LogRing(m_ringSize);
+            m_rings.push_back(ring);
+        }
+    }
+    mine.push_back(ThreadRing{this, ring, &ring->abandoned});
+    return ring;
 }
 
 void Logger::log(const int lv, const char *fileName, const int line, const char *fmt, ...) {
-    if(lv < m_logLevel || lv > LOG_LEVEL_FATAL) {
+    if(lv < LOG_LEVEL_NONE || lv > LOG_LEVEL_FATAL || !enabled(lv)) {
         return ;
     }
-    
-    LogEvent *event = (LogEvent *) malloc(sizeof(LogEvent));
-    event->lv = lv;
-    event->fileName = fileName;
-    event->line = line;
+    LogRing *r = ring();
+    size_t head = r->head.load(std::memory_order_relaxed);
+    while(head - r->tail.load(std::memory_order_acquire) > r->mask) {
+        if(m_overflow != LOG_OVERFLOW_BLOCK) {
+            if(m_overflow == LOG_OVERFLOW_DROP_COUNT) {
+                r->dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return ;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_logMutex);
+            m_cv.notify_one();
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
 
+    LogSlot& slot = r->slots[head & r->mask];
+    slot.lv = lv;
+    slot.fileName = fileName;
+    slot.line = line;
+    slot.time = time(0);
+    slot.heapMsg = NULL;
     va_list args;
     va_start(args, fmt);
-
-    event->msgLen = vsnprintf(NULL, 0, fmt, args);
-    va_end(args);
-    event->logMsg = (char*)malloc(event->msgLen);
-    va_start(args, fmt);
-    vsnprintf(event->logMsg, event->msgLen + 1, fmt, args);
+    int len = vsnprintf(slot.msg, SLOT_MSG, fmt, args);
     va_end(args);
+    slot.msgLen = len < 0 ? 0 : (size_t) len;
+    if(slot.msgLen >= SLOT_MSG) {
+        // too long for the slot, the only case that allocates
+        slot.heapMsg = (char *) malloc(slot.msgLen + 1);
+        va_start(args, fmt);
+        vsnprintf(slot.heapMsg, slot.msgLen + 1, fmt, args);
+        va_end(args);
+    }
+    r->head.store(head + 1, std::memory_order_release);
 
-    {
+    // without a full fence this may miss a writer just going to sleep, which then waits out its timeout
+    if(m_sleeping.load()) {
         std::lock_guard<std::mutex> lock(m_logMutex);
-        m_logEvents.push(event);
         m_cv.notify_one();
     }
 }
@@ -155,40 +271,162 @@ void Logger::console(const int lv, const char *fmt, ...) {
 }
 
 void Logger::logAppendThread() {
-    while(logThreadRuning) {
-        LogEvent *event = NULL;
-        {
-            std::unique_lock<std::mutex> lock(m_logMutex);
-            if(m_logEvents.empty()) {
-                m_cv.wait(lock);
+    while(true) {
+        if(drainBatch()) {
+            continue;
+        }
+        if(!m_running) {
+            break;
+        }
+        std::unique_lock<std::mutex> lock(m_logMutex);
+        m_sleeping = true;
+        bool pending = false;
+        for(size_t i = 0; i < m_rings.size() && !pending; i++) {
+            pending = m_rings[i]->head.load(std::memory_order_acquire) != m_rings[i]->tail.load(std::memory_order_relaxed) ||
+                      m_rings[i]->dropped.load(std::memory_order_relaxed) > 0;
+        }
+        if(!pending && m_running) {
+            m_cv.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        m_sleeping = false;
+    }
+}
+
+void Logger::openFile(time_t now) {
+    if(m_logFd >= 0 && now >= m_dayStart && now < m_dayEnd) {
+        return ;
+    }
+    if(m_logFd >= 0) {
+        close(m_logFd);
+    }
+    struct tm day;
+    localtime_r(&now, &day);
+    char today[16];
+    strftime(today, sizeof(today), "%Y-%m-%d", &day);
+    day.tm_hour = 0;
+    day.tm_min = 0;
+    day.tm_sec = 0;
+    day.tm_isdst = -1;
+    m_dayStart = mktime(&day);
+    // mktime normalizes the 32nd, and a day that is not 24 hours long
+    day.tm_mday++;
+    day.tm_isdst = -1;
+    m_dayEnd = mktime(&day);
+    std::string filePath = m_logPath + '/' + m_logFileName + '-' + today + ".log";
+    m_logFd = open(filePath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+const char* Logger::stamp(time_t when) {
+    if(when != m_stampTime) {
+        struct tm tm;
+        localtime_r(&when, &tm);
+        strftime(m_stamp, sizeof(m_stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        m_stampTime = when;
+    }
+    return m_stamp;
+}
+
+size_t Logger::formatPrefix(LogSlot const& slot, char *out) {
+    static const size_t MAX_NAME = PREFIX_MAX - 8 - 20 - 12;
+    char *p = out;
+    memcpy(p, levelFormat[slot.lv], levelLength[slot.lv]);
+    p += levelLength[slot.lv];
+    *p++ = ' ';
+    memcpy(p, stamp(slot.time), 19);
+    p += 19;
+    *p++ = ' ';
+    size_t nameLen = strnlen(slot.fileName, MAX_NAME);
+    memcpy(p, slot.fileName, nameLen);
+    p += nameLen;
+    *p++ = ':';
+    p += formatUnsigned(p, slot.line < 0 ? 0 : (uint64_t) slot.line);
+    *p++ = ' ';
+    return p - out;
+}
+
+bool Logger::drainBatch() {
+    // three per line and one per drop report
+    static const size_t MAX_IOV = BATCH_LINES * 3 + MAX_REPORTS;
+    {
+        std::lock_guard<std::mutex> lock(m_logMutex);
+        m_drain.assign(m_rings.begin(), m_rings.end());
+    }
+    m_taken.assign(m_drain.size(), 0);
+    struct iovec iov[MAX_IOV];
+    char *prefix = m_prefixes;
+    size_t count = 0;
+    int lines = 0;
+    int reports = 0;
+    time_t now = time(0);
+    for(size_t k = 0; k < m_drain.size() && lines < BATCH_LINES; k++) {
+        LogRing *r = m_drain[k];
+        uint64_t dropped = r->dropped.load(std::memory_order_relaxed);
+        size_t tail = r->tail.load(std::memory_order_relaxed);
+        size_t head = r->head.load(std::memory_order_acquire);
+        size_t n = std::min(head - tail, (size_t) (BATCH_LINES - lines));
+        for(size_t i = 0; i < n; i++) {
+            LogSlot& slot = r->slots[(tail + i) & r->mask];
+            size_t len = formatPrefix(slot, prefix);
+            iov[count].iov_base = prefix;
+            iov[count++].iov_len = len;
+            prefix += len;
+            iov[count].iov_base = slot.heapMsg != NULL ? slot.heapMsg : slot.msg;
+            iov[count++].iov_len = slot.msgLen;
+            iov[count].iov_base = (void *) NEWLINE;
+            iov[count++].iov_len = 1;
+        }
+        m_taken[k] = n;
+        lines += (int) n;
+        // the drops happened after the lines at hand, reported once the ring is caught up
+        if(dropped > 0 && tail + n == head && reports++ < MAX_REPORTS) {
+            r->dropped.fetch_sub(dropped, std::memory_order_relaxed);
+            int len = snprintf(prefix, PREFIX_MAX, "%s %s Logger.cpp:0 %llu lines dropped, log ring full\n",
+                               levelFormat[LOG_LEVEL_WARN], stamp(now), (unsigned long long) dropped);
+            iov[count].iov_base = prefix;
+            iov[count++].iov_len = len;
+            prefix += len;
+        }
+    }
+    if(count == 0) {
+        return false;
+    }
+
+    openFile(now);
+    struct iovec *next = iov;
+    int left = (int) count;
+    while(left > 0 && m_logFd >= 0) {
+        ssize_t written = writev(m_logFd, next, left);
+        if(written < 0) {
+            if(errno == EINTR) {
                 continue;
             }
-            event = m_logEvents.front();
-            m_logEvents.pop();
-
-            std::string today = formatNowDate();
-            if(m_curDate != today) {
-                if(m_logFile) {
-                    fclose(m_logFile);
-                }
-                m_curDate = today;
-                std::string filePath = m_logPath + '/' + m_logFileName + '-' + today + ".log";
-                m_logFile = fopen(filePath.c_str(), "ab");
-            }
+            break;
         }
-        if(event == NULL) {
-            continue;
+        while(left > 0 && (size_t) written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            left--;
         }
-        std::string level(levelFormat[event->lv]);
-        std::string time = formatNowTime();
-        std::string fileName = simplifyFilename(event->fileName);
-        std::string logMsg(event->logMsg, event->msgLen);
-        logMsg = level + ' ' + time + ' ' + fileName + ':' + std::to_string(event->line) + ' ' + logMsg + '\n';
-
-        fprintf(m_logFile, logMsg.c_str());
-        fflush(m_logFile);
+        if(left > 0) {
+            next->iov_base = (char *) next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
 
-        free(event->logMsg);
-        free(event);
+    for(size_t k = 0; k < m_drain.size(); k++) {
+        if(m_taken[k] == 0) {
+            continue;
+        }
+        LogRing *r = m_drain[k];
+        size_t tail = r->tail.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < m_taken[k]; i++) {
+            LogSlot& slot = r->slots[(tail + i) & r->mask];
+            if(slot.heapMsg != NULL) {
+                free(slot.heapMsg);
+                slot.heapMsg = NULL;
+            }
+        }
+        r->tail.store(tail + m_taken[k], std::memory_order_release);
     }
-}
\ No newline at end of file
+    return true;
+}
@@ -2,40 +2,129 @@
 
 #include <string>
 #include <vector>
-#include <queue>
 #include <mutex>
+#include <atomic>
 #include <thread>
+#include <memory>
 #include <condition_variable>
 #include <ctime>
 #include <chrono>
+#include <type_traits>
 
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-enum { LOG_LEVEL_NONE, LOG_LEVEL_TRACE, LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR, LOG_LEVEL_FATAL };
+// LOG_LEVEL_UNSET leaves the level to the enclosing scope
+enum { LOG_LEVEL_UNSET = -1, LOG_LEVEL_NONE, LOG_LEVEL_TRACE, LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_WARN, LOG_LEVEL_ERROR, LOG_LEVEL_FATAL };
+
+// what a producer does when its ring is full
+enum { LOG_OVERFLOW_BLOCK, LOG_OVERFLOW_DROP, LOG_OVERFLOW_DROP_COUNT };
 
 namespace archer 
 {
 namespace common 
 {
 
+// offset of the file name in a source path, evaluated by the compiler for __FILE__
+constexpr size_t basenameOffset(const char *path, size_t at = 0, size_t last = 0) {
+    return path[at] == '\0' ? last : basenameOffset(path, at + 1, (path[at] == '/' || path[at] == '\\') ? at + 1 : last);
+}
+
+// "NONE" to "FATAL" in any case, LOG_LEVEL_UNSET for anything else
+inline int parseLogLevel(std::string const& name) {
+    static const char *names[] = {"NONE", "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
+    for(int lv = LOG_LEVEL_NONE; lv <= LOG_LEVEL_FATAL; lv++) {
+        if(strcasecmp(name.c_str(), names[lv]) == 0) {
+            return lv;
+        }
+    }
+    return LOG_LEVEL_UNSET;
+}
+
+inline const char* logLevelName(int lv) {
+    static const char *names[] = {"NONE", "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"};
+    return lv >= LOG_LEVEL_NONE && lv <= LOG_LEVEL_FATAL ? names[lv] : "UNSET";
+}
+
+/**
+ * Runtime log level of one proxy or location. Requests it applies to log at
+ * level instead of the global one, and one in sampleEvery of them at
+ * sampleLevel when that is lower. Shared by every copy of its owner, so a
+ * change is seen by the next request without rebuilding anything.
+*/
+typedef struct LogControl {
+    std::atomic<int>      level{LOG_LEVEL_UNSET};
+    // 0 disables sampling
+    std::atomic<uint32_t> sampleEvery{0};
+    std::atomic<int>      sampleLevel{LOG_LEVEL_TRACE};
+} LogControl;
+
+typedef std::shared_ptr<LogControl> LogControlPtr;
+
+/**
+ * Asynchronous file logger.
+ *
+ * Every producer thread owns a single producer single consumer ring of
+ * preallocated slots and formats its message straight into the next free
+ * one, so logging takes no lock and allocates nothing unless a message does
+ * not fit its slot. The writer thread drains all rings in batches, one writev
+ * per batch, the message bytes go to the file from the slots themselves.
+ * Lines of one thread keep their order, lines of different threads are
+ * interleaved batch by batch.
+ *
+ * The writer formats every line prefix into one reusable buffer, the
+ * timestamp text is built once per second and the file names come as
+ * basenames from the LOG_ macros, so a steady stream of lines allocates
+ * nothing on either side.
+*/
 class Logger 
 {
 
+static const size_t SLOT_MSG = 448;
+static const int BATCH_LINES = 256;
+// "[FATAL] 2024-01-01 00:00:00 <basename>:<line> ", longer basenames are cut
+static const size_t PREFIX_MAX = 128;
+static const int MAX_REPORTS = 32;
+
 typedef struct {
-    int lv;
+    int         lv;
     const char *fileName;
-    int line;
-    char *logMsg;
-    size_t msgLen;
-} LogEvent;
+    int         line;
+    time_t      time;
+    size_t      msgLen;
+    // set when the message did not fit msg
+    char       *heapMsg;
+    char        msg[SLOT_MSG];
+} LogSlot;
+
+typedef struct LogRing {
+    explicit LogRing(size_t capacity) : slots(capacity), mask(capacity - 1) {}
+    std::vector<LogSlot>     slots;
+    size_t                   mask;
+    std::atomic<size_t>      head{0};
+    std::atomic<size_t>      tail{0};
+    // its thread exited, another one may adopt it once it is drained
+    std::atomic<bool>        abandoned{false};
+    // lines dropped since the last report, LOG_OVERFLOW_DROP_COUNT only
+    std::atomic<uint64_t>    dropped{0};
+} LogRing;
 
 public:
 
+    // level of the request the calling thread works on, LOG_LEVEL_UNSET outside of one
+    static int& scopeLevel() {
+        static thread_local int level = LOG_LEVEL_UNSET;
+        return level;
+    }
+
+    // the level of a request under proxy and location, the location overrides the proxy, both may be null
+    static int requestLevel(LogControl const *proxy, LogControl const *location);
+
     static Logger& getDefault() {
         static Logger instance("logs", "log", LOG_LEVEL_INFO);
         return instance;
@@ -52,42 +141,117 @@ public:
     void console(const int lv, const char *fmt, ...);
 
     void setLevel(const int lv) {
-        m_logLevel = lv;
+        m_logLevel.store(lv, std::memory_order_relaxed);
+    }
+
+    int level() const {
+        return m_logLevel.load(std::memory_order_relaxed);
+    }
+
+    // checked by the LOG_ macros before their arguments are evaluated
+    bool enabled(const int lv) const {
+        int scoped = scopeLevel();
+        return lv >= (scoped != LOG_LEVEL_UNSET ? scoped : m_logLevel.load(std::memory_order_relaxed));
     }
     void setPath(std::string const& path) {
         m_logPath = path;
     }
+    void setOverflow(const int policy) {
+        m_overflow = policy;
+    }
+    // slots of the rings created from now on, rounded up to a power of two
+    void setRingSize(size_t slots);
+
+    // lines lost to full rings so far
+    uint64_t dropped() const {
+        return m_dropped.load(std::memory_order_relaxed);
+    }
 
 private:
 
+    LogRing* ring();
+
     void logAppendThread();
 
+    // moves up to BATCH_LINES lines into one writev, false when all rings were empty
+    bool drainBatch();
+
+    // reopens the file when now is past the day of the current one
+    void openFile(time_t now);
+
+    // "YYYY-MM-DD HH:MM:SS" of when, rebuilt only when the second changes
+    const char* stamp(time_t when);
+
+    // writes the prefix of slot to out, returns its length
+    size_t formatPrefix(LogSlot const& slot, char *out);
+
     std::string                  m_logPath;
     std::string                  m_logFileName;
-    int                          m_logLevel;
+    std::atomic<int>             m_logLevel;
+    int                          m_overflow = LOG_OVERFLOW_BLOCK;
+    size_t                       m_ringSize = 1024;
     std::mutex                   m_logMutex;
-    std::queue<LogEvent *>       m_logEvents;
     std::condition_variable      m_cv;
-    std::string                  m_curDate;
-    FILE                        *m_logFile;
+    std::vector<LogRing *>       m_rings;
+    std::atomic<bool>            m_running{true};
+    // the writer is about to wait, producers wake it only then
+    std::atomic<bool>            m_sleeping{false};
+    std::atomic<uint64_t>        m_dropped{0};
+    int                          m_logFd = -1;
+    // the day of the open file as [start, end) in seconds
+    time_t                       m_dayStart = 0;
+    time_t                       m_dayEnd = 0;
+    // writer thread only, reused from batch to batch
+    time_t                       m_stampTime = -1;
+    char                         m_stamp[20];
+    std::vector<LogRing *>       m_drain;
+    std::vector<size_t>          m_taken;
+    char                         m_prefixes[BATCH_LINES * PREFIX_MAX + MAX_REPORTS * PREFIX_MAX];
+    std::thread                  m_writer;
+};
+
+// sets the request level of the calling thread for its lifetime
+class LogScope
+{
+public:
+
+    explicit LogScope(int level) : m_saved(Logger::scopeLevel()) {
+        Logger::scopeLevel() = level;
+    }
+    ~LogScope() {
+        Logger::scopeLevel() = m_saved;
+    }
+
+    LogScope(const LogScope&) = delete;
+    LogScope& operator=(const LogScope&) = delete;
+
+private:
+
+    int     m_saved;
 };
 }
 }
 
+// basename of the current source file, a constant so nothing is scanned at run time
+#define LOG_FILE (__FILE__ + std::integral_constant<size_t, archer::common::basenameOffset(__FILE__)>::value)
+
 #define console_out(...)   archer::common::Logger::getDefault().console(LOG_LEVEL_INFO, __VA_ARGS__)
 #define console_error(...) archer::common::Logger::getDefault().console(LOG_LEVEL_ERROR, __VA_ARGS__)
 
-#define LOG_trace(...) archer::common::Logger::getDefault().log(LOG_LEVEL_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_debug(...) archer::common::Logger::getDefault().log(LOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_info(...)  archer::common::Logger::getDefault().log(LOG_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_warn(...)  archer::common::Logger::getDefault().log(LOG_LEVEL_WARN, __FILE__, __LINE__,  __VA_ARGS__)
-#define LOG_error(...) archer::common::Logger::getDefault().log(LOG_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define LOG_fatal(...) archer::common::Logger::getDefault().log(LOG_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+// one predictable branch when the level is off, the arguments are not evaluated then
+#define LOG_AT(logger, lv, ...) do { if((logger).enabled(lv)) (logger).log(lv, LOG_FILE, __LINE__, __VA_ARGS__); } while(0)
+
+#define LOG_trace(...) LOG_AT(archer::common::Logger::getDefault(), LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_debug(...) LOG_AT(archer::common::Logger::getDefault(), LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_info(...)  LOG_AT(archer::common::Logger::getDefault(), LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_warn(...)  LOG_AT(archer::common::Logger::getDefault(), LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_error(...) LOG_AT(archer::common::Logger::getDefault(), LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_fatal(...) LOG_AT(archer::common::Logger::getDefault(), LOG_LEVEL_FATAL, __VA_ARGS__)
 
 
-#define LOGGER_trace(logger, ...) logger.log(LOG_LEVEL_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define LOGGER_debug(logger,...)  logger.log(LOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define LOGGER_info(logger, ...)  logger.log(LOG_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
-#define LOGGER_warn(logger, ...)  logger.log(LOG_LEVEL_WARN, __FILE__, __LINE__,  __VA_ARGS__)
-#define LOGGER_error(logger, ...) logger.log(LOG_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define LOGGER_fatal(logger, ...) logger.log(LOG_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+#define LOGGER_trace(logger, ...) LOG_AT(logger, LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOGGER_debug(logger,...)  LOG_AT(logger, LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOGGER_info(logger, ...)  LOG_AT(logger, LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOGGER_warn(logger, ...)  LOG_AT(logger, LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOGGER_error(logger, ...) LOG_AT(logger, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOGGER_fatal(logger, ...) LOG_AT(logger, LOG_LEVEL_FATAL, __VA_ARGS__)
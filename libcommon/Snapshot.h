@@ -0,0 +1,148 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace archer
+{
+namespace common
+{
+
+/**
+ * Small dense index of a live thread. A slot goes back to a free list when its
+ * thread exits, so restarted event loops reuse the slots of the ones before them
+ * instead of running past the per instance tables of Snapshot.
+*/
+class ThreadSlots
+{
+public:
+
+    static uint32_t current() {
+        static thread_local Holder holder;
+        return holder.slot;
+    }
+
+private:
+
+    struct Holder {
+        Holder() : slot(registry().acquire()) {}
+        ~Holder() {registry().release(slot);}
+        uint32_t slot;
+    };
+
+    // never destroyed, threads may exit during static destruction
+    static ThreadSlots& registry() {
+        static ThreadSlots *instance = new ThreadSlots();
+        return *instance;
+    }
+
+    uint32_t acquire() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_free.empty()) {
+            return m_next++;
+        }
+        uint32_t slot = m_free.back();
+        m_free.pop_back();
+        return slot;
+    }
+
+    void release(uint32_t slot) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(slot);
+    }
+
+    std::mutex                   m_mutex;
+    std::vector<uint32_t>        m_free;
+    uint32_t                     m_next = 0;
+};
+
+inline uint32_t currentThreadSlot() {
+    return ThreadSlots::current();
+}
+
+/**
+ * RCU style holder of an immutable, reference counted value.
+ *
+ * Writers build a new value and publish it with store(), readers on the request path
+ * call local() and get a per thread cached pointer, refreshed only when the version
+ * changed, so a read is one atomic load and touches no shared cache line. Old values
+ * are released once every thread has moved on to a newer version. Caches are keyed by
+ * an id no other instance ever gets, an instance allocated where a freed one lived
+ * can not pick up its values. Threads past MAX_THREAD_SLOTS live ones share one
+ * cache for all instances and reload whenever they switch between them.
+ * The returned reference stays valid until the same thread calls local() again.
+*/
+template<typename T>
+class Snapshot
+{
+public:
+    typedef std::shared_ptr<const T> Ptr;
+
+    typedef struct {
+        uint64_t     owner;
+        uint64_t     version;
+        Ptr          ptr;
+        uint32_t     tick;
+    } Local;
+
+    static const uint32_t MAX_THREAD_SLOTS = 128;
+
+    Snapshot() : m_id(nextId()), m_locals(MAX_THREAD_SLOTS) {
+        for(size_t i = 0; i < m_locals.size(); i++) {
+            m_locals[i].local.owner = m_id;
+            m_locals[i].local.version = 0;
+            m_locals[i].local.tick = (uint32_t) i;
+        }
+    }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    void store(Ptr const& val) {
+        std::atomic_store(&m_ptr, val);
+        m_version.fetch_add(1, std::memory_order_release);
+    }
+
+    Ptr load() const {
+        return std::atomic_load(&m_ptr);
+    }
+
+    Local& local() const {
+        uint32_t slot = currentThreadSlot();
+        Local *local = NULL;
+        if(slot < MAX_THREAD_SLOTS) {
+            local = &m_locals[slot].local;
+        } else {
+            static thread_local Local overflow{0, 0, Ptr(), 0};
+            local = &overflow;
+        }
+        uint64_t version = m_version.load(std::memory_order_acquire);
+        if(local->owner != m_id || local->version != version) {
+            local->ptr = std::atomic_load(&m_ptr);
+            local->owner = m_id;
+            local->version = version;
+        }
+        return *local;
+    }
+
+private:
+
+    static uint64_t nextId() {
+        static std::atomic<uint64_t> ids(1);
+        return ids.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    struct alignas(64) PaddedLocal {
+        Local local;
+    };
+
+    const uint64_t                   m_id;
+    Ptr                              m_ptr;
+    std::atomic<uint64_t>            m_version{1};
+    mutable std::vector<PaddedLocal> m_locals;
+};
+}
+}
@@ -2,6 +2,79 @@
 
 using namespace archer::database;
 
+// lmdb keys are at most 511 bytes, longer values are keyed by their first MAX_INDEX_KEY bytes and a digest
+static const size_t MAX_INDEX_KEY = 480;
+
+// a full map is doubled at most this many times for one write
+static const int MAX_MAP_GROWS = 16;
+
+static MDB_val dbValue(std::string const& str) {
+    MDB_val val;
+    val.mv_size = str.length();
+    val.mv_data = (void *)str.c_str();
+    return val;
+}
+
+// 64 bit FNV-1a, only tells long index values apart, nothing relies on it being secret
+static uint64_t digest(std::string const& value) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < value.length(); i++) {
+        hash = (hash ^ (unsigned char) value[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// longer than any value kept as is, so a digest key never equals a short value
+static std::string indexKey(std::string const& value) {
+    if(value.length() <= MAX_INDEX_KEY) {
+        return value;
+    }
+    char suffix[24];
+    snprintf(suffix, sizeof(suffix), "#%016llx", (unsigned long long) digest(value));
+    return value.substr(0, MAX_INDEX_KEY) + suffix;
+}
+
+// the plain prefix older databases keyed long values by, still read and removed
+static std::string legacyIndexKey(std::string const& value) {
+    return value.substr(0, MAX_INDEX_KEY);
+}
+
+// "<port>/<address>", zero padded so one range scan finds every address on a port
+static std::string portPrefix(int port) {
+    char prefix[16];
+    snprintf(prefix, sizeof(prefix), "%05d/", port);
+    return prefix;
+}
+
+static std::string backendValue(std::string const& host, int port) {
+    return host + ":" + std::to_string(port);
+}
+
+// the indexed values of a proxy, not yet turned into keys
+static void proxyIndexEntries(Json::Value const& val, MDB_dbi portDbi, MDB_dbi locationDbi, MDB_dbi backendDbi,
+                              std::vector<std::pair<MDB_dbi, std::string>> &entries) {
+    entries.push_back(std::make_pair(portDbi, portPrefix(val["port"].asInt()) + val["address"].asString()));
+    Json::Value const& locations = val["locations"];
+    for(int i = 0; i < locations.size(); i++) {
+        entries.push_back(std::make_pair(locationDbi, locations[i]["src"].asString()));
+    }
+    Json::Value const& backends = val["backends"];
+    for(int i = 0; i < backends.size(); i++) {
+        entries.push_back(std::make_pair(backendDbi, backendValue(backends[i]["host"].asString(), backends[i]["port"].asInt())));
+    }
+}
+
+static std::string conflictServerName(Json::Value const& names, Json::Value const& used) {
+    for(int i = 0; i < names.size(); i++) {
+        for(int j = 0; j < used.size(); j++) {
+            if(names[i].asString() == used[j].asString()) {
+                return names[i].asString();
+            }
+        }
+    }
+    return "";
+}
+
 void DataBase::init(std::string const& dbPath, unsigned int readerNum, size_t maxMemorySize) {
     openDataBase(dbPath, readerNum, maxMemorySize);
     initData();
@@ -14,7 +87,7 @@ void DataBase::openDataBase(std::string const& dbPath, unsigned int readerNum, s
         LOG_error("Can not create lmdb file database environment. Exit(0)\n");
         exit(0);
     }
-    if(doError(mdb_env_set_maxdbs(m_env, 4))) {
+    if(doError(mdb_env_set_maxdbs(m_env, 8))) {
         console_error("Can not set lmdb file database max db nums. Exit(0)");
         LOG_error("Can not set lmdb file database max db nums. Exit(0)");
         exit(0);
@@ -44,16 +117,29 @@ void DataBase::openDataBase(std::string const& dbPath, unsigned int readerNum, s
         exit(0);
     }
 
-    if(doError(mdb_dbi_open(txn, "aproxy", MDB_CREATE, &m_dbi))) {
-        console_error("Open file database failed. Exit(0)");
-        LOG_error("Open file database failed. Exit(0)");
-        mdb_txn_abort(txn);
-        exit(0);
+    struct {
+        const char *name;
+        unsigned int flags;
+        MDB_dbi *dbi;
+    } dbis[] = {
+        {"aproxy", MDB_CREATE, &m_dbi},
+        {"aproxy-proxy", MDB_CREATE, &m_proxyDbi},
+        {"aproxy-port", MDB_CREATE | MDB_DUPSORT, &m_portDbi},
+        {"aproxy-location", MDB_CREATE | MDB_DUPSORT, &m_locationDbi},
+        {"aproxy-backend", MDB_CREATE | MDB_DUPSORT, &m_backendDbi},
+    };
+    for(size_t i = 0; i < sizeof(dbis) / sizeof(dbis[0]); i++) {
+        if(doError(mdb_dbi_open(txn, dbis[i].name, dbis[i].flags, dbis[i].dbi))) {
+            console_error("Open file database %s failed. Exit(0)", dbis[i].name);
+            LOG_error("Open file database %s failed. Exit(0)", dbis[i].name);
+            mdb_txn_abort(txn);
+            exit(0);
+        }
     }
+    // a failed commit frees the transaction already
     if(doError(mdb_txn_commit(txn))) {
         console_error("Open file database commit transaction failed. Exit(0)");
         LOG_error("Open file database commit transaction failed. Exit(0)");
-        mdb_txn_abort(txn);
         exit(0);
     }
 
@@ -61,111 +147,321 @@ void DataBase::openDataBase(std::string const& dbPath, unsigned int readerNum, s
     LOG_info("Create lmdb file database success");
 }
 
+
 void DataBase::initData() {
-    MDB_txn *txn = NULL;
-    if(doError(mdb_txn_begin(m_env, NULL, 0, &txn))) {
-        console_error("Begin initialize data transaction failed. Exit(0)");
-        LOG_error("Begin initialize data transaction failed. Exit(0)");
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int migrated = 0;
+    int rc = update([&](MDB_txn *txn) -> int {
+        migrated = 0;
+        MDB_val listValue;
+        int rc = mdb_get(txn, m_dbi, &m_key, &listValue);
+        if(rc) {
+            return rc == MDB_NOTFOUND ? 0 : rc;
+        }
+        std::string listStr((char *)listValue.mv_data, listValue.mv_size);
+        Json::Value list;
+        if(listValue.mv_size > 0 && !m_jsonReader.parse(listStr, list)) {
+            console_error("Database JSON parse key %s failed. Exit(0)", m_listKey.c_str());
+            LOG_error("Database JSON parse key %s failed. Exit(0)", m_listKey.c_str());
+            exit(0);
+        }
+        for(int i = 0; i < list.size(); i++) {
+            // ids of the old list could repeat, a later proxy must not overwrite an earlier one
+            std::string id = list[i]["id"].asString();
+            Json::Value taken;
+            while(id.empty() || (rc = readProxy(txn, id, taken)) == 0) {
+                id = archer::common::randomString();
+            }
+            if(rc != MDB_NOTFOUND) {
+                return rc;
+            }
+            if(id != list[i]["id"].asString()) {
+                console_out("Database proxy %d of key %s has a missing or repeated id '%s', migrated as %s", i, m_listKey.c_str(), list[i]["id"].asString().c_str(), id.c_str());
+                LOG_warn("Database proxy %d of key %s has a missing or repeated id '%s', migrated as %s", i, m_listKey.c_str(), list[i]["id"].asString().c_str(), id.c_str());
+                list[i]["id"] = id;
+            }
+            if((rc = putProxy(txn, list[i]))) {
+                return rc;
+            }
+            migrated++;
+        }
+        return mdb_del(txn, m_dbi, &m_key, NULL);
+    });
+    if(rc) {
+        console_error("Database data initialize failed, due to %s. Exit(0)", mdb_strerror(rc));
+        LOG_error("Database data initialize failed, due to %s. Exit(0)", mdb_strerror(rc));
         exit(0);
     }
+    if(migrated > 0) {
+        console_out("Database migrated %d proxies from key %s", migrated, m_listKey.c_str());
+        LOG_info("Database migrated %d proxies from key %s", migrated, m_listKey.c_str());
+    }
+}
 
+int DataBase::update(std::function<int(MDB_txn *)> const& body) {
     int rc = 0;
-    MDB_val listValue;
-    if((rc = mdb_get(txn, m_dbi, &m_key, &listValue))) {
-        LOG_info("Database fetch rc %d, data len %d", rc, listValue.mv_size);
-        if(MDB_NOTFOUND == rc || listValue.mv_size == 0) {
-            listValue.mv_data = (void*)"[]";
-            listValue.mv_size = 2;
-            if((rc = mdb_put(txn, m_dbi, &m_key, &listValue, 0))) {
-                LOG_error("Database Writting data failed, due to %s", mdb_strerror(rc));
-                mdb_txn_abort(txn);
-                exit(0);
-            }
+    for(int attempt = 0; ; attempt++) {
+        MDB_txn *txn = NULL;
+        rc = mdb_txn_begin(m_env, NULL, 0, &txn);
+        // another process grew the map, adopt its size
+        if(rc == MDB_MAP_RESIZED && attempt < MAX_MAP_GROWS && mdb_env_set_mapsize(m_env, 0) == 0) {
+            continue;
+        }
+        if(rc) {
+            LOG_error("database Begin write transaction failed, due to %s", mdb_strerror(rc));
+            return rc;
+        }
+        rc = body(txn);
+        if(rc == 0) {
+            rc = mdb_txn_commit(txn);
         } else {
-            console_error("Database data initialize failed, due to %s", mdb_strerror(rc));
-            LOG_error("Database data initialize failed, due to %s", mdb_strerror(rc));
-            mdb_txn_abort(txn); 
-            exit(0);  
+            mdb_txn_abort(txn);
+        }
+        if(rc != MDB_MAP_FULL || attempt >= MAX_MAP_GROWS) {
+            break;
         }
+        MDB_envinfo info;
+        mdb_env_info(m_env, &info);
+        if(mdb_env_set_mapsize(m_env, info.me_mapsize * 2)) {
+            break;
+        }
+        LOG_info("Database map full, grown from %llu to %llu bytes", (unsigned long long) info.me_mapsize, (unsigned long long) info.me_mapsize * 2);
     }
-    
-    if(doError(mdb_txn_commit(txn))) {
-        console_error("Database data initialize commit transaction failed. Exit(0)");
-        LOG_error("Database data initialize commit transaction failed. Exit(0)");
-        mdb_txn_abort(txn);
-        exit(0);
+    if(rc && rc != MDB_NOTFOUND && rc != MDB_KEYEXIST) {
+        LOG_error("database Write transaction failed, due to %s", mdb_strerror(rc));
     }
+    return rc;
 }
 
-std::string DataBase::listAllProxy() {
-    int rc = 0;
+int DataBase::readProxy(MDB_txn *txn, std::string const& id, Json::Value &val) {
+    MDB_val key = dbValue(id);
+    MDB_val value;
+    int rc = mdb_get(txn, m_proxyDbi, &key, &value);
+    if(rc) {
+        return rc;
+    }
+    std::string str((char *)value.mv_data, value.mv_size);
+    if(!m_jsonReader.parse(str, val)) {
+        LOG_error("database JSON parse proxy %s failed", id.c_str());
+        return MDB_CORRUPTED;
+    }
+    return 0;
+}
+
+int DataBase::putProxy(MDB_txn *txn, Json::Value const& val) {
+    std::string id = val["id"].asString();
+    std::string str = m_jsonWriter.write(val);
+    if(!str.empty() && str[str.length() - 1] == '\n') {
+        str.pop_back();
+    }
+    MDB_val key = dbValue(id);
+    MDB_val value = dbValue(str);
+    int rc = mdb_put(txn, m_proxyDbi, &key, &value, 0);
+    if(rc) {
+        return rc;
+    }
+    std::vector<std::pair<MDB_dbi, std::string>> entries;
+    proxyIndexEntries(val, m_portDbi, m_locationDbi, m_backendDbi, entries);
+    for(size_t i = 0; i < entries.size(); i++) {
+        std::string keyStr = indexKey(entries[i].second);
+        MDB_val key = dbValue(keyStr);
+        MDB_val indexValue = dbValue(id);
+        // two locations of one proxy may share a src
+        rc = mdb_put(txn, entries[i].first, &key, &indexValue, MDB_NODUPDATA);
+        if(rc && rc != MDB_KEYEXIST) {
+            return rc;
+        }
+    }
+    return 0;
+}
 
+int DataBase::removeProxy(MDB_txn *txn, Json::Value const& val) {
+    std::string id = val["id"].asString();
+    MDB_val key = dbValue(id);
+    int rc = mdb_del(txn, m_proxyDbi, &key, NULL);
+    if(rc && rc != MDB_NOTFOUND) {
+        return rc;
+    }
+    std::vector<std::pair<MDB_dbi, std::string>> entries;
+    proxyIndexEntries(val, m_portDbi, m_locationDbi, m_backendDbi, entries);
+    for(size_t i = 0; i < entries.size(); i++) {
+        std::string keys[] = {indexKey(entries[i].second), legacyIndexKey(entries[i].second)};
+        // a long value may still be stored under its legacy key
+        int count = entries[i].second.length() > MAX_INDEX_KEY ? 2 : 1;
+        for(int j = 0; j < count; j++) {
+            MDB_val key = dbValue(keys[j]);
+            MDB_val indexValue = dbValue(id);
+            rc = mdb_del(txn, entries[i].first, &key, &indexValue);
+            if(rc && rc != MDB_NOTFOUND) {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+int DataBase::findIds(MDB_txn *txn, MDB_dbi index, std::string const& key, std::vector<std::string> &ids, bool prefix) {
+    MDB_cursor *cursor = NULL;
+    int rc = mdb_cursor_open(txn, index, &cursor);
+    if(rc) {
+        return rc;
+    }
+    MDB_val k = dbValue(key);
+    MDB_val v;
+    rc = mdb_cursor_get(cursor, &k, &v, prefix ? MDB_SET_RANGE : MDB_SET_KEY);
+    while(rc == 0) {
+        if(k.mv_size < key.length() || memcmp(k.mv_data, key.c_str(), key.length()) != 0 || (!prefix && k.mv_size != key.length())) {
+            break;
+        }
+        ids.push_back(std::string((char *)v.mv_data, v.mv_size));
+        rc = mdb_cursor_get(cursor, &k, &v, prefix ? MDB_NEXT : MDB_NEXT_DUP);
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+std::string DataBase::listAllProxy() {
+    std::lock_guard<std::mutex> lock(m_mutex);
     MDB_txn *txn = NULL;
+    MDB_cursor *cursor = NULL;
+    int rc = 0;
 
     LOG_info("List all proxies");
 
-    if((rc = mdb_txn_begin(m_env, NULL, 0, &txn))) {
+    if((rc = mdb_txn_begin(m_env, NULL, MDB_RDONLY, &txn))) {
         LOG_error("database Begin read transaction failed, due to %s", mdb_strerror(rc));
         return "";
     }
-
-    MDB_val listValue;
-    if((rc = mdb_get(txn, m_dbi, &m_key, &listValue))) {
-        LOG_error("database Readding key %s failed, due to %s", m_listKey.c_str(), mdb_strerror(rc));
+    if((rc = mdb_cursor_open(txn, m_proxyDbi, &cursor))) {
+        LOG_error("database Open cursor failed, due to %s", mdb_strerror(rc));
         mdb_txn_abort(txn);
         return "";
     }
-
-    if((rc = mdb_txn_commit(txn))) {
-        LOG_error("database Commit transaction failed, due to %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
+    // the records are JSON already, they are joined without parsing them
+    std::string list = "[";
+    MDB_val key, value;
+    while((rc = mdb_cursor_get(cursor, &key, &value, MDB_NEXT)) == 0) {
+        if(list.length() > 1) {
+            list += ',';
+        }
+        list.append((char *)value.mv_data, value.mv_size);
+    }
+    list += ']';
+    mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+    if(rc != MDB_NOTFOUND) {
+        LOG_error("database Reading proxies failed, due to %s", mdb_strerror(rc));
         return "";
     }
-    std::string val((char *)listValue.mv_data, listValue.mv_size);
-    return val;
+    return list;
 }
 
-
-bool DataBase::saveAllProxy(Json::Value &val) {
-    
+std::string DataBase::listProxies(MDB_dbi index, std::string const& value, std::function<bool(Json::Value const&)> const& matches) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    MDB_txn *txn = NULL;
     int rc = 0;
+    if((rc = mdb_txn_begin(m_env, NULL, MDB_RDONLY, &txn))) {
+        LOG_error("database Begin read transaction failed, due to %s", mdb_strerror(rc));
+        return "";
+    }
+    std::vector<std::string> ids;
+    if((rc = findIds(txn, index, indexKey(value), ids)) ||
+       (value.length() > MAX_INDEX_KEY && (rc = findIds(txn, index, legacyIndexKey(value), ids)))) {
+        LOG_error("database Reading index %s failed, due to %s", value.c_str(), mdb_strerror(rc));
+        mdb_txn_abort(txn);
+        return "";
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    std::string list = "[";
+    Json::Value proxy;
+    for(size_t i = 0; i < ids.size(); i++) {
+        MDB_val k = dbValue(ids[i]);
+        MDB_val record;
+        if(mdb_get(txn, m_proxyDbi, &k, &record)) {
+            continue;
+        }
+        // a key is only a lookup hint, the record itself must hold the value
+        std::string str((char *)record.mv_data, record.mv_size);
+        if(!m_jsonReader.parse(str, proxy) || !matches(proxy)) {
+            continue;
+        }
+        if(list.length() > 1) {
+            list += ',';
+        }
+        list.append(str);
+    }
+    list += ']';
+    mdb_txn_abort(txn);
+    return list;
+}
 
-    MDB_cursor *cursor = NULL;
-    MDB_txn *txn;
+std::string DataBase::listProxiesByBackend(std::string const& host, int port) {
+    return listProxies(m_backendDbi, backendValue(host, port), [&](Json::Value const& proxy) -> bool {
+        Json::Value const& backends = proxy["backends"];
+        for(int i = 0; i < backends.size(); i++) {
+            if(backends[i]["host"].asString() == host && backends[i]["port"].asInt() == port) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
 
-    LOG_info("Save all proxies");
+std::string DataBase::listProxiesByLocation(std::string const& src) {
+    return listProxies(m_locationDbi, src, [&](Json::Value const& proxy) -> bool {
+        Json::Value const& locations = proxy["locations"];
+        for(int i = 0; i < locations.size(); i++) {
+            if(locations[i]["src"].asString() == src) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
 
-    if((rc = mdb_txn_begin(m_env, NULL, 0, &txn))) {
+bool DataBase::getProxy(std::string const& id, Json::Value &val) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    MDB_txn *txn = NULL;
+    int rc = 0;
+    if((rc = mdb_txn_begin(m_env, NULL, MDB_RDONLY, &txn))) {
         LOG_error("database Begin read transaction failed, due to %s", mdb_strerror(rc));
         return false;
     }
+    rc = readProxy(txn, id, val);
+    mdb_txn_abort(txn);
+    if(rc && rc != MDB_NOTFOUND) {
+        LOG_error("database Reading proxy %s failed, due to %s", id.c_str(), mdb_strerror(rc));
+    }
+    return rc == 0;
+}
 
-    LOG_trace("Begin to save all proxies transaction with key = '%s'", m_listKey.c_str());
-
-    std::string list = m_jsonWriter.write(val);
-    
-    MDB_val listValue;
-    listValue.mv_data = (void *) list.c_str();
-    listValue.mv_size = list.length();
+bool DataBase::saveProxy(Json::Value &val) {
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-    if((rc = mdb_put(txn, m_dbi, &m_key, &listValue, 0))) {
-        LOG_error("database Readding key %s failed, due to %s", m_listKey.c_str(), mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return false;
-    }
+    LOG_info("Save proxy %s", val["id"].asString().c_str());
 
-    if((rc = mdb_txn_commit(txn))) {
-        LOG_error("database Commit transaction failed, due to %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return false;
-    }
-    return true;
+    int rc = update([&](MDB_txn *txn) -> int {
+        Json::Value old;
+        int rc = readProxy(txn, val["id"].asString(), old);
+        if(rc) {
+            return rc;
+        }
+        if((rc = removeProxy(txn, old))) {
+            return rc;
+        }
+        return putProxy(txn, val);
+    });
+    return rc == 0;
 }
+
 /**
  * {
  *   "id": "",
  *   "address": "0.0.0.0"
  *   "port":8080,
+ *   "mode": "http",
+ *   "server_names": ["example.com", "*.example.com"],
  *   "threads": 2,
  *   "proxies": [
  *     {
@@ -183,59 +479,58 @@ bool DataBase::saveAllProxy(Json::Value &val) {
  * }
 */
 std::string DataBase::addProxy(Json::Value &val) {
-    int rc = 0;
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-    // MDB_dbi dbi;
-    MDB_txn *txn;
-    
     LOG_info("Add a proxy to database");
 
-    if((rc = mdb_txn_begin(m_env, NULL, 0, &txn))) {
-        LOG_error("database Begin write transaction failed, due to %s", mdb_strerror(rc));
-        return "";
-    }
-
-    MDB_val listValue;
-    if((rc = mdb_get(txn, m_dbi, &m_key, &listValue))) {
-        LOG_error("database Readding key %s failed, due to %s", m_listKey.c_str(), mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return "";
-    }
-    std::string listStr((char *)listValue.mv_data, listValue.mv_size);
-    Json::Value list;
-    if(!m_jsonReader.parse(listStr, list)) {
-        LOG_error("database JSON parse key %s value %s failed", m_listKey.c_str(), listStr);
-        return "";
-    }
-    for(int i = 0; i < list.size(); i++) {
-        if(val["port"].asInt() ==  list[i]["port"].asInt()) {
-            return "duplicated port " + val["port"].asString();
-        }
-    }
-
     std::string key = archer::common::randomString();
-    val["id"] = key;
-    list.append(val);
-    std::string jsonVal = m_jsonWriter.write(list);
+    std::string result;
+    int rc = update([&](MDB_txn *txn) -> int {
+        // only the proxies on this port can conflict, whatever their address
+        std::vector<std::string> ids;
+        int rc = findIds(txn, m_portDbi, portPrefix(val["port"].asInt()), ids, true);
+        if(rc) {
+            return rc;
+        }
+        for(size_t i = 0; i < ids.size(); i++) {
+            Json::Value other;
+            if((rc = readProxy(txn, ids[i], other))) {
+                return rc;
+            }
+            // proxies on one address:port share the listener and are told apart by server_names
+            // a tcp mode proxy has no Host header to share the port by
+            if(val["address"].asString() != other["address"].asString() || 
+               (val["server_names"].size() == 0 && other["server_names"].size() == 0) ||
+               val.get("mode", "http").asString() == "tcp" || other.get("mode", "http").asString() == "tcp") {
+                result = "duplicated port " + val["port"].asString();
+                return MDB_KEYEXIST;
+            }
+            std::string name = conflictServerName(val["server_names"], other["server_names"]);
+            if(!name.empty()) {
+                result = "duplicated server name " + name;
+                return MDB_KEYEXIST;
+            }
+        }
 
-    LOG_trace("Begin to save proxy write transaction, Key = %s", key.c_str());
+        Json::Value taken;
+        while((rc = readProxy(txn, key, taken)) == 0) {
+            key = archer::common::randomString();
+        }
+        if(rc != MDB_NOTFOUND) {
+            return rc;
+        }
 
-    MDB_val dbValue;
-    dbValue.mv_size = jsonVal.length();
-    dbValue.mv_data = (void *)jsonVal.c_str();
+        LOG_trace("Begin to save proxy write transaction, Key = %s", key.c_str());
 
-    if((rc = mdb_put(txn, m_dbi, &m_key, &dbValue, 0))) {
-        LOG_error("database Writting data failed, due to %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return "";
-    }
-    if((rc = mdb_txn_commit(txn))) {
-        LOG_error("database Commit transaction failed, due to %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return "";
+        val["id"] = key;
+        return putProxy(txn, val);
+    });
+    if(rc == MDB_KEYEXIST) {
+        return result;
     }
-    return key;
+    return rc ? "" : key;
 }
+
 /**
  * {
  *   "id": "",
@@ -245,55 +540,21 @@ std::string DataBase::addProxy(Json::Value &val) {
  * 
 */
 bool DataBase::delProxy(Json::Value &val) {
-    int rc = 0;
-    MDB_txn *txn;
-    
-    LOG_info("Delete a proxy");
+    std::lock_guard<std::mutex> lock(m_mutex);
 
-    if((rc = mdb_txn_begin(m_env, NULL, 0, &txn))) {
-        LOG_error("database Begin write transaction failed, due to %s", mdb_strerror(rc));
-        return false;
-    }
+    LOG_info("Delete a proxy");
 
-    MDB_val listValue;
-    if((rc = mdb_get(txn, m_dbi, &m_key, &listValue))) {
-        LOG_error("database Readding key %s failed, due to %s", m_listKey.c_str(), mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return false;
-    }
-    std::string listStr((char *)listValue.mv_data, listValue.mv_size);
-    Json::Value list;
-    if(!m_jsonReader.parse(listStr, list)) {
-        LOG_error("database JSON parse key %s value %s failed", m_listKey.c_str(), listStr);
-        return false;
-    }
-    int idx = 0;
-    for(; idx < list.size(); idx++) {
-        if(val["id"].asString() ==  list[idx]["id"].asString()) {
-            break ;
+    int rc = update([&](MDB_txn *txn) -> int {
+        Json::Value old;
+        int rc = readProxy(txn, val["id"].asString(), old);
+        if(rc) {
+            return rc;
         }
-    }
-    if(idx < list.size()) {
-        list.removeIndex(idx, NULL);
-    }
-    
-    LOG_trace("Begin to save deleted proxy write transaction, Key = %s", val["id"].asString().c_str());
 
-    std::string jsonVal = m_jsonWriter.write(list);
-    MDB_val dbValue;
-    dbValue.mv_size = jsonVal.length();
-    dbValue.mv_data = (void *)jsonVal.c_str();
+        LOG_trace("Begin to save deleted proxy write transaction, Key = %s", val["id"].asString().c_str());
 
-    if((rc = mdb_put(txn, m_dbi, &m_key, &dbValue, 0))) {
-        LOG_error("database Writting data failed, due to %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return false;
-    }
-    if((rc = mdb_txn_commit(txn))) {
-        LOG_error("database Commit transaction failed, due to %s", mdb_strerror(rc));
-        mdb_txn_abort(txn);
-        return false;
-    }
-    return true;
+        return removeProxy(txn, old);
+    });
+    return rc == 0 || rc == MDB_NOTFOUND;
 }
 
@@ -8,11 +8,23 @@
 #include <mutex>
 #include <array>
 #include <vector>
+#include <algorithm>
+#include <functional>
 
 namespace archer 
 {
 namespace database 
 {
+
+/**
+ * Proxy configurations in LMDB, one JSON record per proxy keyed by its id.
+ *
+ * Secondary dup sorted databases map "<port>/<address>", location src and
+ * backend "host:port" to the ids of the proxies using them, so an admin change
+ * reads and writes one proxy and its index entries instead of every proxy.
+ * The map grows on demand, a write that fills it is retried on a map twice the
+ * size. The single list record of earlier versions is migrated on first start.
+*/
 class DataBase 
 {
 
@@ -34,9 +46,20 @@ public:
 
     void init(std::string const& dbPath, unsigned int readerNum, size_t maxMemorySize);
 
+    // every proxy as a JSON array, empty on a database error
     std::string listAllProxy();
-    
-    bool saveAllProxy(Json::Value &val);
+
+    // the proxies with a backend at host:port, as listAllProxy
+    std::string listProxiesByBackend(std::string const& host, int port);
+
+    // the proxies with a location at src, as listAllProxy
+    std::string listProxiesByLocation(std::string const& src);
+
+    // false when there is no proxy with that id
+    bool getProxy(std::string const& id, Json::Value &val);
+
+    // writes one proxy back and refreshes its index entries
+    bool saveProxy(Json::Value &val);
 
     std::string addProxy(Json::Value &val);
 
@@ -62,15 +85,40 @@ private:
     
     void openDataBase(std::string const& dbPath, unsigned int readerNum, size_t maxMemorySize);
     
+    // moves the proxies of the old single list record to their own records
     void initData();
 
+    // runs body in a write transaction and commits it, the map is grown and body run again when it is full
+    int update(std::function<int(MDB_txn *)> const& body);
+
+    // MDB_NOTFOUND when there is no such proxy
+    int readProxy(MDB_txn *txn, std::string const& id, Json::Value &val);
+
+    // the record and its index entries, the old entries of the same id are expected gone
+    int putProxy(MDB_txn *txn, Json::Value const& val);
+
+    int removeProxy(MDB_txn *txn, Json::Value const& val);
+
+    // the ids stored under key in a dup sorted index, or under every key starting with it
+    int findIds(MDB_txn *txn, MDB_dbi index, std::string const& key, std::vector<std::string> &ids, bool prefix = false);
+
+    // the proxies indexed under value whose record matches it, long values of older databases share their keys
+    std::string listProxies(MDB_dbi index, std::string const& value, std::function<bool(Json::Value const&)> const& matches);
+
     Json::Reader     m_jsonReader;
     Json::FastWriter m_jsonWriter;
     std::string      m_listKey;
     
     MDB_val          m_key;
     MDB_env         *m_env;
+    // held around every transaction, the map is only resized with none open
+    std::mutex       m_mutex;
+    // the old list record, only read to migrate it
     MDB_dbi          m_dbi;
+    MDB_dbi          m_proxyDbi;
+    MDB_dbi          m_portDbi;
+    MDB_dbi          m_locationDbi;
+    MDB_dbi          m_backendDbi;
 };
 }
 }
@@ -0,0 +1,300 @@
+#include "Balancer.h"
+
+#include <algorithm>
+
+using namespace archer::server;
+
+static const uint32_t WEIGHTED_MAX_SCHEDULE = 4096;
+static const uint32_t MAGLEV_TABLE_SIZE = 65537;
+
+inline static uint64_t hashBytes(const char *data, size_t len, uint64_t seed) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+    for(size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+inline static uint64_t mixTick(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+bool archer::server::parseBalancerType(std::string const& name, BalancerType& type) {
+    if(name == "round_robin") {
+        type = BALANCER_ROUND_ROBIN;
+    } else if(name == "weighted") {
+        type = BALANCER_WEIGHTED;
+    } else if(name == "least_request") {
+        type = BALANCER_LEAST_REQUEST;
+    } else if(name == "peak_ewma") {
+        type = BALANCER_PEAK_EWMA;
+    } else if(name == "maglev") {
+        type = BALANCER_MAGLEV;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* archer::server::balancerTypeName(BalancerType type) {
+    switch(type) {
+    case BALANCER_WEIGHTED:      return "weighted";
+    case BALANCER_LEAST_REQUEST: return "least_request";
+    case BALANCER_PEAK_EWMA:     return "peak_ewma";
+    case BALANCER_MAGLEV:        return "maglev";
+    default:                     return "round_robin";
+    }
+}
+
+bool archer::server::parseHashKey(std::string const& spec, HashKey& key) {
+    key.name.clear();
+    if(spec == "path") {
+        key.type = HASH_KEY_PATH;
+    } else if(spec == "ip") {
+        key.type = HASH_KEY_IP;
+    } else if(spec.compare(0, 7, "header:") == 0 && spec.length() > 7) {
+        key.type = HASH_KEY_HEADER;
+        key.name = spec.substr(7);
+    } else if(spec.compare(0, 6, "query:") == 0 && spec.length() > 6) {
+        key.type = HASH_KEY_QUERY;
+        key.name = spec.substr(6);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool archer::server::requestKey(HttpRequest *req, HashKey const& key, const char *&data, size_t& len) {
+    data = NULL;
+    len = 0;
+    // tcp mode has no request to hash
+    if(req == NULL) {
+        return false;
+    }
+    switch(key.type) {
+    case HASH_KEY_PATH:
+        data = http_request_get_uri(req);
+        len = data ? strcspn(data, "?") : 0;
+        break;
+    case HASH_KEY_HEADER:
+        data = http_request_get_header(req, key.name.c_str());
+        len = data ? strlen(data) : 0;
+        break;
+    case HASH_KEY_QUERY:
+        data = http_request_get_query_param(req, key.name.c_str());
+        len = data ? strlen(data) : 0;
+        break;
+    case HASH_KEY_IP:
+        // the manager does not expose the peer address. The rightmost X-Forwarded-For entry is
+        // the one the hop in front of us appended, the ones before it are whatever the client sent
+        data = http_request_get_header(req, "X-Forwarded-For");
+        if(data == NULL) {
+            data = http_request_get_header(req, "X-Real-IP");
+        }
+        if(data != NULL) {
+            const char *comma = strrchr(data, ',');
+            if(comma != NULL) {
+                data = comma + 1;
+            }
+            data += strspn(data, " \t");
+            len = strcspn(data, " \t");
+        }
+        break;
+    }
+    return data != NULL && len > 0;
+}
+
+namespace
+{
+class RoundRobinBalancer : public Balancer
+{
+public:
+    RoundRobinBalancer(PeerList const& peers) : Balancer(peers) {}
+
+    DstPeer* pick(HttpRequest *, uint32_t& tick) const override {
+        return m_peers[tick++ % m_peers.size()].get();
+    }
+};
+
+/**
+ * Smooth weighted round robin (the nginx algorithm) expanded once into a schedule,
+ * the request path only walks the schedule with the thread tick.
+*/
+class WeightedBalancer : public Balancer
+{
+public:
+    WeightedBalancer(PeerList const& peers) : Balancer(peers) {
+        std::vector<int64_t> weights(m_peers.size());
+        int64_t total = 0, divisor = 0;
+        for(size_t i = 0; i < m_peers.size(); i++) {
+            weights[i] = m_peers[i]->weight();
+            total += weights[i];
+            divisor = gcd(divisor, weights[i]);
+        }
+        for(size_t i = 0; i < weights.size(); i++) {
+            weights[i] /= divisor;
+        }
+        total /= divisor;
+        if(total > WEIGHTED_MAX_SCHEDULE) {
+            int64_t scaled = 0;
+            for(size_t i = 0; i < weights.size(); i++) {
+                weights[i] = std::max<int64_t>(1, weights[i] * WEIGHTED_MAX_SCHEDULE / total);
+                scaled += weights[i];
+            }
+            total = scaled;
+        }
+
+        std::vector<int64_t> current(weights.size(), 0);
+        m_schedule.reserve(total);
+        for(int64_t n = 0; n < total; n++) {
+            size_t best = 0;
+            for(size_t i = 0; i < weights.size(); i++) {
+                current[i] += weights[i];
+                if(current[i] > current[best]) {
+                    best = i;
+                }
+            }
+            current[best] -= total;
+            m_schedule.push_back((uint32_t) best);
+        }
+    }
+
+    DstPeer* pick(HttpRequest *, uint32_t& tick) const override {
+        return m_peers[m_schedule[tick++ % m_schedule.size()]].get();
+    }
+
+private:
+    static int64_t gcd(int64_t a, int64_t b) {
+        while(b) {
+            int64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        return a;
+    }
+
+    std::vector<uint32_t> m_schedule;
+};
+
+/**
+ * Fewest outstanding requests relative to the peer weight, the scan starts at
+ * a rotating offset so that ties do not all land on the first peer.
+*/
+class LeastRequestBalancer : public Balancer
+{
+public:
+    LeastRequestBalancer(PeerList const& peers) : Balancer(peers) {}
+
+    DstPeer* pick(HttpRequest *, uint32_t& tick) const override {
+        size_t n = m_peers.size();
+        size_t start = tick++ % n;
+        DstPeer *best = m_peers[start].get();
+        for(size_t i = 1; i < n; i++) {
+            DstPeer *peer = m_peers[(start + i) % n].get();
+            if((int64_t) (peer->outstanding() + 1) * best->weight() < (int64_t) (best->outstanding() + 1) * peer->weight()) {
+                best = peer;
+            }
+        }
+        return best;
+    }
+};
+
+/**
+ * Power of two choices on peak EWMA latency times outstanding requests.
+*/
+class PeakEwmaBalancer : public Balancer
+{
+public:
+    PeakEwmaBalancer(PeerList const& peers) : Balancer(peers) {}
+
+    DstPeer* pick(HttpRequest *, uint32_t& tick) const override {
+        size_t n = m_peers.size();
+        if(n == 1) {
+            return m_peers[0].get();
+        }
+        uint64_t r = mixTick(((uint64_t) (uintptr_t) &tick << 32) ^ tick++);
+        size_t a = r % n;
+        size_t b = (a + 1 + (r >> 32) % (n - 1)) % n;
+        int64_t now = archer::common::steadyNanos();
+        return cost(m_peers[a].get(), now) <= cost(m_peers[b].get(), now) ? m_peers[a].get() : m_peers[b].get();
+    }
+
+private:
+    static double cost(DstPeer *peer, int64_t now) {
+        return (double) (peer->latencyEwma(now) + 1) * (peer->outstanding() + 1) / peer->weight();
+    }
+};
+
+/**
+ * Maglev consistent hashing. Every peer walks its own permutation of the lookup
+ * table and claims free slots in turn, a peer gets a turn as often as its weight
+ * is to the largest one, so it ends up with its weighted share of the slots.
+ * Adding or removing one of N equally weighted peers moves about 1/N of the keys. The table is filled when the peer set is published,
+ * the request path hashes the key and reads one slot.
+ * Requests without the key are spread round robin.
+*/
+class MaglevBalancer : public Balancer
+{
+public:
+    MaglevBalancer(PeerList const& peers, HashKey const& key) : Balancer(peers), m_key(key), m_table(MAGLEV_TABLE_SIZE, -1) {
+        size_t n = m_peers.size();
+        std::vector<uint64_t> offsets(n), skips(n), next(n, 0);
+        std::vector<int64_t> credits(n, 0);
+        int64_t maxWeight = 1;
+        for(size_t i = 0; i < n; i++) {
+            maxWeight = std::max<int64_t>(maxWeight, m_peers[i]->weight());
+            std::string name = m_peers[i]->host() + ':' + std::to_string(m_peers[i]->port());
+            offsets[i] = hashBytes(name.data(), name.length(), 0) % MAGLEV_TABLE_SIZE;
+            skips[i] = hashBytes(name.data(), name.length(), 0x5bd1e995) % (MAGLEV_TABLE_SIZE - 1) + 1;
+        }
+        uint32_t filled = 0;
+        while(true) {
+            for(size_t i = 0; i < n; i++) {
+                // the heaviest peers take a slot every round, the others once their credit adds up to a turn
+                for(credits[i] += m_peers[i]->weight(); credits[i] >= maxWeight; credits[i] -= maxWeight) {
+                    uint64_t slot = (offsets[i] + next[i] * skips[i]) % MAGLEV_TABLE_SIZE;
+                    while(m_table[slot] >= 0) {
+                        next[i]++;
+                        slot = (offsets[i] + next[i] * skips[i]) % MAGLEV_TABLE_SIZE;
+                    }
+                    m_table[slot] = (int32_t) i;
+                    next[i]++;
+                    if(++filled == MAGLEV_TABLE_SIZE) {
+                        return ;
+                    }
+                }
+            }
+        }
+    }
+
+    DstPeer* pick(HttpRequest *req, uint32_t& tick) const override {
+        const char *data = NULL;
+        size_t len = 0;
+        if(!requestKey(req, m_key, data, len)) {
+            return m_peers[tick++ % m_peers.size()].get();
+        }
+        return m_peers[m_table[hashBytes(data, len, 0) % MAGLEV_TABLE_SIZE]].get();
+    }
+
+private:
+    HashKey                 m_key;
+    std::vector<int32_t>    m_table;
+};
+}
+
+Balancer* Balancer::create(BalancerType type, PeerList const& peers, HashKey const& key) {
+    switch(type) {
+    case BALANCER_MAGLEV:        return new MaglevBalancer(peers, key);
+    case BALANCER_WEIGHTED:      return new WeightedBalancer(peers);
+    case BALANCER_LEAST_REQUEST: return new LeastRequestBalancer(peers);
+    case BALANCER_PEAK_EWMA:     return new PeakEwmaBalancer(peers);
+    default:                     return new RoundRobinBalancer(peers);
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "DstPeer.h"
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+
+enum BalancerType { BALANCER_ROUND_ROBIN, BALANCER_WEIGHTED, BALANCER_LEAST_REQUEST, BALANCER_PEAK_EWMA, BALANCER_MAGLEV };
+
+enum HashKeyType { HASH_KEY_PATH, HASH_KEY_HEADER, HASH_KEY_QUERY, HASH_KEY_IP };
+
+/**
+ * Request attribute a hashing balancer selects by, parsed from the proxy "hash_key"
+ * setting: "path", "ip", "header:<name>" or "query:<name>".
+ *
+ * "ip" is the rightmost X-Forwarded-For entry, else X-Real-IP. TLS listeners set
+ * X-Forwarded-For to the client address themselves, a plaintext listener needs an
+ * edge in front of it that appends the client address, or overwrites the header,
+ * otherwise a client picks its own key by sending one.
+*/
+typedef struct {
+    HashKeyType type;
+    std::string name;
+} HashKey;
+
+bool parseBalancerType(std::string const& name, BalancerType& type);
+
+const char* balancerTypeName(BalancerType type);
+
+bool parseHashKey(std::string const& spec, HashKey& key);
+
+// bytes of the request attribute key names, false when the request has none
+bool requestKey(HttpRequest *req, HashKey const& key, const char *&data, size_t& len);
+
+/**
+ * Selection policy compiled from one peer list, immutable after construction
+ * so the request path can share it between event loop threads.
+ * tick is the per thread counter of the calling thread.
+*/
+class Balancer
+{
+public:
+    Balancer(PeerList const& peers) : m_peers(peers) {}
+    virtual ~Balancer() {}
+
+    Balancer(const Balancer&) = delete;
+    Balancer& operator=(const Balancer&) = delete;
+
+    virtual DstPeer* pick(HttpRequest *req, uint32_t& tick) const = 0;
+
+    static Balancer* create(BalancerType type, PeerList const& peers, HashKey const& key);
+
+protected:
+    PeerList    m_peers;
+};
+}
+}
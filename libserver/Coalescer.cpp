@@ -0,0 +1,139 @@
+#include "Coalescer.h"
+#include "Exchange.h"
+
+#include <algorithm>
+
+using namespace archer::server;
+
+bool Flight::join(HttpResponse *res) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!m_open) {
+        return false;
+    }
+    m_waiters.push_back(res);
+    if(m_headed) {
+        sendHead(res);
+        if(!m_replay.empty()) {
+            http_response_send_some(res, m_replay.data(), m_replay.length());
+        }
+    }
+    return true;
+}
+
+bool Flight::relay(HttpResponse *res, const char *chunk, size_t chunkLen, bool last) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!m_headed) {
+        m_headed = true;
+        m_status = http_response_get_status(res);
+        collectHeaders(res, m_headers);
+        for(size_t i = 0; i < m_waiters.size(); i++) {
+            sendHead(m_waiters[i]);
+        }
+    }
+    for(size_t i = 0; i < m_waiters.size(); i++) {
+        http_response_send_some(m_waiters[i], chunk, chunkLen);
+    }
+    if(m_open) {
+        m_replay.append(chunk, chunkLen);
+        if(last || m_replay.length() > MAX_REPLAY_BYTES) {
+            m_open = false;
+            m_replay.clear();
+        }
+    }
+    if(last) {
+        dropWaiters();
+    }
+    return m_open;
+}
+
+void Flight::fail() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_open = false;
+    if(!m_headed) {
+        const char *body = "<!DOCTYPE html><html><head><title>APROXY SERVER</title></head><body><h3>APROXY SERVER 502 Bad Gateway</h3></body></html>";
+        for(size_t i = 0; i < m_waiters.size(); i++) {
+            http_response_set_status(m_waiters[i], 502);
+            http_response_set_content_type(m_waiters[i], "text/html");
+            http_response_send_all(m_waiters[i], body, strlen(body));
+        }
+    }
+    dropWaiters();
+    m_replay.clear();
+}
+
+void Flight::leave(HttpResponse *res) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::find(m_waiters.begin(), m_waiters.end(), res);
+    if(it != m_waiters.end()) {
+        m_waiters.erase(it);
+    }
+}
+
+void Flight::dropWaiters() {
+    for(size_t i = 0; i < m_waiters.size(); i++) {
+        FlightTable::instance().forget(m_waiters[i], this);
+    }
+    m_waiters.clear();
+}
+
+void Flight::sendHead(HttpResponse *waiter) {
+    http_response_set_status(waiter, m_status);
+    for(size_t i = 0; i < m_headers.size(); i++) {
+        http_response_set_header(waiter, m_headers[i].first.c_str(), m_headers[i].second.c_str());
+    }
+}
+
+FlightPtr FlightTable::join(std::string const& key, HttpResponse *res, bool& leader) {
+    Shard& shard = shardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    FlightPtr& flight = shard.flights[key];
+    if(flight) {
+        // known before the flight can relay its last chunk and forget the waiter
+        {
+            WaiterShard& waiters = waiterShardOf(res);
+            std::lock_guard<std::mutex> waitersLock(waiters.mutex);
+            waiters.flights[res] = flight;
+        }
+        if(flight->join(res)) {
+            leader = false;
+            return flight;
+        }
+        forget(res, flight.get());
+    }
+    flight = std::make_shared<Flight>();
+    leader = true;
+    return flight;
+}
+
+void FlightTable::close(std::string const& key, FlightPtr const& flight) {
+    Shard& shard = shardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.flights.find(key);
+    if(it != shard.flights.end() && it->second == flight) {
+        shard.flights.erase(it);
+    }
+}
+
+void FlightTable::leave(HttpResponse *res) {
+    FlightPtr flight;
+    {
+        WaiterShard& shard = waiterShardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.flights.find(res);
+        if(it == shard.flights.end()) {
+            return ;
+        }
+        flight.swap(it->second);
+        shard.flights.erase(it);
+    }
+    flight->leave(res);
+}
+
+void FlightTable::forget(HttpResponse *res, Flight *flight) {
+    WaiterShard& shard = waiterShardOf(res);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.flights.find(res);
+    if(it != shard.flights.end() && it->second.get() == flight) {
+        shard.flights.erase(it);
+    }
+}
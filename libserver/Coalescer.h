@@ -0,0 +1,124 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "ResponseCache.h"
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+
+/**
+ * One upstream request shared by identical concurrent GETs. The leader's
+ * response chunks are relayed to every waiter as they arrive, waiters joining
+ * late first get the head and the body so far. Once the replay buffer would
+ * exceed MAX_REPLAY_BYTES the flight stops taking waiters.
+*/
+class Flight
+{
+public:
+
+    static const size_t MAX_REPLAY_BYTES = 1024 * 1024;
+
+    Flight() {}
+    ~Flight() {}
+
+    Flight(const Flight&) = delete;
+    Flight& operator=(const Flight&) = delete;
+
+    // false once the flight is closed to new waiters
+    bool join(HttpResponse *res);
+
+    // forwards one leader chunk, false once the flight is closed to new waiters
+    bool relay(HttpResponse *res, const char *chunk, size_t chunkLen, bool last);
+
+    // the leader failed, waiters still without a head get a 502
+    void fail();
+
+    // the client of res went away, it gets nothing more from the flight
+    void leave(HttpResponse *res);
+
+private:
+
+    void sendHead(HttpResponse *waiter);
+
+    // with m_mutex held, the flight is done with every waiter
+    void dropWaiters();
+
+    std::mutex                   m_mutex;
+    std::vector<HttpResponse *>  m_waiters;
+    bool                         m_open = true;
+    bool                         m_headed = false;
+    int                          m_status = 0;
+    HeaderList                   m_headers;
+    std::string                  m_replay;
+};
+
+typedef std::shared_ptr<Flight> FlightPtr;
+
+/**
+ * Process wide table of open flights keyed by virtual host, method, Host,
+ * rewritten uri and Accept-Encoding, and of the flight every waiting client
+ * response is on.
+*/
+class FlightTable
+{
+static const size_t SHARDS = 64;
+
+typedef struct {
+    std::mutex                                  mutex;
+    std::unordered_map<std::string, FlightPtr>  flights;
+} Shard;
+
+typedef struct {
+    std::mutex                                      mutex;
+    std::unordered_map<HttpResponse *, FlightPtr>   flights;
+} WaiterShard;
+
+public:
+
+    static FlightTable& instance() {
+        static FlightTable instance;
+        return instance;
+    }
+
+    FlightTable(const FlightTable&) = delete;
+    FlightTable& operator=(const FlightTable&) = delete;
+
+    // joins the open flight of key, or opens a new one with the caller as leader
+    FlightPtr join(std::string const& key, HttpResponse *res, bool& leader);
+
+    // removes the flight unless key already belongs to a newer one
+    void close(std::string const& key, FlightPtr const& flight);
+
+    // takes res off the flight it waits on, from the http error callback
+    void leave(HttpResponse *res);
+
+    // res no longer waits on flight
+    void forget(HttpResponse *res, Flight *flight);
+
+private:
+
+    FlightTable() {}
+
+    Shard& shardOf(std::string const& key) {
+        return m_shards[std::hash<std::string>()(key) % SHARDS];
+    }
+
+    WaiterShard& waiterShardOf(HttpResponse *res) {
+        return m_waiters[(((uintptr_t) res) >> 4) % SHARDS];
+    }
+
+    Shard m_shards[SHARDS];
+    WaiterShard m_waiters[SHARDS];
+};
+}
+}
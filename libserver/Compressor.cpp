@@ -0,0 +1,206 @@
+#include "Compressor.h"
+
+#include <algorithm>
+
+using namespace archer::server;
+
+namespace
+{
+typedef struct {
+    int       windowBits;
+    int       memLevel;
+    int       level;
+    z_stream *stream;
+} PooledStream;
+
+/**
+ * Idle deflate contexts of one thread, keyed by window and memory level so a
+ * reused context never needs to reallocate its window.
+*/
+struct StreamPool {
+    static const size_t MAX_IDLE = 32;
+
+    std::vector<PooledStream> idle;
+
+    ~StreamPool() {
+        for(size_t i = 0; i < idle.size(); i++) {
+            deflateEnd(idle[i].stream);
+            delete idle[i].stream;
+        }
+    }
+
+    z_stream* acquire(int windowBits, int memLevel, int level) {
+        for(size_t i = idle.size(); i > 0; i--) {
+            PooledStream& pooled = idle[i - 1];
+            if(pooled.windowBits != windowBits || pooled.memLevel != memLevel) {
+                continue;
+            }
+            z_stream *stream = pooled.stream;
+            if(pooled.level != level) {
+                deflateParams(stream, level, Z_DEFAULT_STRATEGY);
+            }
+            idle.erase(idle.begin() + (i - 1));
+            return stream;
+        }
+        z_stream *stream = new z_stream();
+        if(deflateInit2(stream, level, Z_DEFLATED, windowBits, memLevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+            delete stream;
+            return NULL;
+        }
+        return stream;
+    }
+
+    void release(z_stream *stream, int windowBits, int memLevel, int level) {
+        if(idle.size() >= MAX_IDLE || deflateReset(stream) != Z_OK) {
+            deflateEnd(stream);
+            delete stream;
+            return ;
+        }
+        idle.push_back(PooledStream{windowBits, memLevel, level, stream});
+    }
+};
+
+thread_local StreamPool streamPool;
+}
+
+inline static bool startsWithNoCase(const char *value, std::string const& prefix) {
+    return strncasecmp(value, prefix.c_str(), prefix.length()) == 0;
+}
+
+ContentEncoding Compressor::negotiate(HttpRequest *req) {
+    const char *method = http_request_get_method(req);
+    const char *accept = http_request_get_header(req, "Accept-Encoding");
+    if(accept == NULL || method == NULL || strcmp(method, "HEAD") == 0) {
+        return ENCODING_IDENTITY;
+    }
+    bool gzip = false, deflate = false;
+    const char *p = accept;
+    while(*p != '\0') {
+        while(*p == ' ' || *p == ',') {
+            p++;
+        }
+        const char *token = p;
+        while(*p != '\0' && *p != ',' && *p != ';' && *p != ' ') {
+            p++;
+        }
+        size_t tokenLen = p - token;
+        double q = 1.0;
+        while(*p == ' ') {
+            p++;
+        }
+        if(*p == ';') {
+            const char *qv = strstr(p, "q=");
+            const char *next = strchr(p, ',');
+            if(qv != NULL && (next == NULL || qv < next)) {
+                q = strtod(qv + 2, NULL);
+            }
+        }
+        while(*p != '\0' && *p != ',') {
+            p++;
+        }
+        if(q <= 0) {
+            continue;
+        }
+        if((tokenLen == 4 && strncasecmp(token, "gzip", 4) == 0) || (tokenLen == 1 && *token == '*')) {
+            gzip = true;
+        } else if(tokenLen == 7 && strncasecmp(token, "deflate", 7) == 0) {
+            deflate = true;
+        }
+    }
+    return gzip ? ENCODING_GZIP : (deflate ? ENCODING_DEFLATE : ENCODING_IDENTITY);
+}
+
+const char* Compressor::encodingName(ContentEncoding encoding) {
+    switch(encoding) {
+        case ENCODING_GZIP: return "gzip";
+        case ENCODING_DEFLATE: return "deflate";
+        default: return "identity";
+    }
+}
+
+bool Compressor::eligible(HttpResponse *res) const {
+    int status = http_response_get_status(res);
+    if(status < 200 || status == 204 || status == 206 || status == 304) {
+        return false;
+    }
+    const char *encoding = http_response_get_header(res, "Content-Encoding");
+    if(encoding != NULL && strcasecmp(encoding, "identity") != 0) {
+        return false;
+    }
+    const char *cacheControl = http_response_get_header(res, "Cache-Control");
+    if(cacheControl != NULL && strstr(cacheControl, "no-transform") != NULL) {
+        return false;
+    }
+    const char *length = http_response_get_header(res, "Content-Length");
+    if(length != NULL) {
+        unsigned long long bytes = strtoull(length, NULL, 10);
+        if(bytes < m_config.minLength || bytes > m_config.maxLength) {
+            return false;
+        }
+    }
+    const char *type = http_response_get_header(res, "Content-Type");
+    if(type == NULL) {
+        return false;
+    }
+    for(size_t i = 0; i < m_config.types.size(); i++) {
+        if(startsWithNoCase(type, m_config.types[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Compressor::account(uint64_t bytesIn, uint64_t bytesOut, uint64_t cpuNanos) {
+    m_responses.fetch_add(1, std::memory_order_relaxed);
+    m_bytesIn.fetch_add(bytesIn, std::memory_order_relaxed);
+    m_bytesOut.fetch_add(bytesOut, std::memory_order_relaxed);
+    m_cpuNanos.fetch_add(cpuNanos, std::memory_order_relaxed);
+}
+
+CompressStats Compressor::stats() {
+    return CompressStats{m_responses.load(), m_bytesIn.load(), m_bytesOut.load(), m_cpuNanos.load()};
+}
+
+CompressStream::CompressStream(CompressorPtr const& compressor, ContentEncoding encoding, bool streaming) : m_compressor(compressor), m_streaming(streaming) {
+    CompressConfig const& config = compressor->config();
+    // zlib wraps gzip when 16 is added to the window bits
+    m_windowBits = encoding == ENCODING_GZIP ? config.windowBits + 16 : config.windowBits;
+    m_stream = streamPool.acquire(m_windowBits, config.memLevel, config.level);
+}
+
+CompressStream::~CompressStream() {
+    if(m_stream != NULL) {
+        streamPool.release(m_stream, m_windowBits, m_compressor->config().memLevel, m_compressor->config().level);
+    }
+}
+
+bool CompressStream::write(const char *data, size_t len, bool finish, std::string& out) {
+    if(m_stream == NULL) {
+        return false;
+    }
+    int64_t start = archer::common::steadyNanos();
+    int flush = finish ? Z_FINISH : (m_streaming ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+    size_t before = out.length();
+    char buf[16384];
+    m_stream->next_in = (Bytef *) data;
+    m_stream->avail_in = (uInt) len;
+    while(true) {
+        m_stream->next_out = (Bytef *) buf;
+        m_stream->avail_out = sizeof(buf);
+        int rc = deflate(m_stream, flush);
+        if(rc == Z_STREAM_ERROR) {
+            return false;
+        }
+        out.append(buf, sizeof(buf) - m_stream->avail_out);
+        if(m_stream->avail_out != 0 && (flush != Z_FINISH || rc == Z_STREAM_END)) {
+            break;
+        }
+    }
+    m_bytesIn += len;
+    m_bytesOut += out.length() - before;
+    m_cpuNanos += archer::common::steadyNanos() - start;
+    if(finish) {
+        m_compressor->account(m_bytesIn, m_bytesOut, m_cpuNanos);
+    }
+    return true;
+}
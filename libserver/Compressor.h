@@ -0,0 +1,115 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+
+enum ContentEncoding {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE
+};
+
+typedef struct {
+    int                      level;
+    // 9..15, bounds the deflate history window per response
+    int                      windowBits;
+    int                      memLevel;
+    size_t                   minLength;
+    // a response with a known length is compressed whole before it goes out, larger ones go out as they are
+    size_t                   maxLength;
+    // Content-Type prefixes worth compressing
+    std::vector<std::string> types;
+} CompressConfig;
+
+typedef struct {
+    uint64_t responses;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t cpuNanos;
+} CompressStats;
+
+/**
+ * Response compression policy and counters of one location.
+*/
+class Compressor
+{
+public:
+
+    explicit Compressor(CompressConfig const& config) : m_config(config) {}
+    ~Compressor() {}
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    CompressConfig const& config() const {return m_config;}
+
+    // best encoding the client accepts, gzip before deflate
+    static ContentEncoding negotiate(HttpRequest *req);
+
+    static const char* encodingName(ContentEncoding encoding);
+
+    // false for encoded, tiny, too large to hold, partial or non text upstream responses
+    bool eligible(HttpResponse *res) const;
+
+    void account(uint64_t bytesIn, uint64_t bytesOut, uint64_t cpuNanos);
+
+    CompressStats stats();
+
+private:
+
+    CompressConfig               m_config;
+    std::atomic<uint64_t>        m_responses{0};
+    std::atomic<uint64_t>        m_bytesIn{0};
+    std::atomic<uint64_t>        m_bytesOut{0};
+    std::atomic<uint64_t>        m_cpuNanos{0};
+};
+
+typedef std::shared_ptr<Compressor> CompressorPtr;
+
+/**
+ * Deflate state of one response. The z_stream comes from a pool owned by the
+ * calling event loop thread and goes back there, reset, when the stream ends,
+ * so steady traffic allocates no compressor memory.
+*/
+class CompressStream
+{
+public:
+
+    // a streaming response is sync flushed on every chunk, otherwise deflate decides when to emit
+    CompressStream(CompressorPtr const& compressor, ContentEncoding encoding, bool streaming);
+    ~CompressStream();
+
+    CompressStream(const CompressStream&) = delete;
+    CompressStream& operator=(const CompressStream&) = delete;
+
+    // false when no deflate context could be set up, the response then goes out as is
+    bool ok() const {return m_stream != NULL;}
+
+    // appends the compressed form of data to out, flushing everything on finish
+    bool write(const char *data, size_t len, bool finish, std::string& out);
+
+private:
+
+    CompressorPtr    m_compressor;
+    int              m_windowBits;
+    bool             m_streaming;
+    z_stream        *m_stream;
+    uint64_t         m_bytesIn = 0;
+    uint64_t         m_bytesOut = 0;
+    uint64_t         m_cpuNanos = 0;
+};
+}
+}
@@ -0,0 +1,182 @@
+#include "ConcurrencyLimiter.h"
+#include "DeadlineTimer.h"
+
+#include <cmath>
+#include <algorithm>
+
+using namespace archer::server;
+
+// weights of one sample in the recent and the long term latency averages
+static const double SHORT_WEIGHT = 0.1;
+static const double LONG_WEIGHT = 1.0 / 600;
+// recent latency may exceed the long term one by this much before the limit shrinks
+static const double TOLERANCE = 1.5;
+// share of the gradient estimate taken per sample
+static const double SMOOTHING = 0.2;
+
+ConcurrencyLimiter::ConcurrencyLimiter(ConcurrencyConfig const& config) : m_config(config) {
+    m_config.minLimit = std::max(1, m_config.minLimit);
+    m_config.maxLimit = std::max(m_config.minLimit, m_config.maxLimit);
+    m_config.initialLimit = std::min(m_config.maxLimit, std::max(m_config.minLimit, m_config.initialLimit));
+    m_estimate = m_config.initialLimit;
+    m_limit.store(m_config.initialLimit);
+}
+
+bool ConcurrencyLimiter::tryAcquire() {
+    int inflight = m_inflight.load();
+    while(inflight < m_limit.load(std::memory_order_relaxed)) {
+        if(m_inflight.compare_exchange_weak(inflight, inflight + 1)) {
+            m_admitted.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+AdmitResult ConcurrencyLimiter::enqueue(Resume const& resume) {
+    int64_t now = archer::common::steadyNanos();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // a slot freed since the caller looked, release() may have seen an empty queue
+        if(m_queue.empty() && tryAcquire()) {
+            return ADMIT_ACQUIRED;
+        }
+        if(m_queue.size() >= (size_t) m_config.maxQueue) {
+            m_shedFull.fetch_add(1, std::memory_order_relaxed);
+            return ADMIT_REJECTED;
+        }
+        m_queue.push_back(Waiter{now, resume});
+        m_queued.store((int) m_queue.size());
+    }
+    // nothing may complete for a while, the wait is bounded by the timer then
+    std::weak_ptr<ConcurrencyLimiter> weak = shared_from_this();
+    DeadlineTimer::instance().schedule(now + m_config.maxWaitMs * 1000000LL, [weak]() {
+        ConcurrencyLimiterPtr limiter = weak.lock();
+        if(limiter) {
+            limiter->expire();
+        }
+    });
+    return ADMIT_QUEUED;
+}
+
+void ConcurrencyLimiter::release(int64_t latencyNanos) {
+    int inflight = m_inflight.fetch_sub(1);
+    if(latencyNanos >= 0) {
+        update(latencyNanos, inflight);
+    }
+    if(m_queued.load() == 0) {
+        return ;
+    }
+    std::vector<std::pair<Resume, bool>> ready;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        drain(archer::common::steadyNanos(), ready);
+    }
+    for(size_t i = 0; i < ready.size(); i++) {
+        ready[i].first(ready[i].second);
+    }
+}
+
+void ConcurrencyLimiter::expire() {
+    std::vector<std::pair<Resume, bool>> ready;
+    {
+        int64_t now = archer::common::steadyNanos();
+        int64_t maxWait = m_config.maxWaitMs * 1000000LL;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        while(!m_queue.empty() && now - m_queue.front().enqueued >= maxWait) {
+            ready.push_back(std::make_pair(m_queue.front().resume, false));
+            m_queue.pop_front();
+            m_shedDelay.fetch_add(1, std::memory_order_relaxed);
+        }
+        m_queued.store((int) m_queue.size());
+    }
+    for(size_t i = 0; i < ready.size(); i++) {
+        ready[i].first(ready[i].second);
+    }
+}
+
+void ConcurrencyLimiter::drain(int64_t now, std::vector<std::pair<Resume, bool>>& ready) {
+    while(!m_queue.empty() && tryAcquire()) {
+        Waiter& waiter = m_queue.front();
+        bool admitted = !drop(now - waiter.enqueued, now);
+        if(!admitted) {
+            // the slot goes to the next waiter
+            m_inflight.fetch_sub(1);
+            m_admitted.fetch_sub(1, std::memory_order_relaxed);
+            m_shedDelay.fetch_add(1, std::memory_order_relaxed);
+        }
+        ready.push_back(std::make_pair(waiter.resume, admitted));
+        m_queue.pop_front();
+    }
+    m_queued.store((int) m_queue.size());
+}
+
+bool ConcurrencyLimiter::drop(int64_t sojourn, int64_t now) {
+    int64_t target = m_config.targetMs * 1000000LL;
+    int64_t interval = m_config.intervalMs * 1000000LL;
+    bool above = false;
+    if(sojourn < target) {
+        m_firstAbove = 0;
+    } else if(m_firstAbove == 0) {
+        m_firstAbove = now + interval;
+    } else {
+        above = now >= m_firstAbove;
+    }
+    if(m_dropping) {
+        if(!above) {
+            m_dropping = false;
+            return false;
+        }
+        if(now < m_dropNext) {
+            return false;
+        }
+        m_dropCount++;
+        m_dropNext += (int64_t) (interval / std::sqrt((double) m_dropCount));
+        return true;
+    }
+    if(!above) {
+        return false;
+    }
+    m_dropping = true;
+    // a drop episode shortly after the last one resumes near its rate
+    m_dropCount = m_dropCount > 2 && now - m_dropNext < 16 * interval ? m_dropCount - 2 : 1;
+    m_dropNext = now + (int64_t) (interval / std::sqrt((double) m_dropCount));
+    return true;
+}
+
+void ConcurrencyLimiter::update(int64_t latencyNanos, int inflight) {
+    std::unique_lock<std::mutex> lock(m_limitMutex, std::try_to_lock);
+    if(!lock.owns_lock()) {
+        return ;
+    }
+    double sample = (double) latencyNanos;
+    m_shortRtt = m_shortRtt == 0 ? sample : m_shortRtt * (1 - SHORT_WEIGHT) + sample * SHORT_WEIGHT;
+    m_longRtt = m_longRtt == 0 ? sample : m_longRtt * (1 - LONG_WEIGHT) + sample * LONG_WEIGHT;
+    // after an overload the long term average comes back down quickly
+    if(m_longRtt > 2 * m_shortRtt) {
+        m_longRtt *= 0.95;
+    }
+    // with half the slots unused the latency says nothing about a higher limit
+    if(inflight < m_estimate / 2) {
+        return ;
+    }
+    double gradient = std::max(0.5, std::min(1.0, TOLERANCE * m_longRtt / std::max(m_shortRtt, 1.0)));
+    double next = m_estimate * gradient + std::sqrt(m_estimate);
+    next = m_estimate * (1 - SMOOTHING) + next * SMOOTHING;
+    m_estimate = std::max((double) m_config.minLimit, std::min((double) m_config.maxLimit, next));
+    m_limit.store((int) m_estimate, std::memory_order_relaxed);
+}
+
+ConcurrencyStats ConcurrencyLimiter::stats() {
+    ConcurrencyStats stats;
+    stats.limit = m_limit.load();
+    stats.inflight = m_inflight.load();
+    stats.queued = m_queued.load();
+    stats.admitted = m_admitted.load();
+    stats.shedQueueFull = m_shedFull.load();
+    stats.shedQueueDelay = m_shedDelay.load();
+    std::lock_guard<std::mutex> lock(m_limitMutex);
+    stats.shortRttNanos = (int64_t) m_shortRtt;
+    stats.longRttNanos = (int64_t) m_longRtt;
+    return stats;
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    // bounds of the adaptive in flight limit and where it starts
+    int         minLimit;
+    int         maxLimit;
+    int         initialLimit;
+    // requests waiting for a slot, over it they are shed at once
+    int         maxQueue;
+    // CoDel: queueing delay tolerated, and for how long it may be exceeded before requests are dropped
+    int         targetMs;
+    int         intervalMs;
+    // no request waits longer than this, whatever the drop state
+    int         maxWaitMs;
+} ConcurrencyConfig;
+
+typedef struct {
+    int      limit;
+    int      inflight;
+    int      queued;
+    uint64_t admitted;
+    uint64_t shedQueueFull;
+    uint64_t shedQueueDelay;
+    int64_t  shortRttNanos;
+    int64_t  longRttNanos;
+} ConcurrencyStats;
+
+enum AdmitResult {
+    ADMIT_ACQUIRED = 0,
+    ADMIT_QUEUED,
+    ADMIT_REJECTED
+};
+
+/**
+ * Adaptive in flight limit of a proxy or a location.
+ *
+ * The limit follows the gradient between the long term and the recent upstream
+ * latency: while the recent one stays close to the long term average the limit
+ * grows by about its square root, when queueing shows up upstream it shrinks by
+ * the latency ratio, down to half per sample. Requests over the limit wait in a
+ * short FIFO, taken over by CoDel once the queueing delay stays above target
+ * for a whole interval, dropped requests are shed with 503.
+*/
+class ConcurrencyLimiter : public std::enable_shared_from_this<ConcurrencyLimiter>
+{
+public:
+
+    // admitted is false when the waiting request was shed, runs on whichever thread freed the slot
+    typedef std::function<void(bool admitted)> Resume;
+
+    explicit ConcurrencyLimiter(ConcurrencyConfig const& config);
+    ~ConcurrencyLimiter() {}
+
+    ConcurrencyLimiter(const ConcurrencyLimiter&) = delete;
+    ConcurrencyLimiter& operator=(const ConcurrencyLimiter&) = delete;
+
+    ConcurrencyConfig const& config() const {return m_config;}
+
+    // takes a slot when one is free, lock free
+    bool tryAcquire();
+
+    // takes a slot or queues resume for the next free one, resume is not called unless ADMIT_QUEUED
+    AdmitResult enqueue(Resume const& resume);
+
+    // gives a slot back, latencyNanos of the request feeds the limit unless negative
+    void release(int64_t latencyNanos);
+
+    // sheds the requests queued for longer than maxWaitMs
+    void expire();
+
+    int limit() const {return m_limit.load(std::memory_order_relaxed);}
+
+    ConcurrencyStats stats();
+
+private:
+
+    typedef struct {
+        int64_t  enqueued;
+        Resume   resume;
+    } Waiter;
+
+    void update(int64_t latencyNanos, int inflight);
+
+    // hands free slots to the queue head, with m_mutex held
+    void drain(int64_t now, std::vector<std::pair<Resume, bool>>& ready);
+
+    // CoDel drop decision for a request that waited sojourn, with m_mutex held
+    bool drop(int64_t sojourn, int64_t now);
+
+    ConcurrencyConfig            m_config;
+    std::atomic<int>             m_limit;
+    std::atomic<int>             m_inflight{0};
+    std::atomic<int>             m_queued{0};
+    std::atomic<uint64_t>        m_admitted{0};
+    std::atomic<uint64_t>        m_shedFull{0};
+    std::atomic<uint64_t>        m_shedDelay{0};
+
+    // samples are skipped while another thread updates the limit
+    std::mutex                   m_limitMutex;
+    double                       m_estimate;
+    double                       m_shortRtt = 0;
+    double                       m_longRtt = 0;
+
+    std::mutex                   m_mutex;
+    std::deque<Waiter>           m_queue;
+    int64_t                      m_firstAbove = 0;
+    bool                         m_dropping = false;
+    int64_t                      m_dropNext = 0;
+    uint32_t                     m_dropCount = 0;
+};
+
+typedef std::shared_ptr<ConcurrencyLimiter> ConcurrencyLimiterPtr;
+
+/**
+ * The slots one request holds, given back once when it completes or fails,
+ * or when the last exchange referring to it goes away.
+*/
+class ConcurrencyTicket
+{
+public:
+
+    ConcurrencyTicket() {}
+    ~ConcurrencyTicket() {
+        release(-1);
+    }
+
+    ConcurrencyTicket(const ConcurrencyTicket&) = delete;
+    ConcurrencyTicket& operator=(const ConcurrencyTicket&) = delete;
+
+    // a slot already taken on limiter
+    void add(ConcurrencyLimiterPtr const& limiter) {
+        m_limiters.push_back(limiter);
+    }
+
+    // latencyNanos is negative for failed requests, they do not feed the limits
+    void release(int64_t latencyNanos) {
+        if(m_released.exchange(true)) {
+            return ;
+        }
+        for(size_t i = 0; i < m_limiters.size(); i++) {
+            m_limiters[i]->release(latencyNanos);
+        }
+    }
+
+private:
+
+    std::vector<ConcurrencyLimiterPtr> m_limiters;
+    std::atomic<bool>            m_released{false};
+};
+
+typedef std::shared_ptr<ConcurrencyTicket> ConcurrencyTicketPtr;
+}
+}
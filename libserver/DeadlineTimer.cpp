@@ -0,0 +1,50 @@
+#include "DeadlineTimer.h"
+
+#include <chrono>
+
+using namespace archer::server;
+
+DeadlineTimer::DeadlineTimer() {
+    m_thread = std::thread(&DeadlineTimer::run, this);
+}
+
+DeadlineTimer::~DeadlineTimer() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+void DeadlineTimer::schedule(int64_t deadline, std::function<void()> const& task) {
+    bool earliest = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        earliest = m_entries.empty() || deadline < m_entries.top().first;
+        m_entries.push(Entry(deadline, task));
+    }
+    if(earliest) {
+        m_cond.notify_one();
+    }
+}
+
+void DeadlineTimer::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while(!m_stopped) {
+        if(m_entries.empty()) {
+            m_cond.wait(lock);
+            continue;
+        }
+        int64_t wait = m_entries.top().first - archer::common::steadyNanos();
+        if(wait > 0) {
+            m_cond.wait_for(lock, std::chrono::nanoseconds(wait));
+            continue;
+        }
+        std::function<void()> task = m_entries.top().second;
+        m_entries.pop();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
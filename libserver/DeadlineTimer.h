@@ -0,0 +1,61 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+namespace archer
+{
+namespace server
+{
+
+/**
+ * Process wide timer for short lived deadlines on the request path, hedges,
+ * queued requests and pooled upstream requests. Tasks run on the timer thread
+ * and should capture weak references, whatever they refer to may be gone when
+ * the deadline passes.
+*/
+class DeadlineTimer
+{
+typedef std::pair<int64_t, std::function<void()>> Entry;
+
+struct Later {
+    bool operator()(Entry const& a, Entry const& b) const {
+        return a.first > b.first;
+    }
+};
+
+public:
+
+    static DeadlineTimer& instance() {
+        static DeadlineTimer instance;
+        return instance;
+    }
+
+    DeadlineTimer(const DeadlineTimer&) = delete;
+    DeadlineTimer& operator=(const DeadlineTimer&) = delete;
+
+    // runs task once the steady clock reaches deadline
+    void schedule(int64_t deadline, std::function<void()> const& task);
+
+private:
+
+    DeadlineTimer();
+    ~DeadlineTimer();
+
+    void run();
+
+    std::mutex                   m_mutex;
+    std::condition_variable      m_cond;
+    bool                         m_stopped = false;
+    std::priority_queue<Entry, std::vector<Entry>, Later> m_entries;
+    std::thread                  m_thread;
+};
+}
+}
@@ -0,0 +1,92 @@
+#include "DstPeer.h"
+
+#include <cmath>
+
+using namespace archer::server;
+
+static const int64_t  EWMA_DECAY_NANOS = 10LL * 1000 * 1000 * 1000;
+static const int64_t  NANOS_PER_SECOND = 1000LL * 1000 * 1000;
+// a ramping peer starts at a tenth of its share rather than at none
+static const uint32_t RAMP_FLOOR_PERMILLE = 100;
+
+void DstPeer::onComplete(int64_t latencyNanos) {
+    m_outstanding.fetch_sub(1, std::memory_order_relaxed);
+    if(latencyNanos < 0) {
+        latencyNanos = 0;
+    }
+    int64_t now = archer::common::steadyNanos();
+    int64_t stamp = m_ewmaStamp.exchange(now, std::memory_order_relaxed);
+    uint64_t ewma = m_ewmaNanos.load(std::memory_order_relaxed);
+    if((uint64_t) latencyNanos > ewma) {
+        // peak sensitive, a slow response is taken at once
+        m_ewmaNanos.store(latencyNanos, std::memory_order_relaxed);
+        return ;
+    }
+    double w = std::exp(-(double) (now - stamp) / EWMA_DECAY_NANOS);
+    m_ewmaNanos.store((uint64_t) (ewma * w + latencyNanos * (1.0 - w)), std::memory_order_relaxed);
+}
+
+uint64_t DstPeer::latencyEwma(int64_t now) const {
+    uint64_t ewma = m_ewmaNanos.load(std::memory_order_relaxed);
+    int64_t idle = now - m_ewmaStamp.load(std::memory_order_relaxed);
+    if(idle <= 0) {
+        return ewma;
+    }
+    return (uint64_t) (ewma * std::exp(-(double) idle / EWMA_DECAY_NANOS));
+}
+
+bool DstPeer::onProbe(bool success, int healthyThreshold, int unhealthyThreshold) {
+    if(success) {
+        m_probeFailures = 0;
+        if(++m_probeSuccesses >= healthyThreshold && !healthy()) {
+            m_healthy.store(true, std::memory_order_relaxed);
+            startRamp();
+            return true;
+        }
+    } else {
+        m_probeSuccesses = 0;
+        if(++m_probeFailures >= unhealthyThreshold && healthy()) {
+            m_healthy.store(false, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+void DstPeer::onResult(bool success, int64_t now) {
+    int64_t second = now / NANOS_PER_SECOND;
+    ResultBucket& bucket = m_buckets[second % RESULT_BUCKETS];
+    int64_t seen = bucket.second.load(std::memory_order_relaxed);
+    if(seen != second && bucket.second.compare_exchange_strong(seen, second, std::memory_order_relaxed)) {
+        bucket.requests.store(0, std::memory_order_relaxed);
+        bucket.failures.store(0, std::memory_order_relaxed);
+    }
+    bucket.requests.fetch_add(1, std::memory_order_relaxed);
+    if(!success) {
+        bucket.failures.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void DstPeer::windowStats(int64_t now, int windowSeconds, uint32_t& requests, uint32_t& failures) const {
+    int64_t second = now / NANOS_PER_SECOND;
+    requests = 0;
+    failures = 0;
+    for(int i = 0; i < RESULT_BUCKETS; i++) {
+        int64_t age = second - m_buckets[i].second.load(std::memory_order_relaxed);
+        if(age >= 0 && age < windowSeconds) {
+            requests += m_buckets[i].requests.load(std::memory_order_relaxed);
+            failures += m_buckets[i].failures.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+uint32_t DstPeer::rampPermille(int64_t now, int64_t windowNanos) const {
+    int64_t elapsed = now - m_rampFrom.load(std::memory_order_relaxed);
+    if(windowNanos <= 0 || elapsed >= windowNanos) {
+        return 1000;
+    }
+    if(elapsed <= 0) {
+        return RAMP_FLOOR_PERMILLE;
+    }
+    return RAMP_FLOOR_PERMILLE + (uint32_t) ((1000 - RAMP_FLOOR_PERMILLE) * elapsed / windowNanos);
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "TlsContext.h"
+#include "Metrics.h"
+
+namespace archer
+{
+namespace server
+{
+class UpstreamPool;
+
+/**
+ * One backend of a proxy. The object is shared by every published peer snapshot,
+ * so the counters below survive addPeer/delPeer of other backends.
+*/
+class DstPeer : public std::enable_shared_from_this<DstPeer>
+{
+static const int RESULT_BUCKETS = 60;
+
+typedef struct {
+    std::atomic<int64_t>  second;
+    std::atomic<uint32_t> requests;
+    std::atomic<uint32_t> failures;
+} ResultBucket;
+
+public:
+
+    DstPeer(std::string const& host, int port, int weight) : m_host(host), m_port(port), m_weight(weight > 0 ? weight : 1), m_rampFrom(common::steadyNanos()) {}
+    ~DstPeer() {}
+
+    DstPeer(const DstPeer&) = delete;
+    DstPeer& operator=(const DstPeer&) = delete;
+
+    std::string const& host() const {return m_host;}
+
+    int port() const {return m_port;}
+
+    int weight() const {return m_weight;}
+
+    int32_t outstanding() const {
+        return m_outstanding.load(std::memory_order_relaxed);
+    }
+
+    void onSend() {
+        m_outstanding.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onComplete(int64_t latencyNanos);
+
+    void onFailure() {
+        m_outstanding.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // peak EWMA of the upstream latency, decayed towards zero while the peer is idle
+    uint64_t latencyEwma(int64_t now) const;
+
+    bool healthy() const {
+        return m_healthy.load(std::memory_order_relaxed);
+    }
+
+    bool ejected() const {
+        return m_ejected.load(std::memory_order_relaxed);
+    }
+
+    // whether the peer may be part of the published selection set
+    bool available() const {
+        return healthy() && !ejected();
+    }
+
+    // record one active probe result, true when the health state flipped
+    bool onProbe(bool success, int healthyThreshold, int unhealthyThreshold);
+
+    // record the outcome of one live request into the one second buckets
+    void onResult(bool success, int64_t now);
+
+    // requests and failures seen during the last windowSeconds
+    void windowStats(int64_t now, int windowSeconds, uint32_t& requests, uint32_t& failures) const;
+
+    // outlier ejection bookkeeping, only touched by the OutlierDetector thread
+    void eject(int64_t until) {
+        m_ejectedUntil = until;
+        m_ejections++;
+        m_ejected.store(true, std::memory_order_relaxed);
+    }
+
+    void uneject() {
+        m_ejected.store(false, std::memory_order_relaxed);
+        startRamp();
+    }
+
+    int64_t ejectedUntil() const {return m_ejectedUntil;}
+
+    int ejections() const {return m_ejections;}
+
+    void forgiveEjections() {m_ejections = 0;}
+
+    // slow start, a new or recovered peer takes a growing share of its traffic
+    void startRamp() {
+        m_rampFrom.store(common::steadyNanos(), std::memory_order_relaxed);
+    }
+
+    // permille of its balanced share the peer takes windowNanos into its ramp, 1000 afterwards
+    uint32_t rampPermille(int64_t now, int64_t windowNanos) const;
+
+    // keep-alive connections to this backend, set before the peer is published, may be null
+    std::shared_ptr<UpstreamPool> const& pool() const {return m_pool;}
+
+    void setPool(std::shared_ptr<UpstreamPool> const& pool) {m_pool = pool;}
+
+    // https backends, null for plaintext ones
+    SSLOptionPtr const& ssl() const {return m_ssl;}
+
+    void setSsl(SSLOptionPtr const& ssl) {m_ssl = ssl;}
+
+    // request metrics of this backend, set before the peer is published, may be null
+    MetricSeries const* metrics() const {return m_metrics.get();}
+
+    void setMetrics(MetricSeriesPtr const& metrics) {m_metrics = metrics;}
+
+    // id of the backend in the access log, set before the peer is published
+    uint32_t accessId() const {return m_accessId;}
+
+    void setAccessId(uint32_t id) {m_accessId = id;}
+
+private:
+
+    std::string               m_host;
+    int                       m_port;
+    int                       m_weight;
+    std::atomic<int32_t>      m_outstanding{0};
+    std::atomic<uint64_t>     m_ewmaNanos{0};
+    std::atomic<int64_t>      m_ewmaStamp{0};
+    std::atomic<bool>         m_healthy{true};
+    int                       m_probeSuccesses = 0;
+    int                       m_probeFailures = 0;
+
+    std::atomic<bool>         m_ejected{false};
+    int64_t                   m_ejectedUntil = 0;
+    int                       m_ejections = 0;
+    ResultBucket              m_buckets[RESULT_BUCKETS] = {};
+
+    std::atomic<int64_t>      m_rampFrom;
+    std::shared_ptr<UpstreamPool> m_pool;
+    SSLOptionPtr              m_ssl;
+    MetricSeriesPtr           m_metrics;
+    uint32_t                  m_accessId = 0;
+};
+
+typedef std::shared_ptr<DstPeer> DstPeerPtr;
+typedef std::vector<DstPeerPtr>  PeerList;
+}
+}
@@ -0,0 +1,228 @@
+#include "Exchange.h"
+#include "VirtualHost.h"
+
+#include <algorithm>
+
+using namespace archer::server;
+
+static const int64_t NANOS_PER_SECOND = 1000LL * 1000 * 1000;
+
+// the foreach callback carries no argument, collect into the calling thread's target
+static thread_local HeaderList *collectTarget = NULL;
+
+std::string archer::server::wireWithHost(std::string const& wire, std::string const& host) {
+    size_t headEnd = wire.find("\r\n\r\n");
+    size_t requestLine = wire.find("\r\n");
+    if(headEnd == std::string::npos) {
+        return wire;
+    }
+    std::string out;
+    out.reserve(wire.length() + host.length() + 8);
+    for(size_t line = requestLine; line < headEnd; ) {
+        size_t start = line + 2;
+        size_t end = wire.find("\r\n", start);
+        if(end - start >= 5 && strncasecmp(wire.data() + start, "Host:", 5) == 0) {
+            out.append(wire, 0, start).append("Host: ").append(host).append(wire, end, std::string::npos);
+            return out;
+        }
+        line = end;
+    }
+    out.append(wire, 0, requestLine + 2).append("Host: ").append(host).append("\r\n").append(wire, requestLine + 2, std::string::npos);
+    return out;
+}
+
+static void collectHeader(const char *key, const char *val) {
+    if(strcasecmp(key, "Connection") == 0 || strcasecmp(key, "Keep-Alive") == 0 || strcasecmp(key, "Transfer-Encoding") == 0) {
+        return ;
+    }
+    collectTarget->push_back(std::make_pair(std::string(key), std::string(val)));
+}
+
+void archer::server::collectHeaders(HttpResponse *res, HeaderList& headers) {
+    collectTarget = &headers;
+    http_response_headers_foreach(res, collectHeader);
+    collectTarget = NULL;
+}
+
+bool Exchange::onChunk(HttpResponse *res, size_t chunkLen) {
+    if(!m_headed) {
+        m_headed = true;
+        m_ttfb = common::steadyNanos() - m_start;
+        m_status = http_response_get_status(res);
+        const char *length = http_response_get_header(res, "Content-Length");
+        m_expected = length ? strtoull(length, NULL, 10) : SIZE_MAX;
+    }
+    m_received += chunkLen;
+    // without a content length the manager ends the body with an empty chunk
+    return chunkLen == 0 || m_received >= m_expected;
+}
+
+void Exchange::recordMetrics(int status) const {
+    int64_t latency = common::steadyNanos() - m_start;
+    Metrics& metrics = Metrics::instance();
+    metrics.record(m_vhost->metrics(), status, latency, m_ttfb, m_bytesIn, m_received);
+    metrics.record(m_metrics.get(), status, latency, m_ttfb, m_bytesIn, m_received);
+    metrics.record(m_peer->metrics(), status, latency, m_ttfb, m_bytesIn, m_received);
+    common::AccessLog::instance().write(m_vhost->accessId(), m_locationId, m_peer->accessId(), status, latency, m_ttfb, m_bytesIn, m_received);
+}
+
+void Exchange::setCacheFill(ResponseCachePtr const& cache, std::string const& key, const char *encoding) {
+    m_cache = cache;
+    m_cacheKey = key;
+    m_encoding = encoding == NULL ? "" : encoding;
+}
+
+void Exchange::fillCache(HttpResponse *res, const char *chunk, size_t chunkLen) {
+    if(!m_cache) {
+        return ;
+    }
+    if(!m_fillHeaded) {
+        m_fillHeaded = true;
+        int ttl = m_cache->freshness(res);
+        const char *length = http_response_get_header(res, "Content-Length");
+        if(ttl < 0 || (length != NULL && strtoull(length, NULL, 10) > m_cache->config().maxObjectBytes)) {
+            m_cache.reset();
+            return ;
+        }
+        m_fill = std::make_shared<CachedResponse>();
+        m_fill->status = http_response_get_status(res);
+        m_fill->varyEncoding = http_response_get_header(res, "Vary") != NULL;
+        m_fill->encoding = m_encoding;
+        m_fill->storedNanos = common::steadyNanos();
+        m_fill->expiresNanos = m_fill->storedNanos + ttl * NANOS_PER_SECOND;
+        HeaderList headers;
+        collectHeaders(res, headers);
+        // framing and age are rebuilt when the entry is served
+        for(size_t i = 0; i < headers.size(); i++) {
+            const char *key = headers[i].first.c_str();
+            if(strcasecmp(key, "Content-Length") != 0 && strcasecmp(key, "Date") != 0 && strcasecmp(key, "Age") != 0) {
+                m_fill->headers.push_back(headers[i]);
+            }
+        }
+    }
+    if(m_fill->body.length() + chunkLen > m_cache->config().maxObjectBytes) {
+        m_cache.reset();
+        m_fill.reset();
+        return ;
+    }
+    m_fill->body.append(chunk, chunkLen);
+}
+
+void Exchange::storeCache() {
+    if(m_cache && m_fill) {
+        m_cache->put(m_cacheKey, m_fill);
+    }
+    m_cache.reset();
+    m_fill.reset();
+}
+
+void Exchange::relay(HttpResponse *res, const char *chunk, size_t chunkLen, bool last) {
+    if(!m_flight) {
+        return ;
+    }
+    // closed flights leave the table so the next identical request leads a new one
+    if(!m_flight->relay(res, chunk, chunkLen, last)) {
+        FlightTable::instance().close(m_flightKey, m_flight);
+    }
+    if(last) {
+        m_flight.reset();
+    }
+}
+
+void Exchange::failFlight() {
+    if(m_flight) {
+        FlightTable::instance().close(m_flightKey, m_flight);
+        m_flight->fail();
+        m_flight.reset();
+    }
+}
+
+void Exchange::deliver(HttpResponse *res, char *chunk, size_t chunkLen, bool last) {
+    if(m_compressor) {
+        CompressorPtr compressor;
+        compressor.swap(m_compressor);
+        if(compressor->eligible(res)) {
+            m_holdBody = http_response_get_header(res, "Content-Length") != NULL;
+            m_deflate.reset(new CompressStream(compressor, m_contentEncoding, !m_holdBody));
+            if(m_deflate->ok()) {
+                http_response_set_header(res, "Content-Encoding", Compressor::encodingName(m_contentEncoding));
+                http_response_set_header(res, "Vary", "Accept-Encoding");
+            } else {
+                m_deflate.reset();
+            }
+        }
+    }
+    if(!m_deflate) {
+        http_response_send_some(res, chunk, chunkLen);
+        return ;
+    }
+    std::string out;
+    m_deflate->write(chunk, chunkLen, last, out);
+    if(m_holdBody) {
+        m_compressed.append(out);
+        if(last) {
+            http_response_set_content_length(res, m_compressed.length());
+            http_response_send_some(res, m_compressed.data(), m_compressed.length());
+        }
+    } else {
+        if(!out.empty()) {
+            http_response_send_some(res, out.data(), out.length());
+        }
+        if(last && chunkLen == 0) {
+            http_response_send_some(res, chunk, 0);
+        }
+    }
+    if(last) {
+        m_deflate.reset();
+        m_compressed.clear();
+    }
+}
+
+bool Exchange::tried(const DstPeer *peer) const {
+    if(peer == m_peer.get()) {
+        return true;
+    }
+    return std::find(m_tried.begin(), m_tried.end(), peer) != m_tried.end();
+}
+
+ExchangePtr Exchange::copyTo(DstPeerPtr const& peer) const {
+    ExchangePtr next = std::make_shared<Exchange>(m_vhost, peer);
+    next->m_requestSent = true;
+    next->m_cache = m_cache;
+    next->m_cacheKey = m_cacheKey;
+    next->m_encoding = m_encoding;
+    next->m_flight = m_flight;
+    next->m_flightKey = m_flightKey;
+    next->m_compressor = m_compressor;
+    next->m_contentEncoding = m_contentEncoding;
+    next->m_res = m_res;
+    next->m_method = m_method;
+    if(!m_wire.empty()) {
+        next->m_wire = wireWithHost(m_wire, peer->host());
+    }
+    next->m_retryPolicy = m_retryPolicy;
+    next->m_hedgePolicy = m_hedgePolicy;
+    next->m_ticket = m_ticket;
+    next->m_metrics = m_metrics;
+    next->m_locationId = m_locationId;
+    next->m_logLevel = m_logLevel;
+    next->m_bytesIn = m_bytesIn;
+    next->m_proxy = m_proxy;
+    next->m_attempts = m_attempts;
+    next->m_tried = m_tried;
+    next->m_tried.push_back(m_peer.get());
+    return next;
+}
+
+ExchangePtr Exchange::retryTo(DstPeerPtr const& peer) const {
+    ExchangePtr next = copyTo(peer);
+    next->m_attempts++;
+    return next;
+}
+
+ExchangePtr Exchange::hedgeTo(DstPeerPtr const& peer) const {
+    ExchangePtr next = copyTo(peer);
+    next->m_race = m_race;
+    next->m_hedgeCopy = true;
+    return next;
+}
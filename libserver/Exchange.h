@@ -0,0 +1,365 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+#include "Balancer.h"
+#include "ResponseCache.h"
+#include "Coalescer.h"
+#include "Compressor.h"
+#include "RetryPolicy.h"
+#include "HedgePolicy.h"
+#include "ConcurrencyLimiter.h"
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+class VirtualHost;
+class ProxyServer;
+class Exchange;
+
+typedef std::shared_ptr<Exchange> ExchangePtr;
+
+/**
+ * State of one proxied request, from the first request chunk until the last
+ * upstream response chunk or the error callback.
+*/
+class Exchange
+{
+public:
+
+    // the exchange keeps the log level of the request it is opened for
+    Exchange(std::shared_ptr<VirtualHost> const& vhost, DstPeerPtr const& peer) : m_vhost(vhost), m_peer(peer), m_start(common::steadyNanos()),
+        m_logLevel(common::Logger::scopeLevel()) {}
+    ~Exchange() {}
+
+    Exchange(const Exchange&) = delete;
+    Exchange& operator=(const Exchange&) = delete;
+
+    // keeps the virtual host alive while the request is in flight
+    std::shared_ptr<VirtualHost> const& vhost() const {return m_vhost;}
+
+    DstPeerPtr const& peer() const {return m_peer;}
+
+    int64_t startNanos() const {return m_start;}
+
+    // for a LogScope around the callbacks of the request
+    int logLevel() const {return m_logLevel;}
+
+    bool requestSent() const {return m_requestSent;}
+
+    void setRequestSent(bool sent) {m_requestSent = sent;}
+
+    // upstream status, known after the first response chunk
+    int status() const {return m_status;}
+
+    // the exchange the table holds for its response, read without the table lock
+    bool current() const {
+        return m_current.load(std::memory_order_acquire);
+    }
+
+    // the outcome goes into the outlier buckets of the peer once, false when it already did
+    bool claimResult() {
+        return !m_resulted.exchange(true, std::memory_order_relaxed);
+    }
+
+    // account one upstream chunk, true once the whole response went through
+    bool onChunk(HttpResponse *res, size_t chunkLen);
+
+    // request metrics and access log id of the location, the proxy and backend ones come with vhost and peer
+    void setLocation(MetricSeriesPtr const& metrics, uint32_t accessId) {
+        m_metrics = metrics;
+        m_locationId = accessId;
+    }
+
+    void addBytesIn(size_t len) {m_bytesIn += len;}
+
+    // records the finished request under its proxy, location and backend, and in the access log
+    void recordMetrics(int status) const;
+
+    // assemble the response for the location cache while it streams to the client
+    void setCacheFill(ResponseCachePtr const& cache, std::string const& key, const char *encoding);
+
+    void fillCache(HttpResponse *res, const char *chunk, size_t chunkLen);
+
+    // store the assembled response, once the last chunk went through
+    void storeCache();
+
+    // lead a flight of identical requests, its waiters get every chunk this exchange receives
+    void setFlight(FlightPtr const& flight, std::string const& key) {
+        m_flight = flight;
+        m_flightKey = key;
+    }
+
+    void relay(HttpResponse *res, const char *chunk, size_t chunkLen, bool last);
+
+    void failFlight();
+
+    // compress the response for the client when the upstream one qualifies
+    void setCompression(CompressorPtr const& compressor, ContentEncoding encoding) {
+        m_compressor = compressor;
+        m_contentEncoding = encoding;
+    }
+
+    // hands one upstream chunk to the client, through the compressor if there is one
+    void deliver(HttpResponse *res, char *chunk, size_t chunkLen, bool last);
+
+    // whether part of the response already went to the client
+    bool responding() const {return m_headed;}
+
+    // the serialized request, for pooled upstream connections that write it themselves
+    void setWire(HttpResponse *res, const char *method, std::string& wire) {
+        m_res = res;
+        m_method = method == NULL ? "" : method;
+        m_wire.swap(wire);
+    }
+
+    HttpResponse* response() const {return m_res;}
+
+    std::string const& wire() const {return m_wire;}
+
+    // answers to HEAD carry no body whatever their framing headers say
+    bool noBody() const {return m_method == "HEAD";}
+
+    // GET and HEAD may be written behind other requests on one connection
+    bool pipelinable() const {return m_method == "GET" || m_method == "HEAD";}
+
+    // retries and hedges replay the wire through proxy, the request must be complete
+    void setReplay(ProxyServer *proxy, const char *method) {
+        m_proxy = proxy;
+        m_method = method == NULL ? "" : method;
+    }
+
+    void setRetryPolicy(RetryPolicyPtr const& policy) {m_retryPolicy = policy;}
+
+    RetryPolicyPtr const& retryPolicy() const {return m_retryPolicy;}
+
+    // a hedged exchange races a copy of itself for the client response
+    void setHedge(HedgePolicyPtr const& policy, HedgeRacePtr const& race) {
+        m_hedgePolicy = policy;
+        m_race = race;
+    }
+
+    HedgePolicyPtr const& hedgePolicy() const {return m_hedgePolicy;}
+
+    HedgeRacePtr const& race() const {return m_race;}
+
+    bool hedgeCopy() const {return m_hedgeCopy;}
+
+    // concurrency slots held for the request, shared by its retries and hedges
+    void setTicket(ConcurrencyTicketPtr const& ticket) {m_ticket = ticket;}
+
+    // gives the slots back, latencyNanos is negative when the request failed
+    void releaseTicket(int64_t latencyNanos) {
+        if(m_ticket) {
+            m_ticket->release(latencyNanos);
+        }
+    }
+
+    ProxyServer* proxy() const {return m_proxy;}
+
+    bool idempotent() const {return RetryPolicy::idempotent(m_method.c_str());}
+
+    // retries so far
+    int attempts() const {return m_attempts;}
+
+    bool tried(const DstPeer *peer) const;
+
+    // the same request, response handling and waiters, sent to peer after a failure,
+    // its wire is this one with the Host line of peer
+    ExchangePtr retryTo(DstPeerPtr const& peer) const;
+
+    // a copy racing this exchange on peer, with the same wire as retryTo
+    ExchangePtr hedgeTo(DstPeerPtr const& peer) const;
+
+private:
+
+    friend class ExchangeTable;
+
+    ExchangePtr copyTo(DstPeerPtr const& peer) const;
+
+    std::shared_ptr<VirtualHost> m_vhost;
+    DstPeerPtr       m_peer;
+    int64_t          m_start;
+    int              m_logLevel;
+    bool             m_requestSent = false;
+    bool             m_headed = false;
+    int              m_status = 0;
+    std::atomic<bool> m_resulted{false};
+    // set and cleared by ExchangeTable under its shard lock
+    std::atomic<bool> m_current{false};
+    size_t           m_expected = 0;
+    size_t           m_received = 0;
+    // first upstream byte after the start, -1 until it came
+    int64_t          m_ttfb = -1;
+    size_t           m_bytesIn = 0;
+    MetricSeriesPtr  m_metrics;
+    uint32_t         m_locationId = 0;
+
+    ResponseCachePtr m_cache;
+    std::string      m_cacheKey;
+    std::string      m_encoding;
+    std::shared_ptr<CachedResponse> m_fill;
+    bool             m_fillHeaded = false;
+
+    FlightPtr        m_flight;
+    std::string      m_flightKey;
+
+    CompressorPtr    m_compressor;
+    ContentEncoding  m_contentEncoding = ENCODING_IDENTITY;
+    std::unique_ptr<CompressStream> m_deflate;
+    // with an upstream Content-Length the compressed body is held back until its length is known
+    bool             m_holdBody = false;
+    std::string      m_compressed;
+
+    HttpResponse    *m_res = NULL;
+    std::string      m_method;
+    std::string      m_wire;
+
+    RetryPolicyPtr   m_retryPolicy;
+    ProxyServer     *m_proxy = NULL;
+    int              m_attempts = 0;
+    std::vector<const DstPeer *> m_tried;
+
+    HedgePolicyPtr   m_hedgePolicy;
+    HedgeRacePtr     m_race;
+    bool             m_hedgeCopy = false;
+
+    ConcurrencyTicketPtr m_ticket;
+};
+
+// upstream headers of res, without the hop by hop ones
+void collectHeaders(HttpResponse *res, HeaderList& headers);
+
+// the serialized request with its Host header set to host, the rest of the wire as it is
+std::string wireWithHost(std::string const& wire, std::string const& host);
+
+/**
+ * Process wide table of in flight exchanges keyed by the client response,
+ * the http error callback has no manager argument so the table cannot live in a proxy.
+*/
+class ExchangeTable
+{
+static const size_t SHARDS = 64;
+
+typedef struct {
+    std::mutex                                      mutex;
+    std::unordered_map<HttpResponse *, ExchangePtr> exchanges;
+} Shard;
+
+public:
+
+    static ExchangeTable& instance() {
+        static ExchangeTable instance;
+        return instance;
+    }
+
+    ExchangeTable(const ExchangeTable&) = delete;
+    ExchangeTable& operator=(const ExchangeTable&) = delete;
+
+    ExchangePtr put(HttpResponse *res, ExchangePtr const& exchange) {
+        Shard& shard = shardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ExchangePtr& slot = shard.exchanges[res];
+        ExchangePtr old = slot;
+        if(old != exchange) {
+            setCurrent(old, false);
+        }
+        slot = exchange;
+        setCurrent(exchange, true);
+        return old;
+    }
+
+    ExchangePtr get(HttpResponse *res) {
+        Shard& shard = shardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.exchanges.find(res);
+        return it == shard.exchanges.end() ? nullptr : it->second;
+    }
+
+    ExchangePtr take(HttpResponse *res) {
+        Shard& shard = shardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.exchanges.find(res);
+        if(it == shard.exchanges.end()) {
+            return nullptr;
+        }
+        ExchangePtr exchange = it->second;
+        setCurrent(exchange, false);
+        shard.exchanges.erase(it);
+        return exchange;
+    }
+
+    // hands the entry over to next while it still is exchange
+    bool replaceIf(HttpResponse *res, ExchangePtr const& exchange, ExchangePtr const& next) {
+        Shard& shard = shardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.exchanges.find(res);
+        if(it == shard.exchanges.end() || it->second != exchange) {
+            return false;
+        }
+        setCurrent(exchange, false);
+        it->second = next;
+        setCurrent(next, true);
+        return true;
+    }
+
+    // removes the entry only while it still is exchange, false once it completed or was replaced
+    bool takeIf(HttpResponse *res, ExchangePtr const& exchange) {
+        Shard& shard = shardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.exchanges.find(res);
+        if(it == shard.exchanges.end() || it->second != exchange) {
+            return false;
+        }
+        setCurrent(exchange, false);
+        shard.exchanges.erase(it);
+        return true;
+    }
+
+    /**
+     * get() for every chunk of one response. archer_net keeps no per response
+     * slot the exchange could live in, so the thread remembers the last one it
+     * looked up and reuses it without the shard lock while it is still current,
+     * chunks of one response arrive on one event loop thread in a row.
+    */
+    ExchangePtr find(HttpResponse *res) {
+        static thread_local HttpResponse *cachedRes = NULL;
+        static thread_local std::weak_ptr<Exchange> cached;
+        if(cachedRes == res) {
+            ExchangePtr exchange = cached.lock();
+            if(exchange && exchange->current()) {
+                return exchange;
+            }
+        }
+        ExchangePtr exchange = get(res);
+        cachedRes = res;
+        cached = exchange;
+        return exchange;
+    }
+
+private:
+
+    ExchangeTable() {}
+
+    static void setCurrent(ExchangePtr const& exchange, bool current) {
+        if(exchange) {
+            exchange->m_current.store(current, std::memory_order_release);
+        }
+    }
+
+    Shard& shardOf(HttpResponse *res) {
+        return m_shards[(((uintptr_t) res) >> 4) % SHARDS];
+    }
+
+    Shard m_shards[SHARDS];
+};
+}
+}
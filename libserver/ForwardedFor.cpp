@@ -0,0 +1,184 @@
+#include "ForwardedFor.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <algorithm>
+
+using namespace archer::server;
+
+static const size_t MAX_HEAD = 64 * 1024;
+static const size_t MAX_LINE = 4096;
+
+inline static bool headerIs(const char *line, size_t nameLen, const char *name) {
+    return nameLen == strlen(name) && strncasecmp(line, name, nameLen) == 0;
+}
+
+// value of a header line without the leading blanks and the line end
+inline static std::string headerValue(const char *line, size_t lineLen, size_t nameLen) {
+    size_t from = nameLen + 1;
+    while(from < lineLen && (line[from] == ' ' || line[from] == '\t')) {
+        from++;
+    }
+    size_t to = lineLen;
+    while(to > from && (line[to - 1] == '\r' || line[to - 1] == '\n' || line[to - 1] == ' ' || line[to - 1] == '\t')) {
+        to--;
+    }
+    return std::string(line + from, to - from);
+}
+
+bool ForwardedFor::feed(const char *data, size_t len, std::string& out) {
+    size_t at = 0;
+    while(at < len) {
+        switch(m_state) {
+        case STATE_BODY:
+        case STATE_CHUNK_DATA: {
+            size_t n = (size_t) std::min<uint64_t>(m_remaining, len - at);
+            out.append(data + at, n);
+            at += n;
+            m_remaining -= n;
+            if(m_remaining == 0) {
+                m_state = m_state == STATE_BODY ? STATE_HEAD : STATE_CHUNK_SIZE;
+            }
+            break;
+        }
+        case STATE_HEAD: {
+            // blank lines between requests are allowed and passed on
+            if(m_line.empty() && (data[at] == '\r' || data[at] == '\n')) {
+                out.push_back(data[at++]);
+                break;
+            }
+            size_t before = m_line.length();
+            m_line.append(data + at, len - at);
+            size_t end = m_line.find("\r\n\r\n", before < 3 ? 0 : before - 3);
+            if(end == std::string::npos) {
+                at = len;
+                if(m_line.length() > MAX_HEAD) {
+                    m_status = 431;
+                    return false;
+                }
+                break;
+            }
+            at += end + 4 - before;
+            m_line.resize(end + 4);
+            if(!rewriteHead(out)) {
+                return false;
+            }
+            m_line.clear();
+            break;
+        }
+        case STATE_CHUNK_SIZE:
+        case STATE_TRAILER: {
+            const char *nl = (const char *) memchr(data + at, '\n', len - at);
+            size_t n = nl == NULL ? len - at : nl - (data + at) + 1;
+            m_line.append(data + at, n);
+            at += n;
+            if(nl == NULL) {
+                if(m_line.length() > MAX_LINE) {
+                    return false;
+                }
+                break;
+            }
+            if(!endLine(out)) {
+                return false;
+            }
+            m_line.clear();
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+bool ForwardedFor::rewriteHead(std::string& out) {
+    const char *head = m_line.c_str();
+    const char *lineEnd = strstr(head, "\r\n");
+    size_t requestLine = lineEnd - head + 2;
+    out.append(head, requestLine);
+    out.append(m_header);
+    // the relay frames requests itself, a connection it can not follow to the next head is refused
+    if(strncmp(head, "CONNECT ", 8) == 0) {
+        m_status = 501;
+        return false;
+    }
+    bool hasLength = false;
+    bool hasEncoding = false;
+    uint64_t length = 0;
+    size_t pos = requestLine;
+    // the head ends with an empty line, every line before it is a header
+    while(pos + 2 < m_line.length()) {
+        const char *line = head + pos;
+        const char *next = strstr(line, "\r\n");
+        size_t lineLen = next - line + 2;
+        pos += lineLen;
+        const char *colon = (const char *) memchr(line, ':', lineLen);
+        if(colon == NULL) {
+            return false;
+        }
+        size_t nameLen = colon - line;
+        // folded lines and blanks around a name hide headers from one parser but not the other
+        if(nameLen == 0 || memchr(line, ' ', nameLen) != NULL || memchr(line, '\t', nameLen) != NULL) {
+            return false;
+        }
+        if(headerIs(line, nameLen, "X-Forwarded-For") || headerIs(line, nameLen, "X-Real-IP") || headerIs(line, nameLen, RELAY_SECRET_HEADER)) {
+            continue;
+        }
+        // one framing only, a second Content-Length or one next to Transfer-Encoding is how requests get smuggled
+        if(headerIs(line, nameLen, "Content-Length")) {
+            std::string value = headerValue(line, lineLen, nameLen);
+            if(hasLength || value.empty() || value.length() > 18 || value.find_first_not_of("0123456789") != std::string::npos) {
+                return false;
+            }
+            hasLength = true;
+            length = strtoull(value.c_str(), NULL, 10);
+        } else if(headerIs(line, nameLen, "Transfer-Encoding")) {
+            if(hasEncoding || strcasecmp(headerValue(line, lineLen, nameLen).c_str(), "chunked") != 0) {
+                return false;
+            }
+            hasEncoding = true;
+        } else if(headerIs(line, nameLen, "Upgrade")) {
+            m_status = 501;
+            return false;
+        }
+        out.append(line, lineLen);
+    }
+    if(hasLength && hasEncoding) {
+        return false;
+    }
+    out.append("\r\n");
+    if(hasEncoding) {
+        m_state = STATE_CHUNK_SIZE;
+    } else if(length > 0) {
+        m_state = STATE_BODY;
+        m_remaining = length;
+    } else {
+        m_state = STATE_HEAD;
+    }
+    return true;
+}
+
+bool ForwardedFor::endLine(std::string& out) {
+    out.append(m_line);
+    if(m_state == STATE_TRAILER) {
+        if(m_line == "\r\n" || m_line == "\n") {
+            m_state = STATE_HEAD;
+        }
+        return true;
+    }
+    char *end = NULL;
+    uint64_t size = strtoull(m_line.c_str(), &end, 16);
+    // digits only, and few enough not to wrap
+    if(!isxdigit((unsigned char) m_line[0]) || end - m_line.c_str() > 15) {
+        return false;
+    }
+    if(size == 0) {
+        m_state = STATE_TRAILER;
+    } else {
+        // the chunk and its line end
+        m_state = STATE_CHUNK_DATA;
+        m_remaining = size + 2;
+    }
+    return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <string>
+
+namespace archer
+{
+namespace server
+{
+
+// carries the secret of the relay to the loopback manager, requests without it did not come through TLS
+#define RELAY_SECRET_HEADER "X-Aproxy-Relay"
+
+/**
+ * Request side of one TLS client of a http listener, on its way from the TLS
+ * front to the loopback http manager. The manager only ever sees 127.0.0.1,
+ * so every request head gets the real client address as X-Forwarded-For and
+ * the relay secret of the listener, whatever X-Forwarded-For, X-Real-IP or
+ * secret the client sent is dropped, the ip keys of balancers and rate
+ * limiters read those. Bodies are framed by
+ * Content-Length or chunked encoding and passed through untouched. Requests
+ * the relay could not frame the way the manager does are refused: a second
+ * Content-Length, Content-Length next to Transfer-Encoding, any coding but
+ * chunked, and CONNECT or Upgrade, whose bytes would no longer be requests.
+*/
+class ForwardedFor
+{
+public:
+
+    ForwardedFor(std::string const& address, std::string const& secret)
+        : m_header("X-Forwarded-For: " + address + "\r\n" RELAY_SECRET_HEADER ": " + secret + "\r\n") {}
+
+    ForwardedFor(const ForwardedFor&) = delete;
+    ForwardedFor& operator=(const ForwardedFor&) = delete;
+
+    // appends the rewritten bytes of data to out, false when the stream can not be framed as http/1 requests
+    bool feed(const char *data, size_t len, std::string& out);
+
+    // the response status for the client once feed() failed
+    int status() const {return m_status;}
+
+private:
+
+    enum State { STATE_HEAD, STATE_BODY, STATE_CHUNK_SIZE, STATE_CHUNK_DATA, STATE_TRAILER };
+
+    // the complete head in m_line, rewritten to out, picks the state of what follows it
+    bool rewriteHead(std::string& out);
+
+    // one chunk size or trailer line in m_line
+    bool endLine(std::string& out);
+
+    State                        m_state = STATE_HEAD;
+    std::string                  m_header;
+    // head or line collected so far
+    std::string                  m_line;
+    uint64_t                     m_remaining = 0;
+    int                          m_status = 400;
+};
+}
+}
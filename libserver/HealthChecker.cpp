@@ -0,0 +1,302 @@
+#include "HealthChecker.h"
+
+#include <errno.h>
+#include <string.h>
+#include <netdb.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+using namespace archer::server;
+
+// resolved names are looked up again this often, the old addresses stay in use meanwhile
+static const int64_t RESOLVE_EVERY_NANOS = 60 * 1000000000LL;
+
+enum ProbeState { PROBE_CONNECT, PROBE_SEND, PROBE_RECV, PROBE_DONE };
+
+typedef struct {
+    int          fd;
+    ProbeState   state;
+    std::string  request;
+    size_t       off;
+    // "HTTP/1.1 200" is all we need
+    char         status[12];
+    size_t       got;
+    bool         ok;
+} Probe;
+
+inline static int remainingMs(int64_t deadline) {
+    int64_t left = (deadline - archer::common::steadyNanos()) / 1000000;
+    return left > 0 ? (int) left : 0;
+}
+
+// every address of host, numericOnly never blocks, empty when there is none
+static void resolve(std::string const& host, bool numericOnly, ResolvedHost& resolved) {
+    resolved.addrs.clear();
+    resolved.lengths.clear();
+    struct addrinfo hints, *addrs = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = numericOnly ? AI_NUMERICHOST : 0;
+    if(getaddrinfo(host.c_str(), NULL, &hints, &addrs) != 0) {
+        return ;
+    }
+    for(struct addrinfo *ai = addrs; ai != NULL; ai = ai->ai_next) {
+        struct sockaddr_storage addr;
+        memset(&addr, 0, sizeof(addr));
+        memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+        resolved.addrs.push_back(addr);
+        resolved.lengths.push_back(ai->ai_addrlen);
+    }
+    freeaddrinfo(addrs);
+}
+
+// a non blocking connect to the first address that takes one, -1 when none does
+static int startConnect(ResolvedHost const& resolved, int port, bool& connected) {
+    for(size_t i = 0; i < resolved.addrs.size(); i++) {
+        struct sockaddr_storage addr = resolved.addrs[i];
+        if(addr.ss_family == AF_INET) {
+            ((struct sockaddr_in *) &addr)->sin_port = htons(port);
+        } else if(addr.ss_family == AF_INET6) {
+            ((struct sockaddr_in6 *) &addr)->sin6_port = htons(port);
+        }
+        int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(fd < 0) {
+            continue;
+        }
+        if(connect(fd, (struct sockaddr *) &addr, resolved.lengths[i]) == 0) {
+            connected = true;
+            return fd;
+        }
+        if(errno == EINPROGRESS) {
+            connected = false;
+            return fd;
+        }
+        ::close(fd);
+    }
+    return -1;
+}
+
+void HealthChecker::start() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_running) {
+        return ;
+    }
+    m_running = true;
+    m_thread = std::thread(&HealthChecker::probeLoop, this);
+    m_resolver = std::thread(&HealthChecker::resolveLoop, this);
+}
+
+void HealthChecker::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+        m_cv.notify_all();
+    }
+    if(m_thread.joinable()) {
+        m_thread.join();
+    }
+    if(m_resolver.joinable()) {
+        m_resolver.join();
+    }
+}
+
+void HealthChecker::probeLoop() {
+    std::vector<int> results;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait_for(lock, std::chrono::milliseconds(m_config.intervalMs), [this]() { return !m_running; });
+            if(!m_running) {
+                return ;
+            }
+        }
+        bool changed = false;
+        PeerList peers = m_upstream.peers();
+        probeAll(peers, results);
+        for(int i = 0; i < peers.size(); i++) {
+            if(results[i] < 0) {
+                continue;
+            }
+            bool ok = results[i] > 0;
+            if(peers[i]->onProbe(ok, m_config.healthyThreshold, m_config.unhealthyThreshold)) {
+                LOG_warn("Health check peer %s:%d is now %s", peers[i]->host().c_str(), peers[i]->port(), ok ? "HEALTHY" : "UNHEALTHY");
+                changed = true;
+            }
+        }
+        if(changed) {
+            m_upstream.refresh();
+        }
+    }
+}
+
+bool HealthChecker::addressesOf(std::string const& host, ResolvedHost& resolved) {
+    int64_t now = archer::common::steadyNanos();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_resolved.find(host);
+        if(it != m_resolved.end()) {
+            if(now - it->second.resolvedAt > RESOLVE_EVERY_NANOS && m_pending.insert(host).second) {
+                m_cv.notify_all();
+            }
+            resolved = it->second;
+            return true;
+        }
+    }
+    // literal addresses need no lookup
+    resolve(host, true, resolved);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(!resolved.addrs.empty()) {
+        // never looked up again, a literal does not change
+        resolved.resolvedAt = INT64_MAX / 2;
+        m_resolved[host] = resolved;
+        return true;
+    }
+    if(m_pending.insert(host).second) {
+        m_cv.notify_all();
+    }
+    return false;
+}
+
+void HealthChecker::resolveLoop() {
+    while(true) {
+        std::string host;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return !m_running || !m_pending.empty(); });
+            if(!m_running) {
+                return ;
+            }
+            host = *m_pending.begin();
+        }
+        ResolvedHost resolved;
+        resolve(host, false, resolved);
+        resolved.resolvedAt = archer::common::steadyNanos();
+        if(resolved.addrs.empty()) {
+            LOG_warn("Health check can not resolve %s", host.c_str());
+        }
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.erase(host);
+        auto it = m_resolved.find(host);
+        // a failed refresh keeps the addresses that worked
+        if(it == m_resolved.end() || !resolved.addrs.empty()) {
+            m_resolved[host] = resolved;
+        } else {
+            it->second.resolvedAt = resolved.resolvedAt;
+        }
+    }
+}
+
+void HealthChecker::probeAll(PeerList const& peers, std::vector<int>& results) {
+    int64_t deadline = archer::common::steadyNanos() + (int64_t) m_config.timeoutMs * 1000000;
+    results.assign(peers.size(), -1);
+    std::vector<Probe> probes(peers.size());
+    size_t active = 0;
+    ResolvedHost resolved;
+    for(size_t i = 0; i < peers.size(); i++) {
+        Probe& probe = probes[i];
+        probe.fd = -1;
+        probe.state = PROBE_DONE;
+        probe.ok = false;
+        if(!addressesOf(peers[i]->host(), resolved)) {
+            continue;
+        }
+        bool connected = false;
+        probe.fd = startConnect(resolved, peers[i]->port(), connected);
+        if(probe.fd < 0) {
+            LOG_debug("Health check connect %s:%d failed", peers[i]->host().c_str(), peers[i]->port());
+            results[i] = 0;
+            continue;
+        }
+        // a plaintext probe means nothing to a https backend, it has to accept the connection
+        if(!m_config.connectOnly && !peers[i]->ssl()) {
+            probe.request = "GET " + m_config.path + " HTTP/1.1\r\nHost: " + peers[i]->host() + "\r\nUser-Agent: archer-proxy\r\nConnection: close\r\n\r\n";
+        }
+        probe.off = 0;
+        probe.got = 0;
+        probe.state = PROBE_CONNECT;
+        active++;
+    }
+
+    std::vector<struct pollfd> fds;
+    std::vector<size_t> owners;
+    while(active > 0) {
+        fds.clear();
+        owners.clear();
+        for(size_t i = 0; i < probes.size(); i++) {
+            if(probes[i].state == PROBE_DONE) {
+                continue;
+            }
+            struct pollfd pfd;
+            pfd.fd = probes[i].fd;
+            pfd.events = probes[i].state == PROBE_RECV ? POLLIN : POLLOUT;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            owners.push_back(i);
+        }
+        int ready = poll(fds.data(), fds.size(), remainingMs(deadline));
+        if(ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ready <= 0) {
+            break;
+        }
+        for(size_t k = 0; k < fds.size(); k++) {
+            if(fds[k].revents == 0) {
+                continue;
+            }
+            Probe& probe = probes[owners[k]];
+            if(probe.state == PROBE_CONNECT) {
+                int err = 0;
+                socklen_t errLen = sizeof(err);
+                if(getsockopt(probe.fd, SOL_SOCKET, SO_ERROR, &err, &errLen) != 0 || err != 0) {
+                    probe.state = PROBE_DONE;
+                } else if(probe.request.empty()) {
+                    probe.ok = true;
+                    probe.state = PROBE_DONE;
+                } else {
+                    probe.state = PROBE_SEND;
+                }
+            }
+            if(probe.state == PROBE_SEND) {
+                ssize_t n = send(probe.fd, probe.request.c_str() + probe.off, probe.request.length() - probe.off, MSG_NOSIGNAL);
+                if(n > 0) {
+                    probe.off += n;
+                    if(probe.off == probe.request.length()) {
+                        probe.state = PROBE_RECV;
+                    }
+                } else if(n < 0 && errno != EAGAIN) {
+                    probe.state = PROBE_DONE;
+                }
+            } else if(probe.state == PROBE_RECV) {
+                ssize_t n = recv(probe.fd, probe.status + probe.got, sizeof(probe.status) - probe.got, 0);
+                if(n > 0) {
+                    probe.got += n;
+                } else if(n == 0 || errno != EAGAIN) {
+                    probe.state = PROBE_DONE;
+                }
+                if(probe.got == sizeof(probe.status)) {
+                    probe.ok = memcmp(probe.status, "HTTP/1.", 7) == 0 && (probe.status[9] == '2' || probe.status[9] == '3');
+                    probe.state = PROBE_DONE;
+                }
+            }
+            if(probe.state == PROBE_DONE) {
+                active--;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < probes.size(); i++) {
+        if(probes[i].fd < 0) {
+            continue;
+        }
+        ::close(probes[i].fd);
+        results[i] = probes[i].ok ? 1 : 0;
+        if(!probes[i].ok) {
+            LOG_debug("Health check %s:%d%s failed", peers[i]->host().c_str(), peers[i]->port(), m_config.path.c_str());
+        }
+    }
+}
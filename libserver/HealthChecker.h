@@ -0,0 +1,92 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+#include <sys/socket.h>
+
+#include "Upstream.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    std::string path;
+    int         intervalMs;
+    int         timeoutMs;
+    int         healthyThreshold;
+    int         unhealthyThreshold;
+    // tcp mode backends only have to accept the connection
+    bool        connectOnly;
+} HealthCheckConfig;
+
+typedef struct {
+    std::vector<sockaddr_storage> addrs;
+    std::vector<socklen_t>        lengths;
+    int64_t                       resolvedAt;
+} ResolvedHost;
+
+/**
+ * Background prober of one proxy. Every interval each backend gets a plain
+ * HTTP/1.1 GET of the probe path, 2xx and 3xx count as success, tcp mode
+ * and https backends only get a connect. A peer flips state after the configured number
+ * of consecutive results, and the upstream peer set is republished so
+ * unhealthy peers leave the rotation without a delPeer.
+ *
+ * All backends of a round are probed at once on non blocking sockets polled
+ * together, a round takes at most one timeout however many peers are down.
+ * Host names are resolved on a thread of their own and refreshed in the
+ * background, a backend whose name was never resolved yet sits out its rounds.
+*/
+class HealthChecker
+{
+public:
+
+    HealthChecker(Upstream& upstream, HealthCheckConfig const& config) : m_upstream(upstream), m_config(config) {}
+    ~HealthChecker() {
+        stop();
+    }
+
+    HealthChecker(const HealthChecker&) = delete;
+    HealthChecker& operator=(const HealthChecker&) = delete;
+
+    void start();
+
+    void stop();
+
+    HealthCheckConfig const& config() {return m_config;}
+
+private:
+
+    void probeLoop();
+
+    // one round over peers, results[i] is 1 for a success, 0 for a failure and -1 for no probe
+    void probeAll(PeerList const& peers, std::vector<int>& results);
+
+    // addresses of host, false while it waits for the resolver
+    bool addressesOf(std::string const& host, ResolvedHost& resolved);
+
+    void resolveLoop();
+
+    Upstream&                    m_upstream;
+    HealthCheckConfig            m_config;
+    bool                         m_running = false;
+    std::mutex                   m_mutex;
+    // wakes the probe loop and the resolver
+    std::condition_variable      m_cv;
+    std::thread                  m_thread;
+    std::thread                  m_resolver;
+    std::unordered_map<std::string, ResolvedHost> m_resolved;
+    std::unordered_set<std::string> m_pending;
+};
+}
+}
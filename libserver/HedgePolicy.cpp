@@ -0,0 +1,138 @@
+#include "HedgePolicy.h"
+
+using namespace archer::server;
+
+static const int64_t MIN_HEDGE_DELAY_NANOS = 1000LL * 1000;
+
+int HedgePolicy::bucketOf(uint64_t micros) {
+    if(micros < 4) {
+        return (int) micros;
+    }
+    int exp = 63 - __builtin_clzll(micros);
+    int bucket = exp * 4 + (int) ((micros >> (exp - 2)) & 3);
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+uint64_t HedgePolicy::bucketLimit(int bucket) {
+    if(bucket < 4) {
+        return bucket;
+    }
+    int exp = bucket / 4;
+    return (uint64_t) (4 + bucket % 4 + 1) << (exp - 2);
+}
+
+void HedgePolicy::record(int64_t latencyNanos) {
+    uint64_t micros = latencyNanos > 0 ? latencyNanos / 1000 : 0;
+    m_buckets[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+    uint32_t samples = m_samples.fetch_add(1, std::memory_order_relaxed) + 1;
+    if(samples >= DECAY_SAMPLES) {
+        // old traffic fades out, a racing recorder may lose a sample
+        m_samples.store(DECAY_SAMPLES / 2, std::memory_order_relaxed);
+        for(int i = 0; i < BUCKETS; i++) {
+            m_buckets[i].store(m_buckets[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+        }
+    }
+    if(samples % 64 == 0) {
+        recompute();
+    }
+}
+
+void HedgePolicy::recompute() {
+    uint64_t counts[BUCKETS];
+    uint64_t total = 0;
+    for(int i = 0; i < BUCKETS; i++) {
+        counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if(total < MIN_SAMPLES) {
+        return ;
+    }
+    uint64_t target = total - total / 20;
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if(seen >= target) {
+            m_p95Nanos.store((int64_t) bucketLimit(i) * 1000, std::memory_order_relaxed);
+            return ;
+        }
+    }
+}
+
+int64_t HedgePolicy::delayNanos() const {
+    int64_t delay = m_config.delayMs > 0 ? m_config.delayMs * 1000000LL : m_p95Nanos.load(std::memory_order_relaxed);
+    if(delay <= 0) {
+        return 0;
+    }
+    return delay < MIN_HEDGE_DELAY_NANOS ? MIN_HEDGE_DELAY_NANOS : delay;
+}
+
+bool HedgePolicy::acquire() {
+    if(!m_budget.acquire()) {
+        return false;
+    }
+    m_hedged.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+HedgeStats HedgePolicy::stats() {
+    return HedgeStats{m_hedged.load(), m_won.load(), m_budget.exhausted(), delayNanos()};
+}
+
+bool HedgeRace::launch(std::shared_ptr<Exchange> const& hedge) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_winner.load(std::memory_order_relaxed) != NULL || m_alive == 0) {
+        return false;
+    }
+    m_hedge = hedge;
+    m_alive++;
+    return true;
+}
+
+RaceResult HedgeRace::claim(Exchange *self, std::shared_ptr<Exchange>& loser) {
+    Exchange *winner = m_winner.load(std::memory_order_acquire);
+    if(winner != NULL) {
+        return winner == self ? RACE_OWN : RACE_LOST;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    winner = m_winner.load(std::memory_order_relaxed);
+    if(winner != NULL) {
+        return winner == self ? RACE_OWN : RACE_LOST;
+    }
+    m_winner.store(self, std::memory_order_release);
+    loser = other(self);
+    return RACE_WON;
+}
+
+RaceResult HedgeRace::fail(Exchange *self, std::shared_ptr<Exchange>& survivor) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Exchange *winner = m_winner.load(std::memory_order_relaxed);
+    if(winner != NULL) {
+        return winner == self ? RACE_LAST : RACE_LOST;
+    }
+    // a failed copy must not be cancelled again when the survivor wins
+    if(m_primary.lock().get() == self) {
+        m_primary.reset();
+    } else {
+        m_hedge.reset();
+    }
+    if(--m_alive > 0) {
+        survivor = other(self);
+        if(survivor) {
+            return RACE_SURVIVED;
+        }
+    }
+    m_alive = 0;
+    return RACE_LAST;
+}
+
+std::shared_ptr<Exchange> HedgeRace::other(Exchange *self) {
+    std::shared_ptr<Exchange> primary = m_primary.lock();
+    if(primary && primary.get() != self) {
+        return primary;
+    }
+    std::shared_ptr<Exchange> hedge = m_hedge.lock();
+    if(hedge && hedge.get() != self) {
+        return hedge;
+    }
+    return nullptr;
+}
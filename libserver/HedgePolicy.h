@@ -0,0 +1,147 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#include "TrafficBudget.h"
+
+namespace archer
+{
+namespace server
+{
+class Exchange;
+
+typedef struct {
+    // fixed hedge delay, 0 to follow the observed p95 latency of the location
+    int         delayMs;
+    // hedges allowed per hundred live requests
+    int         maxPercent;
+} HedgeConfig;
+
+typedef struct {
+    uint64_t hedged;
+    uint64_t won;
+    uint64_t budgetExhausted;
+    int64_t  delayNanos;
+} HedgeStats;
+
+/**
+ * Hedging policy of one location: when a GET has produced no response byte
+ * after the hedge delay a second copy goes to another peer. The delay follows
+ * the p95 of a decaying latency histogram unless it is configured, hedges are
+ * paid from a budget refilled by live requests.
+*/
+class HedgePolicy
+{
+// quarter powers of two of microseconds, up to about 35 minutes
+static const int BUCKETS = 128;
+// no adaptive hedging before the histogram holds this many samples
+static const uint32_t MIN_SAMPLES = 100;
+// counts are halved once this many samples accumulated
+static const uint32_t DECAY_SAMPLES = 4096;
+
+public:
+
+    explicit HedgePolicy(HedgeConfig const& config) : m_config(config), m_budget(config.maxPercent) {}
+    ~HedgePolicy() {}
+
+    HedgePolicy(const HedgePolicy&) = delete;
+    HedgePolicy& operator=(const HedgePolicy&) = delete;
+
+    HedgeConfig const& config() const {return m_config;}
+
+    // one live request, refills the budget
+    void onRequest() {
+        m_budget.onRequest();
+    }
+
+    // record the latency of one completed request
+    void record(int64_t latencyNanos);
+
+    // current hedge delay, 0 while the location has not seen enough traffic to tell
+    int64_t delayNanos() const;
+
+    // takes one hedge from the budget, false once it is exhausted
+    bool acquire();
+
+    void onWon() {
+        m_won.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    HedgeStats stats();
+
+private:
+
+    static int bucketOf(uint64_t micros);
+
+    static uint64_t bucketLimit(int bucket);
+
+    void recompute();
+
+    HedgeConfig                  m_config;
+    TrafficBudget                m_budget;
+    std::atomic<uint32_t>        m_buckets[BUCKETS] = {};
+    std::atomic<uint32_t>        m_samples{0};
+    std::atomic<int64_t>         m_p95Nanos{0};
+    std::atomic<uint64_t>        m_hedged{0};
+    std::atomic<uint64_t>        m_won{0};
+};
+
+typedef std::shared_ptr<HedgePolicy> HedgePolicyPtr;
+
+enum RaceResult {
+    RACE_LOST = 0,
+    RACE_OWN,
+    RACE_WON,
+    RACE_SURVIVED,
+    RACE_LAST
+};
+
+/**
+ * The primary exchange of a hedged request and its copy, racing for one client
+ * response. The first copy producing a response byte wins, the other one is
+ * cancelled. When one copy fails the other one carries on alone.
+*/
+class HedgeRace
+{
+public:
+
+    explicit HedgeRace(std::shared_ptr<Exchange> const& primary) : m_primary(primary) {}
+    ~HedgeRace() {}
+
+    HedgeRace(const HedgeRace&) = delete;
+    HedgeRace& operator=(const HedgeRace&) = delete;
+
+    // false when the race is already decided or the primary failed
+    bool launch(std::shared_ptr<Exchange> const& hedge);
+
+    // whether the race is still open for a hedge
+    bool open() const {
+        return m_winner.load(std::memory_order_acquire) == NULL;
+    }
+
+    // RACE_WON the first time, RACE_OWN afterwards, RACE_LOST for the other copy
+    RaceResult claim(Exchange *self, std::shared_ptr<Exchange>& loser);
+
+    // RACE_SURVIVED while the other copy is still running, RACE_LAST when self
+    // has to fail the request, RACE_LOST for a cancelled copy
+    RaceResult fail(Exchange *self, std::shared_ptr<Exchange>& survivor);
+
+private:
+
+    // with m_mutex held
+    std::shared_ptr<Exchange> other(Exchange *self);
+
+    std::mutex                   m_mutex;
+    std::atomic<Exchange *>      m_winner{NULL};
+    int                          m_alive = 1;
+    std::weak_ptr<Exchange>      m_primary;
+    std::weak_ptr<Exchange>      m_hedge;
+};
+
+typedef std::shared_ptr<HedgeRace> HedgeRacePtr;
+}
+}
@@ -0,0 +1,180 @@
+#include "HostRouter.h"
+
+#include <map>
+#include <queue>
+#include <memory>
+#include <string.h>
+
+using namespace archer::server;
+
+namespace
+{
+struct LabelNode {
+    int32_t                                             wildcard = -1;
+    std::map<std::string, std::unique_ptr<LabelNode>>   children;
+};
+}
+
+inline static uint64_t hashName(const char *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+inline static int compareLabel(const char *a, size_t aLen, const char *b, size_t bLen) {
+    int rc = memcmp(a, b, aLen < bLen ? aLen : bLen);
+    if(rc != 0) {
+        return rc;
+    }
+    return aLen < bLen ? -1 : (aLen > bLen ? 1 : 0);
+}
+
+HostRouter::HostRouter(std::vector<std::string> const& names, std::vector<int32_t> const& hosts) {
+    size_t exactCount = 0;
+    for(size_t i = 0; i < names.size(); i++) {
+        if(!isWildcard(names[i])) {
+            exactCount++;
+        }
+    }
+    size_t capacity = 8;
+    while(capacity < exactCount * 2) {
+        capacity <<= 1;
+    }
+    m_exact.resize(capacity, ExactEntry{"", -1});
+    m_exactMask = capacity - 1;
+
+    LabelNode root;
+    for(size_t i = 0; i < names.size(); i++) {
+        std::string const& name = names[i];
+        if(!isWildcard(name)) {
+            size_t slot = hashName(name.data(), name.length()) & m_exactMask;
+            while(m_exact[slot].host >= 0 && m_exact[slot].name != name) {
+                slot = (slot + 1) & m_exactMask;
+            }
+            if(m_exact[slot].host < 0) {
+                m_exact[slot].name = name;
+                m_exact[slot].host = hosts[i];
+            }
+            continue;
+        }
+        // "*.eu.example.com" is stored as com -> example -> eu
+        LabelNode *cur = &root;
+        size_t end = name.length();
+        while(end > 2) {
+            size_t start = name.rfind('.', end - 1);
+            std::unique_ptr<LabelNode>& next = cur->children[name.substr(start + 1, end - start - 1)];
+            if(!next) {
+                next.reset(new LabelNode());
+            }
+            cur = next.get();
+            end = start;
+        }
+        if(cur->wildcard < 0) {
+            cur->wildcard = hosts[i];
+        }
+    }
+
+    std::queue<std::pair<const LabelNode *, uint32_t>> pending;
+    m_nodes.push_back(Node{0, 0, 0, 0, -1});
+    pending.push(std::make_pair(&root, 0));
+    while(!pending.empty()) {
+        const LabelNode *label = pending.front().first;
+        uint32_t idx = pending.front().second;
+        pending.pop();
+
+        m_nodes[idx].firstChild = (uint32_t) m_nodes.size();
+        m_nodes[idx].childCount = (uint32_t) label->children.size();
+        for(auto it = label->children.begin(); it != label->children.end(); it++) {
+            pending.push(std::make_pair(it->second.get(), (uint32_t) m_nodes.size()));
+            m_nodes.push_back(Node{(uint32_t) m_labels.length(), (uint32_t) it->first.length(), 0, 0, it->second->wildcard});
+            m_labels.append(it->first);
+        }
+    }
+}
+
+int32_t HostRouter::match(const char *host) const {
+    if(host == NULL) {
+        return -1;
+    }
+    char name[MAX_HOST_LEN + 1];
+    size_t len = 0;
+    for(; host[len] != '\0' && host[len] != ':'; len++) {
+        if(len == MAX_HOST_LEN) {
+            return -1;
+        }
+        char c = host[len];
+        name[len] = (c >= 'A' && c <= 'Z') ? (char) (c + 32) : c;
+    }
+    // "example.com." names the same host as "example.com"
+    if(len > 0 && name[len - 1] == '.') {
+        len--;
+    }
+    if(len == 0) {
+        return -1;
+    }
+    int32_t found = matchExact(name, len);
+    if(found >= 0) {
+        return found;
+    }
+    return matchWildcard(name, len);
+}
+
+int32_t HostRouter::matchExact(const char *name, size_t len) const {
+    size_t slot = hashName(name, len) & m_exactMask;
+    while(m_exact[slot].host >= 0) {
+        ExactEntry const& entry = m_exact[slot];
+        if(entry.name.length() == len && memcmp(entry.name.data(), name, len) == 0) {
+            return entry.host;
+        }
+        slot = (slot + 1) & m_exactMask;
+    }
+    return -1;
+}
+
+int32_t HostRouter::matchWildcard(const char *name, size_t len) const {
+    const char *labels = m_labels.data();
+    int32_t best = -1;
+    uint32_t idx = 0;
+    size_t end = len;
+    while(m_nodes[idx].childCount > 0) {
+        size_t start = end;
+        while(start > 0 && name[start - 1] != '.') {
+            --start;
+        }
+        const char *label = name + start;
+        size_t labelLen = end - start;
+
+        // siblings are sorted like std::string, binary search them
+        uint32_t lo = m_nodes[idx].firstChild, hi = lo + m_nodes[idx].childCount;
+        int32_t child = -1;
+        while(lo < hi) {
+            uint32_t mid = (lo + hi) >> 1;
+            int rc = compareLabel(labels + m_nodes[mid].labelOff, m_nodes[mid].labelLen, label, labelLen);
+            if(rc == 0) {
+                child = (int32_t) mid;
+                break;
+            }
+            if(rc < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if(child < 0) {
+            break;
+        }
+        idx = (uint32_t) child;
+        // a wildcard needs at least one more label in front of it
+        if(start == 0) {
+            break;
+        }
+        if(m_nodes[idx].wildcard >= 0) {
+            best = m_nodes[idx].wildcard;
+        }
+        end = start - 1;
+    }
+    return best;
+}
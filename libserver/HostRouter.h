@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace archer
+{
+namespace server
+{
+
+/**
+ * Immutable server name table of one listener, compiled whenever a virtual host
+ * is added or removed.
+ *
+ * Exact names live in an open addressing hash table, wildcard names like
+ * "*.example.com" in a trie over the reversed labels (com -> example) where the
+ * deepest wildcard still followed by at least one label wins. Lookups lower case
+ * the Host header into a stack buffer, drop the port and never allocate.
+*/
+class HostRouter
+{
+typedef struct {
+    std::string name;
+    int32_t     host;
+} ExactEntry;
+
+typedef struct {
+    uint32_t labelOff;
+    uint32_t labelLen;
+    uint32_t firstChild;
+    uint32_t childCount;
+    int32_t  wildcard;
+} Node;
+
+public:
+
+    static const size_t MAX_HOST_LEN = 255;
+
+    // names[i] is served by virtual host hosts[i]
+    HostRouter(std::vector<std::string> const& names, std::vector<int32_t> const& hosts);
+    ~HostRouter() {}
+
+    HostRouter(const HostRouter&) = delete;
+    HostRouter& operator=(const HostRouter&) = delete;
+
+    // index of the virtual host serving the Host header value, -1 when none
+    int32_t match(const char *host) const;
+
+    static bool isWildcard(std::string const& name) {
+        return name.length() > 2 && name[0] == '*' && name[1] == '.';
+    }
+
+private:
+
+    int32_t matchExact(const char *name, size_t len) const;
+
+    int32_t matchWildcard(const char *name, size_t len) const;
+
+    std::vector<ExactEntry>      m_exact;
+    size_t                       m_exactMask = 0;
+    std::vector<Node>            m_nodes;
+    std::string                  m_labels;
+};
+}
+}
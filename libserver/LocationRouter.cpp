@@ -0,0 +1,109 @@
+#include "LocationRouter.h"
+
+#include <map>
+#include <queue>
+#include <algorithm>
+#include <string.h>
+
+using namespace archer::server;
+
+namespace
+{
+struct TrieNode {
+    int32_t                                               rank = -1;
+    std::map<unsigned char, std::unique_ptr<TrieNode>>    children;
+};
+}
+
+LocationRouter::LocationRouter(std::vector<Location> const& locations) : m_locations(locations) {
+    TrieNode root;
+    for(size_t i = 0; i < m_locations.size(); i++) {
+        TrieNode *cur = &root;
+        std::string const& src = m_locations[i].src;
+        for(size_t j = 0; j < src.length(); j++) {
+            std::unique_ptr<TrieNode>& next = cur->children[(unsigned char) src[j]];
+            if(!next) {
+                next.reset(new TrieNode());
+            }
+            cur = next.get();
+        }
+        if(cur->rank < 0) {
+            cur->rank = (int32_t) i;
+        }
+    }
+
+    // breadth first flatten, chains of single child nodes without a location are merged into one edge label
+    std::queue<std::pair<const TrieNode *, uint32_t>> pending;
+    m_nodes.push_back(Node{0, 0, 0, 0, root.rank});
+    m_edges.push_back(0);
+    pending.push(std::make_pair(&root, 0));
+    while(!pending.empty()) {
+        const TrieNode *trie = pending.front().first;
+        uint32_t idx = pending.front().second;
+        pending.pop();
+
+        m_nodes[idx].firstChild = (uint32_t) m_nodes.size();
+        m_nodes[idx].childCount = (uint32_t) trie->children.size();
+        for(auto it = trie->children.begin(); it != trie->children.end(); it++) {
+            Node node{(uint32_t) m_labels.length(), 1, 0, 0, -1};
+            m_labels.push_back((char) it->first);
+            const TrieNode *tail = it->second.get();
+            while(tail->rank < 0 && tail->children.size() == 1) {
+                m_labels.push_back((char) tail->children.begin()->first);
+                node.labelLen++;
+                tail = tail->children.begin()->second.get();
+            }
+            node.rank = tail->rank;
+            pending.push(std::make_pair(tail, (uint32_t) m_nodes.size()));
+            m_nodes.push_back(node);
+            m_edges.push_back(it->first);
+        }
+    }
+}
+
+int32_t LocationRouter::findChild(Node const& node, unsigned char c) const {
+    const unsigned char *begin = m_edges.data() + node.firstChild;
+    const unsigned char *end = begin + node.childCount;
+    if(node.childCount <= 8) {
+        for(const unsigned char *it = begin; it < end; it++) {
+            if(*it == c) {
+                return (int32_t) (it - m_edges.data());
+            }
+        }
+        return -1;
+    }
+    const unsigned char *it = std::lower_bound(begin, end, c);
+    if(it == end || *it != c) {
+        return -1;
+    }
+    return (int32_t) (it - m_edges.data());
+}
+
+const Location* LocationRouter::match(const char *uri, size_t uriLen) const {
+    if(m_locations.empty()) {
+        return NULL;
+    }
+    const char *labels = m_labels.data();
+    int32_t best = m_nodes[0].rank;
+    size_t pos = 0;
+    uint32_t idx = 0;
+    while(pos < uriLen && m_nodes[idx].childCount > 0) {
+        int32_t child = findChild(m_nodes[idx], (unsigned char) uri[pos]);
+        if(child < 0) {
+            break ;
+        }
+        Node const& node = m_nodes[child];
+        if(uriLen - pos < node.labelLen || memcmp(labels + node.labelOff, uri + pos, node.labelLen) != 0) {
+            break ;
+        }
+        pos += node.labelLen;
+        if(node.rank >= 0 && (best < 0 || node.rank < best)) {
+            best = node.rank;
+        }
+        idx = (uint32_t) child;
+    }
+    if(best < 0) {
+        return NULL;
+    }
+    return &m_locations[best];
+}
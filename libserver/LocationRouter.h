@@ -0,0 +1,100 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+namespace archer
+{
+namespace common
+{
+struct LogControl;
+}
+namespace server
+{
+class ResponseCache;
+class Compressor;
+class RetryPolicy;
+class HedgePolicy;
+class RateLimiter;
+class ConcurrencyLimiter;
+class StaticFiles;
+class MetricSeries;
+
+typedef struct {
+    int         order;
+    std::string src;
+    std::string dst;
+    // optional, responses under this location are cached when set
+    std::shared_ptr<ResponseCache> cache;
+    // identical concurrent GETs share one upstream request
+    bool        coalesce;
+    // optional, compresses responses for clients that accept it
+    std::shared_ptr<Compressor> compressor;
+    // optional, failed requests are sent again to another peer within a budget
+    std::shared_ptr<RetryPolicy> retry;
+    // optional, slow GETs race a second copy on another peer
+    std::shared_ptr<HedgePolicy> hedge;
+    // optional, requests over the rate are answered 429 here
+    std::shared_ptr<RateLimiter> limiter;
+    // optional, adaptive limit on the requests in flight upstream, on top of the proxy one
+    std::shared_ptr<ConcurrencyLimiter> concurrency;
+    // set for "type": "static", files under a root directory are served in place of a backend
+    std::shared_ptr<StaticFiles> statics;
+    // set by the virtual host the location is added to
+    std::shared_ptr<MetricSeries> metrics;
+    uint32_t    accessId;
+    // runtime log level of the requests under this location
+    std::shared_ptr<common::LogControl> log;
+} Location;
+
+/**
+ * Immutable radix tree compiled from the location list of a proxy.
+ *
+ * Locations are expected sorted by order, the index in that list is the match rank,
+ * so among all src prefixes of an uri the one with the smallest rank wins, exactly like
+ * the old linear scan. Nodes are flattened into one array with siblings stored
+ * contiguously, a lookup walks the uri bytes once and never allocates.
+*/
+class LocationRouter
+{
+typedef struct {
+    uint32_t labelOff;
+    uint32_t labelLen;
+    uint32_t firstChild;
+    uint32_t childCount;
+    int32_t  rank;
+} Node;
+
+public:
+
+    explicit LocationRouter(std::vector<Location> const& locations);
+    ~LocationRouter() {}
+
+    LocationRouter(const LocationRouter&) = delete;
+    LocationRouter& operator=(const LocationRouter&) = delete;
+
+    const Location* match(const char *uri, size_t uriLen) const;
+
+    std::vector<Location> const& locations() const {
+        return m_locations;
+    }
+
+    size_t size() const {
+        return m_locations.size();
+    }
+
+private:
+
+    int32_t findChild(Node const& node, unsigned char c) const;
+
+    std::vector<Location>        m_locations;
+    std::vector<Node>            m_nodes;
+    std::vector<unsigned char>   m_edges;
+    std::string                  m_labels;
+};
+
+typedef std::shared_ptr<const LocationRouter> LocationRouterPtr;
+}
+}
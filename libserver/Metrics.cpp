@@ -0,0 +1,252 @@
+#include "Metrics.h"
+
+#include <algorithm>
+
+using namespace archer::server;
+
+static const char *KIND_PREFIX[] = {"aproxy_proxy_", "aproxy_location_", "aproxy_backend_"};
+static const char *KIND_LABEL[] = {"", "location", "backend"};
+static const double BUCKET_SECONDS[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+inline static void escapeLabel(std::string const& value, std::string& out) {
+    for(size_t i = 0; i < value.length(); i++) {
+        char c = value[i];
+        if(c == '\\' || c == '"') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if(c == '\n') {
+            out.append("\\n");
+        } else {
+            out.push_back(c);
+        }
+    }
+}
+
+inline static void appendNumber(std::string& out, double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", value);
+    out.append(buf);
+}
+
+// one exposition line, extra is an additional label already formatted as name="value"
+static void appendSample(std::string& out, const char *prefix, const char *name, std::string const& labels, const char *extra, double value) {
+    out.append(prefix).append(name).push_back('{');
+    out.append(labels);
+    if(extra != NULL) {
+        out.push_back(',');
+        out.append(extra);
+    }
+    out.append("} ");
+    appendNumber(out, value);
+    out.push_back('\n');
+}
+
+static void appendHistogram(std::string& out, const char *prefix, const char *name, std::string const& labels,
+                            uint64_t const *buckets, uint64_t sumUs, uint64_t count) {
+    std::string bucketName = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    int idx = 0;
+    char le[32];
+    for(size_t i = 0; i < sizeof(BUCKET_SECONDS) / sizeof(BUCKET_SECONDS[0]); i++) {
+        uint64_t boundUs = (uint64_t) (BUCKET_SECONDS[i] * 1000000);
+        for(; idx < LatencyBuckets::COUNT && LatencyBuckets::upperBound(idx) <= boundUs; idx++) {
+            cumulative += buckets[idx];
+        }
+        snprintf(le, sizeof(le), "le=\"%g\"", BUCKET_SECONDS[i]);
+        appendSample(out, prefix, bucketName.c_str(), labels, le, (double) cumulative);
+    }
+    appendSample(out, prefix, bucketName.c_str(), labels, "le=\"+Inf\"", (double) count);
+    appendSample(out, prefix, (std::string(name) + "_sum").c_str(), labels, NULL, sumUs / 1e6);
+    appendSample(out, prefix, (std::string(name) + "_count").c_str(), labels, NULL, (double) count);
+}
+
+inline static void appendHeader(std::string& out, const char *prefix, const char *name, const char *type, const char *help) {
+    out.append("# HELP ").append(prefix).append(name).append(" ").append(help).push_back('\n');
+    out.append("# TYPE ").append(prefix).append(name).append(" ").append(type).push_back('\n');
+}
+
+MetricSeries::~MetricSeries() {
+    if(m_id >= 0) {
+        Metrics::instance().release(m_id);
+    }
+}
+
+MetricSeriesPtr Metrics::series(SeriesKind kind, std::string const& proxy, std::string const& label) {
+    std::string key = keyOf(kind, proxy, label);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_ids.find(key);
+    if(it != m_ids.end()) {
+        int id = it->second;
+        if(m_series[id].refs++ == 0) {
+            m_free.erase(std::find(m_free.begin(), m_free.end(), id));
+        }
+        return std::make_shared<MetricSeries>(id);
+    }
+    int id;
+    if(m_series.size() < MAX_SERIES) {
+        id = (int) m_series.size();
+        m_series.push_back(SeriesInfo{kind, proxy, label, 1});
+    } else if(!m_free.empty()) {
+        id = m_free.front();
+        m_free.pop_front();
+        SeriesInfo& info = m_series[id];
+        m_ids.erase(keyOf(info.kind, info.proxy, info.label));
+        info = SeriesInfo{kind, proxy, label, 1};
+        // no handle is left, so no thread records into the cells while they are cleared
+        for(size_t s = 0; s < m_shards.size(); s++) {
+            Cell *cell = m_shards[s]->cells[id].load(std::memory_order_acquire);
+            if(cell != NULL) {
+                clear(cell);
+            }
+        }
+    } else {
+        LOG_warn("Metrics series limit %d reached, %s %s is not recorded", MAX_SERIES, proxy.c_str(), label.c_str());
+        return nullptr;
+    }
+    m_ids[key] = id;
+    return std::make_shared<MetricSeries>(id);
+}
+
+void Metrics::release(int id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(--m_series[id].refs == 0) {
+        m_free.push_back(id);
+    }
+}
+
+void Metrics::clear(Cell *cell) {
+    cell->requests.store(0, std::memory_order_relaxed);
+    for(int i = 0; i < 5; i++) {
+        cell->status[i].store(0, std::memory_order_relaxed);
+    }
+    cell->bytesIn.store(0, std::memory_order_relaxed);
+    cell->bytesOut.store(0, std::memory_order_relaxed);
+    for(int i = 0; i < LatencyBuckets::COUNT; i++) {
+        cell->latency[i].store(0, std::memory_order_relaxed);
+        cell->ttfb[i].store(0, std::memory_order_relaxed);
+    }
+    cell->latencySumUs.store(0, std::memory_order_relaxed);
+    cell->ttfbSumUs.store(0, std::memory_order_relaxed);
+    cell->ttfbCount.store(0, std::memory_order_relaxed);
+}
+
+Metrics::Shard* Metrics::newShard() {
+    Shard *shard = new Shard();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_shards.push_back(shard);
+    return shard;
+}
+
+void Metrics::merge(int id, SeriesTotals& totals) {
+    memset(&totals, 0, sizeof(totals));
+    for(size_t s = 0; s < m_shards.size(); s++) {
+        Cell *cell = m_shards[s]->cells[id].load(std::memory_order_acquire);
+        if(cell == NULL) {
+            continue;
+        }
+        totals.requests += cell->requests.load(std::memory_order_relaxed);
+        for(int i = 0; i < 5; i++) {
+            totals.status[i] += cell->status[i].load(std::memory_order_relaxed);
+        }
+        totals.bytesIn += cell->bytesIn.load(std::memory_order_relaxed);
+        totals.bytesOut += cell->bytesOut.load(std::memory_order_relaxed);
+        for(int i = 0; i < LatencyBuckets::COUNT; i++) {
+            totals.latency[i] += cell->latency[i].load(std::memory_order_relaxed);
+            totals.ttfb[i] += cell->ttfb[i].load(std::memory_order_relaxed);
+        }
+        totals.latencySumUs += cell->latencySumUs.load(std::memory_order_relaxed);
+        totals.ttfbSumUs += cell->ttfbSumUs.load(std::memory_order_relaxed);
+        totals.ttfbCount += cell->ttfbCount.load(std::memory_order_relaxed);
+    }
+}
+
+std::string Metrics::scrape() {
+    std::vector<SeriesInfo> infos;
+    std::vector<std::unique_ptr<SeriesTotals>> totals;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(int id = 0; id < (int) m_series.size(); id++) {
+            if(m_series[id].refs <= 0) {
+                continue;
+            }
+            infos.push_back(m_series[id]);
+            totals.emplace_back(new SeriesTotals());
+            merge(id, *totals.back());
+        }
+    }
+    std::vector<std::string> labels(infos.size());
+    for(size_t i = 0; i < infos.size(); i++) {
+        labels[i].append("proxy=\"");
+        escapeLabel(infos[i].proxy, labels[i]);
+        labels[i].push_back('"');
+        if(infos[i].kind != SERIES_PROXY) {
+            labels[i].append(",").append(KIND_LABEL[infos[i].kind]).append("=\"");
+            escapeLabel(infos[i].label, labels[i]);
+            labels[i].push_back('"');
+        }
+    }
+
+    std::string out;
+    out.reserve(4096 + infos.size() * 2048);
+    for(int kind = SERIES_PROXY; kind <= SERIES_BACKEND; kind++) {
+        const char *prefix = KIND_PREFIX[kind];
+        appendHeader(out, prefix, "requests_total", "counter", "Requests answered, by status class.");
+        for(size_t i = 0; i < infos.size(); i++) {
+            if(infos[i].kind != kind) {
+                continue;
+            }
+            for(int c = 0; c < 5; c++) {
+                char code[16];
+                snprintf(code, sizeof(code), "code=\"%dxx\"", c + 1);
+                appendSample(out, prefix, "requests_total", labels[i], code, (double) totals[i]->status[c]);
+            }
+        }
+        appendHeader(out, prefix, "received_bytes_total", "counter", "Request body bytes received from clients.");
+        for(size_t i = 0; i < infos.size(); i++) {
+            if(infos[i].kind == kind) {
+                appendSample(out, prefix, "received_bytes_total", labels[i], NULL, (double) totals[i]->bytesIn);
+            }
+        }
+        appendHeader(out, prefix, "sent_bytes_total", "counter", "Response body bytes sent to clients.");
+        for(size_t i = 0; i < infos.size(); i++) {
+            if(infos[i].kind == kind) {
+                appendSample(out, prefix, "sent_bytes_total", labels[i], NULL, (double) totals[i]->bytesOut);
+            }
+        }
+        appendHeader(out, prefix, "request_duration_seconds", "histogram", "Time from the request to the last response byte.");
+        for(size_t i = 0; i < infos.size(); i++) {
+            if(infos[i].kind == kind) {
+                appendHistogram(out, prefix, "request_duration_seconds", labels[i], totals[i]->latency, totals[i]->latencySumUs, totals[i]->requests);
+            }
+        }
+        appendHeader(out, prefix, "upstream_ttfb_seconds", "histogram", "Time from the request to the first upstream response byte.");
+        for(size_t i = 0; i < infos.size(); i++) {
+            if(infos[i].kind == kind) {
+                appendHistogram(out, prefix, "upstream_ttfb_seconds", labels[i], totals[i]->ttfb, totals[i]->ttfbSumUs, totals[i]->ttfbCount);
+            }
+        }
+        // exact to the bucket resolution, which the coarse le buckets above are not
+        appendHeader(out, prefix, "request_duration_quantile_seconds", "gauge", "Request duration quantiles since start.");
+        for(size_t i = 0; i < infos.size(); i++) {
+            if(infos[i].kind != kind || totals[i]->requests == 0) {
+                continue;
+            }
+            for(size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++) {
+                uint64_t rank = (uint64_t) (QUANTILES[q] * totals[i]->requests);
+                uint64_t seen = 0;
+                int idx = 0;
+                for(; idx < LatencyBuckets::COUNT - 1; idx++) {
+                    seen += totals[i]->latency[idx];
+                    if(seen > rank) {
+                        break;
+                    }
+                }
+                char quantile[32];
+                snprintf(quantile, sizeof(quantile), "quantile=\"%g\"", QUANTILES[q]);
+                appendSample(out, prefix, "request_duration_quantile_seconds", labels[i], quantile, LatencyBuckets::upperBound(idx) / 1e6);
+            }
+        }
+    }
+    return out;
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+namespace archer
+{
+namespace server
+{
+
+enum SeriesKind {
+    SERIES_PROXY = 0,
+    SERIES_LOCATION,
+    SERIES_BACKEND
+};
+
+/**
+ * Log linear latency buckets in microseconds, the HDR histogram layout with 16
+ * sub buckets per power of two: every recorded value is within 1/16 of the
+ * bucket bound it is counted under, from 1us up to about two minutes.
+*/
+class LatencyBuckets
+{
+public:
+
+    static const int SUB_BITS = 4;
+    static const int MAX_EXPONENT = 26;
+    static const int COUNT = (MAX_EXPONENT - SUB_BITS + 2) << SUB_BITS;
+
+    static int index(uint64_t us) {
+        if(us < (1U << SUB_BITS)) {
+            return (int) us;
+        }
+        int exponent = 63 - __builtin_clzll(us);
+        if(exponent > MAX_EXPONENT) {
+            return COUNT - 1;
+        }
+        return ((exponent - SUB_BITS + 1) << SUB_BITS) + (int) ((us >> (exponent - SUB_BITS)) & ((1U << SUB_BITS) - 1));
+    }
+
+    // largest value counted under idx
+    static uint64_t upperBound(int idx) {
+        if(idx < (1 << SUB_BITS)) {
+            return idx;
+        }
+        int exponent = (idx >> SUB_BITS) + SUB_BITS - 1;
+        uint64_t sub = idx & ((1 << SUB_BITS) - 1);
+        return (((1ULL << SUB_BITS) + sub + 1) << (exponent - SUB_BITS)) - 1;
+    }
+};
+
+// merged counters of one series, status holds the 1xx to 5xx classes
+typedef struct {
+    uint64_t requests;
+    uint64_t status[5];
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t latency[LatencyBuckets::COUNT];
+    uint64_t latencySumUs;
+    uint64_t ttfb[LatencyBuckets::COUNT];
+    uint64_t ttfbSumUs;
+    uint64_t ttfbCount;
+} SeriesTotals;
+
+/**
+ * Handle of one registered series, the series stops being exported once the
+ * last handle for its labels is gone. Copies of a location share one handle.
+*/
+class MetricSeries
+{
+public:
+
+    explicit MetricSeries(int id) : m_id(id) {}
+    ~MetricSeries();
+
+    MetricSeries(const MetricSeries&) = delete;
+    MetricSeries& operator=(const MetricSeries&) = delete;
+
+    int id() const {return m_id;}
+
+private:
+
+    int     m_id;
+};
+
+typedef std::shared_ptr<MetricSeries> MetricSeriesPtr;
+
+/**
+ * Process wide request metrics per proxy, location and backend.
+ *
+ * Every thread records into its own shard, a table of per series cells it is
+ * the only writer of, so record() is a handful of relaxed loads and stores
+ * with no lock, no atomic read-modify-write and no shared cache line. Cells
+ * are allocated by their thread on first use and are never freed, a scrape
+ * walks all shards and sums them.
+*/
+class Metrics
+{
+static const int MAX_SERIES = 4096;
+
+typedef struct {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> status[5];
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> latency[LatencyBuckets::COUNT];
+    std::atomic<uint64_t> latencySumUs;
+    std::atomic<uint64_t> ttfb[LatencyBuckets::COUNT];
+    std::atomic<uint64_t> ttfbSumUs;
+    std::atomic<uint64_t> ttfbCount;
+} Cell;
+
+typedef struct {
+    std::atomic<Cell *> cells[MAX_SERIES];
+} Shard;
+
+typedef struct {
+    SeriesKind   kind;
+    std::string  proxy;
+    std::string  label;
+    int          refs;
+} SeriesInfo;
+
+public:
+
+    // never destroyed, series handles may be released during static destruction
+    static Metrics& instance() {
+        static Metrics *instance = new Metrics();
+        return *instance;
+    }
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    // the same labels get the same series back, so counters survive a reload, null once MAX_SERIES are in use
+    MetricSeriesPtr series(SeriesKind kind, std::string const& proxy, std::string const& label);
+
+    // one finished request, ttfbNanos is negative when no upstream byte came back, series may be null
+    void record(MetricSeries const *series, int status, int64_t latencyNanos, int64_t ttfbNanos, uint64_t bytesIn, uint64_t bytesOut) {
+        if(series == NULL) {
+            return ;
+        }
+        Cell *cell = cellOf(series->id());
+        bump(cell->requests, 1);
+        if(status >= 100 && status < 600) {
+            bump(cell->status[status / 100 - 1], 1);
+        }
+        bump(cell->bytesIn, bytesIn);
+        bump(cell->bytesOut, bytesOut);
+        uint64_t us = latencyNanos > 0 ? (uint64_t) latencyNanos / 1000 : 0;
+        bump(cell->latency[LatencyBuckets::index(us)], 1);
+        bump(cell->latencySumUs, us);
+        if(ttfbNanos >= 0) {
+            us = (uint64_t) ttfbNanos / 1000;
+            bump(cell->ttfb[LatencyBuckets::index(us)], 1);
+            bump(cell->ttfbSumUs, us);
+            bump(cell->ttfbCount, 1);
+        }
+    }
+
+    // every live series in the Prometheus text exposition format
+    std::string scrape();
+
+    void release(int id);
+
+private:
+
+    Metrics() {}
+    ~Metrics() {}
+
+    // single writer, a plain load and store is enough and readers never see a torn value
+    static void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    Cell* cellOf(int id) {
+        static thread_local Shard *shard = NULL;
+        if(shard == NULL) {
+            shard = newShard();
+        }
+        Cell *cell = shard->cells[id].load(std::memory_order_relaxed);
+        if(cell == NULL) {
+            cell = new Cell();
+            shard->cells[id].store(cell, std::memory_order_release);
+        }
+        return cell;
+    }
+
+    Shard* newShard();
+
+    static void clear(Cell *cell);
+
+    void merge(int id, SeriesTotals& totals);
+
+    static std::string keyOf(SeriesKind kind, std::string const& proxy, std::string const& label) {
+        return std::to_string((int) kind) + " " + proxy + " " + label;
+    }
+
+    std::mutex                   m_mutex;
+    std::vector<SeriesInfo>      m_series;
+    std::unordered_map<std::string, int> m_ids;
+    // ids without handles, oldest first, they keep their labels and counters until taken for other labels
+    std::deque<int>              m_free;
+    std::vector<Shard *>         m_shards;
+};
+}
+}
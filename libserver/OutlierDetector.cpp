@@ -0,0 +1,88 @@
+#include "OutlierDetector.h"
+
+using namespace archer::server;
+
+static const int64_t NANOS_PER_MILLI = 1000LL * 1000;
+
+void OutlierDetector::start() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_running) {
+        return ;
+    }
+    m_running = true;
+    m_thread = std::thread(&OutlierDetector::detectLoop, this);
+}
+
+void OutlierDetector::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_running = false;
+        m_cv.notify_all();
+    }
+    if(m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void OutlierDetector::detectLoop() {
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait_for(lock, std::chrono::seconds(1), [this]() { return !m_running; });
+            if(!m_running) {
+                return ;
+            }
+        }
+        if(sweep(archer::common::steadyNanos())) {
+            m_upstream.refresh();
+        }
+    }
+}
+
+bool OutlierDetector::sweep(int64_t now) {
+    bool changed = false;
+    PeerList peers = m_upstream.peers();
+    int ejected = 0;
+    for(int i = 0; i < peers.size(); i++) {
+        if(peers[i]->ejected()) {
+            ejected++;
+        }
+    }
+    for(int i = 0; i < peers.size(); i++) {
+        DstPeer& peer = *peers[i];
+        if(peer.ejected()) {
+            if(now >= peer.ejectedUntil()) {
+                LOG_info("Outlier peer %s:%d back in rotation", peer.host().c_str(), peer.port());
+                peer.uneject();
+                ejected--;
+                changed = true;
+            }
+            continue;
+        }
+        uint32_t requests = 0, failures = 0;
+        peer.windowStats(now, m_config.windowSeconds, requests, failures);
+        if(requests < (uint32_t) m_config.minRequests) {
+            continue;
+        }
+        if((uint64_t) failures * 100 < (uint64_t) requests * m_config.failurePercent) {
+            // a full clean window wipes the ejection history
+            if(failures == 0 && peer.ejections() > 0) {
+                peer.forgiveEjections();
+            }
+            continue;
+        }
+        // never eject the last peers standing, the upstream would fall back to all of them anyway
+        if(ejected + 1 >= (int) peers.size()) {
+            continue;
+        }
+        int64_t period = (int64_t) m_config.baseEjectionMs << std::min(peer.ejections(), 16);
+        if(period > m_config.maxEjectionMs) {
+            period = m_config.maxEjectionMs;
+        }
+        LOG_warn("Outlier peer %s:%d ejected for %lldms, %u of %u requests failed", peer.host().c_str(), peer.port(), (long long) period, failures, requests);
+        peer.eject(now + period * NANOS_PER_MILLI);
+        ejected++;
+        changed = true;
+    }
+    return changed;
+}
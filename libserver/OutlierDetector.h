@@ -0,0 +1,67 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "Upstream.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    int     windowSeconds;
+    int     minRequests;
+    int     failurePercent;
+    int     timeoutMs;
+    int     baseEjectionMs;
+    int     maxEjectionMs;
+} OutlierConfig;
+
+/**
+ * Passive outlier detection of one proxy. The request path only records
+ * results into per peer one second buckets (5xx, sub channel errors and
+ * requests not completed within timeoutMs count as failures, the latter from
+ * a deadline so a blackholed peer counts too). Once a second this thread
+ * sums the window of every peer, ejects the ones above failurePercent for
+ * baseEjectionMs doubled on every repeated ejection, and lets them back in
+ * when the period is over.
+*/
+class OutlierDetector
+{
+public:
+
+    OutlierDetector(Upstream& upstream, OutlierConfig const& config) : m_upstream(upstream), m_config(config) {}
+    ~OutlierDetector() {
+        stop();
+    }
+
+    OutlierDetector(const OutlierDetector&) = delete;
+    OutlierDetector& operator=(const OutlierDetector&) = delete;
+
+    void start();
+
+    void stop();
+
+    OutlierConfig const& config() {return m_config;}
+
+private:
+
+    void detectLoop();
+
+    bool sweep(int64_t now);
+
+    Upstream&                    m_upstream;
+    OutlierConfig                m_config;
+    bool                         m_running = false;
+    std::mutex                   m_mutex;
+    std::condition_variable      m_cv;
+    std::thread                  m_thread;
+};
+}
+}
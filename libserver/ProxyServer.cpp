@@ -1,4 +1,10 @@
 #include "ProxyServer.h"
+#include "DeadlineTimer.h"
+
+#include <unistd.h>
+#include <random>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 using namespace archer::server;
 
@@ -9,6 +15,92 @@ inline static void sendRequestError(HttpResponse *res) {
     http_response_send_all(res, body, strlen(body));
 }
 
+inline static void sendForbidden(HttpResponse *res) {
+    const char *body = "<!DOCTYPE html><html><head><title>APROXY SERVER</title></head><body><h3>APROXY SERVER 403 Forbidden</h3></body></html>";
+    http_response_set_status(res, 403);
+    http_response_set_content_type(res, "text/html");
+    http_response_send_all(res, body, strlen(body));
+}
+
+inline static void sendTooManyRequests(HttpResponse *res, int retryAfter) {
+    const char *body = "<!DOCTYPE html><html><head><title>APROXY SERVER</title></head><body><h3>APROXY SERVER 429 Too Many Requests</h3></body></html>";
+    std::string seconds = std::to_string(retryAfter);
+    http_response_set_status(res, 429);
+    http_response_set_header(res, "Retry-After", seconds.c_str());
+    http_response_set_content_type(res, "text/html");
+    http_response_send_all(res, body, strlen(body));
+}
+
+inline static void sendServiceUnavailable(HttpResponse *res) {
+    const char *body = "<!DOCTYPE html><html><head><title>APROXY SERVER</title></head><body><h3>APROXY SERVER 503 Service Unavailable</h3></body></html>";
+    http_response_set_status(res, 503);
+    http_response_set_content_type(res, "text/html");
+    http_response_send_all(res, body, strlen(body));
+}
+
+// ports picked for the manager behind TLS before giving up
+static const int LOOPBACK_ATTEMPTS = 8;
+
+// 128 random bits in hex, what the relay of a TLS listener proves itself with
+static std::string relaySecret() {
+    static const char *digits = "0123456789abcdef";
+    std::random_device random;
+    std::string secret;
+    for(int i = 0; i < 4; i++) {
+        uint32_t bits = random();
+        for(int j = 0; j < 8; j++, bits >>= 4) {
+            secret.push_back(digits[bits & 15]);
+        }
+    }
+    return secret;
+}
+
+// equal without telling how many leading bytes matched
+static bool secretEquals(const char *given, std::string const& secret) {
+    if(given == NULL || strlen(given) != secret.length()) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for(size_t i = 0; i < secret.length(); i++) {
+        diff |= (unsigned char) (given[i] ^ secret[i]);
+    }
+    return diff == 0;
+}
+
+// a port the kernel considers free on the loopback interface, 0 when there is none
+inline static int loopbackPort() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return 0;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int port = 0;
+    if(bind(fd, (struct sockaddr *) &addr, len) == 0 && getsockname(fd, (struct sockaddr *) &addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    ::close(fd);
+    return port;
+}
+
+// the request as a pooled keep-alive connection writes it, false when it cannot be serialized
+static bool serializeRequest(HttpRequest *req, const char *chunk, size_t len, std::string& wire) {
+    http_request_set_header(req, "Connection", "keep-alive");
+    char *head = NULL;
+    size_t headLen = 0;
+    http_request_to_string(req, &head, &headLen);
+    if(head == NULL) {
+        return false;
+    }
+    wire.reserve(headLen + len);
+    wire.append(head, headLen).append(chunk, len);
+    free(head);
+    return true;
+}
+
 static void httpRequestMessage(HttpManager *mgr, HttpRequest *req, HttpResponse *res, char *chunk, size_t chunk_len) {
     ProxyServer *proxy = static_cast<ProxyServer *>(http_manager_get_arg(mgr));
     proxy->onRequest(req, res, chunk, chunk_len);
@@ -20,12 +112,33 @@ static void httpResponseMessage(HttpManager *mgr, HttpResponse *res, char *chunk
 }
 
 static void httpOnError(HttpRequest *req, HttpResponse *res, const char *error) {
+    // a request still waiting on a concurrency limit never writes to res after this
+    AdmissionTable::instance().drop(res);
+    ExchangePtr exchange = ExchangeTable::instance().take(res);
+    archer::common::LogScope scope(exchange ? exchange->logLevel() : LOG_LEVEL_UNSET);
     LOG_warn("http request error, %s", error);
+    if(exchange) {
+        exchange->peer()->onFailure();
+        if(exchange->claimResult()) {
+            exchange->peer()->onResult(false, archer::common::steadyNanos());
+        }
+        // the manager does not tell how much of the request went out, assume all of it
+        if(exchange->proxy() != NULL && exchange->proxy()->retry(exchange, true)) {
+            return ;
+        }
+        exchange->releaseTicket(-1);
+        exchange->failFlight();
+        exchange->recordMetrics(exchange->responding() ? exchange->status() : 500);
+    }
+    // a waiter of a coalesced request, the leader must not write to res anymore
+    FlightTable::instance().leave(res);
     sendRequestError(res);
 }
 
 static void subChannelOnError(HttpManager *mgr, const char *host, int port, const char *error) {
     LOG_warn("peer connection %s:%d error, %s", host, port, error);
+    ProxyServer *proxy = static_cast<ProxyServer *>(http_manager_get_arg(mgr));
+    proxy->onPeerError(host, port);
 }
 
 static void subChannelOnClose(HttpManager *mgr, const char *host, int port) {
@@ -45,6 +158,30 @@ ProxyServer::~ProxyServer() {
 }
 
 void ProxyServer::close() {
+    m_closing = true;
+    std::vector<VirtualHostPtr> vhosts;
+    {
+        std::lock_guard<std::mutex> lock(m_hostMutex);
+        for(int i = 0; i < m_vhosts.size(); i++) {
+            m_vhosts[i]->stop();
+        }
+        vhosts = m_vhosts;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_peerMutex);
+        for(int i = 0; i < vhosts.size(); i++) {
+            PeerList peers = vhosts[i]->upstream().peers();
+            for(int j = 0; j < peers.size(); j++) {
+                if(peers[j]->pool()) {
+                    peers[j]->pool()->close();
+                }
+            }
+        }
+        m_loops.reset();
+    }
+    if(m_tlsFront) {
+        m_tlsFront->close();
+    }
     if(m_httpManager) {
         http_manager_close(m_httpManager);
     }
@@ -55,93 +192,845 @@ void ProxyServer::startAsync() {
     asyncListen.detach();
 }
 
-void ProxyServer::addPeer(std::string const& host, int port) {
-    if(m_httpManager) {
+bool ProxyServer::addVirtualHost(VirtualHostPtr const& vhost) {
+    std::lock_guard<std::mutex> lock(m_hostMutex);
+    std::vector<std::string> const& names = vhost->serverNames();
+    for(int i = 0; i < m_vhosts.size(); i++) {
+        if(m_vhosts[i]->id() == vhost->id()) {
+            return false;
+        }
+        std::vector<std::string> const& used = m_vhosts[i]->serverNames();
+        if(names.empty() && used.empty()) {
+            LOG_warn("Proxy Server %s:%d already has a default virtual host", m_host.c_str(), m_port);
+            return false;
+        }
+        for(int j = 0; j < names.size(); j++) {
+            if(std::find(used.begin(), used.end(), names[j]) != used.end()) {
+                LOG_warn("Proxy Server %s:%d server name %s is already taken", m_host.c_str(), m_port, names[j].c_str());
+                return false;
+            }
+        }
+    }
+    LOG_info("Proxy Server %s:%d add virtual host %s", m_host.c_str(), m_port, vhost->name());
+    m_vhosts.push_back(vhost);
+    compileHosts();
+    return true;
+}
 
-        LOG_info("Proxy Server %s:%d add peer %s:%d", m_host.c_str(), m_port, host.c_str(), port);
-        std::lock_guard<std::mutex> lock(m_peerMutex);
-        for(int i = 0; i < m_peers.size(); i++) {
-            if(m_peers[i].host == host && m_peers[i].port == port) {
-                return ;
+bool ProxyServer::delVirtualHost(std::string const& id) {
+    VirtualHostPtr vhost;
+    {
+        std::lock_guard<std::mutex> lock(m_hostMutex);
+        for(int i = 0; i < m_vhosts.size(); i++) {
+            if(m_vhosts[i]->id() == id) {
+                vhost = m_vhosts[i];
+                m_vhosts.erase(m_vhosts.begin() + i);
+                break;
             }
         }
-        http_manager_add_sub_connection(m_httpManager, host.c_str(), port, NULL);
-        DstPeer peer{host, port};
-        m_peers.push_back(peer);
+        if(!vhost) {
+            return false;
+        }
+        LOG_info("Proxy Server %s:%d delete virtual host %s", m_host.c_str(), m_port, vhost->name());
+        compileHosts();
+    }
+    vhost->stop();
+    PeerList peers = vhost->upstream().peers();
+    for(int i = 0; i < peers.size(); i++) {
+        delPeer(vhost, peers[i]->host(), peers[i]->port());
+    }
+    return true;
+}
+
+VirtualHostPtr ProxyServer::findVirtualHost(std::string const& id) {
+    std::lock_guard<std::mutex> lock(m_hostMutex);
+    for(int i = 0; i < m_vhosts.size(); i++) {
+        if(m_vhosts[i]->id() == id) {
+            return m_vhosts[i];
+        }
     }
+    return nullptr;
 }
 
-void ProxyServer::delPeer(std::string const& host, int port) {
+size_t ProxyServer::virtualHostCount() {
+    std::lock_guard<std::mutex> lock(m_hostMutex);
+    return m_vhosts.size();
+}
+
+void ProxyServer::addPeer(VirtualHostPtr const& vhost, std::string const& host, int port, int weight, SSLOptionPtr const& ssl) {
     if(m_httpManager) {
-        LOG_info("Proxy Server %s:%d delete peer %s:%d", m_host.c_str(), m_port, host.c_str(), port);
-        http_manager_del_sub_connection(m_httpManager, host.c_str(), port);
+        LOG_info("Proxy Server %s:%d virtual host %s add peer %s%s:%d weight %d", m_host.c_str(), m_port, vhost->name(), ssl ? "https://" : "", host.c_str(), port, weight);
         std::lock_guard<std::mutex> lock(m_peerMutex);
-        int idx = 0;
-        for(; idx < m_peers.size(); idx++) {
-            if(m_peers[idx].host == host && m_peers[idx].port == port) {
-                break;
+        DstPeerPtr peer = std::make_shared<DstPeer>(host, port, weight);
+        peer->setSsl(ssl);
+        peer->setMetrics(Metrics::instance().series(SERIES_BACKEND, vhost->id(), host + ":" + std::to_string(port)));
+        peer->setAccessId(common::AccessLog::instance().nameId('b', vhost->id() + " " + host + ":" + std::to_string(port)));
+        UpstreamPoolPtr pool;
+        if(vhost->pooled()) {
+            if(!m_loops) {
+                m_loops.reset(new UpstreamLoops(m_threads));
+            }
+            PoolConfig config = vhost->poolConfig();
+            // a handshake is too slow to pay on the first request after idle, keep one connection warm
+            if(ssl && config.minConnections < 1) {
+                config.minConnections = 1;
             }
+            pool = std::make_shared<UpstreamPool>(this, m_loops.get(), host, port, ssl, config);
+            peer->setPool(pool);
+        }
+        if(!vhost->upstream().addPeer(peer)) {
+            return ;
+        }
+        if(pool) {
+            pool->prewarm();
+        }
+        // streamed request bodies still go over the shared sub connection
+        SubConnection& connection = m_subConnections[host + ":" + std::to_string(port)];
+        if(connection.refs++ == 0) {
+            connection.ssl = ssl;
+            http_manager_add_sub_connection(m_httpManager, host.c_str(), port, ssl.get());
+        }
+    }
+}
+
+void ProxyServer::delPeer(VirtualHostPtr const& vhost, std::string const& host, int port) {
+    if(m_httpManager) {
+        LOG_info("Proxy Server %s:%d virtual host %s delete peer %s:%d", m_host.c_str(), m_port, vhost->name(), host.c_str(), port);
+        std::lock_guard<std::mutex> lock(m_peerMutex);
+        DstPeerPtr peer = vhost->upstream().findPeer(host, port);
+        // unpublish first, requests still holding the old snapshot may finish their write
+        if(!vhost->upstream().delPeer(host, port)) {
+            return ;
         }
-        if(idx < m_peers.size()) {
-            m_peers.erase(m_peers.begin() + idx);
+        if(peer && peer->pool()) {
+            peer->pool()->close();
         }
+        auto it = m_subConnections.find(host + ":" + std::to_string(port));
+        if(it != m_subConnections.end() && --it->second.refs <= 0) {
+            http_manager_del_sub_connection(m_httpManager, host.c_str(), port);
+            m_subConnections.erase(it);
+        }
+    }
+}
+
+void ProxyServer::onPeerError(const char *host, int port) {
+    common::Snapshot<HostTable>::Ptr table = m_hostTable.load();
+    if(!table) {
+        return ;
+    }
+    for(int i = 0; i < table->hosts.size(); i++) {
+        table->hosts[i]->onPeerError(host, port);
+    }
+}
+
+void ProxyServer::compileHosts() {
+    std::shared_ptr<HostTable> table = std::make_shared<HostTable>();
+    std::vector<std::string> names;
+    std::vector<int32_t> hosts;
+    table->hosts = m_vhosts;
+    for(int i = 0; i < m_vhosts.size(); i++) {
+        std::vector<std::string> const& serverNames = m_vhosts[i]->serverNames();
+        if(serverNames.empty()) {
+            table->fallback = m_vhosts[i];
+        }
+        for(int j = 0; j < serverNames.size(); j++) {
+            names.push_back(serverNames[j]);
+            hosts.push_back(i);
+        }
+    }
+    table->router.reset(new HostRouter(names, hosts));
+    m_hostTable.store(table);
+}
+
+VirtualHostPtr const& ProxyServer::resolveHost(HttpRequest *req) {
+    static const VirtualHostPtr none;
+    common::Snapshot<HostTable>::Ptr const& table = m_hostTable.local().ptr;
+    if(!table) {
+        return none;
     }
+    int32_t idx = table->router->match(http_request_get_header(req, "Host"));
+    return idx >= 0 ? table->hosts[idx] : table->fallback;
 }
 
 void ProxyServer::doStart() {
     http_manager_set_threads(m_httpManager, m_threads);
     http_manager_set_arg(m_httpManager, this);
-    LOG_info("Start Proxy on %s:%d", m_host.c_str(), m_port);
-    m_active = true;
-    if(!http_manager_listen(m_httpManager, m_host.c_str(), m_port, httpRequestMessage, httpResponseMessage, httpOnError, subChannelOnError, subChannelOnClose)) {
-        const char *errstr = http_manager_get_error_str(m_httpManager);
-        LOG_error("Proxy Server listen on %s:%d error, %s", m_host.c_str(), m_port, errstr);
+    if(!m_tls) {
+        LOG_info("Start Proxy on %s:%d", m_host.c_str(), m_port);
+        m_active = true;
+        if(!http_manager_listen(m_httpManager, m_host.c_str(), m_port, httpRequestMessage, httpResponseMessage, httpOnError, subChannelOnError, subChannelOnClose)) {
+            const char *errstr = http_manager_get_error_str(m_httpManager);
+            LOG_error("Proxy Server listen on %s:%d error, %s", m_host.c_str(), m_port, errstr);
+        }
+        m_active = false;
+        return ;
+    }
+    VirtualHostPtr relay = std::make_shared<VirtualHost>("tls", std::vector<std::string>());
+    m_tlsFront.reset(new TcpProxyServer(m_host, m_port));
+    m_tlsFront->setThreads(m_threads);
+    m_tlsFront->setTls(m_tls);
+    m_relaySecret = relaySecret();
+    m_tlsFront->setForwardedFor(m_relaySecret);
+    m_tlsFront->addVirtualHost(relay);
+    int internalPort = m_tls->config().internalPort;
+    if(internalPort == 0) {
+        LOG_warn("Proxy Server %s:%d has no tls internal_port, a picked loopback port may be taken before the manager listens on it", m_host.c_str(), m_port);
+    }
+    // a picked port that got taken in between is replaced by another one, a configured port is tried once
+    int attempts = internalPort > 0 ? 1 : LOOPBACK_ATTEMPTS;
+    for(int attempt = 0; attempt < attempts && !m_closing; attempt++) {
+        int port = internalPort > 0 ? internalPort : loopbackPort();
+        if(port == 0) {
+            continue;
+        }
+        m_tlsFront->addPeer(relay, "127.0.0.1", port);
+        if(attempt == 0) {
+            m_tlsFront->startAsync();
+        }
+        LOG_info("Start Proxy on 127.0.0.1:%d behind TLS on %s:%d", port, m_host.c_str(), m_port);
+        m_active = true;
+        bool listened = http_manager_listen(m_httpManager, "127.0.0.1", port, httpRequestMessage, httpResponseMessage, httpOnError, subChannelOnError, subChannelOnClose);
+        m_active = false;
+        if(listened || m_closing) {
+            return ;
+        }
+        LOG_warn("Proxy Server listen on 127.0.0.1:%d behind TLS error, %s", port, http_manager_get_error_str(m_httpManager));
+        m_tlsFront->delPeer(relay, "127.0.0.1", port);
+    }
+    if(internalPort == 0) {
+        LOG_error("Proxy Server %s:%d found no loopback port behind TLS", m_host.c_str(), m_port);
     }
-    m_active = false;
 }
 
 void ProxyServer::onRequest(HttpRequest *req, HttpResponse *res, char *chunk, size_t chunk_len) {
-    std::string uri(http_request_get_uri(req)), newUri;
-    LOG_trace("Proxy Server access %s", uri.c_str());
-    bool found = false;
-    {
-        std::lock_guard<std::mutex> lock(m_uriMutex);
-        for(int i = 0; i < m_locations.size(); i++) {
-            if(uri.length() >= m_locations[i].src.length() && uri.substr(0, m_locations[i].src.length()) == m_locations[i].src) {
-                newUri = m_locations[i].dst + uri.substr(m_locations[i].src.length(), uri.length() - m_locations[i].src.length());
-                http_request_set_uri(req, newUri.c_str());
-                found = true;
+    ExchangePtr exchange = ExchangeTable::instance().find(res);
+    if(exchange && !exchange->requestSent()) {
+        // rest of a chunked request body, stay on the peer of the first chunk
+        common::LogScope scope(exchange->logLevel());
+        DstPeerPtr const& peer = exchange->peer();
+        exchange->setRequestSent(http_request_is_finished(req));
+        exchange->addBytesIn(chunk_len);
+        http_manager_write_to(m_httpManager, peer->host().c_str(), peer->port(), req, chunk, chunk_len);
+        return ;
+    }
+    if(m_tls) {
+        // the loopback port is reachable past TLS by local processes, only the relay knows the secret
+        if(!secretEquals(http_request_get_header(req, RELAY_SECRET_HEADER), m_relaySecret)) {
+            LOG_warn("Proxy Server %s:%d refused a request that did not come through TLS", m_host.c_str(), m_port);
+            sendForbidden(res);
+            return ;
+        }
+        // archer_net can not delete a header, an empty one tells the backend nothing
+        http_request_set_header(req, RELAY_SECRET_HEADER, "");
+    }
+    int64_t start = common::steadyNanos();
+    const char *uri = http_request_get_uri(req);
+    size_t uriLen = strlen(uri);
+    VirtualHostPtr const& vhost = resolveHost(req);
+    const Location *loc = vhost ? vhost->matchLocation(uri, uriLen) : NULL;
+    common::LogScope scope(common::Logger::requestLevel(vhost ? &vhost->logControl() : NULL, loc ? loc->log.get() : NULL));
+    LOG_trace("Proxy Server access %s", uri);
+    if(loc == NULL) {
+        sendNotFound(req, res);
+        if(vhost) {
+            int64_t latency = common::steadyNanos() - start;
+            Metrics::instance().record(vhost->metrics(), 404, latency, -1, chunk_len, 0);
+            common::AccessLog::instance().write(vhost->accessId(), 0, 0, 404, latency, -1, chunk_len, 0);
+        }
+        return ;
+    }
+    int retryAfter = 0;
+    if(loc->limiter && !loc->limiter->take(req, retryAfter)) {
+        LOG_debug("Proxy Server %s rate limited", uri);
+        sendTooManyRequests(res, retryAfter);
+        recordLocal(vhost, *loc, 429, start, chunk_len, 0);
+        return ;
+    }
+    if(loc->statics) {
+        size_t sent = loc->statics->serve(req, res, uri + loc->src.length(), uriLen - loc->src.length());
+        recordLocal(vhost, *loc, http_response_get_status(res), start, chunk_len, sent);
+        return ;
+    }
+    std::string newUri;
+    newUri.reserve(loc->dst.length() + uriLen - loc->src.length());
+    newUri.append(loc->dst).append(uri + loc->src.length(), uriLen - loc->src.length());
+    http_request_set_uri(req, newUri.c_str());
+    if(m_tls) {
+        http_request_set_header(req, "X-Forwarded-Proto", "https");
+    }
+
+    const char *host = http_request_get_header(req, "Host");
+    std::string cacheKey;
+    ResponseCache *cache = loc->cache.get();
+    if(cache != NULL && ResponseCache::requestCacheable(req)) {
+        cacheKey.append(host == NULL ? "" : host).append(newUri);
+        int64_t now = common::steadyNanos();
+        CachedResponsePtr cached = cache->get(cacheKey, now);
+        const char *encoding = http_request_get_header(req, "Accept-Encoding");
+        if(cached && (!cached->varyEncoding || cached->encoding == (encoding == NULL ? "" : encoding))) {
+            sendCached(res, *cached, now);
+            recordLocal(vhost, *loc, cached->status, start, chunk_len, cached->body.length());
+            return ;
+        }
+    }
+
+    FlightPtr flight;
+    std::string flightKey;
+    if(loc->coalesce && coalescible(req)) {
+        // waiters get the leader's encoding, only requests accepting the same one may share it
+        const char *encoding = http_request_get_header(req, "Accept-Encoding");
+        flightKey.append(vhost->id()).append(" GET ").append(host == NULL ? "" : host).append(newUri)
+                 .append(" ").append(encoding == NULL ? "" : encoding);
+        bool leader = false;
+        flight = FlightTable::instance().join(flightKey, res, leader);
+        if(!leader) {
+            LOG_trace("Proxy Server %s joins an in flight request", newUri.c_str());
+            return ;
+        }
+    }
+
+    // concurrency limits apply to what goes upstream, the location one first
+    ConcurrencyTicketPtr ticket;
+    ConcurrencyLimiterPtr const *limits[2] = {&loc->concurrency, &vhost->concurrency()};
+    for(int i = 0; i < 2; i++) {
+        ConcurrencyLimiterPtr const& limiter = *limits[i];
+        if(!limiter) {
+            continue;
+        }
+        if(!ticket) {
+            ticket = std::make_shared<ConcurrencyTicket>();
+        }
+        if(limiter->tryAcquire()) {
+            ticket->add(limiter);
+            continue;
+        }
+        // the rest of a streamed body would arrive with no exchange to take it, and a waiting request
+        // is sent from its serialized form once admitted, which only a pooled connection can write
+        AdmissionPtr admission = std::make_shared<Admission>();
+        if(!http_request_is_finished(req) || !vhost->pooled() || http_request_get_header(req, "Transfer-Encoding") != NULL ||
+           !serializeRequest(req, chunk, chunk_len, admission->wire)) {
+            ticket->release(-1);
+            shed(res, flight, flightKey);
+            recordLocal(vhost, *loc, 503, start, chunk_len, 0);
+            return ;
+        }
+        const char *method = http_request_get_method(req);
+        const char *encoding = http_request_get_header(req, "Accept-Encoding");
+        admission->vhost = vhost;
+        admission->loc = *loc;
+        admission->res = res;
+        admission->method = method == NULL ? "" : method;
+        admission->acceptEncoding = encoding == NULL ? "" : encoding;
+        admission->encoding = loc->compressor ? Compressor::negotiate(req) : ENCODING_IDENTITY;
+        admission->bytesIn = chunk_len;
+        admission->cacheKey.swap(cacheKey);
+        admission->flight = flight;
+        admission->flightKey.swap(flightKey);
+        for(int j = i; j < 2; j++) {
+            if(*limits[j]) {
+                admission->limits.push_back(*limits[j]);
+            }
+        }
+        admission->stage = 0;
+        admission->ticket = ticket;
+        admission->start = start;
+        admission->logLevel = common::Logger::scopeLevel();
+        AdmissionTable::instance().put(res, admission);
+        acquireSlots(admission);
+        return ;
+    }
+    dispatch(vhost, *loc, req, res, chunk, chunk_len, cacheKey, flight, flightKey, ticket);
+}
+
+void ProxyServer::acquireSlots(AdmissionPtr const& admission) {
+    while(admission->stage < admission->limits.size()) {
+        {
+            std::lock_guard<std::mutex> lock(admission->mutex);
+            if(admission->dropped) {
                 break ;
             }
         }
+        ConcurrencyLimiterPtr const& limiter = admission->limits[admission->stage];
+        ProxyServer *proxy = this;
+        AdmitResult result = limiter->enqueue([proxy, admission](bool admitted) {
+            common::LogScope scope(admission->logLevel);
+            if(!admitted) {
+                LOG_debug("Proxy Server %s:%d request shed after queueing", proxy->m_host.c_str(), proxy->m_port);
+                proxy->finishQueued(admission, false);
+                return ;
+            }
+            admission->ticket->add(admission->limits[admission->stage++]);
+            proxy->acquireSlots(admission);
+        });
+        if(result == ADMIT_QUEUED) {
+            return ;
+        }
+        if(result == ADMIT_REJECTED) {
+            LOG_debug("Proxy Server %s:%d request shed, queue full", m_host.c_str(), m_port);
+            finishQueued(admission, false);
+            return ;
+        }
+        admission->ticket->add(limiter);
+        admission->stage++;
+    }
+    finishQueued(admission, true);
+}
+
+void ProxyServer::finishQueued(AdmissionPtr const& admission, bool admitted) {
+    bool dropped = false;
+    {
+        std::lock_guard<std::mutex> lock(admission->mutex);
+        dropped = admission->dropped;
+        if(!dropped && admitted) {
+            dispatch(admission->vhost, admission->loc, NULL, admission->res, NULL, 0,
+                     admission->cacheKey, admission->flight, admission->flightKey, admission->ticket, admission.get());
+        } else if(!dropped) {
+            sendServiceUnavailable(admission->res);
+            recordLocal(admission->vhost, admission->loc, 503, admission->start, admission->bytesIn, 0);
+        }
+        // the exchange table has the request now, or it is over
+        AdmissionTable::instance().takeIf(admission->res, admission);
     }
-    if(found) {
-        sendRequsetToPeer(req, res, chunk, chunk_len);
+    if(!dropped && admitted) {
+        return ;
+    }
+    admission->ticket->release(-1);
+    if(admission->flight) {
+        FlightTable::instance().close(admission->flightKey, admission->flight);
+        admission->flight->fail();
+    }
+}
+
+void ProxyServer::shed(HttpResponse *res, FlightPtr const& flight, std::string const& flightKey) {
+    sendServiceUnavailable(res);
+    if(flight) {
+        FlightTable::instance().close(flightKey, flight);
+        flight->fail();
+    }
+}
+
+void ProxyServer::dispatch(VirtualHostPtr const& vhost, Location const& location, HttpRequest *req, HttpResponse *res, char *chunk, size_t chunk_len,
+                           std::string const& cacheKey, FlightPtr const& flight, std::string const& flightKey, ConcurrencyTicketPtr const& ticket,
+                           Admission *queued) {
+    const Location *loc = &location;
+    ExchangePtr opened = openExchange(vhost, req, res);
+    if(!opened) {
+        if(ticket) {
+            ticket->release(-1);
+        }
+        if(flight) {
+            FlightTable::instance().close(flightKey, flight);
+            flight->fail();
+        }
+        return ;
+    }
+    if(ticket) {
+        opened->setTicket(ticket);
+    }
+    opened->setLocation(loc->metrics, loc->accessId);
+    opened->addBytesIn(queued ? queued->bytesIn : chunk_len);
+    if(!cacheKey.empty()) {
+        opened->setCacheFill(loc->cache, cacheKey, queued ? queued->acceptEncoding.c_str() : http_request_get_header(req, "Accept-Encoding"));
+    }
+    if(flight) {
+        opened->setFlight(flight, flightKey);
+    }
+    if(loc->compressor) {
+        ContentEncoding encoding = queued ? queued->encoding : Compressor::negotiate(req);
+        if(encoding != ENCODING_IDENTITY) {
+            opened->setCompression(loc->compressor, encoding);
+        }
+    }
+    // only a request complete in its first chunk can be replayed
+    if((loc->retry || loc->hedge) && opened->requestSent()) {
+        opened->setReplay(this, queued ? queued->method.c_str() : http_request_get_method(req));
+    }
+    if(loc->retry) {
+        loc->retry->onRequest();
+        opened->setRetryPolicy(loc->retry);
+    }
+    int64_t hedgeDelay = 0;
+    if(loc->hedge) {
+        loc->hedge->onRequest();
+        hedgeDelay = loc->hedge->delayNanos();
+        HedgeRacePtr race;
+        if(hedgeDelay > 0 && opened->requestSent() && opened->pipelinable() && vhost->pooled()) {
+            race = std::make_shared<HedgeRace>(opened);
+        }
+        opened->setHedge(loc->hedge, race);
+    }
+    if(queued) {
+        std::string wire = wireWithHost(queued->wire, opened->peer()->host());
+        opened->setWire(res, queued->method.c_str(), wire);
+        watch(opened);
+        if(!opened->peer()->pool() || !submit(opened)) {
+            onUpstreamError(opened, "upstream pool closed", false);
+        }
     } else {
-        sendNotFound(req, res);
+        forward(opened, req, res, chunk, chunk_len);
+    }
+    if(opened->race() && !opened->wire().empty()) {
+        std::weak_ptr<Exchange> weak = opened;
+        DeadlineTimer::instance().schedule(common::steadyNanos() + hedgeDelay, [weak]() {
+            ExchangePtr exchange = weak.lock();
+            // an exchange no longer in the table has completed or failed, its proxy may be gone
+            if(exchange && exchange->current()) {
+                exchange->proxy()->hedge(exchange);
+            }
+        });
     }
 }
 
 void ProxyServer::onResponse(HttpResponse *res, char *chunk, size_t chunk_len) {
-    http_response_send_some(res, chunk, chunk_len);
+    ExchangePtr exchange = ExchangeTable::instance().find(res);
+    if(!exchange) {
+        http_response_send_some(res, chunk, chunk_len);
+        return ;
+    }
+    common::LogScope scope(exchange->logLevel());
+    respond(exchange, res, chunk, chunk_len);
 }
 
-void ProxyServer::sendRequsetToPeer(HttpRequest *req, HttpResponse *res, char *chunk, size_t len) {
-    if(m_peers.empty()) {
-        sendNotFound(req, res);
+void ProxyServer::onUpstreamHead(ExchangePtr const& exchange, int status, HeaderList const& headers) {
+    common::LogScope scope(exchange->logLevel());
+    HttpResponse *res = exchange->response();
+    if(!admit(exchange)) {
         return ;
     }
-    int idx = 0;
-    {
-        std::lock_guard<std::mutex> lock(m_peerMutex);
-        idx = m_peerIdx++;
-        if(m_peerIdx >= m_peers.size()) {
-            m_peerIdx = 0;
+    http_response_set_status(res, status);
+    for(size_t i = 0; i < headers.size(); i++) {
+        const char *key = headers[i].first.c_str();
+        if(strcasecmp(key, "Connection") == 0 || strcasecmp(key, "Keep-Alive") == 0 || strcasecmp(key, "Transfer-Encoding") == 0) {
+            continue;
         }
+        http_response_set_header(res, key, headers[i].second.c_str());
     }
-    http_request_set_header(req, "Host", m_peers[idx].host.c_str());
-    LOG_trace("Proxy Server send to %s:%d", m_peers[idx].host.c_str(), m_peers[idx].port);
-    http_manager_write_to(m_httpManager, m_peers[idx].host.c_str(), m_peers[idx].port, req, chunk, len);
+}
+
+void ProxyServer::onUpstreamBody(ExchangePtr const& exchange, const char *data, size_t len) {
+    common::LogScope scope(exchange->logLevel());
+    if(admit(exchange)) {
+        respond(exchange, exchange->response(), (char *) data, len);
+    }
+}
+
+void ProxyServer::onUpstreamComplete(ExchangePtr const& exchange) {
+    static char end[1] = {0};
+    common::LogScope scope(exchange->logLevel());
+    // responses framed by Content-Length completed with their last body byte already
+    if(admit(exchange)) {
+        respond(exchange, exchange->response(), end, 0);
+    }
+}
+
+bool ProxyServer::admit(ExchangePtr const& exchange) {
+    HttpResponse *res = exchange->response();
+    HedgeRace *race = exchange->race().get();
+    if(race != NULL) {
+        ExchangePtr loser;
+        RaceResult result = race->claim(exchange.get(), loser);
+        if(result == RACE_LOST) {
+            return false;
+        }
+        if(result == RACE_WON) {
+            // first response byte of a hedged request, the other copy is cancelled
+            ExchangeTable::instance().put(res, exchange);
+            if(exchange->hedgeCopy()) {
+                exchange->hedgePolicy()->onWon();
+            }
+            if(loser) {
+                cancel(loser);
+            }
+            return true;
+        }
+    }
+    return exchange->current();
+}
+
+void ProxyServer::cancel(ExchangePtr const& loser) {
+    DstPeerPtr const& peer = loser->peer();
+    peer->onFailure();
+    if(peer->pool()) {
+        peer->pool()->cancel(loser);
+    }
+}
+
+void ProxyServer::onUpstreamError(ExchangePtr const& exchange, const char *error, bool sent) {
+    common::LogScope scope(exchange->logLevel());
+    DstPeerPtr const& peer = exchange->peer();
+    LOG_warn("Proxy Server upstream %s:%d error, %s", peer->host().c_str(), peer->port(), error);
+    HttpResponse *res = exchange->response();
+    HedgeRace *race = exchange->race().get();
+    if(race != NULL) {
+        ExchangePtr survivor;
+        RaceResult result = race->fail(exchange.get(), survivor);
+        if(result == RACE_LOST) {
+            // cancelled, already accounted for
+            return ;
+        }
+        if(result == RACE_SURVIVED) {
+            peer->onFailure();
+            if(exchange->claimResult()) {
+                peer->onResult(false, common::steadyNanos());
+            }
+            ExchangeTable::instance().replaceIf(res, exchange, survivor);
+            return ;
+        }
+    }
+    if(!ExchangeTable::instance().takeIf(res, exchange)) {
+        return ;
+    }
+    peer->onFailure();
+    if(exchange->claimResult()) {
+        peer->onResult(false, common::steadyNanos());
+    }
+    if(retry(exchange, sent)) {
+        return ;
+    }
+    exchange->releaseTicket(-1);
+    exchange->failFlight();
+    exchange->recordMetrics(exchange->responding() ? exchange->status() : 500);
+    if(!exchange->responding()) {
+        sendRequestError(res);
+    }
+}
+
+void ProxyServer::shedExchange(ExchangePtr const& exchange) {
+    LOG_warn("Proxy Server %s:%d upstream pool of %s:%d has too many waiting requests", m_host.c_str(), m_port, exchange->peer()->host().c_str(), exchange->peer()->port());
+    // local overload says nothing about the health of the peer
+    exchange->claimResult();
+    if(exchange->race()) {
+        onUpstreamError(exchange, "upstream pool full", false);
+        return ;
+    }
+    HttpResponse *res = exchange->response();
+    if(!ExchangeTable::instance().takeIf(res, exchange)) {
+        return ;
+    }
+    exchange->peer()->onFailure();
+    if(retry(exchange, false)) {
+        return ;
+    }
+    exchange->releaseTicket(-1);
+    exchange->failFlight();
+    exchange->recordMetrics(503);
+    sendServiceUnavailable(res);
+}
+
+bool ProxyServer::retry(ExchangePtr const& failed, bool sent) {
+    RetryPolicy *policy = failed->retryPolicy().get();
+    if(policy == NULL || failed->responding() || failed->attempts() >= policy->config().attempts) {
+        return false;
+    }
+    // a non idempotent request may have had its effect already
+    if(sent && !failed->idempotent()) {
+        return false;
+    }
+    // the client request may be gone by now, only a request serialized for a pooled connection can be replayed
+    if(failed->wire().empty()) {
+        return false;
+    }
+    DstPeerPtr peer = retryPeer(failed);
+    if(!peer || !peer->pool()) {
+        return false;
+    }
+    VirtualHostPtr const& vhost = failed->vhost();
+    if(vhost->maxPending() > 0 && peer->outstanding() >= vhost->maxPending()) {
+        return false;
+    }
+    if(!policy->acquire()) {
+        LOG_warn("Proxy Server %s:%d retry budget exhausted", m_host.c_str(), m_port);
+        return false;
+    }
+    ExchangePtr next = failed->retryTo(peer);
+    peer->onSend();
+    ExchangeTable::instance().put(next->response(), next);
+    LOG_info("Proxy Server retry on %s:%d, attempt %d", peer->host().c_str(), peer->port(), next->attempts());
+    watch(next);
+    if(!submit(next)) {
+        onUpstreamError(next, "upstream pool closed", false);
+    }
+    return true;
+}
+
+void ProxyServer::hedge(ExchangePtr const& primary) {
+    HedgeRace *race = primary->race().get();
+    HedgePolicy *policy = primary->hedgePolicy().get();
+    if(race == NULL || policy == NULL || !race->open()) {
+        return ;
+    }
+    // a copy only races on pooled connections, the manager would mix both responses
+    DstPeerPtr peer = retryPeer(primary);
+    if(!peer || !peer->pool()) {
+        return ;
+    }
+    VirtualHostPtr const& vhost = primary->vhost();
+    if(vhost->maxPending() > 0 && peer->outstanding() >= vhost->maxPending()) {
+        return ;
+    }
+    if(!policy->acquire()) {
+        return ;
+    }
+    ExchangePtr copy = primary->hedgeTo(peer);
+    if(!race->launch(copy)) {
+        return ;
+    }
+    peer->onSend();
+    LOG_debug("Proxy Server hedge on %s:%d", peer->host().c_str(), peer->port());
+    // the primary went out pooled, its wire is set, the client request may already be gone
+    watch(copy);
+    if(!submit(copy)) {
+        onUpstreamError(copy, "upstream pool closed", false);
+    }
+}
+
+DstPeerPtr ProxyServer::retryPeer(ExchangePtr const& failed) {
+    Upstream& upstream = failed->vhost()->upstream();
+    // the balancer first, the client request may be gone so hashing ones spread it round robin, then a scan
+    for(int i = 0; i < 3; i++) {
+        DstPeer *peer = upstream.select(NULL);
+        if(peer != NULL && !failed->tried(peer)) {
+            return peer->shared_from_this();
+        }
+    }
+    PeerList peers = upstream.peers();
+    for(int i = 0; i < peers.size(); i++) {
+        if(peers[i]->available() && !failed->tried(peers[i].get())) {
+            return peers[i];
+        }
+    }
+    return nullptr;
+}
+
+DstPeerPtr ProxyServer::unsaturatedPeer(VirtualHostPtr const& vhost, HttpRequest *req) {
+    Upstream& upstream = vhost->upstream();
+    int maxPending = vhost->maxPending();
+    // the balancer first, hashing ones keep answering the saturated peer so fall back to a scan
+    for(int i = 0; i < 3; i++) {
+        DstPeer *peer = upstream.select(req);
+        if(peer != NULL && peer->outstanding() < maxPending) {
+            return peer->shared_from_this();
+        }
+    }
+    PeerList peers = upstream.peers();
+    for(int i = 0; i < peers.size(); i++) {
+        if(peers[i]->available() && peers[i]->outstanding() < maxPending) {
+            return peers[i];
+        }
+    }
+    return nullptr;
+}
+
+void ProxyServer::respond(ExchangePtr const& exchange, HttpResponse *res, char *chunk, size_t chunk_len) {
+    bool done = exchange->onChunk(res, chunk_len);
+    // cache and waiters take the identity body, before compression touches the headers
+    exchange->fillCache(res, chunk, chunk_len);
+    exchange->relay(res, chunk, chunk_len, done);
+    exchange->deliver(res, chunk, chunk_len, done);
+    if(done) {
+        ExchangeTable::instance().take(res);
+        exchange->storeCache();
+        int64_t now = common::steadyNanos();
+        int64_t latency = now - exchange->startNanos();
+        DstPeerPtr const& peer = exchange->peer();
+        peer->onComplete(latency);
+        int64_t slowNanos = exchange->vhost()->slowNanos();
+        if(exchange->claimResult()) {
+            peer->onResult(exchange->status() < 500 && (slowNanos == 0 || latency <= slowNanos), now);
+        }
+        if(exchange->attempts() > 0 && exchange->status() < 500) {
+            exchange->retryPolicy()->onSucceeded();
+        }
+        if(exchange->hedgePolicy()) {
+            exchange->hedgePolicy()->record(latency);
+        }
+        exchange->releaseTicket(latency);
+        exchange->recordMetrics(exchange->status());
+    }
+}
+
+ExchangePtr ProxyServer::openExchange(VirtualHostPtr const& vhost, HttpRequest *req, HttpResponse *res) {
+    DstPeer *peer = vhost->upstream().select(req);
+    if(peer == NULL) {
+        sendNotFound(req, res);
+        return nullptr;
+    }
+    // a saturated peer sheds only when every other one is saturated too
+    DstPeerPtr fallback;
+    if(vhost->maxPending() > 0 && peer->outstanding() >= vhost->maxPending()) {
+        LOG_warn("Proxy Server %s:%d circuit open on %s:%d, %d pending", m_host.c_str(), m_port, peer->host().c_str(), peer->port(), peer->outstanding());
+        fallback = unsaturatedPeer(vhost, req);
+        if(!fallback) {
+            sendServiceUnavailable(res);
+            return nullptr;
+        }
+        peer = fallback.get();
+    }
+    peer->onSend();
+    ExchangePtr exchange = std::make_shared<Exchange>(vhost, peer->shared_from_this());
+    // a queued request has no client request anymore, it was complete when it started waiting
+    exchange->setRequestSent(req == NULL || http_request_is_finished(req));
+    ExchangePtr stale = ExchangeTable::instance().put(res, exchange);
+    if(stale) {
+        // the response object was recycled before its last chunk was seen
+        stale->peer()->onFailure();
+        stale->releaseTicket(-1);
+        stale->failFlight();
+    }
+    return exchange;
+}
+
+void ProxyServer::watch(ExchangePtr const& exchange) {
+    int64_t slowNanos = exchange->vhost()->slowNanos();
+    if(slowNanos > 0) {
+        // a blackholed peer never completes a response, count it failed at the outlier timeout already
+        std::weak_ptr<Exchange> weak = exchange;
+        DeadlineTimer::instance().schedule(common::steadyNanos() + slowNanos, [weak]() {
+            ExchangePtr exchange = weak.lock();
+            if(exchange && exchange->claimResult()) {
+                exchange->peer()->onResult(false, common::steadyNanos());
+            }
+        });
+    }
+}
+
+bool ProxyServer::submit(ExchangePtr const& exchange) {
+    SubmitResult result = exchange->peer()->pool()->submit(exchange);
+    if(result == SUBMIT_FULL) {
+        shedExchange(exchange);
+    }
+    return result != SUBMIT_CLOSED;
+}
+
+void ProxyServer::forward(ExchangePtr const& exchange, HttpRequest *req, HttpResponse *res, char *chunk, size_t len) {
+    DstPeerPtr const& peer = exchange->peer();
+    watch(exchange);
+    http_request_set_header(req, "Host", peer->host().c_str());
+    LOG_trace("Proxy Server send to %s:%d", peer->host().c_str(), peer->port());
+    UpstreamPoolPtr const& pool = peer->pool();
+    if(pool && exchange->requestSent() && http_request_get_header(req, "Transfer-Encoding") == NULL) {
+        // the whole request is at hand, it goes out on a pooled keep-alive connection
+        std::string wire;
+        if(serializeRequest(req, chunk, len, wire)) {
+            exchange->setWire(res, http_request_get_method(req), wire);
+            if(submit(exchange)) {
+                return ;
+            }
+            if(exchange->race()) {
+                onUpstreamError(exchange, "upstream pool closed", false);
+                return ;
+            }
+        }
+    }
+    http_manager_write_to(m_httpManager, peer->host().c_str(), peer->port(), req, chunk, len);
+}
+
+bool ProxyServer::coalescible(HttpRequest *req) {
+    const char *method = http_request_get_method(req);
+    // credentials and ranges may change the answer, such requests always go upstream on their own
+    return method != NULL && strcmp(method, "GET") == 0 && http_request_is_finished(req) && 
+           http_request_get_header(req, "Authorization") == NULL && http_request_get_header(req, "Cookie") == NULL &&
+           http_request_get_header(req, "Range") == NULL;
 }
 
 
@@ -152,4 +1041,20 @@ void ProxyServer::sendNotFound(HttpRequest *req, HttpResponse *res) {
     http_response_send_all(res, body, strlen(body));
 }
 
+void ProxyServer::recordLocal(VirtualHostPtr const& vhost, Location const& loc, int status, int64_t start, size_t bytesIn, size_t bytesOut) {
+    int64_t latency = common::steadyNanos() - start;
+    Metrics::instance().record(vhost->metrics(), status, latency, -1, bytesIn, bytesOut);
+    Metrics::instance().record(loc.metrics.get(), status, latency, -1, bytesIn, bytesOut);
+    common::AccessLog::instance().write(vhost->accessId(), loc.accessId, 0, status, latency, -1, bytesIn, bytesOut);
+}
 
+void ProxyServer::sendCached(HttpResponse *res, CachedResponse const& cached, int64_t now) {
+    http_response_set_status(res, cached.status);
+    for(size_t i = 0; i < cached.headers.size(); i++) {
+        http_response_set_header(res, cached.headers[i].first.c_str(), cached.headers[i].second.c_str());
+    }
+    std::string age = std::to_string((now - cached.storedNanos) / 1000000000LL);
+    http_response_set_header(res, "Age", age.c_str());
+    http_response_set_header(res, "X-Cache", "HIT");
+    http_response_send_all(res, cached.body.data(), cached.body.length());
+}
@@ -3,10 +3,21 @@
 #include <libcommon/Common.h>
 #include <libcommon/GlobalConfig.h>
 #include <libcommon/Logger.h>
+#include <libcommon/Snapshot.h>
 #include <libhandler/HttpHandler.h>
 
+#include <mutex>
 #include <atomic>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include "HostRouter.h"
+#include "VirtualHost.h"
+#include "Exchange.h"
+#include "UpstreamPool.h"
+#include "TcpProxyServer.h"
+#include "TlsContext.h"
 
 #include "archer_net.h"
 
@@ -14,17 +25,121 @@ namespace archer
 {
 namespace server 
 {
-class ProxyServer
-{
 typedef struct {
-    std::string host;
-    int port;
-} DstPeer;
+    std::vector<VirtualHostPtr>  hosts;
+    std::unique_ptr<HostRouter>  router;
+    // serves requests whose Host matches no server name, may be null
+    VirtualHostPtr               fallback;
+} HostTable;
+
+typedef struct {
+    int                          refs;
+    // the option the sub connection was opened with, it must outlive it
+    SSLOptionPtr                 ssl;
+} SubConnection;
+
+// a request waiting on a concurrency limit, with all dispatch needs once it holds its slots.
+// The client request may be gone by then, what dispatch reads from it is taken when it starts waiting.
+typedef struct {
+    VirtualHostPtr               vhost;
+    Location                     loc;
+    HttpResponse                *res;
+    // the serialized request with its body, the Host line is set per peer
+    std::string                  wire;
+    std::string                  method;
+    std::string                  acceptEncoding;
+    ContentEncoding              encoding;
+    size_t                       bytesIn;
+    std::string                  cacheKey;
+    FlightPtr                    flight;
+    std::string                  flightKey;
+    // limiters in acquisition order, the ones before stage are held by ticket
+    std::vector<ConcurrencyLimiterPtr> limits;
+    size_t                       stage;
+    ConcurrencyTicketPtr         ticket;
+    int64_t                      start;
+    int                          logLevel;
+    // held while res is written, the http error callback sets dropped under it once the client is gone
+    std::mutex                   mutex;
+    bool                         dropped = false;
+} Admission;
+
+typedef std::shared_ptr<Admission> AdmissionPtr;
+
+/**
+ * Process wide table of the requests waiting on concurrency limits keyed by
+ * the client response, for the http error callback to drop them.
+*/
+class AdmissionTable
+{
+static const size_t SHARDS = 64;
+
 typedef struct {
-    int         order;
-    std::string src;
-    std::string dst;
-} Location;
+    std::mutex                                       mutex;
+    std::unordered_map<HttpResponse *, AdmissionPtr> admissions;
+} Shard;
+
+public:
+
+    static AdmissionTable& instance() {
+        static AdmissionTable instance;
+        return instance;
+    }
+
+    AdmissionTable(const AdmissionTable&) = delete;
+    AdmissionTable& operator=(const AdmissionTable&) = delete;
+
+    void put(HttpResponse *res, AdmissionPtr const& admission) {
+        Shard& shard = shardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.admissions[res] = admission;
+    }
+
+    // removes the entry only while it still is admission
+    void takeIf(HttpResponse *res, AdmissionPtr const& admission) {
+        Shard& shard = shardOf(res);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.admissions.find(res);
+        if(it != shard.admissions.end() && it->second == admission) {
+            shard.admissions.erase(it);
+        }
+    }
+
+    // the client of res is gone, waits for a dispatch in progress to hand it to the exchange table
+    void drop(HttpResponse *res) {
+        AdmissionPtr admission;
+        {
+            Shard& shard = shardOf(res);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.admissions.find(res);
+            if(it == shard.admissions.end()) {
+                return ;
+            }
+            admission.swap(it->second);
+            shard.admissions.erase(it);
+        }
+        std::lock_guard<std::mutex> lock(admission->mutex);
+        admission->dropped = true;
+    }
+
+private:
+
+    AdmissionTable() {}
+
+    Shard& shardOf(HttpResponse *res) {
+        return m_shards[(((uintptr_t) res) >> 4) % SHARDS];
+    }
+
+    Shard m_shards[SHARDS];
+};
+
+/**
+ * One listener and its event loop pool. Every request is first mapped to a
+ * virtual host by its Host header, then routed by that host's location table,
+ * so any number of proxies with server_names can share an address:port.
+*/
+class ProxyServer
+{
 public:
 
     ProxyServer(std::string const& host, std::uint16_t port);
@@ -33,9 +148,29 @@ public:
     ProxyServer(const ProxyServer&) = delete;
     ProxyServer& operator=(const ProxyServer&) = delete;
 
-    void addPeer(std::string const& host, int port);
+    // false when one of its server names, or the default slot, is already taken
+    bool addVirtualHost(VirtualHostPtr const& vhost);
+
+    bool delVirtualHost(std::string const& id);
+
+    VirtualHostPtr findVirtualHost(std::string const& id);
+
+    size_t virtualHostCount();
+
+    // peers of all virtual hosts share one sub connection per host:port, ssl is set for https backends
+    void addPeer(VirtualHostPtr const& vhost, std::string const& host, int port, int weight = 1, SSLOptionPtr const& ssl = nullptr);
 
-    void delPeer(std::string const& host, int port);
+    void delPeer(VirtualHostPtr const& vhost, std::string const& host, int port);
+
+    void onPeerError(const char *host, int port);
+
+    // terminates TLS in front of the listener, before startAsync
+    void setTls(TlsContextPtr const& tls) {
+        m_tls = tls;
+    }
+
+    // null for plaintext listeners
+    TlsContextPtr const& tls() const {return m_tls;}
 
     void startAsync();
 
@@ -45,6 +180,25 @@ public:
     
     void onResponse(HttpResponse *res, char *chunk, size_t chunk_len);
 
+    // callbacks of pooled upstream connections, ignored once the exchange is no longer current
+    void onUpstreamHead(ExchangePtr const& exchange, int status, HeaderList const& headers);
+
+    void onUpstreamBody(ExchangePtr const& exchange, const char *data, size_t len);
+
+    void onUpstreamComplete(ExchangePtr const& exchange);
+
+    // sent is false when no byte of the request reached the upstream
+    void onUpstreamError(ExchangePtr const& exchange, const char *error, bool sent);
+
+    // the pool of the peer has too many waiting requests, retries elsewhere or answers 503
+    void shedExchange(ExchangePtr const& exchange);
+
+    // resends a failed exchange to another peer, false when the policy or the budget says no
+    bool retry(ExchangePtr const& failed, bool sent);
+
+    // races a copy of a request that has not been answered within its hedge delay
+    void hedge(ExchangePtr const& primary);
+
     void sendNotFound(HttpRequest *req, HttpResponse *res);
 
     bool isActive() {return m_active;}
@@ -53,33 +207,6 @@ public:
         m_threads = threadNum;
     }
 
-    void addLocation(int order, std::string const& src, std::string const& dst) {
-        Location loc{order, src, dst};
-        std::lock_guard<std::mutex> lock(m_uriMutex);
-        for(int i = 0; i < m_locations.size(); i++) {
-            if(src == m_locations[i].src) {
-                return ;
-            }
-        }
-        LOG_info("Proxy Server %s:%d add location %s:%s", m_host.c_str(), m_port, src.c_str(), dst.c_str());
-        m_locations.push_back(loc);
-        std::sort(m_locations.begin(), m_locations.end(), [](const Location& s1, const Location& s2) { return s1.order < s2.order;});
-    }
-
-    void delLocation(std::string const& src, std::string const& dst) {
-        int idx = 0;
-        std::lock_guard<std::mutex> lock(m_uriMutex);
-        for(; idx < m_locations.size(); idx++) {
-            if(src == m_locations[idx].src && dst == m_locations[idx].dst) {
-                break ;
-            }
-        }
-        LOG_info("Proxy Server %s:%d delete location %s:%s", m_host.c_str(), m_port, src.c_str(), dst.c_str());
-        if(idx < m_locations.size()) {
-            m_locations.erase(m_locations.begin() + idx);
-        }
-    }
-
     std::string& getHost() {
         return m_host;
     }
@@ -90,10 +217,59 @@ public:
 
 private:
 
-    void sendRequsetToPeer(HttpRequest *req, HttpResponse *res, char *chunked, size_t len);
+    // picks the peer and registers the exchange, null after an error response was sent
+    ExchangePtr openExchange(VirtualHostPtr const& vhost, HttpRequest *req, HttpResponse *res);
+
+    // sends a request that passed cache, coalescing and concurrency limits upstream,
+    // a queued one goes from what it kept and req is null
+    void dispatch(VirtualHostPtr const& vhost, Location const& loc, HttpRequest *req, HttpResponse *res, char *chunk, size_t chunk_len,
+                  std::string const& cacheKey, FlightPtr const& flight, std::string const& flightKey, ConcurrencyTicketPtr const& ticket,
+                  Admission *queued = NULL);
+
+    // takes the remaining slots of a queued request, dispatched once it holds all of them
+    void acquireSlots(AdmissionPtr const& admission);
+
+    // ends a queued request with its upstream exchange or a 503, unless its client is gone
+    void finishQueued(AdmissionPtr const& admission, bool admitted);
+
+    // answers 503 to a request over the concurrency limit, and to the waiters of its flight
+    static void shed(HttpResponse *res, FlightPtr const& flight, std::string const& flightKey);
+
+    void forward(ExchangePtr const& exchange, HttpRequest *req, HttpResponse *res, char *chunked, size_t len);
+
+    // counts the exchange failed at the outlier timeout unless it has completed by then
+    static void watch(ExchangePtr const& exchange);
+
+    // hands a serialized exchange to the pool of its peer, false when the pool is closed
+    bool submit(ExchangePtr const& exchange);
+
+    void respond(ExchangePtr const& exchange, HttpResponse *res, char *chunk, size_t chunk_len);
+
+    // whether a pooled exchange may still write to its client response
+    bool admit(ExchangePtr const& exchange);
+
+    void cancel(ExchangePtr const& loser);
+
+    static bool coalescible(HttpRequest *req);
+
+    // a peer the exchange has not been sent to yet, or null
+    static DstPeerPtr retryPeer(ExchangePtr const& failed);
+
+    // another available peer under the circuit breaker limit, null when all of them are at it
+    static DstPeerPtr unsaturatedPeer(VirtualHostPtr const& vhost, HttpRequest *req);
+
+    void sendCached(HttpResponse *res, CachedResponse const& cached, int64_t now);
+
+    // metrics and access record of a request answered here, with no upstream involved
+    static void recordLocal(VirtualHostPtr const& vhost, Location const& loc, int status, int64_t start, size_t bytesIn, size_t bytesOut);
 
     void doStart();
 
+    void compileHosts();
+
+    // lock free, valid until this thread resolves again
+    VirtualHostPtr const& resolveHost(HttpRequest *req);
+
     HttpManager                 *m_httpManager;
     uint16_t                     m_threads = 0;
 
@@ -101,16 +277,26 @@ private:
     int                          m_port = 0;
 
     bool                         m_active = false;
+    std::atomic<bool>            m_closing{false};
     Json::Reader                 m_jsonReader;
 
     std::mutex                   m_peerMutex;
-    int                          m_peerIdx = 0;
-    std::vector<DstPeer>         m_peers;
+    std::unordered_map<std::string, SubConnection> m_subConnections;
+    // event loops of the pooled upstream connections, created with the first pooled peer
+    std::unique_ptr<UpstreamLoops> m_loops;
+
+    // archer_net has no TLS http manager, TLS is terminated on the public address:port
+    // and relayed to the manager listening on the tls internal_port of loopback. The
+    // relay sets X-Forwarded-For to the client address, the manager itself only sees
+    // 127.0.0.1. Local processes can reach the loopback port directly, so the relay
+    // also sends a secret drawn at start and requests without it are refused.
+    TlsContextPtr                m_tls;
+    std::unique_ptr<TcpProxyServer> m_tlsFront;
+    std::string                  m_relaySecret;
 
-    std::mutex                   m_uriMutex;
-    std::vector<Location>        m_locations;
-    // std::vector<std::string>     m_srcUris;
-    // std::vector<std::string>     m_dstUris;
+    std::mutex                   m_hostMutex;
+    std::vector<VirtualHostPtr>  m_vhosts;
+    common::Snapshot<HostTable>  m_hostTable;
 };
 }
 }
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include "RateLimiter.h"
+
+#include <algorithm>
+
+using namespace archer::server;
+
+static const uint64_t MILLI = 1000;
+
+inline static uint64_t hashKey(const char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    // zero marks an empty slot
+    return h == 0 ? 1 : h;
+}
+
+inline static uint64_t packState(uint32_t stampMs, uint64_t tokens) {
+    return ((uint64_t) stampMs << 32) | (tokens & 0xffffffffULL);
+}
+
+RateLimiter::RateLimiter(RateLimitConfig const& config) : m_config(config), m_epoch(archer::common::steadyNanos()) {
+    if(m_config.rate == 0) {
+        m_config.rate = 1;
+    }
+    if(m_config.burst == 0) {
+        m_config.burst = m_config.rate;
+    }
+    // the tokens field is 32 bits of thousandths
+    if(m_config.burst > 4000000) {
+        m_config.burst = 4000000;
+    }
+    m_burstMilli = (uint64_t) m_config.burst * MILLI;
+    m_fullAfterMs = (uint32_t) (m_burstMilli / m_config.rate + 1);
+    size_t perShard = 1;
+    size_t wanted = m_config.perRoute ? 1 : (m_config.maxKeys + SHARDS - 1) / SHARDS;
+    while(perShard < wanted || perShard < MAX_PROBE) {
+        perShard <<= 1;
+    }
+    m_shardMask = perShard - 1;
+    m_slots = std::vector<Slot>(perShard * SHARDS);
+    for(size_t i = 0; i < m_slots.size(); i++) {
+        m_slots[i].hash.store(0, std::memory_order_relaxed);
+        m_slots[i].state.store(0, std::memory_order_relaxed);
+    }
+}
+
+bool RateLimiter::parseKey(std::string const& spec, RateLimitConfig& config) {
+    config.perRoute = spec == "route";
+    if(config.perRoute) {
+        config.key.type = HASH_KEY_PATH;
+        config.key.name.clear();
+        return true;
+    }
+    return parseHashKey(spec, config.key) && config.key.type != HASH_KEY_PATH;
+}
+
+uint32_t RateLimiter::nowMs() const {
+    return (uint32_t) ((archer::common::steadyNanos() - m_epoch) / 1000000);
+}
+
+bool RateLimiter::take(HttpRequest *req, int& retryAfter) {
+    uint64_t hash = 1;
+    if(!m_config.perRoute) {
+        const char *data = NULL;
+        size_t len = 0;
+        // requests without the key share one bucket, they cannot dodge the limit by omitting it
+        if(requestKey(req, m_config.key, data, len)) {
+            hash = hashKey(data, len);
+        }
+    }
+    return take(hash, nowMs(), retryAfter);
+}
+
+bool RateLimiter::take(uint64_t hash, uint32_t nowMs, int& retryAfter) {
+    std::atomic<uint64_t>& state = acquire(hash, nowMs).state;
+    uint64_t old = state.load(std::memory_order_relaxed);
+    while(true) {
+        // unsigned arithmetic keeps the elapsed time right across the 49 day wrap
+        uint32_t elapsed = nowMs - (uint32_t) (old >> 32);
+        uint64_t tokens = old & 0xffffffffULL;
+        tokens = elapsed >= m_fullAfterMs ? m_burstMilli : std::min(m_burstMilli, tokens + (uint64_t) elapsed * m_config.rate);
+        bool allowed = tokens >= MILLI;
+        uint64_t next = packState(nowMs, allowed ? tokens - MILLI : tokens);
+        if(state.compare_exchange_weak(old, next, std::memory_order_relaxed)) {
+            if(allowed) {
+                m_allowed.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+            uint64_t waitMs = (MILLI - tokens + m_config.rate - 1) / m_config.rate;
+            retryAfter = (int) ((waitMs + 999) / 1000);
+            m_limited.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+}
+
+RateLimiter::Slot& RateLimiter::acquire(uint64_t hash, uint32_t nowMs) {
+    size_t base = (hash % SHARDS) * (m_shardMask + 1);
+    size_t start = (size_t) (hash >> 6);
+    Slot *oldest = NULL;
+    uint32_t oldestIdle = 0;
+    for(size_t i = 0; i < MAX_PROBE && i <= m_shardMask; i++) {
+        Slot& slot = m_slots[base + ((start + i) & m_shardMask)];
+        uint64_t seen = slot.hash.load(std::memory_order_acquire);
+        if(seen == hash) {
+            return slot;
+        }
+        uint32_t idle = nowMs - (uint32_t) (slot.state.load(std::memory_order_relaxed) >> 32);
+        if(seen == 0 || idle >= m_fullAfterMs) {
+            // empty or as good as empty, a full bucket stamped now is what a new key starts with
+            if(slot.hash.compare_exchange_strong(seen, hash, std::memory_order_acq_rel)) {
+                slot.state.store(packState(nowMs, m_burstMilli), std::memory_order_relaxed);
+                if(seen != 0) {
+                    m_evictions.fetch_add(1, std::memory_order_relaxed);
+                }
+                return slot;
+            }
+            if(seen == hash) {
+                return slot;
+            }
+            // another key just took it, still a candidate so the window never runs out of them
+            idle = 0;
+        }
+        if(oldest == NULL || idle > oldestIdle) {
+            oldest = &slot;
+            oldestIdle = idle;
+        }
+    }
+    // every slot of the window is busy, recycle the least recently used one
+    uint64_t seen = oldest->hash.load(std::memory_order_relaxed);
+    if(seen != hash && oldest->hash.compare_exchange_strong(seen, hash, std::memory_order_acq_rel)) {
+        oldest->state.store(packState(nowMs, m_burstMilli), std::memory_order_relaxed);
+        m_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    return *oldest;
+}
+
+RateLimitStats RateLimiter::stats() {
+    return RateLimitStats{m_allowed.load(), m_limited.load(), m_evictions.load()};
+}
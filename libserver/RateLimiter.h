@@ -0,0 +1,97 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "Balancer.h"
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    // "route" for one bucket per location, otherwise a hash key: "ip", "header:<name>", "query:<name>" as in HashKey
+    bool        perRoute;
+    HashKey     key;
+    // tokens per second and bucket size
+    uint32_t    rate;
+    uint32_t    burst;
+    // buckets tracked at once, idle ones are reused first
+    size_t      maxKeys;
+} RateLimitConfig;
+
+typedef struct {
+    uint64_t allowed;
+    uint64_t limited;
+    uint64_t evictions;
+} RateLimitStats;
+
+/**
+ * Token bucket rate limit of one location.
+ *
+ * Buckets live in a sharded open addressing table of fixed size, one slot is
+ * two atomic words: the 64 bit hash of the key and the bucket state, packed as
+ * the last refill in milliseconds and the tokens in thousandths. take() is a
+ * short probe and one CAS, no lock and no allocation. A bucket idle for long
+ * enough to be full again is indistinguishable from a new one, so such slots
+ * are reused for other keys without changing any decision. When a probe window
+ * holds no such slot its least recently used bucket is recycled.
+*/
+class RateLimiter
+{
+static const size_t SHARDS = 64;
+static const size_t MAX_PROBE = 16;
+
+typedef struct {
+    std::atomic<uint64_t> hash;
+    std::atomic<uint64_t> state;
+} Slot;
+
+public:
+
+    explicit RateLimiter(RateLimitConfig const& config);
+    ~RateLimiter() {}
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    RateLimitConfig const& config() const {return m_config;}
+
+    // true when the request may pass, otherwise retryAfter holds the seconds until a token is back
+    bool take(HttpRequest *req, int& retryAfter);
+
+    // the same for a precomputed key hash and a steady clock in milliseconds
+    bool take(uint64_t hash, uint32_t nowMs, int& retryAfter);
+
+    // "route", "ip", "header:<name>" or "query:<name>"
+    static bool parseKey(std::string const& spec, RateLimitConfig& config);
+
+    RateLimitStats stats();
+
+private:
+
+    Slot& acquire(uint64_t hash, uint32_t nowMs);
+
+    uint32_t nowMs() const;
+
+    RateLimitConfig              m_config;
+    int64_t                      m_epoch;
+    size_t                       m_shardMask;
+    uint64_t                     m_burstMilli;
+    // milliseconds for an empty bucket to fill up
+    uint32_t                     m_fullAfterMs;
+    std::vector<Slot>            m_slots;
+    std::atomic<uint64_t>        m_allowed{0};
+    std::atomic<uint64_t>        m_limited{0};
+    std::atomic<uint64_t>        m_evictions{0};
+};
+
+typedef std::shared_ptr<RateLimiter> RateLimiterPtr;
+}
+}
@@ -0,0 +1,163 @@
+#include "ResponseCache.h"
+
+#include <time.h>
+#include <algorithm>
+
+using namespace archer::server;
+
+inline static std::string lowerHeader(const char *value) {
+    std::string lower(value == NULL ? "" : value);
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    return lower;
+}
+
+// value of "name=N" in a Cache-Control header, -1 when absent
+inline static long directiveSeconds(std::string const& cacheControl, const char *name) {
+    size_t pos = cacheControl.find(name);
+    while(pos != std::string::npos) {
+        size_t end = pos + strlen(name);
+        bool start = pos == 0 || cacheControl[pos - 1] == ' ' || cacheControl[pos - 1] == ',';
+        if(start && end < cacheControl.length() && cacheControl[end] == '=') {
+            return strtol(cacheControl.c_str() + end + 1, NULL, 10);
+        }
+        pos = cacheControl.find(name, end);
+    }
+    return -1;
+}
+
+inline static bool cacheableStatus(int status) {
+    switch(status) {
+        case 200: case 203: case 204: case 300: case 301: case 404: case 410:
+            return true;
+        default:
+            return false;
+    }
+}
+
+CachedResponsePtr ResponseCache::get(std::string const& key, int64_t now) {
+    Shard& shard = shardOf(key);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if(it != shard.index.end()) {
+            Slot& slot = shard.ring[it->second];
+            if(slot.value->expiresNanos > now) {
+                slot.referenced = true;
+                m_hits.fetch_add(1, std::memory_order_relaxed);
+                return slot.value;
+            }
+            removeSlot(shard, it->second);
+        }
+    }
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void ResponseCache::put(std::string const& key, CachedResponsePtr const& value) {
+    size_t bytes = key.length() + sizeOf(*value);
+    if(bytes > m_config.maxObjectBytes || bytes > m_shardBytes) {
+        return ;
+    }
+    int64_t now = value->storedNanos;
+    Shard& shard = shardOf(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(key);
+    if(it != shard.index.end()) {
+        removeSlot(shard, it->second);
+    }
+    // CLOCK sweep, stale entries go regardless of their reference bit
+    while(shard.bytes + bytes > m_shardBytes && !shard.index.empty()) {
+        shard.hand = shard.hand % shard.ring.size();
+        Slot& slot = shard.ring[shard.hand];
+        if(slot.value) {
+            if(slot.referenced && slot.value->expiresNanos > now) {
+                slot.referenced = false;
+            } else {
+                removeSlot(shard, shard.hand);
+                m_evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        shard.hand++;
+    }
+    size_t idx;
+    if(shard.freeSlots.empty()) {
+        idx = shard.ring.size();
+        shard.ring.push_back(Slot{key, value, bytes, false});
+    } else {
+        idx = shard.freeSlots.back();
+        shard.freeSlots.pop_back();
+        shard.ring[idx] = Slot{key, value, bytes, false};
+    }
+    shard.index[key] = idx;
+    shard.bytes += bytes;
+}
+
+void ResponseCache::removeSlot(Shard& shard, size_t idx) {
+    Slot& slot = shard.ring[idx];
+    shard.index.erase(slot.key);
+    shard.bytes -= slot.bytes;
+    slot.key.clear();
+    slot.value.reset();
+    slot.referenced = false;
+    shard.freeSlots.push_back(idx);
+}
+
+CacheStats ResponseCache::stats() {
+    CacheStats stats{m_hits.load(), m_misses.load(), m_evictions.load(), 0, 0};
+    for(size_t i = 0; i < SHARDS; i++) {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        stats.entries += m_shards[i].index.size();
+        stats.bytes += m_shards[i].bytes;
+    }
+    return stats;
+}
+
+int ResponseCache::freshness(HttpResponse *res) const {
+    if(!cacheableStatus(http_response_get_status(res)) || http_response_get_header(res, "Set-Cookie") != NULL) {
+        return -1;
+    }
+    const char *vary = http_response_get_header(res, "Vary");
+    if(vary != NULL && lowerHeader(vary) != "accept-encoding") {
+        return -1;
+    }
+    std::string cacheControl = lowerHeader(http_response_get_header(res, "Cache-Control"));
+    if(cacheControl.find("no-store") != std::string::npos || cacheControl.find("no-cache") != std::string::npos ||
+       cacheControl.find("private") != std::string::npos) {
+        return -1;
+    }
+    long seconds = directiveSeconds(cacheControl, "s-maxage");
+    if(seconds < 0) {
+        seconds = directiveSeconds(cacheControl, "max-age");
+    }
+    if(seconds < 0) {
+        const char *expires = http_response_get_header(res, "Expires");
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        if(expires != NULL && strptime(expires, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL) {
+            seconds = (long) (timegm(&tm) - time(NULL));
+        } else if(expires == NULL) {
+            seconds = m_config.defaultTtlSeconds;
+        }
+    }
+    return seconds > 0 ? (int) std::min<long>(seconds, INT32_MAX) : -1;
+}
+
+bool ResponseCache::requestCacheable(HttpRequest *req) {
+    const char *method = http_request_get_method(req);
+    if(method == NULL || strcmp(method, "GET") != 0 || http_request_get_header(req, "Authorization") != NULL) {
+        return false;
+    }
+    std::string cacheControl = lowerHeader(http_request_get_header(req, "Cache-Control"));
+    if(cacheControl.find("no-store") != std::string::npos || cacheControl.find("no-cache") != std::string::npos) {
+        return false;
+    }
+    return lowerHeader(http_request_get_header(req, "Pragma")).find("no-cache") == std::string::npos;
+}
+
+size_t ResponseCache::sizeOf(CachedResponse const& value) {
+    size_t bytes = sizeof(CachedResponse) + value.body.length();
+    for(size_t i = 0; i < value.headers.size(); i++) {
+        bytes += value.headers[i].first.length() + value.headers[i].second.length() + 2 * sizeof(std::string);
+    }
+    return bytes;
+}
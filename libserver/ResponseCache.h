@@ -0,0 +1,120 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    size_t  maxBytes;
+    size_t  maxObjectBytes;
+    // freshness of responses without Cache-Control max-age or Expires, 0 never caches them
+    int     defaultTtlSeconds;
+} CacheConfig;
+
+typedef std::vector<std::pair<std::string, std::string>> HeaderList;
+
+typedef struct {
+    int          status;
+    HeaderList   headers;
+    std::string  body;
+    // request Accept-Encoding the entry was stored for, when the upstream sent Vary: Accept-Encoding
+    bool         varyEncoding;
+    std::string  encoding;
+    int64_t      storedNanos;
+    int64_t      expiresNanos;
+} CachedResponse;
+
+typedef std::shared_ptr<const CachedResponse> CachedResponsePtr;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t entries;
+    uint64_t bytes;
+} CacheStats;
+
+/**
+ * Byte bounded response cache of one location.
+ *
+ * Keys are spread over SHARDS independent shards, each with its own lock, index
+ * and CLOCK ring: a hit only sets the reference bit, an insert sweeps the hand
+ * over the ring, giving referenced entries a second chance and evicting the
+ * rest until the new entry fits in the shard's share of maxBytes.
+*/
+class ResponseCache
+{
+static const size_t SHARDS = 16;
+
+typedef struct {
+    std::string          key;
+    CachedResponsePtr    value;
+    size_t               bytes;
+    bool                 referenced;
+} Slot;
+
+typedef struct {
+    std::mutex                              mutex;
+    std::unordered_map<std::string, size_t> index;
+    std::vector<Slot>                       ring;
+    std::vector<size_t>                     freeSlots;
+    size_t                                  hand = 0;
+    size_t                                  bytes = 0;
+} Shard;
+
+public:
+
+    explicit ResponseCache(CacheConfig const& config) : m_config(config), m_shardBytes(config.maxBytes / SHARDS) {}
+    ~ResponseCache() {}
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    CacheConfig const& config() const {return m_config;}
+
+    // null on a miss or when the entry went stale
+    CachedResponsePtr get(std::string const& key, int64_t now);
+
+    void put(std::string const& key, CachedResponsePtr const& value);
+
+    CacheStats stats();
+
+    // seconds the upstream response may be served from cache, -1 when it must not be stored
+    int freshness(HttpResponse *res) const;
+
+    // false when the client asks to bypass caches
+    static bool requestCacheable(HttpRequest *req);
+
+    static size_t sizeOf(CachedResponse const& value);
+
+private:
+
+    Shard& shardOf(std::string const& key) {
+        return m_shards[std::hash<std::string>()(key) % SHARDS];
+    }
+
+    void removeSlot(Shard& shard, size_t idx);
+
+    CacheConfig                  m_config;
+    size_t                       m_shardBytes;
+    Shard                        m_shards[SHARDS];
+
+    std::atomic<uint64_t>        m_hits{0};
+    std::atomic<uint64_t>        m_misses{0};
+    std::atomic<uint64_t>        m_evictions{0};
+};
+
+typedef std::shared_ptr<ResponseCache> ResponseCachePtr;
+}
+}
@@ -0,0 +1,183 @@
+#include "ResponseParser.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+using namespace archer::server;
+
+inline static std::string trim(const char *begin, const char *end) {
+    while(begin < end && (*begin == ' ' || *begin == '\t')) {
+        begin++;
+    }
+    while(end > begin && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    return std::string(begin, end - begin);
+}
+
+inline static bool containsToken(std::string const& value, const char *token) {
+    std::string lower(value);
+    for(size_t i = 0; i < lower.length(); i++) {
+        lower[i] = (char) tolower(lower[i]);
+    }
+    return lower.find(token) != std::string::npos;
+}
+
+void ResponseParser::reset(bool noBody) {
+    m_state = STATE_HEAD;
+    m_noBody = noBody;
+    m_keepAlive = true;
+    m_remaining = 0;
+    m_line.clear();
+}
+
+ssize_t ResponseParser::feed(const char *data, size_t len, Listener& listener) {
+    size_t off = 0;
+    while(off < len && m_state != STATE_COMPLETE) {
+        switch(m_state) {
+            case STATE_HEAD:
+            case STATE_CHUNK_SIZE:
+            case STATE_TRAILERS: {
+                // line oriented states, look for the end of the line or of the head
+                size_t searchFrom = m_line.length() > 3 ? m_line.length() - 3 : 0;
+                m_line.append(data + off, len - off);
+                const char *eol = m_state == STATE_HEAD ? "\r\n\r\n" : "\r\n";
+                size_t pos = m_line.find(eol, searchFrom);
+                if(pos == std::string::npos) {
+                    if(m_line.length() > MAX_HEAD_BYTES) {
+                        return -1;
+                    }
+                    off = len;
+                    break;
+                }
+                size_t end = pos + strlen(eol);
+                // give back what belongs past the line
+                off = len - (m_line.length() - end);
+                m_line.resize(end);
+                if(m_state == STATE_HEAD) {
+                    if(!parseHead(listener)) {
+                        return -1;
+                    }
+                } else if(m_state == STATE_CHUNK_SIZE) {
+                    char *hexEnd = NULL;
+                    m_remaining = strtoull(m_line.c_str(), &hexEnd, 16);
+                    if(hexEnd == m_line.c_str()) {
+                        return -1;
+                    }
+                    m_state = m_remaining == 0 ? STATE_TRAILERS : STATE_CHUNK_DATA;
+                } else if(m_line.length() == 2) {
+                    finish(listener);
+                }
+                m_line.clear();
+                break;
+            }
+            case STATE_BODY_LENGTH:
+            case STATE_CHUNK_DATA: {
+                size_t n = len - off < m_remaining ? len - off : (size_t) m_remaining;
+                listener.onBody(data + off, n);
+                off += n;
+                m_remaining -= n;
+                if(m_remaining == 0) {
+                    if(m_state == STATE_BODY_LENGTH) {
+                        finish(listener);
+                    } else {
+                        m_state = STATE_CHUNK_CRLF;
+                        m_remaining = 2;
+                    }
+                }
+                break;
+            }
+            case STATE_CHUNK_CRLF: {
+                size_t n = len - off < m_remaining ? len - off : (size_t) m_remaining;
+                off += n;
+                m_remaining -= n;
+                if(m_remaining == 0) {
+                    m_state = STATE_CHUNK_SIZE;
+                }
+                break;
+            }
+            case STATE_BODY_CLOSE:
+                listener.onBody(data + off, len - off);
+                off = len;
+                break;
+            default:
+                break;
+        }
+    }
+    return (ssize_t) off;
+}
+
+bool ResponseParser::onClose(Listener& listener) {
+    if(m_state == STATE_BODY_CLOSE) {
+        finish(listener);
+        return true;
+    }
+    return m_state == STATE_COMPLETE;
+}
+
+bool ResponseParser::parseHead(Listener& listener) {
+    const char *head = m_line.c_str();
+    if(strncmp(head, "HTTP/1.", 7) != 0 || m_line.length() < 12) {
+        return false;
+    }
+    bool http10 = head[7] == '0';
+    int status = atoi(head + 9);
+    if(status < 100 || status > 999) {
+        return false;
+    }
+    HeaderList headers;
+    bool chunked = false, hasLength = false;
+    uint64_t length = 0;
+    m_keepAlive = !http10;
+    const char *line = strstr(head, "\r\n") + 2;
+    const char *end = head + m_line.length() - 2;
+    while(line < end) {
+        const char *eol = strstr(line, "\r\n");
+        const char *colon = (const char *) memchr(line, ':', eol - line);
+        if(colon != NULL) {
+            std::string key = trim(line, colon);
+            std::string value = trim(colon + 1, eol);
+            if(strcasecmp(key.c_str(), "Content-Length") == 0) {
+                hasLength = true;
+                length = strtoull(value.c_str(), NULL, 10);
+            } else if(strcasecmp(key.c_str(), "Transfer-Encoding") == 0) {
+                chunked = containsToken(value, "chunked");
+            } else if(strcasecmp(key.c_str(), "Connection") == 0) {
+                if(containsToken(value, "close")) {
+                    m_keepAlive = false;
+                } else if(containsToken(value, "keep-alive")) {
+                    m_keepAlive = true;
+                }
+            }
+            headers.push_back(std::make_pair(key, value));
+        }
+        line = eol + 2;
+    }
+    // interim answers like 100 Continue are dropped, the final head follows
+    if(status < 200 && status != 101) {
+        m_state = STATE_HEAD;
+        return true;
+    }
+    listener.onHead(status, headers);
+    if(m_noBody || status == 204 || status == 304) {
+        finish(listener);
+    } else if(chunked) {
+        m_state = STATE_CHUNK_SIZE;
+    } else if(hasLength) {
+        m_remaining = length;
+        m_state = STATE_BODY_LENGTH;
+        if(length == 0) {
+            finish(listener);
+        }
+    } else {
+        m_keepAlive = false;
+        m_state = STATE_BODY_CLOSE;
+    }
+    return true;
+}
+
+void ResponseParser::finish(Listener& listener) {
+    m_state = STATE_COMPLETE;
+    listener.onComplete();
+}
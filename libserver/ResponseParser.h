@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "ResponseCache.h"
+
+namespace archer
+{
+namespace server
+{
+
+/**
+ * Incremental HTTP/1.1 response parser of one upstream connection.
+ *
+ * Bytes are fed as they are read, the head is buffered until complete, body
+ * bytes are passed through without a copy, unframed by Content-Length, chunked
+ * transfer coding or connection close. feed() stops right after the end of a
+ * response so that pipelined responses can be handed to their own listener.
+*/
+class ResponseParser
+{
+enum State {
+    STATE_HEAD = 0,
+    STATE_BODY_LENGTH,
+    STATE_CHUNK_SIZE,
+    STATE_CHUNK_DATA,
+    STATE_CHUNK_CRLF,
+    STATE_TRAILERS,
+    STATE_BODY_CLOSE,
+    STATE_COMPLETE
+};
+
+public:
+
+    static const size_t MAX_HEAD_BYTES = 64 * 1024;
+
+    class Listener
+    {
+    public:
+        virtual ~Listener() {}
+
+        virtual void onHead(int status, HeaderList const& headers) = 0;
+
+        virtual void onBody(const char *data, size_t len) = 0;
+
+        virtual void onComplete() = 0;
+    };
+
+    ResponseParser() {}
+    ~ResponseParser() {}
+
+    // starts the next response, noBody for answers to HEAD requests
+    void reset(bool noBody);
+
+    // bytes consumed, less than len once the response completed, -1 on a malformed response
+    ssize_t feed(const char *data, size_t len, Listener& listener);
+
+    // the connection closed, true if that legitimately ended the response
+    bool onClose(Listener& listener);
+
+    bool complete() const {return m_state == STATE_COMPLETE;}
+
+    // whether nothing of the current response was parsed yet
+    bool idle() const {return m_state == STATE_HEAD && m_line.empty();}
+
+    // whether the connection may carry another response afterwards
+    bool keepAlive() const {return m_keepAlive;}
+
+private:
+
+    bool parseHead(Listener& listener);
+
+    void finish(Listener& listener);
+
+    State            m_state = STATE_HEAD;
+    bool             m_noBody = false;
+    bool             m_keepAlive = true;
+    uint64_t         m_remaining = 0;
+    std::string      m_line;
+};
+}
+}
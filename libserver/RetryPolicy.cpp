@@ -0,0 +1,25 @@
+#include "RetryPolicy.h"
+
+#include <string.h>
+
+using namespace archer::server;
+
+bool RetryPolicy::idempotent(const char *method) {
+    if(method == NULL) {
+        return false;
+    }
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 || strcmp(method, "OPTIONS") == 0 ||
+           strcmp(method, "TRACE") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0;
+}
+
+bool RetryPolicy::acquire() {
+    if(!m_budget.acquire()) {
+        return false;
+    }
+    m_retried.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+RetryStats RetryPolicy::stats() {
+    return RetryStats{m_retried.load(), m_succeeded.load(), m_budget.exhausted()};
+}
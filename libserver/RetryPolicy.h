@@ -0,0 +1,72 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <atomic>
+#include <memory>
+
+#include "TrafficBudget.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    // attempts after the first one
+    int         attempts;
+    // retries allowed per hundred live requests
+    int         budgetPercent;
+} RetryConfig;
+
+typedef struct {
+    uint64_t retried;
+    uint64_t succeeded;
+    uint64_t budgetExhausted;
+} RetryStats;
+
+/**
+ * Retry policy and counters of one location. Retries are paid from a budget
+ * refilled by live requests, so during an outage they add at most
+ * budgetPercent to the upstream load.
+*/
+class RetryPolicy
+{
+public:
+
+    explicit RetryPolicy(RetryConfig const& config) : m_config(config), m_budget(config.budgetPercent) {}
+    ~RetryPolicy() {}
+
+    RetryPolicy(const RetryPolicy&) = delete;
+    RetryPolicy& operator=(const RetryPolicy&) = delete;
+
+    RetryConfig const& config() const {return m_config;}
+
+    // GET, HEAD, OPTIONS, TRACE, PUT and DELETE may be sent twice
+    static bool idempotent(const char *method);
+
+    // one live request, refills the budget
+    void onRequest() {
+        m_budget.onRequest();
+    }
+
+    // takes one retry from the budget, false once it is exhausted
+    bool acquire();
+
+    void onSucceeded() {
+        m_succeeded.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    RetryStats stats();
+
+private:
+
+    RetryConfig                  m_config;
+    TrafficBudget                m_budget;
+    std::atomic<uint64_t>        m_retried{0};
+    std::atomic<uint64_t>        m_succeeded{0};
+};
+
+typedef std::shared_ptr<RetryPolicy> RetryPolicyPtr;
+}
+}
@@ -0,0 +1,475 @@
+#include "StaticFiles.h"
+#include "Compressor.h"
+
+#include <algorithm>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+using namespace archer::server;
+
+// bytes read and sent at a time from a file too large to cache
+static const size_t READ_CHUNK = 64 * 1024;
+
+static const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+inline static size_t sendStatus(HttpResponse *res, int status, const char *title) {
+    std::string body = std::string("<!DOCTYPE html><html><head><title>APROXY SERVER</title></head><body><h3>APROXY SERVER ") + title + "</h3></body></html>";
+    http_response_set_status(res, status);
+    http_response_set_content_type(res, "text/html");
+    http_response_send_all(res, body.data(), body.length());
+    return body.length();
+}
+
+inline static int hexValue(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// decodes the uri path below the location, false for anything that could leave the root
+static bool decodePath(const char *path, size_t len, std::string& out) {
+    out.reserve(len + 1);
+    out.push_back('/');
+    for(size_t i = 0; i < len && path[i] != '?' && path[i] != '#'; i++) {
+        char c = path[i];
+        if(c == '%') {
+            int hi = i + 2 < len ? hexValue(path[i + 1]) : -1;
+            int lo = hi < 0 ? -1 : hexValue(path[i + 2]);
+            if(lo < 0) {
+                return false;
+            }
+            c = (char) (hi * 16 + lo);
+            i += 2;
+        }
+        if(c == '\0' || c == '\\') {
+            return false;
+        }
+        if(c == '/' && out.back() == '/') {
+            continue;
+        }
+        out.push_back(c);
+    }
+    size_t start = 0;
+    while(start < out.length()) {
+        size_t end = out.find('/', start + 1);
+        if(end == std::string::npos) {
+            end = out.length();
+        }
+        if(out.compare(start, end - start, "/..") == 0) {
+            return false;
+        }
+        start = end;
+    }
+    return true;
+}
+
+static const char* contentTypeOf(std::string const& path) {
+    static const char *types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"}, {".js", "application/javascript"},
+        {".mjs", "application/javascript"}, {".json", "application/json"}, {".map", "application/json"},
+        {".xml", "application/xml"}, {".txt", "text/plain"}, {".svg", "image/svg+xml"}, {".png", "image/png"},
+        {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"}, {".gif", "image/gif"}, {".webp", "image/webp"},
+        {".ico", "image/x-icon"}, {".wasm", "application/wasm"}, {".woff", "font/woff"}, {".woff2", "font/woff2"},
+        {".ttf", "font/ttf"}, {".pdf", "application/pdf"}, {".zip", "application/zip"}, {".gz", "application/gzip"},
+        {".tar", "application/x-tar"}, {".mp4", "video/mp4"}, {".webm", "video/webm"}
+    };
+    size_t dot = path.rfind('.');
+    if(dot == std::string::npos || path.find('/', dot) != std::string::npos) {
+        return "application/octet-stream";
+    }
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if(strcasecmp(path.c_str() + dot, types[i][0]) == 0) {
+            return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+// 1 for one satisfiable range in [first, last], -1 when unsatisfiable, 0 when it is ignored
+static int parseRange(const char *spec, size_t size, size_t& first, size_t& last) {
+    if(strncmp(spec, "bytes=", 6) != 0 || strchr(spec, ',') != NULL) {
+        return 0;
+    }
+    const char *p = spec + 6;
+    char *end = NULL;
+    if(*p == '-') {
+        unsigned long long suffix = strtoull(p + 1, &end, 10);
+        if(end == p + 1 || *end != '\0') {
+            return 0;
+        }
+        if(suffix == 0 || size == 0) {
+            return -1;
+        }
+        first = suffix >= size ? 0 : size - suffix;
+        last = size - 1;
+        return 1;
+    }
+    unsigned long long from = strtoull(p, &end, 10);
+    if(end == p || *end != '-') {
+        return 0;
+    }
+    p = end + 1;
+    unsigned long long to = size == 0 ? 0 : size - 1;
+    if(*p != '\0') {
+        to = strtoull(p, &end, 10);
+        if(end == p || *end != '\0' || to < from) {
+            return 0;
+        }
+    }
+    if(from >= size) {
+        return -1;
+    }
+    first = from;
+    last = to >= size ? size - 1 : to;
+    return 1;
+}
+
+StaticFile::~StaticFile() {
+    if(fd >= 0) {
+        ::close(fd);
+    }
+}
+
+StaticFiles::StaticFiles(StaticConfig const& config) : m_config(config) {
+    while(m_config.root.length() > 1 && m_config.root.back() == '/') {
+        m_config.root.pop_back();
+    }
+    if(m_config.index.empty()) {
+        m_config.index = "index.html";
+    }
+    m_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_inotify < 0) {
+        LOG_warn("Static files %s can not use inotify, %s, nothing is cached", m_config.root.c_str(), strerror(errno));
+        return ;
+    }
+    m_running = true;
+    m_watcher = std::thread(&StaticFiles::watchLoop, this);
+}
+
+StaticFiles::~StaticFiles() {
+    m_running = false;
+    if(m_watcher.joinable()) {
+        m_watcher.join();
+    }
+    if(m_inotify >= 0) {
+        ::close(m_inotify);
+    }
+}
+
+size_t StaticFiles::serve(HttpRequest *req, HttpResponse *res, const char *path, size_t pathLen) {
+    const char *method = http_request_get_method(req);
+    bool head = method != NULL && strcmp(method, "HEAD") == 0;
+    if(!head && (method == NULL || strcmp(method, "GET") != 0)) {
+        http_response_set_header(res, "Allow", "GET, HEAD");
+        return sendStatus(res, 405, "405 Method Not Allowed");
+    }
+    std::string full = m_config.root;
+    std::string rel;
+    if(!decodePath(path, pathLen, rel)) {
+        return sendStatus(res, 404, "404 Not Found");
+    }
+    full.append(m_config.root == "/" ? rel.c_str() + 1 : rel.c_str());
+    if(full.back() == '/') {
+        full.append(m_config.index);
+    }
+
+    const char *range = http_request_get_header(req, "Range");
+    StaticFilePtr file;
+    bool gzip = false;
+    // a range addresses the identity bytes, the sidecar is only for whole bodies
+    if(range == NULL && Compressor::negotiate(req) == ENCODING_GZIP) {
+        file = lookup(full + ".gz");
+        gzip = file && file->found;
+    }
+    if(!gzip) {
+        file = lookup(full);
+    }
+    if(!file) {
+        return sendStatus(res, 500, "INTERNAL ERROR");
+    }
+    if(!file->found) {
+        return sendStatus(res, 404, "404 Not Found");
+    }
+
+    http_response_set_header(res, "ETag", file->etag.c_str());
+    http_response_set_header(res, "Last-Modified", file->lastModified.c_str());
+    const char *match = http_request_get_header(req, "If-None-Match");
+    const char *since = http_request_get_header(req, "If-Modified-Since");
+    bool fresh = false;
+    if(match != NULL) {
+        fresh = strcmp(match, "*") == 0 || strstr(match, file->etag.c_str()) != NULL;
+    } else if(since != NULL) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        fresh = end != NULL && file->mtime <= timegm(&tm);
+    }
+    if(gzip) {
+        http_response_set_header(res, "Content-Encoding", "gzip");
+        http_response_set_header(res, "Vary", "Accept-Encoding");
+        m_gzip.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        http_response_set_header(res, "Accept-Ranges", "bytes");
+    }
+    if(fresh) {
+        m_notModified.fetch_add(1, std::memory_order_relaxed);
+        http_response_set_status(res, 304);
+        http_response_send_head(res);
+        return 0;
+    }
+    http_response_set_content_type(res, contentTypeOf(full));
+
+    size_t first = 0, last = file->size == 0 ? 0 : file->size - 1;
+    int status = 200;
+    const char *ifRange = http_request_get_header(req, "If-Range");
+    if(range != NULL && (ifRange == NULL || file->etag == ifRange || file->lastModified == ifRange)) {
+        int ranged = parseRange(range, file->size, first, last);
+        if(ranged < 0) {
+            std::string unsatisfied = "bytes */" + std::to_string(file->size);
+            http_response_set_header(res, "Content-Range", unsatisfied.c_str());
+            return sendStatus(res, 416, "416 Range Not Satisfiable");
+        }
+        if(ranged > 0) {
+            status = 206;
+            m_partial.fetch_add(1, std::memory_order_relaxed);
+            std::string contentRange = "bytes " + std::to_string(first) + "-" + std::to_string(last) + "/" + std::to_string(file->size);
+            http_response_set_header(res, "Content-Range", contentRange.c_str());
+        }
+    }
+    size_t len = file->size == 0 ? 0 : last - first + 1;
+    if(len > m_config.maxServedBytes) {
+        return sendStatus(res, 413, "413 Content Too Large");
+    }
+    http_response_set_status(res, status);
+    if(head) {
+        http_response_set_content_length(res, len);
+        http_response_send_head(res);
+        return 0;
+    }
+    if(file->data != NULL) {
+        http_response_send_all(res, file->data + first, len);
+        return len;
+    }
+    http_response_set_content_length(res, len);
+    http_response_send_head(res);
+    std::string buf(std::min(len, READ_CHUNK), '\0');
+    size_t sent = 0;
+    while(sent < len) {
+        ssize_t n = pread(file->fd, &buf[0], std::min(len - sent, READ_CHUNK), (off_t) (first + sent));
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            LOG_warn("Static files %s ends at %zu of %zu bytes, %s", full.c_str(), first + sent, file->size, n < 0 ? strerror(errno) : "truncated");
+            break;
+        }
+        http_response_send_body(res, buf.data(), (size_t) n);
+        sent += n;
+    }
+    return sent;
+}
+
+StaticFilePtr StaticFiles::lookup(std::string const& full) {
+    uint64_t generation;
+    bool cacheable;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(full);
+        if(it != m_entries.end()) {
+            m_lru.splice(m_lru.begin(), m_lru, it->second.pos);
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+            return it->second.file;
+        }
+        // the watch goes first, a change while loading then at least bumps the generation
+        cacheable = watch(full.substr(0, full.rfind('/')));
+        generation = m_generation;
+    }
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    StaticFilePtr file = load(full);
+    if(file && cacheable && file->fd < 0) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(generation == m_generation) {
+            insert(full, file);
+        }
+    }
+    return file;
+}
+
+StaticFilePtr StaticFiles::load(std::string const& full) {
+    std::shared_ptr<StaticFile> file = std::make_shared<StaticFile>();
+    file->found = false;
+    file->data = "";
+    file->size = 0;
+    file->fd = -1;
+    file->mtime = 0;
+    int fd = open(full.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        if(errno == ENOENT || errno == ENOTDIR || errno == ENAMETOOLONG) {
+            return file;
+        }
+        LOG_warn("Static files can not open %s, %s", full.c_str(), strerror(errno));
+        return nullptr;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        // directories are not listed
+        ::close(fd);
+        return file;
+    }
+    file->size = (size_t) st.st_size;
+    if(file->size <= m_config.maxCachedFileBytes) {
+        file->body.resize(file->size);
+        size_t done = 0;
+        while(done < file->size) {
+            ssize_t n = read(fd, &file->body[done], file->size - done);
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            if(n <= 0) {
+                break;
+            }
+            done += n;
+        }
+        // the file shrank while it was read, serve what is there
+        file->body.resize(done);
+        file->size = done;
+        file->data = file->body.data();
+        ::close(fd);
+    } else {
+        // read per request, a mapping would fault with SIGBUS once the file is truncated under it
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        file->fd = fd;
+        file->data = NULL;
+    }
+    file->found = true;
+    file->mtime = st.st_mtim.tv_sec;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\"%llx-%llx\"", (unsigned long long) st.st_size,
+             (unsigned long long) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+    file->etag = buf;
+    struct tm tm;
+    gmtime_r(&st.st_mtim.tv_sec, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    file->lastModified = buf;
+    return file;
+}
+
+void StaticFiles::insert(std::string const& full, StaticFilePtr const& file) {
+    size_t bytes = file->size + full.length() + sizeof(StaticFile);
+    if(bytes > m_config.maxCacheBytes || m_entries.count(full) > 0) {
+        return ;
+    }
+    while(m_bytes + bytes > m_config.maxCacheBytes && !m_lru.empty()) {
+        auto victim = m_entries.find(m_lru.back());
+        m_bytes -= victim->second.bytes;
+        m_entries.erase(victim);
+        m_lru.pop_back();
+    }
+    m_lru.push_front(full);
+    m_entries[full] = Entry{file, bytes, m_lru.begin()};
+    m_bytes += bytes;
+}
+
+bool StaticFiles::watch(std::string const& dir) {
+    if(m_inotify < 0) {
+        return false;
+    }
+    if(m_watched.count(dir) > 0) {
+        return true;
+    }
+    int wd = inotify_add_watch(m_inotify, dir.empty() ? "/" : dir.c_str(), WATCH_MASK | IN_ONLYDIR);
+    if(wd < 0) {
+        if(errno != ENOENT && errno != ENOTDIR) {
+            LOG_warn("Static files can not watch %s, %s", dir.c_str(), strerror(errno));
+        }
+        return false;
+    }
+    m_watches[wd] = dir;
+    m_watched.insert(dir);
+    return true;
+}
+
+void StaticFiles::invalidate(std::string const& full) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    auto it = m_entries.find(full);
+    if(it == m_entries.end()) {
+        return ;
+    }
+    m_bytes -= it->second.bytes;
+    m_lru.erase(it->second.pos);
+    m_entries.erase(it);
+    m_invalidations.fetch_add(1, std::memory_order_relaxed);
+}
+
+void StaticFiles::invalidateAll() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_generation++;
+    m_invalidations.fetch_add(m_entries.size(), std::memory_order_relaxed);
+    m_entries.clear();
+    m_lru.clear();
+    m_bytes = 0;
+}
+
+void StaticFiles::watchLoop() {
+    alignas(struct inotify_event) char buf[64 * 1024];
+    struct pollfd pfd = {m_inotify, POLLIN, 0};
+    while(m_running) {
+        if(poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        ssize_t n = read(m_inotify, buf, sizeof(buf));
+        for(char *p = buf; n > 0 && p < buf + n; ) {
+            struct inotify_event *ev = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+            if(ev->mask & IN_Q_OVERFLOW) {
+                LOG_warn("Static files %s missed inotify events, cache dropped", m_config.root.c_str());
+                invalidateAll();
+                continue;
+            }
+            std::string dir;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                auto it = m_watches.find(ev->wd);
+                if(it == m_watches.end()) {
+                    continue;
+                }
+                dir = it->second;
+                if(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    if(ev->mask & IN_IGNORED) {
+                        m_watches.erase(it);
+                    } else {
+                        inotify_rm_watch(m_inotify, ev->wd);
+                    }
+                    m_watched.erase(dir);
+                }
+            }
+            if(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // the paths below it now point somewhere else
+                invalidateAll();
+            } else if(ev->len > 0) {
+                invalidate(dir + "/" + ev->name);
+            }
+        }
+    }
+}
+
+StaticStats StaticFiles::stats() {
+    StaticStats stats;
+    stats.hits = m_hits.load(std::memory_order_relaxed);
+    stats.misses = m_misses.load(std::memory_order_relaxed);
+    stats.notModified = m_notModified.load(std::memory_order_relaxed);
+    stats.partial = m_partial.load(std::memory_order_relaxed);
+    stats.gzip = m_gzip.load(std::memory_order_relaxed);
+    stats.invalidations = m_invalidations.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats.entries = m_entries.size();
+    stats.bytes = m_bytes;
+    return stats;
+}
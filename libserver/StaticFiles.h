@@ -0,0 +1,146 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/types.h>
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    std::string root;
+    // served for uris ending in '/'
+    std::string index;
+    size_t      maxCacheBytes;
+    // larger files are read in chunks for each request instead of being cached
+    size_t      maxCachedFileBytes;
+    // larger responses, whole files or ranges, get 413, their chunks are sent from the request thread
+    size_t      maxServedBytes;
+} StaticConfig;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t notModified;
+    uint64_t partial;
+    uint64_t gzip;
+    uint64_t invalidations;
+    uint64_t entries;
+    uint64_t bytes;
+} StaticStats;
+
+// one file as served, found is false for a path known to be missing
+typedef struct StaticFile {
+    bool         found;
+    const char  *data;
+    size_t       size;
+    std::string  body;
+    // open descriptor of a file too large to cache, data is null then, -1 otherwise
+    int          fd;
+    std::string  etag;
+    std::string  lastModified;
+    time_t       mtime;
+    const char  *contentType;
+
+    ~StaticFile();
+} StaticFile;
+
+typedef std::shared_ptr<const StaticFile> StaticFilePtr;
+
+/**
+ * Serves the files under a root directory for one location.
+ *
+ * Files up to maxCachedFileBytes are kept in memory, least recently used first
+ * out, and every directory holding a cached file is watched with inotify so a
+ * change drops its entries at once, a hit never touches the file system. Known
+ * missing paths are cached the same way, which keeps absent .gz sidecars cheap.
+ * Larger files are opened per request and sent in chunks read with pread, a
+ * file truncated meanwhile cuts the response short. The request thread reads
+ * and queues every chunk before it returns, so a response longer than
+ * maxServedBytes is refused with 413, a range of the file below that still
+ * works. Without inotify nothing is cached.
+ *
+ * GET and HEAD only, with ETag and Last-Modified validators, single byte ranges
+ * and a precompressed "<file>.gz" served to clients that accept gzip.
+*/
+class StaticFiles
+{
+typedef struct {
+    StaticFilePtr                    file;
+    size_t                           bytes;
+    std::list<std::string>::iterator pos;
+} Entry;
+
+public:
+
+    explicit StaticFiles(StaticConfig const& config);
+    ~StaticFiles();
+
+    StaticFiles(const StaticFiles&) = delete;
+    StaticFiles& operator=(const StaticFiles&) = delete;
+
+    StaticConfig const& config() const {return m_config;}
+
+    // answers the request, path is the uri part below the location src, returns the body bytes sent
+    size_t serve(HttpRequest *req, HttpResponse *res, const char *path, size_t pathLen);
+
+    StaticStats stats();
+
+private:
+
+    // the file at full, from the cache or the file system, null on an error other than not found
+    StaticFilePtr lookup(std::string const& full);
+
+    StaticFilePtr load(std::string const& full);
+
+    void insert(std::string const& full, StaticFilePtr const& file);
+
+    // with m_mutex held, false when the directory can not be watched
+    bool watch(std::string const& dir);
+
+    void invalidate(std::string const& full);
+
+    void invalidateAll();
+
+    void watchLoop();
+
+    StaticConfig                 m_config;
+
+    std::mutex                   m_mutex;
+    // most recently used first
+    std::list<std::string>       m_lru;
+    std::unordered_map<std::string, Entry> m_entries;
+    size_t                       m_bytes = 0;
+    // bumped by every invalidation, a load that raced one is not cached
+    uint64_t                     m_generation = 0;
+
+    int                          m_inotify = -1;
+    std::unordered_map<int, std::string> m_watches;
+    std::unordered_set<std::string> m_watched;
+    std::atomic<bool>            m_running{false};
+    std::thread                  m_watcher;
+
+    std::atomic<uint64_t>        m_hits{0};
+    std::atomic<uint64_t>        m_misses{0};
+    std::atomic<uint64_t>        m_notModified{0};
+    std::atomic<uint64_t>        m_partial{0};
+    std::atomic<uint64_t>        m_gzip{0};
+    std::atomic<uint64_t>        m_invalidations{0};
+};
+
+typedef std::shared_ptr<StaticFiles> StaticFilesPtr;
+}
+}
@@ -0,0 +1,443 @@
+#include "TcpProxyServer.h"
+
+#include <thread>
+
+using namespace archer::server;
+
+// client bytes held while the backend connection is being set up
+static const size_t MAX_PENDING_BYTES = 1024 * 1024;
+
+static void sessionOnConnect(Channel *channel) {
+    static_cast<TcpSession *>(channel_get_arg(channel))->onConnect();
+}
+
+static void sessionOnRead(Channel *channel, char *data, size_t data_len) {
+    static_cast<TcpSession *>(channel_get_arg(channel))->onRead(data, data_len);
+}
+
+static void sessionOnError(Channel *channel, const char *err_msg) {
+    static_cast<TcpSession *>(channel_get_arg(channel))->onError(err_msg);
+}
+
+static void sessionOnClose(Channel *channel) {
+    static_cast<TcpSession *>(channel_get_arg(channel))->onError(NULL);
+}
+
+static void tcpOnConnect(ChannelManager *mgr, Channel *channel) {
+    TcpProxyServer *proxy = static_cast<TcpProxyServer *>(channel_manager_get_arg(mgr));
+    proxy->onConnect(channel);
+}
+
+static void tcpOnRead(ChannelManager *mgr, Channel *channel, char *data, size_t data_len) {
+    TcpProxyServer *proxy = static_cast<TcpProxyServer *>(channel_manager_get_arg(mgr));
+    proxy->onRead(channel, data, data_len);
+}
+
+static void tcpOnError(ChannelManager *mgr, Channel *channel, const char *error) {
+    LOG_debug("tcp client %s:%d error, %s", channel_get_host(channel), channel_get_port(channel), error);
+    TcpProxyServer *proxy = static_cast<TcpProxyServer *>(channel_manager_get_arg(mgr));
+    proxy->onClose(channel);
+}
+
+static void tcpOnClose(ChannelManager *mgr, Channel *channel) {
+    TcpProxyServer *proxy = static_cast<TcpProxyServer *>(channel_manager_get_arg(mgr));
+    proxy->onClose(channel);
+}
+
+// accepted channels carry the arg of their server channel
+static void tlsOnAccept(Channel *channel) {
+    static_cast<TcpProxyServer *>(channel_get_arg(channel))->onAccept(channel);
+}
+
+static void tlsOnConnect(Channel *channel) {
+    static_cast<TcpProxyServer *>(channel_get_arg(channel))->onConnect(channel);
+}
+
+static void tlsOnRead(Channel *channel, char *data, size_t data_len) {
+    static_cast<TcpProxyServer *>(channel_get_arg(channel))->onRead(channel, data, data_len);
+}
+
+static void tlsOnError(Channel *channel, const char *error) {
+    LOG_debug("tls client %s:%d error, %s", channel_get_host(channel), channel_get_port(channel), error);
+    static_cast<TcpProxyServer *>(channel_get_arg(channel))->onClose(channel);
+}
+
+static void tlsOnClose(Channel *channel) {
+    static_cast<TcpProxyServer *>(channel_get_arg(channel))->onClose(channel);
+}
+
+// backends are connected per client, the manager keeps no sub connections of its own
+static void subChannelOnError(HttpManager *, const char *host, int port, const char *error) {
+    LOG_warn("tcp peer connection %s:%d error, %s", host, port, error);
+}
+
+static void subChannelOnClose(HttpManager *, const char *host, int port) {
+    LOG_warn("tcp peer connection %s:%d closed", host, port);
+}
+
+
+TcpSession::~TcpSession() {
+    if(m_upstream) {
+        channel_free(m_upstream);
+    }
+}
+
+bool TcpSession::open(ChannelBase *base) {
+    m_upstream = channel_new();
+    channel_set_channel_arg(m_upstream, this);
+    channel_set_channel_on_connect(m_upstream, sessionOnConnect);
+    channel_set_channel_on_read(m_upstream, sessionOnRead);
+    channel_set_channel_on_error(m_upstream, sessionOnError);
+    channel_set_channel_on_close(m_upstream, sessionOnClose);
+    m_self = shared_from_this();
+    if(!channel_connect_to_with_base(m_upstream, m_peer->host().c_str(), m_peer->port(), base)) {
+        shutdown(channel_get_errstr(m_upstream), true);
+        m_self.reset();
+        return false;
+    }
+    return true;
+}
+
+void TcpSession::onClientData(const char *data, size_t len) {
+    std::string rewritten;
+    if(m_forwarded) {
+        if(!m_forwarded->feed(data, len, rewritten)) {
+            refuse(m_forwarded->status());
+            return ;
+        }
+        if(rewritten.empty()) {
+            return ;
+        }
+        data = rewritten.data();
+        len = rewritten.length();
+    }
+    bool overflow = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return ;
+        }
+        if(m_connected) {
+            channel_write(m_upstream, data, len);
+            return ;
+        }
+        m_pending.append(data, len);
+        overflow = m_pending.length() > MAX_PENDING_BYTES;
+    }
+    if(overflow) {
+        shutdown("too much client data before the backend connected", true);
+    }
+}
+
+void TcpSession::refuse(int status) {
+    const char *reason = status == 501 ? "Not Implemented" : status == 431 ? "Request Header Fields Too Large" : "Bad Request";
+    std::string response = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\nConnection: close\r\nContent-Length: 0\r\n\r\n";
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return ;
+        }
+        channel_write(m_client, response.data(), response.length());
+    }
+    shutdown("client sent a request the relay can not frame", true);
+}
+
+void TcpSession::onClientClose() {
+    shutdown(NULL, false);
+}
+
+void TcpSession::onConnect() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_closed) {
+        return ;
+    }
+    m_connected = true;
+    // the connect time stands for the latency of a tcp peer
+    m_connectNanos = common::steadyNanos() - m_start;
+    if(!m_pending.empty()) {
+        channel_write(m_upstream, m_pending.data(), m_pending.length());
+        std::string().swap(m_pending);
+    }
+}
+
+void TcpSession::onRead(const char *data, size_t len) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // the client channel is only valid until its close callback took the lock
+    if(!m_closed) {
+        channel_write(m_client, data, len);
+    }
+}
+
+void TcpSession::onError(const char *error) {
+    shutdown(error == NULL ? "backend closed the connection" : error, true);
+    // the last callback of the backend channel, the proxy frees the session out of it
+    m_proxy->retire(shared_from_this());
+    m_self.reset();
+}
+
+void TcpSession::shutdown(const char *error, bool closeClient) {
+    bool connected = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return ;
+        }
+        m_closed = true;
+        connected = m_connected;
+        m_pending.clear();
+        if(closeClient) {
+            channel_close(m_client);
+        }
+    }
+    if(error != NULL) {
+        LOG_debug("tcp session to %s:%d ends, %s", m_peer->host().c_str(), m_peer->port(), error);
+    }
+    int64_t now = common::steadyNanos();
+    if(connected) {
+        m_peer->onComplete(m_connectNanos);
+        m_peer->onResult(true, now);
+    } else if(error == NULL) {
+        // the client gave up first, nothing to hold against the backend
+        m_peer->onFailure();
+    } else {
+        LOG_warn("tcp backend %s:%d connect failed, %s", m_peer->host().c_str(), m_peer->port(), error);
+        m_peer->onFailure();
+        m_peer->onResult(false, now);
+    }
+    if(!closeClient) {
+        channel_close(m_upstream);
+    }
+    m_proxy->onSessionClosed(m_client, this);
+}
+
+
+TcpProxyServer::TcpProxyServer(std::string const& host, std::uint16_t port) {
+    m_host = host;
+    m_port = port;
+    m_channelManager = channel_manager_new();
+}
+
+TcpProxyServer::~TcpProxyServer() {
+    close();
+    channel_manager_free(m_channelManager);
+    if(m_serverChannel) {
+        server_channel_free(m_serverChannel);
+    }
+}
+
+bool TcpProxyServer::addVirtualHost(VirtualHostPtr const& vhost) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_vhost) {
+        LOG_warn("Tcp Proxy Server %s:%d already carries proxy %s", m_host.c_str(), m_port, m_vhost->id().c_str());
+        return false;
+    }
+    LOG_info("Tcp Proxy Server %s:%d add proxy %s", m_host.c_str(), m_port, vhost->id().c_str());
+    m_vhost = vhost;
+    return true;
+}
+
+bool TcpProxyServer::delVirtualHost(std::string const& id) {
+    VirtualHostPtr vhost;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(!m_vhost || m_vhost->id() != id) {
+            return false;
+        }
+        vhost.swap(m_vhost);
+    }
+    LOG_info("Tcp Proxy Server %s:%d delete proxy %s", m_host.c_str(), m_port, id.c_str());
+    vhost->stop();
+    PeerList peers = vhost->upstream().peers();
+    for(int i = 0; i < peers.size(); i++) {
+        delPeer(vhost, peers[i]->host(), peers[i]->port());
+    }
+    return true;
+}
+
+VirtualHostPtr TcpProxyServer::findVirtualHost(std::string const& id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_vhost && m_vhost->id() == id ? m_vhost : nullptr;
+}
+
+size_t TcpProxyServer::virtualHostCount() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_vhost ? 1 : 0;
+}
+
+void TcpProxyServer::addPeer(VirtualHostPtr const& vhost, std::string const& host, int port, int weight) {
+    LOG_info("Tcp Proxy Server %s:%d add peer %s:%d weight %d", m_host.c_str(), m_port, host.c_str(), port, weight);
+    vhost->upstream().addPeer(host, port, weight);
+}
+
+void TcpProxyServer::delPeer(VirtualHostPtr const& vhost, std::string const& host, int port) {
+    LOG_info("Tcp Proxy Server %s:%d delete peer %s:%d", m_host.c_str(), m_port, host.c_str(), port);
+    // sessions already on the peer keep running until either side closes
+    vhost->upstream().delPeer(host, port);
+}
+
+void TcpProxyServer::startAsync() {
+    m_loops.reset(new UpstreamLoops(m_threads));
+    std::thread asyncListen(&TcpProxyServer::doStart, this);
+    asyncListen.detach();
+}
+
+void TcpProxyServer::close() {
+    std::unordered_map<Channel *, TcpSessionPtr> sessions;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        sessions.swap(m_sessions);
+        m_retired.clear();
+    }
+    if(m_serverChannel) {
+        server_channel_close(m_serverChannel);
+    } else if(m_channelManager) {
+        channel_manager_close(m_channelManager);
+    }
+    for(auto it = sessions.begin(); it != sessions.end(); ++it) {
+        it->second->onClientClose();
+    }
+    m_loops.reset();
+}
+
+void TcpProxyServer::doStart() {
+    if(m_tls) {
+        m_serverChannel = server_channel_new_with_ssl(m_tls->current());
+        server_channel_set_eventloop_threads(m_serverChannel, m_threads);
+        server_channel_set_arg(m_serverChannel, this);
+        server_channel_set_on_accept(m_serverChannel, tlsOnAccept);
+        server_channel_set_channel_on_connect(m_serverChannel, tlsOnConnect);
+        server_channel_set_channel_on_read(m_serverChannel, tlsOnRead);
+        server_channel_set_channel_on_error(m_serverChannel, tlsOnError);
+        server_channel_set_channel_on_close(m_serverChannel, tlsOnClose);
+        LOG_info("Start TLS listener on %s:%d", m_host.c_str(), m_port);
+        m_active = true;
+        if(!server_channel_listen(m_serverChannel, m_host.c_str(), m_port)) {
+            LOG_error("TLS listener on %s:%d error, %s", m_host.c_str(), m_port, server_channel_get_errstr(m_serverChannel));
+        }
+        m_active = false;
+        return ;
+    }
+    channel_manager_set_threads(m_channelManager, m_threads);
+    channel_manager_set_arg(m_channelManager, this);
+    LOG_info("Start Tcp Proxy on %s:%d", m_host.c_str(), m_port);
+    m_active = true;
+    if(!channel_manager_listen(m_channelManager, m_host.c_str(), m_port, tcpOnConnect, tcpOnRead, tcpOnError, tcpOnClose, subChannelOnError, subChannelOnClose)) {
+        const char *errstr = channel_manager_get_error_str(m_channelManager);
+        LOG_error("Tcp Proxy Server listen on %s:%d error, %s", m_host.c_str(), m_port, errstr);
+    }
+    m_active = false;
+}
+
+void TcpProxyServer::onAccept(Channel *client) {
+    SSLOption *rotated = m_tls->rotate();
+    if(rotated != NULL) {
+        server_channel_set_channel_ssl_option(m_serverChannel, rotated);
+    }
+    SSLOption *option = channel_get_ssl_option(client);
+    if(option != NULL) {
+        m_tls->attach(option);
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_handshakes[client] = common::steadyNanos();
+    if(option != NULL) {
+        m_options[client] = option;
+    }
+}
+
+void TcpProxyServer::onConnect(Channel *client) {
+    VirtualHostPtr vhost;
+    std::vector<TcpSessionPtr> retired;
+    int64_t accepted = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        vhost = m_vhost;
+        retired.swap(m_retired);
+        auto it = m_handshakes.find(client);
+        if(it != m_handshakes.end()) {
+            accepted = it->second;
+            m_handshakes.erase(it);
+        }
+    }
+    if(accepted > 0) {
+        m_tls->onHandshake(common::steadyNanos() - accepted);
+    }
+    DstPeer *peer = vhost ? vhost->upstream().select(NULL) : NULL;
+    if(peer == NULL) {
+        LOG_warn("Tcp Proxy Server %s:%d has no available backend", m_host.c_str(), m_port);
+        channel_close(client);
+        return ;
+    }
+    if(vhost->maxPending() > 0 && peer->outstanding() >= vhost->maxPending()) {
+        LOG_warn("Tcp Proxy Server %s:%d circuit open on %s:%d, %d connections", m_host.c_str(), m_port, peer->host().c_str(), peer->port(), peer->outstanding());
+        channel_close(client);
+        return ;
+    }
+    peer->onSend();
+    TcpSessionPtr session = std::make_shared<TcpSession>(this, client, peer->shared_from_this());
+    if(m_forwardedFor) {
+        const char *address = channel_get_host(client);
+        session->forwardFor(address == NULL ? "unknown" : address, m_relaySecret);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_sessions[client] = session;
+    }
+    session->open(m_loops->next());
+}
+
+void TcpProxyServer::onRead(Channel *client, const char *data, size_t len) {
+    TcpSessionPtr session = findSession(client);
+    if(session) {
+        session->onClientData(data, len);
+    }
+}
+
+void TcpProxyServer::onClose(Channel *client) {
+    TcpSessionPtr session;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        // error and close both land here, only the first one releases the context
+        auto option = m_options.find(client);
+        if(option != m_options.end()) {
+            m_tls->detach(option->second);
+            m_options.erase(option);
+        }
+        // gone before the handshake completed
+        if(m_handshakes.erase(client) > 0) {
+            m_tls->onHandshakeFailed();
+            return ;
+        }
+        auto it = m_sessions.find(client);
+        if(it == m_sessions.end()) {
+            return ;
+        }
+        session = it->second;
+        m_sessions.erase(it);
+    }
+    session->onClientClose();
+}
+
+void TcpProxyServer::onSessionClosed(Channel *client, TcpSession *session) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(client);
+    // the client channel may already stand for a new connection
+    if(it != m_sessions.end() && it->second.get() == session) {
+        m_sessions.erase(it);
+    }
+}
+
+void TcpProxyServer::retire(TcpSessionPtr const& session) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_retired.push_back(session);
+}
+
+size_t TcpProxyServer::sessions() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sessions.size();
+}
+
+TcpSessionPtr TcpProxyServer::findSession(Channel *client) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_sessions.find(client);
+    return it == m_sessions.end() ? nullptr : it->second;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+#include "VirtualHost.h"
+#include "UpstreamPool.h"
+#include "TlsContext.h"
+#include "ForwardedFor.h"
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+class TcpProxyServer;
+
+/**
+ * One client connection of a tcp mode proxy and its own connection to the
+ * backend picked for it. Bytes are relayed both ways untouched, whichever
+ * side closes first takes the other one down.
+*/
+class TcpSession : public std::enable_shared_from_this<TcpSession>
+{
+public:
+
+    TcpSession(TcpProxyServer *proxy, Channel *client, DstPeerPtr const& peer) 
+        : m_proxy(proxy), m_client(client), m_peer(peer), m_start(common::steadyNanos()) {}
+    ~TcpSession();
+
+    TcpSession(const TcpSession&) = delete;
+    TcpSession& operator=(const TcpSession&) = delete;
+
+    bool open(ChannelBase *base);
+
+    // requests of the client carry address as X-Forwarded-For and the relay secret, before open
+    void forwardFor(std::string const& address, std::string const& secret) {
+        m_forwarded.reset(new ForwardedFor(address, secret));
+    }
+
+    // client bytes, held back until the backend connection is up
+    void onClientData(const char *data, size_t len);
+
+    // the client went away, the backend connection follows
+    void onClientClose();
+
+    void onConnect();
+
+    void onRead(const char *data, size_t len);
+
+    void onError(const char *error);
+
+    DstPeerPtr const& peer() const {return m_peer;}
+
+private:
+
+    // answers the client with status and takes the session down, the rest of its bytes never reach the backend
+    void refuse(int status);
+
+    void shutdown(const char *error, bool closeClient);
+
+    TcpProxyServer              *m_proxy;
+    Channel                     *m_client;
+    Channel                     *m_upstream = NULL;
+    DstPeerPtr                   m_peer;
+    int64_t                      m_start;
+    int64_t                      m_connectNanos = 0;
+
+    std::mutex                   m_mutex;
+    bool                         m_connected = false;
+    bool                         m_closed = false;
+    std::string                  m_pending;
+    // only touched from the client callbacks
+    std::unique_ptr<ForwardedFor> m_forwarded;
+    // keeps the session alive until its backend channel called back for the last time
+    std::shared_ptr<TcpSession>  m_self;
+};
+
+typedef std::shared_ptr<TcpSession> TcpSessionPtr;
+
+/**
+ * Layer 4 listener of a proxy in "tcp" mode. Connections accepted by the
+ * channel manager are relayed byte for byte to a backend chosen by the proxy
+ * balancer, with the same backend list, health checks, outlier detection and
+ * circuit breaker as the http mode. There is no request to route on, so a
+ * tcp listener carries exactly one proxy and hashing balancers fall back to
+ * round robin. With TLS the listener is a server channel that terminates it,
+ * backends get the plaintext, this is also how http listeners take TLS.
+*/
+class TcpProxyServer
+{
+public:
+
+    TcpProxyServer(std::string const& host, std::uint16_t port);
+    ~TcpProxyServer();
+
+    TcpProxyServer(const TcpProxyServer&) = delete;
+    TcpProxyServer& operator=(const TcpProxyServer&) = delete;
+
+    // false when the listener already carries a proxy
+    bool addVirtualHost(VirtualHostPtr const& vhost);
+
+    bool delVirtualHost(std::string const& id);
+
+    VirtualHostPtr findVirtualHost(std::string const& id);
+
+    size_t virtualHostCount();
+
+    void addPeer(VirtualHostPtr const& vhost, std::string const& host, int port, int weight = 1);
+
+    void delPeer(VirtualHostPtr const& vhost, std::string const& host, int port);
+
+    // terminate TLS on accepted connections, before startAsync
+    void setTls(TlsContextPtr const& tls) {
+        m_tls = tls;
+    }
+
+    TlsContextPtr const& tls() const {return m_tls;}
+
+    // the relay of a TLS http listener, backends get the client address and secret in every request head, before startAsync
+    void setForwardedFor(std::string const& secret) {
+        m_forwardedFor = true;
+        m_relaySecret = secret;
+    }
+
+    void startAsync();
+
+    void close();
+
+    // a TLS client connected, its handshake is under way
+    void onAccept(Channel *client);
+
+    void onConnect(Channel *client);
+
+    void onRead(Channel *client, const char *data, size_t len);
+
+    void onClose(Channel *client);
+
+    // session ended, it no longer takes the bytes of client
+    void onSessionClosed(Channel *client, TcpSession *session);
+
+    // keeps a session whose backend channel is in its last callback, released on the next accept
+    void retire(TcpSessionPtr const& session);
+
+    size_t sessions();
+
+    bool isActive() {return m_active;}
+
+    void setThreads(uint16_t threadNum) {
+        m_threads = threadNum;
+    }
+
+    std::string& getHost() {
+        return m_host;
+    }
+
+    int getPort() {
+        return m_port;
+    }
+
+private:
+
+    void doStart();
+
+    TcpSessionPtr findSession(Channel *client);
+
+    ChannelManager              *m_channelManager;
+    ServerChannel               *m_serverChannel = NULL;
+    TlsContextPtr                m_tls;
+    bool                         m_forwardedFor = false;
+    std::string                  m_relaySecret;
+    uint16_t                     m_threads = 0;
+
+    std::string                  m_host  = "";
+    int                          m_port = 0;
+
+    bool                         m_active = false;
+
+    std::mutex                   m_mutex;
+    VirtualHostPtr               m_vhost;
+    // event loops of the backend connections, created with the listener
+    std::unique_ptr<UpstreamLoops> m_loops;
+    std::unordered_map<Channel *, TcpSessionPtr> m_sessions;
+    // TLS clients in their handshake, by accept time
+    std::unordered_map<Channel *, int64_t> m_handshakes;
+    // context each TLS client was accepted with, released when it closes
+    std::unordered_map<Channel *, SSLOption *> m_options;
+    // ended sessions, released outside of their own callbacks
+    std::vector<TcpSessionPtr>   m_retired;
+};
+
+typedef std::shared_ptr<TcpProxyServer> TcpProxyServerPtr;
+}
+}
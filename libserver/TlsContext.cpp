@@ -0,0 +1,162 @@
+#include "TlsContext.h"
+
+#include <libcommon/Logger.h>
+
+#include <fstream>
+#include <iterator>
+
+using namespace archer::server;
+
+// the PEM trust store of the system, read once, empty when none of the usual places has one
+static std::string const& systemTrustStore() {
+    static const std::string store = []() {
+        const char *bundles[] = {"/etc/ssl/certs/ca-certificates.crt", "/etc/pki/tls/certs/ca-bundle.crt", "/etc/ssl/cert.pem"};
+        for(size_t i = 0; i < sizeof(bundles) / sizeof(bundles[0]); i++) {
+            std::ifstream file(bundles[i]);
+            if(file.good()) {
+                return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            }
+        }
+        return std::string();
+    }();
+    return store;
+}
+
+TlsContext::~TlsContext() {
+    if(m_current) {
+        ssl_option_free(m_current);
+    }
+    if(m_previous) {
+        ssl_option_free(m_previous);
+    }
+    for(size_t i = 0; i < m_retired.size(); i++) {
+        ssl_option_free(m_retired[i]);
+    }
+}
+
+bool TlsContext::init(std::string& error) {
+    SSLOption *option = create(error);
+    if(option == NULL) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_current = option;
+    if(m_config.ticketRotationSeconds > 0) {
+        m_rotateAt.store(archer::common::steadyNanos() + m_config.ticketRotationSeconds * 1000000000LL);
+    }
+    return true;
+}
+
+SSLOption* TlsContext::current() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_current;
+}
+
+SSLOption* TlsContext::rotate() {
+    int64_t at = m_rotateAt.load(std::memory_order_relaxed);
+    int64_t now = archer::common::steadyNanos();
+    if(at == 0 || now < at || !m_rotateAt.compare_exchange_strong(at, now + m_config.ticketRotationSeconds * 1000000000LL)) {
+        return NULL;
+    }
+    std::string error;
+    SSLOption *option = create(error);
+    if(option == NULL) {
+        LOG_error("TLS ticket key rotation failed, %s", error.c_str());
+        return NULL;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_previous) {
+        if(m_live.count(m_previous) == 0) {
+            ssl_option_free(m_previous);
+        } else {
+            m_retired.push_back(m_previous);
+        }
+    }
+    m_previous = m_current;
+    m_current = option;
+    m_rotations++;
+    LOG_info("TLS session ticket key rotated");
+    return option;
+}
+
+void TlsContext::attach(SSLOption *option) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_live[option]++;
+}
+
+void TlsContext::detach(SSLOption *option) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_live.find(option);
+    if(it == m_live.end() || --it->second > 0) {
+        return ;
+    }
+    m_live.erase(it);
+    for(size_t i = 0; i < m_retired.size(); i++) {
+        if(m_retired[i] == option) {
+            m_retired.erase(m_retired.begin() + i);
+            ssl_option_free(option);
+            return ;
+        }
+    }
+}
+
+void TlsContext::onHandshake(int64_t nanos) {
+    m_handshakes.fetch_add(1, std::memory_order_relaxed);
+    m_handshakeNanos.fetch_add(nanos, std::memory_order_relaxed);
+    int64_t max = m_maxHandshakeNanos.load(std::memory_order_relaxed);
+    while(nanos > max && !m_maxHandshakeNanos.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {
+    }
+}
+
+TlsStats TlsContext::stats() {
+    TlsStats stats;
+    stats.handshakes = m_handshakes.load();
+    stats.failed = m_failed.load();
+    stats.avgHandshakeNanos = stats.handshakes == 0 ? 0 : m_handshakeNanos.load() / (int64_t) stats.handshakes;
+    stats.maxHandshakeNanos = m_maxHandshakeNanos.load();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats.rotations = m_rotations;
+    return stats;
+}
+
+SSLOption* TlsContext::create(std::string& error) {
+    SSLOption *option = ssl_option_new(0, 0);
+    if(option == NULL) {
+        error = "can not create ssl option";
+        return NULL;
+    }
+    if(!ssl_option_set_certificate_and_key(option, m_config.certificate.c_str(), m_config.certificate.length(), m_config.key.c_str(), m_config.key.length())) {
+        const char *errstr = ssl_option_get_errstr(option);
+        error = errstr == NULL ? "invalid certificate or key" : errstr;
+        ssl_option_free(option);
+        return NULL;
+    }
+    return option;
+}
+
+SSLOptionPtr archer::server::newUpstreamSSLOption(UpstreamTlsConfig const& config, std::string& error) {
+    // backends are always verified, against the system trust store unless a ca is given
+    std::string const& ca = config.ca.empty() ? systemTrustStore() : config.ca;
+    if(ca.empty()) {
+        error = "has no ca and no system trust store was found";
+        return nullptr;
+    }
+    SSLOptionPtr option(ssl_option_new(1, 1), ssl_option_free);
+    if(!option) {
+        error = "can not create ssl option";
+        return nullptr;
+    }
+    bool ok = ssl_option_set_trust_ca(option.get(), ca.c_str(), ca.length());
+    if(ok && !config.hostname.empty()) {
+        ok = ssl_option_authonrized_hostname(option.get(), config.hostname.c_str());
+    }
+    if(ok && !config.certificate.empty()) {
+        ok = ssl_option_set_certificate_and_key(option.get(), config.certificate.c_str(), config.certificate.length(), config.key.c_str(), config.key.length());
+    }
+    if(!ok) {
+        const char *errstr = ssl_option_get_errstr(option.get());
+        error = errstr == NULL ? "invalid upstream tls settings" : errstr;
+        return nullptr;
+    }
+    return option;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <libcommon/Common.h>
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    // PEM encoded certificate chain and private key
+    std::string certificate;
+    std::string key;
+    // a fresh context, with a new ticket key, is swapped in this often, 0 keeps one for good
+    int         ticketRotationSeconds;
+    // loopback port of the http manager behind a TLS http listener, 0 picks a free one at start
+    int         internalPort;
+} TlsConfig;
+
+typedef struct {
+    uint64_t handshakes;
+    uint64_t failed;
+    int64_t  avgHandshakeNanos;
+    int64_t  maxHandshakeNanos;
+    uint64_t rotations;
+} TlsStats;
+
+/**
+ * Server side TLS of one listener. Every connection is accepted with the same
+ * SSLOption, so the session cache and the ticket key of the underlying context
+ * are shared by all event loops and returning clients resume instead of doing
+ * a full handshake. archer_net gives no access to the ticket keys themselves,
+ * they are rotated by swapping in a new context. That context starts with an
+ * empty session cache too, so after every rotation each returning client does
+ * one full handshake. The listener counts its live connections per context,
+ * a replaced context is freed once its last connection closed, the one
+ * replaced last always lives until the next rotation for the accepts that
+ * raced with it.
+*/
+class TlsContext
+{
+public:
+
+    explicit TlsContext(TlsConfig const& config) : m_config(config) {}
+    ~TlsContext();
+
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    // loads certificate and key, false with the reason in error
+    bool init(std::string& error);
+
+    SSLOption* current();
+
+    TlsConfig const& config() const {return m_config;}
+
+    // the new context once the current one is due for rotation, otherwise null
+    SSLOption* rotate();
+
+    // a connection was accepted with option
+    void attach(SSLOption *option);
+
+    // a connection accepted with option closed, frees a replaced option with it
+    void detach(SSLOption *option);
+
+    void onHandshake(int64_t nanos);
+
+    void onHandshakeFailed() {
+        m_failed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TlsStats stats();
+
+private:
+
+    SSLOption* create(std::string& error);
+
+    TlsConfig                    m_config;
+
+    std::mutex                   m_mutex;
+    SSLOption                   *m_current = NULL;
+    SSLOption                   *m_previous = NULL;
+    // replaced before m_previous, freed as their last connection closes
+    std::vector<SSLOption *>     m_retired;
+    std::unordered_map<SSLOption *, size_t> m_live;
+    std::atomic<int64_t>         m_rotateAt{0};
+    uint64_t                     m_rotations = 0;
+
+    std::atomic<uint64_t>        m_handshakes{0};
+    std::atomic<uint64_t>        m_failed{0};
+    std::atomic<int64_t>         m_handshakeNanos{0};
+    std::atomic<int64_t>         m_maxHandshakeNanos{0};
+};
+
+typedef std::shared_ptr<TlsContext> TlsContextPtr;
+
+typedef std::shared_ptr<SSLOption> SSLOptionPtr;
+
+typedef struct {
+    // PEM trust anchors the peer certificate is verified against, the system trust store when empty
+    std::string ca;
+    // sent as SNI and matched against the peer certificate
+    std::string hostname;
+    // optional PEM client certificate and key
+    std::string certificate;
+    std::string key;
+} UpstreamTlsConfig;
+
+// client side option of a https backend, shared by all connections to it, null with the reason in error
+SSLOptionPtr newUpstreamSSLOption(UpstreamTlsConfig const& config, std::string& error);
+}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
+
+namespace archer
+{
+namespace server
+{
+
+/**
+ * Token bucket refilled by live traffic. Every request earns percent hundredths
+ * of a token, so extra upstream requests paid from it stay within that share
+ * of the load. A quiet location may still spend a small burst.
+*/
+class TrafficBudget
+{
+static const int64_t TOKEN_COST = 100;
+static const int64_t MAX_BURST = 10;
+
+public:
+
+    explicit TrafficBudget(int percent) : m_percent(percent), m_tokens(MAX_BURST * TOKEN_COST) {}
+    ~TrafficBudget() {}
+
+    TrafficBudget(const TrafficBudget&) = delete;
+    TrafficBudget& operator=(const TrafficBudget&) = delete;
+
+    void onRequest() {
+        const int64_t cap = MAX_BURST * TOKEN_COST;
+        int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+        while(tokens < cap && !m_tokens.compare_exchange_weak(tokens, std::min(cap, tokens + m_percent), std::memory_order_relaxed)) {
+        }
+    }
+
+    // takes one token, false once the bucket is empty
+    bool acquire() {
+        int64_t tokens = m_tokens.load(std::memory_order_relaxed);
+        while(tokens >= TOKEN_COST) {
+            if(m_tokens.compare_exchange_weak(tokens, tokens - TOKEN_COST, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        m_exhausted.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint64_t exhausted() const {
+        return m_exhausted.load(std::memory_order_relaxed);
+    }
+
+private:
+
+    int64_t                      m_percent;
+    std::atomic<int64_t>         m_tokens;
+    std::atomic<uint64_t>        m_exhausted{0};
+};
+}
+}
@@ -0,0 +1,108 @@
+#include "Upstream.h"
+
+using namespace archer::server;
+
+bool Upstream::addPeer(std::string const& host, int port, int weight) {
+    return addPeer(std::make_shared<DstPeer>(host, port, weight));
+}
+
+bool Upstream::addPeer(DstPeerPtr const& peer) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(int i = 0; i < m_list.size(); i++) {
+        if(m_list[i]->host() == peer->host() && m_list[i]->port() == peer->port()) {
+            return false;
+        }
+    }
+    m_list.push_back(peer);
+    publish(m_list);
+    return true;
+}
+
+bool Upstream::delPeer(std::string const& host, int port) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int idx = 0;
+    for(; idx < m_list.size(); idx++) {
+        if(m_list[idx]->host() == host && m_list[idx]->port() == port) {
+            break ;
+        }
+    }
+    if(idx >= m_list.size()) {
+        return false;
+    }
+    m_list.erase(m_list.begin() + idx);
+    publish(m_list);
+    return true;
+}
+
+bool Upstream::hasPeer(std::string const& host, int port) {
+    return findPeer(host, port) != nullptr;
+}
+
+DstPeerPtr Upstream::findPeer(std::string const& host, int port) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(int i = 0; i < m_list.size(); i++) {
+        if(m_list[i]->host() == host && m_list[i]->port() == port) {
+            return m_list[i];
+        }
+    }
+    return nullptr;
+}
+
+PeerList Upstream::peers() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_list;
+}
+
+void Upstream::refresh() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    publish(m_list);
+}
+
+void Upstream::setBalancer(BalancerType type) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_type = type;
+    publish(m_list);
+}
+
+void Upstream::setHashKey(HashKey const& key) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_hashKey = key;
+    publish(m_list);
+}
+
+void Upstream::publish(PeerList const& peers) {
+    std::shared_ptr<PeerSet> set = std::make_shared<PeerSet>();
+    for(int i = 0; i < peers.size(); i++) {
+        if(peers[i]->available()) {
+            set->peers.push_back(peers[i]);
+        }
+    }
+    if(set->peers.empty()) {
+        set->peers = peers;
+    }
+    if(!set->peers.empty()) {
+        set->balancer.reset(Balancer::create(m_type, set->peers, m_hashKey));
+    }
+    m_peers.store(set);
+}
+
+DstPeer* Upstream::select(HttpRequest *req) {
+    common::Snapshot<PeerSet>::Local& local = m_peers.local();
+    if(!local.ptr || !local.ptr->balancer) {
+        return NULL;
+    }
+    DstPeer *peer = local.ptr->balancer->pick(req, local.tick);
+    int64_t window = m_slowStartNanos.load(std::memory_order_relaxed);
+    if(peer == NULL || window <= 0 || local.ptr->peers.size() < 2) {
+        return peer;
+    }
+    // a ramping peer hands the request to the next pick with probability 1 - permille
+    uint32_t permille = peer->rampPermille(common::steadyNanos(), window);
+    if(permille < 1000 && ((local.tick * 2654435761u) >> 8) % 1000 >= permille) {
+        DstPeer *other = local.ptr->balancer->pick(req, local.tick);
+        if(other != NULL) {
+            peer = other;
+        }
+    }
+    return peer;
+}
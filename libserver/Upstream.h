@@ -0,0 +1,83 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+#include <libcommon/Snapshot.h>
+
+#include <mutex>
+#include <atomic>
+
+#include "Balancer.h"
+
+namespace archer
+{
+namespace server
+{
+
+typedef struct {
+    PeerList                  peers;
+    std::unique_ptr<Balancer> balancer;
+} PeerSet;
+
+/**
+ * Backend list of a proxy, published as an immutable PeerSet whenever a peer,
+ * its availability or the balancing policy changes. select() is lock free.
+ * Only available peers are handed to the balancer, if none is left every peer
+ * is used rather than failing all requests.
+*/
+class Upstream
+{
+public:
+
+    Upstream() {}
+    ~Upstream() {}
+
+    Upstream(const Upstream&) = delete;
+    Upstream& operator=(const Upstream&) = delete;
+
+    bool addPeer(std::string const& host, int port, int weight);
+
+    // publishes a peer built by the caller, false if its host:port is already there
+    bool addPeer(DstPeerPtr const& peer);
+
+    bool delPeer(std::string const& host, int port);
+
+    bool hasPeer(std::string const& host, int port);
+
+    void setBalancer(BalancerType type);
+
+    BalancerType getBalancer() {return m_type;}
+
+    void setHashKey(HashKey const& key);
+
+    DstPeerPtr findPeer(std::string const& host, int port);
+
+    // new and recovered peers ramp up to their full share over windowNanos, 0 disables
+    void setSlowStart(int64_t windowNanos) {
+        m_slowStartNanos.store(windowNanos, std::memory_order_relaxed);
+    }
+
+    int64_t slowStartNanos() const {
+        return m_slowStartNanos.load(std::memory_order_relaxed);
+    }
+
+    PeerList peers();
+
+    // republish after the availability of a peer changed
+    void refresh();
+
+    DstPeer* select(HttpRequest *req);
+
+private:
+
+    void publish(PeerList const& peers);
+
+    std::mutex                   m_mutex;
+    BalancerType                 m_type = BALANCER_ROUND_ROBIN;
+    HashKey                      m_hashKey{HASH_KEY_PATH, ""};
+    PeerList                     m_list;
+    common::Snapshot<PeerSet>    m_peers;
+    std::atomic<int64_t>         m_slowStartNanos{0};
+};
+}
+}
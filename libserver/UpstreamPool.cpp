@@ -0,0 +1,556 @@
+#include "UpstreamPool.h"
+#include "ProxyServer.h"
+#include "DeadlineTimer.h"
+
+#include <chrono>
+#include <algorithm>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+using namespace archer::server;
+
+static void connectionOnConnect(Channel *channel) {
+    static_cast<UpstreamConnection *>(channel_get_arg(channel))->onConnect();
+}
+
+static void connectionOnRead(Channel *channel, char *data, size_t data_len) {
+    static_cast<UpstreamConnection *>(channel_get_arg(channel))->onRead(data, data_len);
+}
+
+static void connectionOnError(Channel *channel, const char *err_msg) {
+    static_cast<UpstreamConnection *>(channel_get_arg(channel))->onError(err_msg);
+}
+
+static void connectionOnClose(Channel *channel) {
+    static_cast<UpstreamConnection *>(channel_get_arg(channel))->onError(NULL);
+}
+
+static void keepaliveOnConnect(Channel *) {}
+
+static void keepaliveOnRead(Channel *, char *, size_t) {}
+
+static void keepaliveOnError(Channel *, const char *) {}
+
+static void keepaliveOnClose(Channel *) {}
+
+// a loopback socket listening with room for backlog connections, its port in port
+static int keepaliveListener(int backlog, int& port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if(bind(fd, (struct sockaddr *) &addr, len) != 0 || listen(fd, backlog) != 0 || getsockname(fd, (struct sockaddr *) &addr, &len) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+
+UpstreamLoops::UpstreamLoops(int threads) : m_running(true) {
+    if(threads < 1) {
+        threads = 1;
+    }
+    int port = 0;
+    m_keepaliveFd = keepaliveListener(threads, port);
+    if(m_keepaliveFd < 0) {
+        LOG_warn("upstream loops found no loopback port for their keepalive channels");
+    }
+    for(int i = 0; i < threads; i++) {
+        ChannelBase *base = channel_base_new();
+        m_bases.push_back(base);
+        if(m_keepaliveFd >= 0) {
+            Channel *keepalive = channel_new();
+            channel_set_channel_on_connect(keepalive, keepaliveOnConnect);
+            channel_set_channel_on_read(keepalive, keepaliveOnRead);
+            channel_set_channel_on_error(keepalive, keepaliveOnError);
+            channel_set_channel_on_close(keepalive, keepaliveOnClose);
+            if(channel_connect_to_with_base(keepalive, "127.0.0.1", port, base)) {
+                m_keepalives.push_back(keepalive);
+            } else {
+                channel_free(keepalive);
+            }
+        }
+        m_threads.push_back(std::thread([this, base]() {
+            // only a loop that lost its keepalive channel returns early, it is restarted for the next connect
+            while(m_running.load(std::memory_order_relaxed)) {
+                channel_base_start_event_loop(base);
+                if(m_running.load(std::memory_order_relaxed)) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+            }
+        }));
+    }
+}
+
+UpstreamLoops::~UpstreamLoops() {
+    m_running.store(false, std::memory_order_relaxed);
+    for(size_t i = 0; i < m_bases.size(); i++) {
+        channel_base_stop(m_bases[i]);
+    }
+    for(size_t i = 0; i < m_threads.size(); i++) {
+        m_threads[i].join();
+    }
+    for(size_t i = 0; i < m_keepalives.size(); i++) {
+        channel_free(m_keepalives[i]);
+    }
+    if(m_keepaliveFd >= 0) {
+        ::close(m_keepaliveFd);
+    }
+    for(size_t i = 0; i < m_bases.size(); i++) {
+        channel_base_free(m_bases[i]);
+    }
+}
+
+
+UpstreamConnection::~UpstreamConnection() {
+    if(m_channel) {
+        channel_free(m_channel);
+    }
+}
+
+bool UpstreamConnection::open(std::string const& host, int port, SSLOption *ssl, ChannelBase *base) {
+    m_channel = channel_new();
+    if(ssl != NULL) {
+        channel_set_channel_ssl_option(m_channel, ssl);
+    }
+    channel_set_channel_arg(m_channel, this);
+    channel_set_channel_on_connect(m_channel, connectionOnConnect);
+    channel_set_channel_on_read(m_channel, connectionOnRead);
+    channel_set_channel_on_error(m_channel, connectionOnError);
+    channel_set_channel_on_close(m_channel, connectionOnClose);
+    m_self = shared_from_this();
+    if(!channel_connect_to_with_base(m_channel, host.c_str(), port, base)) {
+        LOG_warn("upstream connection to %s:%d failed, %s", host.c_str(), port, channel_get_errstr(m_channel));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_self.reset();
+        return false;
+    }
+    return true;
+}
+
+bool UpstreamConnection::send(ExchangePtr const& exchange) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_closed) {
+        return false;
+    }
+    m_inflight.push_back(exchange);
+    if(m_connected) {
+        channel_write(m_channel, exchange->wire().data(), exchange->wire().length());
+        m_written++;
+    }
+    return true;
+}
+
+void UpstreamConnection::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return ;
+        }
+    }
+    // the close callback fails whatever is still in flight
+    channel_close(m_channel);
+}
+
+bool UpstreamConnection::cancel(ExchangePtr const& exchange) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find(m_inflight.begin(), m_inflight.end(), exchange);
+        if(m_closed || it == m_inflight.end()) {
+            return false;
+        }
+        if((size_t) (it - m_inflight.begin()) >= m_written) {
+            m_inflight.erase(it);
+            return true;
+        }
+        // pipelined responses behind it still need the connection, its answer is dropped
+        if(m_inflight.size() > 1) {
+            return true;
+        }
+    }
+    close();
+    return true;
+}
+
+bool UpstreamConnection::expire(ExchangePtr const& exchange) {
+    bool written = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find(m_inflight.begin(), m_inflight.end(), exchange);
+        if(m_closed || it == m_inflight.end()) {
+            return false;
+        }
+        written = (size_t) (it - m_inflight.begin()) < m_written;
+        if(written) {
+            m_closeReason = "upstream timeout";
+        } else {
+            m_inflight.erase(it);
+        }
+    }
+    if(!written) {
+        m_proxy->onUpstreamError(exchange, "upstream timeout", false);
+        return true;
+    }
+    // responses come in order, whatever is behind the silent one is stuck with it
+    close();
+    return true;
+}
+
+size_t UpstreamConnection::inflight() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_inflight.size();
+}
+
+bool UpstreamConnection::closed() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_closed;
+}
+
+bool UpstreamConnection::accepts(ExchangePtr const& exchange, int pipelineDepth) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_closed) {
+        return false;
+    }
+    if(m_inflight.empty()) {
+        return true;
+    }
+    if(!exchange->pipelinable() || m_inflight.size() >= (size_t) pipelineDepth) {
+        return false;
+    }
+    // never queue behind a request that must not be replayed
+    for(size_t i = 0; i < m_inflight.size(); i++) {
+        if(!m_inflight[i]->pipelinable()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void UpstreamConnection::onConnect() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_connected = true;
+    for(; m_written < m_inflight.size(); m_written++) {
+        std::string const& wire = m_inflight[m_written]->wire();
+        channel_write(m_channel, wire.data(), wire.length());
+    }
+}
+
+void UpstreamConnection::onRead(const char *data, size_t len) {
+    while(len > 0) {
+        if(!m_current) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(m_written == 0) {
+                break ;
+            }
+            m_current = m_inflight.front();
+            m_parser.reset(m_current->noBody());
+        }
+        ssize_t consumed = m_parser.feed(data, len, *this);
+        if(consumed < 0) {
+            shutdown("malformed upstream response");
+            return ;
+        }
+        data += consumed;
+        len -= consumed;
+        if(!m_parser.complete()) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_inflight.pop_front();
+            m_written--;
+        }
+        m_current.reset();
+        if(!m_parser.keepAlive()) {
+            shutdown("upstream closes the connection");
+            return ;
+        }
+        std::shared_ptr<UpstreamPool> pool = m_pool.lock();
+        if(pool) {
+            pool->onIdle(this);
+        } else {
+            close();
+        }
+    }
+    if(len > 0) {
+        shutdown("unsolicited upstream response");
+    }
+}
+
+void UpstreamConnection::onError(const char *error) {
+    // a close delimited body ends with the connection
+    if(m_current && m_parser.onClose(*this)) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_inflight.pop_front();
+        m_written--;
+        m_current.reset();
+    }
+    const char *reason = NULL;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        reason = m_closeReason;
+    }
+    if(error == NULL) {
+        error = reason == NULL ? "upstream connection closed" : reason;
+    }
+    shutdown(error);
+}
+
+void UpstreamConnection::shutdown(const char *error) {
+    std::deque<ExchangePtr> failed;
+    size_t written = 0;
+    bool wasConnected = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return ;
+        }
+        m_closed = true;
+        wasConnected = m_connected;
+        failed.swap(m_inflight);
+        written = m_written;
+        m_written = 0;
+    }
+    m_current.reset();
+    for(size_t i = 0; i < failed.size(); i++) {
+        m_proxy->onUpstreamError(failed[i], error, i < written);
+    }
+    std::shared_ptr<UpstreamPool> pool = m_pool.lock();
+    if(pool) {
+        // the pool keeps the connection until it is out of its own callbacks
+        pool->onClosed(shared_from_this(), wasConnected);
+        m_self.reset();
+    }
+}
+
+void UpstreamConnection::onHead(int status, HeaderList const& headers) {
+    m_proxy->onUpstreamHead(m_current, status, headers);
+}
+
+void UpstreamConnection::onBody(const char *data, size_t len) {
+    m_proxy->onUpstreamBody(m_current, data, len);
+}
+
+void UpstreamConnection::onComplete() {
+    m_proxy->onUpstreamComplete(m_current);
+}
+
+
+UpstreamPool::UpstreamPool(ProxyServer *proxy, UpstreamLoops *loops, std::string const& host, int port, SSLOptionPtr const& ssl, PoolConfig const& config)
+    : m_proxy(proxy), m_loops(loops), m_host(host), m_port(port), m_ssl(ssl), m_config(config) {
+    if(m_config.maxConnections < 1) {
+        m_config.maxConnections = 1;
+    }
+    if(m_config.minConnections > m_config.maxConnections) {
+        m_config.minConnections = m_config.maxConnections;
+    }
+    if(m_config.pipelineDepth < 1) {
+        m_config.pipelineDepth = 1;
+    }
+    if(m_config.maxWaiting < 1) {
+        m_config.maxWaiting = 1;
+    }
+}
+
+void UpstreamPool::prewarm() {
+    std::vector<UpstreamConnectionPtr> retired;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    retired.swap(m_retired);
+    while(!m_closed && m_connections.size() < (size_t) m_config.minConnections) {
+        if(!openConnection()) {
+            break ;
+        }
+    }
+    LOG_info("upstream pool %s:%d prewarmed %d connections", m_host.c_str(), m_port, (int) m_connections.size());
+}
+
+SubmitResult UpstreamPool::submit(ExchangePtr const& exchange) {
+    std::vector<UpstreamConnectionPtr> retired;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        retired.swap(m_retired);
+        if(m_closed) {
+            return SUBMIT_CLOSED;
+        }
+        UpstreamConnectionPtr best;
+        size_t bestLoad = SIZE_MAX;
+        for(size_t i = 0; i < m_connections.size() && bestLoad > 0; i++) {
+            if(m_connections[i]->accepts(exchange, m_config.pipelineDepth)) {
+                size_t load = m_connections[i]->inflight();
+                if(load < bestLoad) {
+                    best = m_connections[i];
+                    bestLoad = load;
+                }
+            }
+        }
+        // an idle connection beats pipelining, open one while under the limit
+        if((!best || bestLoad > 0) && m_connections.size() < (size_t) m_config.maxConnections) {
+            UpstreamConnectionPtr opened = openConnection();
+            if(opened) {
+                best = opened;
+            }
+        }
+        if(!best || !best->send(exchange)) {
+            if(m_waiting.size() >= (size_t) m_config.maxWaiting) {
+                return SUBMIT_FULL;
+            }
+            m_waiting.push_back(exchange);
+        }
+    }
+    if(m_config.timeoutMs > 0) {
+        // a blackholed backend never answers nor closes, the deadline fails the request instead
+        std::weak_ptr<UpstreamPool> weakPool = shared_from_this();
+        std::weak_ptr<Exchange> weak = exchange;
+        DeadlineTimer::instance().schedule(common::steadyNanos() + m_config.timeoutMs * 1000000LL, [weakPool, weak]() {
+            UpstreamPoolPtr pool = weakPool.lock();
+            ExchangePtr exchange = weak.lock();
+            if(pool && exchange) {
+                pool->expire(exchange);
+            }
+        });
+    }
+    return SUBMIT_OK;
+}
+
+void UpstreamPool::close() {
+    std::deque<ExchangePtr> waiting;
+    std::vector<UpstreamConnectionPtr> idle;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return ;
+        }
+        m_closed = true;
+        waiting.swap(m_waiting);
+        // busy connections finish what they carry and close from onIdle
+        for(size_t i = 0; i < m_connections.size(); i++) {
+            if(m_connections[i]->inflight() == 0) {
+                idle.push_back(m_connections[i]);
+            }
+        }
+    }
+    for(size_t i = 0; i < idle.size(); i++) {
+        idle[i]->close();
+    }
+    for(size_t i = 0; i < waiting.size(); i++) {
+        m_proxy->onUpstreamError(waiting[i], "upstream pool closed", false);
+    }
+}
+
+void UpstreamPool::cancel(ExchangePtr const& exchange) {
+    std::vector<UpstreamConnectionPtr> connections;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find(m_waiting.begin(), m_waiting.end(), exchange);
+        if(it != m_waiting.end()) {
+            m_waiting.erase(it);
+            return ;
+        }
+        connections = m_connections;
+    }
+    for(size_t i = 0; i < connections.size(); i++) {
+        if(connections[i]->cancel(exchange)) {
+            return ;
+        }
+    }
+}
+
+void UpstreamPool::expire(ExchangePtr const& exchange) {
+    std::vector<UpstreamConnectionPtr> connections;
+    bool waiting = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_closed) {
+            return ;
+        }
+        auto it = std::find(m_waiting.begin(), m_waiting.end(), exchange);
+        waiting = it != m_waiting.end();
+        if(waiting) {
+            m_waiting.erase(it);
+        } else {
+            connections = m_connections;
+        }
+    }
+    if(waiting) {
+        m_proxy->onUpstreamError(exchange, "upstream timeout", false);
+        return ;
+    }
+    for(size_t i = 0; i < connections.size(); i++) {
+        if(connections[i]->expire(exchange)) {
+            return ;
+        }
+    }
+}
+
+size_t UpstreamPool::size() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_connections.size();
+}
+
+void UpstreamPool::onIdle(UpstreamConnection *connection) {
+    bool closing = false;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        while(!m_waiting.empty() && connection->accepts(m_waiting.front(), m_config.pipelineDepth)) {
+            if(!connection->send(m_waiting.front())) {
+                break ;
+            }
+            m_waiting.pop_front();
+        }
+        closing = m_closed && connection->inflight() == 0;
+    }
+    if(closing) {
+        connection->close();
+    }
+}
+
+void UpstreamPool::onClosed(UpstreamConnectionPtr const& connection, bool wasConnected) {
+    std::deque<ExchangePtr> failed;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(size_t i = 0; i < m_connections.size(); i++) {
+            if(m_connections[i] == connection) {
+                m_retired.push_back(connection);
+                m_connections.erase(m_connections.begin() + i);
+                break ;
+            }
+        }
+        if(m_closed) {
+            return ;
+        }
+        if(!wasConnected) {
+            // the backend is unreachable, do not keep waiting requests for it
+            if(m_connections.empty()) {
+                failed.swap(m_waiting);
+            }
+        } else if(m_connections.size() < (size_t) m_config.minConnections || !m_waiting.empty()) {
+            UpstreamConnectionPtr opened = openConnection();
+            while(opened && !m_waiting.empty() && opened->accepts(m_waiting.front(), m_config.pipelineDepth)) {
+                opened->send(m_waiting.front());
+                m_waiting.pop_front();
+            }
+        }
+    }
+    for(size_t i = 0; i < failed.size(); i++) {
+        m_proxy->onUpstreamError(failed[i], "upstream unreachable", false);
+    }
+}
+
+UpstreamConnectionPtr UpstreamPool::openConnection() {
+    UpstreamConnectionPtr connection = std::make_shared<UpstreamConnection>(shared_from_this(), m_proxy);
+    if(!connection->open(m_host, m_port, m_ssl.get(), m_loops->next())) {
+        return nullptr;
+    }
+    m_connections.push_back(connection);
+    return connection;
+}
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+
+#include "Exchange.h"
+#include "ResponseParser.h"
+
+#include "archer_net.h"
+
+namespace archer
+{
+namespace server
+{
+class ProxyServer;
+class UpstreamPool;
+
+typedef struct {
+    int     minConnections;
+    int     maxConnections;
+    // requests written ahead on one connection, idempotent ones only
+    int     pipelineDepth;
+    // deadline of one request from submit to its last response byte, 0 disables
+    int     timeoutMs;
+    // requests waiting for a connection, the excess is shed with a 503
+    int     maxWaiting;
+} PoolConfig;
+
+enum SubmitResult { SUBMIT_OK, SUBMIT_CLOSED, SUBMIT_FULL };
+
+/**
+ * Event loops driving the pooled upstream connections of one listener. An
+ * archer_net loop returns as soon as it has no channel left, every loop holds
+ * an idle keepalive channel to a loopback socket of its own so it keeps
+ * running while the pool has no connection.
+*/
+class UpstreamLoops
+{
+public:
+
+    explicit UpstreamLoops(int threads);
+    ~UpstreamLoops();
+
+    UpstreamLoops(const UpstreamLoops&) = delete;
+    UpstreamLoops& operator=(const UpstreamLoops&) = delete;
+
+    ChannelBase* next() {
+        return m_bases[m_next.fetch_add(1, std::memory_order_relaxed) % m_bases.size()];
+    }
+
+private:
+
+    std::vector<ChannelBase *>   m_bases;
+    std::vector<Channel *>       m_keepalives;
+    // listening, never accepting, the keepalive channels stay in its backlog
+    int                          m_keepaliveFd = -1;
+    std::vector<std::thread>     m_threads;
+    std::atomic<uint32_t>        m_next{0};
+    std::atomic<bool>            m_running;
+};
+
+/**
+ * One keep-alive HTTP/1.1 connection to a backend. Requests are written in
+ * order and answered in order, the parser hands every response to the exchange
+ * at the front of the in flight queue.
+*/
+class UpstreamConnection : public ResponseParser::Listener, public std::enable_shared_from_this<UpstreamConnection>
+{
+public:
+
+    UpstreamConnection(std::weak_ptr<UpstreamPool> const& pool, ProxyServer *proxy) : m_pool(pool), m_proxy(proxy) {}
+    ~UpstreamConnection();
+
+    UpstreamConnection(const UpstreamConnection&) = delete;
+    UpstreamConnection& operator=(const UpstreamConnection&) = delete;
+
+    // ssl is null for plaintext backends
+    bool open(std::string const& host, int port, SSLOption *ssl, ChannelBase *base);
+
+    // queues the request, written at once when connected, false once the connection is closed
+    bool send(ExchangePtr const& exchange);
+
+    void close();
+
+    // drops exchange if it has not been written yet or closes the connection if it is all it carries
+    bool cancel(ExchangePtr const& exchange);
+
+    // exchange ran past its deadline, fails it if it has not been written yet or closes the
+    // connection, false when the connection does not carry it
+    bool expire(ExchangePtr const& exchange);
+
+    size_t inflight();
+
+    bool closed();
+
+    // whether exchange may be queued behind the requests already in flight
+    bool accepts(ExchangePtr const& exchange, int pipelineDepth);
+
+    void onConnect();
+
+    void onRead(const char *data, size_t len);
+
+    void onError(const char *error);
+
+    void onHead(int status, HeaderList const& headers) override;
+
+    void onBody(const char *data, size_t len) override;
+
+    void onComplete() override;
+
+private:
+
+    void shutdown(const char *error);
+
+    std::weak_ptr<UpstreamPool>  m_pool;
+    ProxyServer                 *m_proxy;
+    Channel                     *m_channel = NULL;
+
+    std::mutex                   m_mutex;
+    bool                         m_connected = false;
+    bool                         m_closed = false;
+    // why the connection was closed from this side, reported for what it still carries
+    const char                  *m_closeReason = NULL;
+    // in wire order, the first m_written ones are on the wire
+    std::deque<ExchangePtr>      m_inflight;
+    size_t                       m_written = 0;
+    // keeps the connection alive while its channel may still call back
+    std::shared_ptr<UpstreamConnection> m_self;
+
+    // only touched from the event loop thread
+    ResponseParser               m_parser;
+    ExchangePtr                  m_current;
+};
+
+typedef std::shared_ptr<UpstreamConnection> UpstreamConnectionPtr;
+
+/**
+ * Connections of one proxy to one backend, between minConnections kept open
+ * from the moment the peer is added and maxConnections under load. For https
+ * backends the kept ones are already past their handshake when a request comes. A request
+ * goes to the least loaded connection that accepts it, when all of them are at
+ * their pipeline depth it waits for the next response to complete.
+*/
+class UpstreamPool : public std::enable_shared_from_this<UpstreamPool>
+{
+public:
+
+    UpstreamPool(ProxyServer *proxy, UpstreamLoops *loops, std::string const& host, int port, SSLOptionPtr const& ssl, PoolConfig const& config);
+    ~UpstreamPool() {
+        close();
+    }
+
+    UpstreamPool(const UpstreamPool&) = delete;
+    UpstreamPool& operator=(const UpstreamPool&) = delete;
+
+    // opens minConnections right away
+    void prewarm();
+
+    // SUBMIT_CLOSED once the pool is closed, SUBMIT_FULL when maxWaiting requests already wait
+    SubmitResult submit(ExchangePtr const& exchange);
+
+    void close();
+
+    // gives up on exchange, its response is of no use anymore
+    void cancel(ExchangePtr const& exchange);
+
+    // exchange is still waiting or in flight at its deadline, it fails as an upstream timeout
+    void expire(ExchangePtr const& exchange);
+
+    size_t size();
+
+    // a response completed on connection, it may take a waiting request
+    void onIdle(UpstreamConnection *connection);
+
+    // connection is gone, replace it if the pool fell under minConnections
+    void onClosed(UpstreamConnectionPtr const& connection, bool wasConnected);
+
+private:
+
+    // with m_mutex held
+    UpstreamConnectionPtr openConnection();
+
+    ProxyServer                 *m_proxy;
+    UpstreamLoops               *m_loops;
+    std::string                  m_host;
+    int                          m_port;
+    // one option for every connection, they all share its session state
+    SSLOptionPtr                 m_ssl;
+    PoolConfig                   m_config;
+
+    std::mutex                   m_mutex;
+    bool                         m_closed = false;
+    std::vector<UpstreamConnectionPtr> m_connections;
+    // closed connections, released outside of their own callbacks
+    std::vector<UpstreamConnectionPtr> m_retired;
+    std::deque<ExchangePtr>      m_waiting;
+};
+
+typedef std::shared_ptr<UpstreamPool> UpstreamPoolPtr;
+}
+}
@@ -0,0 +1,80 @@
+#include "VirtualHost.h"
+
+using namespace archer::server;
+
+VirtualHost::VirtualHost(std::string const& id, std::vector<std::string> const& serverNames) {
+    m_id = id;
+    m_serverNames = serverNames;
+    m_name = serverNames.empty() ? "default" : serverNames[0];
+    m_metrics = Metrics::instance().series(SERIES_PROXY, id, "");
+    m_accessId = common::AccessLog::instance().nameId('p', id);
+    m_log = std::make_shared<common::LogControl>();
+}
+
+void VirtualHost::start() {
+    if(m_healthChecker) {
+        m_healthChecker->start();
+    }
+    if(m_outlierDetector) {
+        m_outlierDetector->start();
+    }
+}
+
+void VirtualHost::stop() {
+    if(m_healthChecker) {
+        m_healthChecker->stop();
+    }
+    if(m_outlierDetector) {
+        m_outlierDetector->stop();
+    }
+}
+
+void VirtualHost::setBalancer(BalancerType type) {
+    LOG_info("Virtual host %s use balancer %s", name(), balancerTypeName(type));
+    m_upstream.setBalancer(type);
+}
+
+void VirtualHost::setHashKey(HashKey const& key) {
+    m_upstream.setHashKey(key);
+}
+
+void VirtualHost::setHealthCheck(HealthCheckConfig const& config) {
+    LOG_info("Virtual host %s health check %s every %dms", name(), config.path.c_str(), config.intervalMs);
+    m_healthChecker.reset(new HealthChecker(m_upstream, config));
+}
+
+void VirtualHost::setOutlierDetection(OutlierConfig const& config) {
+    LOG_info("Virtual host %s outlier detection over %ds at %d%% failures", name(), config.windowSeconds, config.failurePercent);
+    m_slowNanos = (int64_t) config.timeoutMs * 1000000;
+    m_outlierDetector.reset(new OutlierDetector(m_upstream, config));
+}
+
+void VirtualHost::setCircuitBreaker(int maxPending) {
+    LOG_info("Virtual host %s circuit breaker at %d pending requests per peer", name(), maxPending);
+    m_maxPending = maxPending;
+}
+
+void VirtualHost::onPeerError(const char *host, int port) {
+    DstPeerPtr peer = m_upstream.findPeer(host, port);
+    if(peer) {
+        peer->onResult(false, common::steadyNanos());
+    }
+}
+
+const char* VirtualHost::peerHealth(std::string const& host, int port) {
+    DstPeerPtr peer = m_upstream.findPeer(host, port);
+    if(!peer) {
+        return "UNKNOWN";
+    }
+    if(peer->ejected()) {
+        return "EJECTED";
+    }
+    if(!m_healthChecker) {
+        return "UNKNOWN";
+    }
+    return peer->healthy() ? "HEALTHY" : "UNHEALTHY";
+}
+
+void VirtualHost::compileLocations() {
+    m_router.store(std::make_shared<const LocationRouter>(m_locations));
+}
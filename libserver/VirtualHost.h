@@ -0,0 +1,195 @@
+#pragma once
+
+#include <libcommon/Common.h>
+#include <libcommon/Logger.h>
+#include <libcommon/Snapshot.h>
+#include <libcommon/AccessLog.h>
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "LocationRouter.h"
+#include "ResponseCache.h"
+#include "Compressor.h"
+#include "RateLimiter.h"
+#include "ConcurrencyLimiter.h"
+#include "StaticFiles.h"
+#include "Metrics.h"
+#include "Upstream.h"
+#include "UpstreamPool.h"
+#include "HealthChecker.h"
+#include "OutlierDetector.h"
+
+namespace archer
+{
+namespace server
+{
+
+/**
+ * One configured proxy: its server names, location table, backends and the
+ * policies around them. Several virtual hosts may share one ProxyServer
+ * listener, which picks the virtual host from the Host header first.
+*/
+class VirtualHost
+{
+public:
+
+    VirtualHost(std::string const& id, std::vector<std::string> const& serverNames);
+    ~VirtualHost() {
+        stop();
+    }
+
+    VirtualHost(const VirtualHost&) = delete;
+    VirtualHost& operator=(const VirtualHost&) = delete;
+
+    std::string const& id() const {return m_id;}
+
+    // empty for the default virtual host of a listener
+    std::vector<std::string> const& serverNames() const {return m_serverNames;}
+
+    // first server name or "default", for logs
+    const char* name() const {return m_name.c_str();}
+
+    Upstream& upstream() {return m_upstream;}
+
+    // request metrics of the whole proxy, may be null
+    MetricSeries const* metrics() const {return m_metrics.get();}
+
+    // id of the proxy in the access log
+    uint32_t accessId() const {return m_accessId;}
+
+    // runtime log level of the requests of this proxy
+    common::LogControl& logControl() const {return *m_log;}
+
+    void setBalancer(BalancerType type);
+
+    void setHashKey(HashKey const& key);
+
+    void setHealthCheck(HealthCheckConfig const& config);
+
+    void setOutlierDetection(OutlierConfig const& config);
+
+    // fail fast with 503 once a peer has maxPending requests in flight, 0 disables
+    void setCircuitBreaker(int maxPending);
+
+    int maxPending() const {return m_maxPending;}
+
+    // responses slower than this count as failures for outlier detection, 0 disables
+    int64_t slowNanos() const {return m_slowNanos;}
+
+    // new and recovered backends ramp up to their full share over slowStartMs, 0 disables
+    void setSlowStart(int slowStartMs) {
+        m_upstream.setSlowStart(slowStartMs * 1000000LL);
+    }
+
+    // requests go over pooled keep-alive connections instead of the shared sub connection
+    void setConnectionPool(PoolConfig const& config) {
+        m_poolConfig = config;
+        m_pooled = true;
+    }
+
+    bool pooled() const {return m_pooled;}
+
+    PoolConfig const& poolConfig() const {return m_poolConfig;}
+
+    // adaptive limit on the requests of the whole proxy in flight upstream
+    void setConcurrency(ConcurrencyConfig const& config) {
+        m_concurrency = std::make_shared<ConcurrencyLimiter>(config);
+    }
+
+    // null when the proxy is not limited
+    ConcurrencyLimiterPtr const& concurrency() const {return m_concurrency;}
+
+    void onPeerError(const char *host, int port);
+
+    // "HEALTHY", "UNHEALTHY", "EJECTED" or "UNKNOWN" when the backend is not probed
+    const char* peerHealth(std::string const& host, int port);
+
+    void addLocation(Location const& loc) {
+        std::lock_guard<std::mutex> lock(m_uriMutex);
+        for(int i = 0; i < m_locations.size(); i++) {
+            if(loc.src == m_locations[i].src) {
+                return ;
+            }
+        }
+        Location added = loc;
+        added.metrics = Metrics::instance().series(SERIES_LOCATION, m_id, loc.src);
+        added.accessId = common::AccessLog::instance().nameId('l', m_id + " " + loc.src);
+        added.log = std::make_shared<common::LogControl>();
+        if(loc.statics) {
+            LOG_info("Virtual host %s add static location %s:%s", name(), loc.src.c_str(), loc.statics->config().root.c_str());
+        } else {
+            LOG_info("Virtual host %s add location %s:%s%s", name(), loc.src.c_str(), loc.dst.c_str(), loc.cache ? " cached" : "");
+        }
+        m_locations.push_back(added);
+        std::stable_sort(m_locations.begin(), m_locations.end(), [](const Location& s1, const Location& s2) { return s1.order < s2.order;});
+        compileLocations();
+    }
+
+    void delLocation(std::string const& src, std::string const& dst) {
+        int idx = 0;
+        std::lock_guard<std::mutex> lock(m_uriMutex);
+        for(; idx < m_locations.size(); idx++) {
+            if(src == m_locations[idx].src && dst == m_locations[idx].dst) {
+                break ;
+            }
+        }
+        LOG_info("Virtual host %s delete location %s:%s", name(), src.c_str(), dst.c_str());
+        if(idx < m_locations.size()) {
+            m_locations.erase(m_locations.begin() + idx);
+            compileLocations();
+        }
+    }
+
+    bool findLocation(std::string const& src, Location& loc) {
+        std::lock_guard<std::mutex> lock(m_uriMutex);
+        for(int i = 0; i < m_locations.size(); i++) {
+            if(src == m_locations[i].src) {
+                loc = m_locations[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // lock free, the returned location lives until this thread matches again
+    const Location* matchLocation(const char *uri, size_t uriLen) const {
+        LocationRouterPtr const& router = m_router.local().ptr;
+        return router ? router->match(uri, uriLen) : NULL;
+    }
+
+    // starts the health checker and outlier detector threads, if configured
+    void start();
+
+    void stop();
+
+private:
+
+    void compileLocations();
+
+    std::string                  m_id;
+    std::vector<std::string>     m_serverNames;
+    std::string                  m_name;
+    MetricSeriesPtr              m_metrics;
+    uint32_t                     m_accessId;
+    common::LogControlPtr        m_log;
+
+    Upstream                     m_upstream;
+    std::unique_ptr<HealthChecker> m_healthChecker;
+    std::unique_ptr<OutlierDetector> m_outlierDetector;
+    int64_t                      m_slowNanos = 0;
+    int                          m_maxPending = 0;
+    bool                         m_pooled = false;
+    PoolConfig                   m_poolConfig{0, 0, 1, 30000, 1024};
+    ConcurrencyLimiterPtr        m_concurrency;
+
+    std::mutex                   m_uriMutex;
+    std::vector<Location>        m_locations;
+    common::Snapshot<LocationRouter> m_router;
+};
+
+typedef std::shared_ptr<VirtualHost> VirtualHostPtr;
+}
+}
@@ -6,6 +6,7 @@
 #include <libcommon/GlobalConfig.h>
 #include <libdatabase/DataBase.h>
 #include <libserver/ProxyServer.h>
+#include <libserver/TcpProxyServer.h>
 
 namespace archer 
 {
@@ -15,6 +16,7 @@ class ProxyService
 {
 
 typedef std::shared_ptr<server::ProxyServer> ProxyServerPtr;
+typedef std::shared_ptr<server::TcpProxyServer> TcpProxyServerPtr;
 
 public:
 
@@ -28,7 +30,16 @@ public:
     
     ~ProxyService() {}
 
-    void listAllProxy(HttpResponse *res);
+    void listAllProxy(HttpResponse *res, Json::Value &val);
+
+    // request metrics of every proxy, location and backend in the Prometheus text format
+    void metrics(HttpResponse *res);
+
+    // the global log level, the overrides are listed with their proxies and locations
+    void logLevel(HttpResponse *res);
+
+    // runtime log level and sampling of the process, a proxy or a location
+    void setLogLevel(HttpResponse *res, Json::Value &val);
 
     void addProxy(HttpResponse *res, Json::Value &val);
 
@@ -52,9 +63,26 @@ private:
 
     ProxyService() {}
 
+    // builds the virtual host of a stored proxy and attaches it to the listener of its address:port
+    server::VirtualHostPtr createProxy(Json::Value &val);
+
+    // the stored proxy of val["id"] when its address and port match val too
+    bool findStoredProxy(Json::Value const& val, Json::Value &proxy);
+
+    ProxyServerPtr findListener(std::string const& address, int port);
+
+    server::VirtualHostPtr findVirtualHost(std::string const& id, ProxyServerPtr *listener = NULL);
+
+    // a tcp listener carries one proxy, it is found by the proxy id
+    TcpProxyServerPtr findTcpProxy(std::string const& id);
+
+    // whether address:port is taken by a listener of the other mode
+    bool listenerConflict(std::string const& address, int port, bool tcp);
+
     Json::FastWriter                    m_jsonWriter;
     Json::Reader                        m_jsonReader;
     std::vector<ProxyServerPtr>         m_proxies;
+    std::vector<TcpProxyServerPtr>      m_tcpProxies;
 };
 }
 }
\ No newline at end of file
@@ -0,0 +1,219 @@
+#include <libcommon/AccessRecord.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/**
+ * archer-proxy-logcat, prints the records of binary access log segments as
+ * text or as one JSON object per line.
+ *
+ *   archer-proxy-logcat [-j] [-n names] <segment or directory>...
+ *
+ * A directory stands for all its segments, oldest first. Ids are resolved
+ * with the names file next to the segments unless -n gives another one.
+*/
+
+typedef std::unordered_map<std::string, std::string> NameMap;
+
+static void usage() {
+    fprintf(stderr, "usage: archer-proxy-logcat [-j] [-n names] <segment or directory>...\n");
+}
+
+static bool isDirectory(std::string const& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static std::string parentOf(std::string const& path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+}
+
+static void loadNames(std::string const& path, NameMap& names) {
+    FILE *file = fopen(path.c_str(), "r");
+    if(file == NULL) {
+        return ;
+    }
+    char line[1024];
+    while(fgets(line, sizeof(line), file) != NULL) {
+        char kind;
+        unsigned id;
+        int offset = 0;
+        if(sscanf(line, "%c %u %n", &kind, &id, &offset) < 2 || offset == 0) {
+            continue;
+        }
+        std::string name(line + offset);
+        if(!name.empty() && name[name.length() - 1] == '\n') {
+            name.pop_back();
+        }
+        names[kind + std::to_string(id)] = name;
+    }
+    fclose(file);
+}
+
+// locations and backends are stored as "<proxy> <name>", the proxy is printed on its own
+static std::string nameOf(NameMap const& names, char kind, uint32_t id, std::string const& proxy) {
+    if(id == 0) {
+        return "-";
+    }
+    auto it = names.find(kind + std::to_string(id));
+    if(it == names.end()) {
+        return "#" + std::to_string(id);
+    }
+    std::string const& name = it->second;
+    if(kind != 'p' && name.length() > proxy.length() && name.compare(0, proxy.length(), proxy) == 0 && name[proxy.length()] == ' ') {
+        return name.substr(proxy.length() + 1);
+    }
+    return name;
+}
+
+static void printJsonString(std::string const& value) {
+    putchar('"');
+    for(size_t i = 0; i < value.length(); i++) {
+        unsigned char c = value[i];
+        if(c == '"' || c == '\\') {
+            putchar('\\');
+            putchar(c);
+        } else if(c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void printRecord(AccessRecord const& record, NameMap const& names, bool json) {
+    std::string proxy = nameOf(names, 'p', record.proxy, "");
+    std::string location = nameOf(names, 'l', record.location, proxy);
+    std::string backend = nameOf(names, 'b', record.peer, proxy);
+    time_t seconds = (time_t) (record.time / 1000000);
+    struct tm tm;
+    char when[32];
+    if(json) {
+        gmtime_r(&seconds, &tm);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+        printf("{\"time\":\"%s.%06uZ\",\"proxy\":", when, (unsigned) (record.time % 1000000));
+        printJsonString(proxy);
+        printf(",\"location\":");
+        printJsonString(location);
+        printf(",\"backend\":");
+        printJsonString(backend);
+        printf(",\"status\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu,\"upstream_us\":", record.status,
+               (unsigned long long) record.bytesIn, (unsigned long long) record.bytesOut);
+        if(record.upstreamUs == ACCESS_NO_UPSTREAM) {
+            printf("null");
+        } else {
+            printf("%u", record.upstreamUs);
+        }
+        printf(",\"total_us\":%u}\n", record.totalUs);
+        return ;
+    }
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    char upstream[16] = "-";
+    if(record.upstreamUs != ACCESS_NO_UPSTREAM) {
+        snprintf(upstream, sizeof(upstream), "%u", record.upstreamUs);
+    }
+    printf("%s.%06u %s %s %s %u in=%llu out=%llu upstream_us=%s total_us=%u\n", when, (unsigned) (record.time % 1000000),
+           proxy.c_str(), location.c_str(), backend.c_str(), record.status,
+           (unsigned long long) record.bytesIn, (unsigned long long) record.bytesOut, upstream, record.totalUs);
+}
+
+static bool printSegment(std::string const& path, NameMap const& names, bool json) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if(file == NULL) {
+        fprintf(stderr, "archer-proxy-logcat: can not open %s, %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    AccessSegmentHeader header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, ACCESS_SEGMENT_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version != ACCESS_SEGMENT_VERSION || header.recordSize != sizeof(AccessRecord)) {
+        fprintf(stderr, "archer-proxy-logcat: %s is not an access log segment\n", path.c_str());
+        fclose(file);
+        return false;
+    }
+    std::vector<AccessRecord> records(4096);
+    size_t n;
+    while((n = fread(records.data(), sizeof(AccessRecord), records.size(), file)) > 0) {
+        for(size_t i = 0; i < n; i++) {
+            // claimed slots of a crashed process and the unused tail stay zero
+            if(records[i].time != 0) {
+                printRecord(records[i], names, json);
+            }
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    bool json = false;
+    std::string namesPath;
+    std::vector<std::string> inputs;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-j") == 0) {
+            json = true;
+        } else if(strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            namesPath = argv[++i];
+        } else if(argv[i][0] == '-') {
+            usage();
+            return 2;
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if(inputs.empty()) {
+        usage();
+        return 2;
+    }
+
+    NameMap names;
+    std::vector<std::string> segments;
+    for(size_t i = 0; i < inputs.size(); i++) {
+        std::string dir = inputs[i];
+        if(!isDirectory(dir)) {
+            segments.push_back(inputs[i]);
+            dir = parentOf(inputs[i]);
+        } else {
+            std::vector<std::string> found;
+            DIR *d = opendir(dir.c_str());
+            struct dirent *entry;
+            while(d != NULL && (entry = readdir(d)) != NULL) {
+                std::string name(entry->d_name);
+                size_t suffix = strlen(ACCESS_SEGMENT_SUFFIX);
+                if(name.length() > suffix && name.compare(name.length() - suffix, suffix, ACCESS_SEGMENT_SUFFIX) == 0) {
+                    found.push_back(dir + "/" + name);
+                }
+            }
+            if(d != NULL) {
+                closedir(d);
+            }
+            std::sort(found.begin(), found.end());
+            segments.insert(segments.end(), found.begin(), found.end());
+        }
+        if(namesPath.empty()) {
+            loadNames(dir + "/" + ACCESS_NAMES_FILE, names);
+        }
+    }
+    if(!namesPath.empty()) {
+        loadNames(namesPath, names);
+    }
+
+    int status = 0;
+    for(size_t i = 0; i < segments.size(); i++) {
+        if(!printSegment(segments[i], names, json)) {
+            status = 1;
+        }
+    }
+    return status;
+}